@@ -101,9 +101,30 @@
  * portability an relies on text-processing rather than attempting
  * to pick struct sockaddr apart to decode the IPv4 number.
  *
+ * Optional functionality lives in separate source files, which are
+ * reached as subcommands of this program:
+ *
+ *	cc -pthread -o dns_leap dns_leap.c leap_arm.c leap_audit.c \
+ *	    leap_bench.c leap_clock.c leap_convert.c leap_date.c \
+ *	    leap_dnssec.c leap_dut1.c leap_file.c leap_metrics.c \
+ *	    leap_pcap.c leap_query.c leap_serve.c leap_smear.c \
+ *	    leap_store.c leap_table.c leap_xdp.c -lm
+ *
+ *	./dns_leap		Run test-vectors, query and print
+ *	./dns_leap arm ...	Arm the kernel for announced leap seconds
+ *	./dns_leap audit ...	Check the answers of many resolvers at once
+ *	./dns_leap bench [name]	Run micro-benchmarks
+ *	./dns_leap convert ...	Re-stamp log files from UTC to TAI
+ *	./dns_leap dut1 ...	DUT1 and announcement in one AAAA record
+ *	./dns_leap leapfile ...	Maintain an NTP leap-seconds.list file
+ *	./dns_leap pcap ...	Audit resolver answers in packet captures
+ *	./dns_leap query ...	Query a resolver directly, DNSSEC, TCP, TLS
+ *	./dns_leap serve ...	Authoritative DNS responder
+ *
  */
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -113,6 +134,8 @@
 #include <sys/socket.h>
 #include <netdb.h>
 
+#include "dns_leap.h"
+
 /*
  * MSB first CRC8 with polynomium (x^8 +x^5 +x^3 +x^2 +x +1)
  *
@@ -125,17 +148,19 @@
  * PS:  The CRC seed is not random.
  */
 
-static int
+int
 crc8(uint32_t inp, int len)
 {
 	uint32_t crc = 0x54a9abf8 ^ (inp << (32 - len));
 	int i;
 
+	LEAP_PROBE2(crc8__entry, inp, len);
 	for (i = 0; i < len; i++) {
 		if (crc & (1U << 31))
 			crc ^= (0x12fU << 23);
 		crc <<= 1;
 	}
+	LEAP_PROBE1(crc8__return, crc >> 24);
 	return (crc >> 24);
 }
 
@@ -149,13 +174,15 @@ crc8(uint32_t inp, int len)
  * 'delta' is what you do to dtai at the end of that month
  */
 
-static int
+int
 decode_leapsecond(const char *ip, int *year, int *month, int *dtai, int *delta)
 {
-	int error;
+	int error, y, m;
 	unsigned o1, o2, o3, o4;
 	uint32_t u, d, mn, o;
 
+	LEAP_PROBE1(decode__entry, ip);
+
 	/* Zero returns in case of error ------------------------------*/
 
 	if (year != NULL)
@@ -170,8 +197,10 @@ decode_leapsecond(const char *ip, int *year, int *month, int *dtai, int *delta)
 	/* Convert to 32 bit integer ----------------------------------*/
 
 	error = sscanf(ip, "%u.%u.%u.%u", &o1, &o2, &o3, &o4);
-	if (error != 4)
+	if (error != 4) {
+		LEAP_PROBE3(decode__return, ip, -1, 0);
 		return (-1);
+	}
 
 	u = o1 << 24;
 	u |= o2 << 16;
@@ -180,15 +209,19 @@ decode_leapsecond(const char *ip, int *year, int *month, int *dtai, int *delta)
 
 	/* Check & remove class E -------------------------------------*/
 
-	if ((u >> 28) != 0xf)
+	if ((u >> 28) != 0xf) {
+		LEAP_PROBE3(decode__return, ip, -1, u);
 		return (-1);
+	}
 
 	u &= (1 << 28) - 1;
 
 	/* Check & remove CRC8 ----------------------------------------*/
 
-	if (crc8(u, 28) != 0x80)
+	if (crc8(u, 28) != 0x80) {
+		LEAP_PROBE3(decode__return, ip, -2, u);
 		return (-2);
+	}
 
 	u >>= 8;
 
@@ -200,20 +233,24 @@ decode_leapsecond(const char *ip, int *year, int *month, int *dtai, int *delta)
 	d = u & 3;
 	u >>= 2;
 
-	mn = (u & 0x7ff) + 10;
+	mn = u & 0x7ff;
 
 	/* Error checks -----------------------------------------------*/
 
-	if (d == 3)
+	if (d == 3) {
+		LEAP_PROBE3(decode__return, ip, -3, u);
 		return (-3);
+	}
 
 	/* Convert to return values -----------------------------------*/
 
+	leap_month_from_index(mn, &y, &m);
+
 	if (year != NULL)
-		*year = 1971 + (mn / 12);
+		*year = y;
 
 	if (month != NULL)
-		*month = 1 + (mn % 12);
+		*month = m;
 
 	if (dtai != NULL)
 		*dtai = o;
@@ -225,27 +262,125 @@ decode_leapsecond(const char *ip, int *year, int *month, int *dtai, int *delta)
 		case 2: *delta = +1; break;
 		}
 	}
+	LEAP_PROBE3(decode__return, ip, 0, u);
 	return (0);
 }
 
+/*
+ * Encode an announcement, the inverse of decode_leapsecond().
+ *
+ * Returns the 32 bit IPv4 address, or zero if a field is out of range.
+ */
+
+uint32_t
+encode_leapsecond(int year, int month, int dtai, int delta)
+{
+	int mn;
+	uint32_t u;
+
+	mn = leap_month_index(year, month);
+	if (mn < 0 || mn > 0x7ff || month < 1 || month > 12)
+		return (0);
+	if (dtai < 0 || dtai > 0x7f || delta < -1 || delta > 1)
+		return (0);
+
+	u = mn << 2;
+	if (delta > 0)
+		u |= 2;
+	else if (delta < 0)
+		u |= 1;
+	u <<= 7;
+	u |= dtai;
+	u <<= 8;
+	u |= crc8(u >> 8, 20);
+	assert(crc8(u, 28) == 0x80);
+	return (u | (0xfU << 28));
+}
+
+/*
+ * Decode 'n' announcements at once, as decode_leapsecond() would, from
+ * the addresses in host order.  Returns how many are valid.
+ *
+ * The CRC is affine in its input, so it is the CRC of zero XOR one
+ * table entry per octet, rather than a loop over the 28 bits.
+ */
+
+static uint8_t crc8_tab[4][256], crc8_zero;
+static pthread_once_t crc8_once = PTHREAD_ONCE_INIT;
+
+static void
+crc8_init(void)
+{
+	int i, j;
+
+	crc8_zero = crc8(0, 28);
+	for (i = 0; i < 4; i++)
+		for (j = 0; j < (i == 3 ? 16 : 256); j++)
+			crc8_tab[i][j] = crc8((uint32_t)j << (8 * i), 28) ^
+			    crc8_zero;
+}
+
+size_t
+decode_leapsecond_n(const uint32_t *addr, struct leap_answer *la, size_t n)
+{
+	size_t i, good = 0;
+	uint32_t u, d;
+	int c, y, m;
+
+	(void)pthread_once(&crc8_once, crc8_init);
+	for (i = 0; i < n; i++) {
+		u = addr[i];
+		c = crc8_zero ^ crc8_tab[0][u & 0xff] ^
+		    crc8_tab[1][(u >> 8) & 0xff] ^
+		    crc8_tab[2][(u >> 16) & 0xff] ^
+		    crc8_tab[3][(u >> 24) & 0xf];
+		d = (u >> 15) & 3;
+		if ((u >> 28) != 0xf)
+			la[i].error = -1;
+		else if (c != 0x80)
+			la[i].error = -2;
+		else if (d == 3)
+			la[i].error = -3;
+		else
+			la[i].error = 0;
+		if (la[i].error) {
+			la[i].year = la[i].month = la[i].dtai = la[i].delta = 0;
+			continue;
+		}
+		leap_month_from_index((u >> 17) & 0x7ff, &y, &m);
+		la[i].year = y;
+		la[i].month = m;
+		la[i].dtai = (u >> 8) & 0x7f;
+		la[i].delta = (int)(d >> 1) - (int)(d & 1);
+		good++;
+	}
+	return (good);
+}
+
 /*
  * Query leapsecond.utcd.org for current leapsecond information
  */
 
-static int
+int
 query_leapsecond(const char *fqdn,
     int *year, int *month, int *tai, int *delta, char **ip)
 {
 	struct addrinfo hints, *res, *res0;
 	char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
+	uint64_t t0;
 	int error;
 
+	LEAP_PROBE1(query__entry, fqdn);
+	t0 = metric_usec();
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_family = PF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM;
 	error = getaddrinfo(fqdn, NULL, &hints, &res0);
 	if (error != 0) {
 		fprintf(stderr, "Lookup error: %s\n", gai_strerror(error));
+		t0 = metric_usec() - t0;
+		metric_query(-10, t0);
+		LEAP_PROBE3(query__return, fqdn, -10, t0);
 		return (-10);
 	}
 	error = -11;
@@ -257,12 +392,17 @@ query_leapsecond(const char *fqdn,
 		continue;
 
 		error = decode_leapsecond(hbuf, year, month, tai, delta);
+		metric_decode(error);
 		if (error == 0) {
 			if (ip != NULL)
 				*ip = strdup(hbuf);
 			break;
 		}
 	}
+	freeaddrinfo(res0);
+	t0 = metric_usec() - t0;
+	metric_query(error, t0);
+	LEAP_PROBE3(query__return, fqdn, error, t0);
 	return (error);
 }
 
@@ -284,16 +424,42 @@ static struct test_vector {
 	{ NULL,                  0,    0,  0,   0,  0 }
 };
 
+static const struct subcmd {
+	const char	*name;
+	int		(*func)(int argc, char **argv);
+} subcmds[] = {
+	{ "arm",	main_arm },
+	{ "audit",	main_audit },
+	{ "bench",	main_bench },
+	{ "convert",	main_convert },
+	{ "dut1",	main_dut1 },
+	{ "leapfile",	main_leapfile },
+	{ "pcap",	main_pcap },
+	{ "query",	main_query },
+	{ "serve",	main_serve },
+	{ NULL,		NULL }
+};
+
 int
 main(int argc, char **argv)
 {
 	int error;
 	int year, month, tai, delta;
 	struct test_vector *tv;
-	char *ip;
-
-	(void)argc;
-	(void)argv;
+	const struct subcmd *sc;
+	char *ip, buf[16];
+	uint32_t u;
+
+	if (argc > 1) {
+		for (sc = subcmds; sc->name != NULL; sc++)
+			if (!strcmp(argv[1], sc->name))
+				return (sc->func(argc - 1, argv + 1));
+		fprintf(stderr, "Usage: %s [subcommand [args]]\n", argv[0]);
+		fprintf(stderr, "Subcommands:\n");
+		for (sc = subcmds; sc->name != NULL; sc++)
+			fprintf(stderr, "\t%s\n", sc->name);
+		return (1);
+	}
 
 	printf("Checking test-vectors:\n\n");
 	for (tv = test_vectors; tv->ip != NULL; tv++) {
@@ -307,7 +473,28 @@ main(int argc, char **argv)
 		assert(month == tv->month);
 		assert(tai == tv->tai);
 		assert(delta == tv->delta);
+		if (error != 0)
+			continue;
+		u = encode_leapsecond(year, month, tai, delta);
+		snprintf(buf, sizeof buf, "%u.%u.%u.%u",
+		    u >> 24, (u >> 16) & 0xff, (u >> 8) & 0xff, u & 0xff);
+		assert(!strcmp(buf, tv->ip));
 	}
+	test_leap_dut1();
+	test_leap_arm();
+	test_leap_date();
+	test_leap_smear();
+	test_leap_clock();
+	test_leap_convert();
+	test_leap_pcap();
+	test_leapfile();
+	test_leap_history();
+	test_leap_metrics();
+	test_leap_serve();
+	test_leap_query();
+	test_leap_dnssec();
+	test_leap_audit();
+	test_leap_store();
 	printf("\nIf you see this, the tests ran OK\n");
 
 	printf("\n");
@@ -0,0 +1,509 @@
+/*-
+ * Copyright (c) 2015 Poul-Henning Kamp <phk@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Shared declarations for the DNS leap-second reference implementation.
+ *
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <sys/types.h>
+
+/*
+ * Static tracepoints, see bpftrace/ for how to use them.
+ *
+ * Where the systemtap <sys/sdt.h> is available these compile to a
+ * single nop, which the tracer patches when attached.  Elsewhere, or
+ * with -DNO_PROBES, they compile to nothing.
+ */
+
+#if !defined(NO_PROBES) && defined(__linux__) && defined(__has_include)
+#  if __has_include(<sys/sdt.h>)
+#    include <sys/sdt.h>
+#    define LEAP_PROBE1(n, a)		DTRACE_PROBE1(dns_leap, n, a)
+#    define LEAP_PROBE2(n, a, b)	DTRACE_PROBE2(dns_leap, n, a, b)
+#    define LEAP_PROBE3(n, a, b, c)	DTRACE_PROBE3(dns_leap, n, a, b, c)
+#  endif
+#endif
+#ifndef LEAP_PROBE1
+#  define LEAP_PROBE1(n, a)		do { } while (0)
+#  define LEAP_PROBE2(n, a, b)		do { } while (0)
+#  define LEAP_PROBE3(n, a, b, c)	do { } while (0)
+#endif
+
+/* DNS wire format */
+
+#define DNS_HDRLEN	12
+#define DNS_MAXNAME	255
+#define DNS_MAXUDP	512
+#define DNS_EDNS_SIZE	1232
+
+#define T_A		1
+#define T_OPT		41
+#define T_DS		43
+#define T_RRSIG		46
+#define T_DNSKEY	48
+#define T_ANY		255
+#define C_IN		1
+
+#define R_NXDOMAIN	3
+#define R_REFUSED	5
+
+static inline uint8_t
+dns_lower(uint8_t c)
+{
+
+	return (c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c);
+}
+
+static inline unsigned
+dns_get16(const uint8_t *p)
+{
+
+	return ((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t
+dns_get32(const uint8_t *p)
+{
+
+	return (((uint32_t)dns_get16(p) << 16) | dns_get16(p + 2));
+}
+
+static inline void
+dns_put16(uint8_t *p, unsigned u)
+{
+
+	p[0] = u >> 8;
+	p[1] = u;
+}
+
+static inline void
+dns_put32(uint8_t *p, uint32_t u)
+{
+
+	dns_put16(p, u >> 16);
+	dns_put16(p + 2, u & 0xffff);
+}
+
+/*
+ * Calendar, see leap_date.c.  The macros work on uint32_t or on GCC
+ * vectors of it, with every division by a constant and no branches.
+ */
+
+#define LEAP_DATE_ERAS	5		/* Valid from year -2000 */
+#define LEAP_DATE_Z0	(719468 + 146097 * LEAP_DATE_ERAS)
+#define LEAP_MJD_UNIX	40587		/* MJD of 1970-01-01 */
+
+#define LEAP_CIVIL(T, z, y, m, d)	do {				\
+	T n_ = (T)(z) + LEAP_DATE_Z0;					\
+	T era_ = n_ / 146097;						\
+	T doe_ = n_ - era_ * 146097;					\
+	T yoe_ = (doe_ - doe_ / 1460 + doe_ / 36524 - doe_ / 146096) /	\
+	    365;							\
+	T doy_ = doe_ - (365 * yoe_ + yoe_ / 4 - yoe_ / 100);		\
+	T mp_ = (5 * doy_ + 2) / 153;					\
+	T jf_ = (mp_ + 2) / 12;		/* January or February */	\
+	(d) = doy_ - (153 * mp_ + 2) / 5 + 1;				\
+	(m) = mp_ + 3 - 12 * jf_;					\
+	(y) = yoe_ + era_ * 400 + jf_ - 400 * LEAP_DATE_ERAS;		\
+} while (0)
+
+#define LEAP_DAYS(T, y, m, d, z)	do {				\
+	T jf_ = (14 - (T)(m)) / 12;					\
+	T yy_ = (T)(y) - jf_ + 400 * LEAP_DATE_ERAS;			\
+	T mp_ = (T)(m) + 12 * jf_ - 3;					\
+	T era_ = yy_ / 400;						\
+	T yoe_ = yy_ - era_ * 400;					\
+	(z) = era_ * 146097 + yoe_ * 365 + yoe_ / 4 - yoe_ / 100 +	\
+	    (153 * mp_ + 2) / 5 + (T)(d) - 1 - LEAP_DATE_Z0;		\
+} while (0)
+
+/* Days since 1970-01-01 of a proleptic gregorian date */
+static inline int32_t
+leap_days_from_civil(int year, int month, int day)
+{
+	uint32_t z;
+
+	LEAP_DAYS(uint32_t, year, month, day, z);
+	return ((int32_t)z);
+}
+
+static inline void
+leap_civil_from_days(int32_t z, int *year, int *month, int *day)
+{
+	uint32_t y, m, d;
+
+	LEAP_CIVIL(uint32_t, z, y, m, d);
+	*year = (int32_t)y;
+	*month = (int)m;
+	*day = (int)d;
+}
+
+static inline int64_t
+leap_mjd_unix(int32_t mjd)
+{
+
+	return ((int64_t)(mjd - LEAP_MJD_UNIX) * 86400);
+}
+
+static inline int32_t
+leap_unix_mjd(int64_t t)
+{
+
+	return ((int32_t)(t / 86400 - (t % 86400 < 0)) + LEAP_MJD_UNIX);
+}
+
+/* The month counter of the announcement, 1971-12 is 1 */
+static inline int
+leap_month_index(int year, int month)
+{
+
+	return ((year - 1971) * 12 + month - 11);
+}
+
+static inline void
+leap_month_from_index(int mn, int *year, int *month)
+{
+	unsigned u = (unsigned)(mn + 10 + 12 * 400 * LEAP_DATE_ERAS);
+
+	*year = 1971 - 400 * LEAP_DATE_ERAS + (int)(u / 12);
+	*month = 1 + (int)(u % 12);
+}
+
+/*
+ * The UTC instant where the given month ends, which is where the
+ * leap second, if any, happens.
+ */
+
+static inline time_t
+leap_month_end(int year, int month)
+{
+	int y, m;
+
+	leap_month_from_index(leap_month_index(year, month) + 1, &y, &m);
+	return ((time_t)leap_days_from_civil(y, m, 1) * 86400);
+}
+
+void leap_civil_from_days_n(const int32_t *z, int32_t *year, int32_t *month,
+    int32_t *day, size_t n);
+void test_leap_date(void);
+void bench_civil(unsigned long n);
+void bench_civil_bulk(unsigned long n);
+
+/* dns_leap.c */
+int crc8(uint32_t inp, int len);
+int decode_leapsecond(const char *ip,
+    int *year, int *month, int *dtai, int *delta);
+uint32_t encode_leapsecond(int year, int month, int dtai, int delta);
+struct leap_answer {
+	int		error;		/* As decode_leapsecond() */
+	int		year;
+	int		month;
+	int		dtai;
+	int		delta;
+};
+size_t decode_leapsecond_n(const uint32_t *addr, struct leap_answer *la,
+    size_t n);
+int query_leapsecond(const char *fqdn,
+    int *year, int *month, int *tai, int *delta, char **ip);
+
+/* leap_convert.c */
+void test_leap_convert(void);
+void bench_convert(unsigned long n);
+int main_convert(int argc, char **argv);
+
+/* leap_dut1.c */
+struct leap_dut1 {
+	int		year;
+	int		month;
+	int		dtai;
+	int		delta;
+	int		dut1;		/* UT1 - UTC in microseconds */
+	int		mjd_from;	/* DUT1 valid these days, inclusive */
+	int		mjd_until;
+};
+
+uint32_t crc32c(const uint8_t *p, size_t len);
+int encode_dut1(const struct leap_dut1 *ld, uint8_t *aaaa);
+int decode_dut1(const char *ip, struct leap_dut1 *ld);
+int query_dut1(const char *fqdn, struct leap_dut1 *ld, char **ip);
+void test_leap_dut1(void);
+int main_dut1(int argc, char **argv);
+
+/* leap_store.c */
+#define LEAP_STORE_PATH		"/var/db/dns_leap.lkg"
+
+int leap_store_read(const char *path, int *year, int *month, int *dtai,
+    int *delta, int64_t *updated);
+int leap_store_write(const char *path, int year, int month, int dtai,
+    int delta, int64_t updated);
+int query_leapsecond_lkg(const char *fqdn, const char *path,
+    int *year, int *month, int *tai, int *delta);
+void leap_store_wait(void);
+void test_leap_store(void);
+void bench_store_read(unsigned long n);
+
+/* leap_table.c */
+struct leap_entry {
+	int		year;
+	int		month;
+	int		dtai;
+};
+
+/* At the end of 'year'-'month' dTAI became 'dtai' */
+#define LEAP_TABLE(X)	\
+	X(1971, 12, 10)	\
+	X(1972,  6, 11)	\
+	X(1972, 12, 12)	\
+	X(1973, 12, 13)	\
+	X(1974, 12, 14)	\
+	X(1975, 12, 15)	\
+	X(1976, 12, 16)	\
+	X(1977, 12, 17)	\
+	X(1978, 12, 18)	\
+	X(1979, 12, 19)	\
+	X(1981,  6, 20)	\
+	X(1982,  6, 21)	\
+	X(1983,  6, 22)	\
+	X(1985,  6, 23)	\
+	X(1987, 12, 24)	\
+	X(1989, 12, 25)	\
+	X(1990, 12, 26)	\
+	X(1992,  6, 27)	\
+	X(1993,  6, 28)	\
+	X(1994,  6, 29)	\
+	X(1995, 12, 30)	\
+	X(1997,  6, 31)	\
+	X(1998, 12, 32)	\
+	X(2005, 12, 33)	\
+	X(2008, 12, 34)	\
+	X(2012,  6, 35)	\
+	X(2015,  6, 36)	\
+	X(2016, 12, 37)
+
+extern const struct leap_entry leap_table[];
+extern const int leap_table_len;
+int leap_history(FILE *fi, struct leap_entry *le, int max);
+uint32_t leap_history_announce(const struct leap_entry *le, int n);
+int leap_history_encode(const struct leap_entry *le, int n, uint32_t *addr);
+int leap_history_decode(const uint32_t *addr, int n, struct leap_entry *le,
+    int max);
+int query_leap_history(const char *fqdn, struct leap_entry *le, int max);
+#define LEAP_HALF_C0	38		/* Half year index of Bulletin C 0 */
+int leap_bulletin_month(int n, int *year, int *month);
+int leap_bulletin_label(const uint8_t *p, size_t len);
+int leap_bulletins(const struct leap_entry *le, int n, uint32_t announce,
+    uint32_t *bull, int max);
+int query_leapsecond_bulletin(const char *fqdn, int n,
+    int *year, int *month, int *tai, int *delta, char **ip);
+void test_leap_history(void);
+
+/* leap_arm.c */
+enum arm_action {
+	ARM_IDLE,		/* No leap announced, sleep until horizon */
+	ARM_WAIT,		/* Leap announced, too early to arm */
+	ARM_NOW,		/* Arm kernel now, sleep until month end */
+	ARM_STALE,		/* Announcement expired, fetch a new one */
+};
+
+enum arm_action leap_arm_plan(int year, int month, int delta, time_t now,
+    time_t *when, int *sta);
+int leap_arm_status(int status, enum arm_action act, int sta);
+void test_leap_arm(void);
+int main_arm(int argc, char **argv);
+
+/* leap_smear.c */
+#define SMEAR_STEP	0
+#define SMEAR_LINEAR	1
+#define SMEAR_COSINE	2
+
+struct leap_smear {
+	int64_t		leap;		/* Month end, TAI - dTAI */
+	int32_t		delta;
+	int32_t		kind;		/* SMEAR_* */
+	int32_t		width;		/* Seconds, centred on 'leap' */
+	int32_t		pad;
+};
+
+#define LEAP_STATE_NAME		"/dns_leap"
+#define LEAP_STATE_VERSION	1
+
+struct leap_state {
+	uint32_t	seq;		/* Odd while being written */
+	uint32_t	version;
+	int32_t		year;
+	int32_t		month;
+	int32_t		dtai;
+	int32_t		delta;
+	struct leap_smear smear;
+	int64_t		updated;	/* Last good announcement */
+};
+
+int smear_kind(const char *name);
+int smear_init(struct leap_smear *ls, int year, int month, int delta,
+    int kind, int width);
+double smear_offset(const struct leap_smear *ls, double t);
+void smear_offsets(const struct leap_smear *ls, const double *t,
+    double *off, size_t n);
+int leap_state_publish(const char *name, const struct leap_state *ls);
+int leap_state_read(const char *name, struct leap_state *ls);
+void test_leap_smear(void);
+void bench_smear(unsigned long n);
+void bench_smear_bulk(unsigned long n);
+
+/* leap_clock.c */
+struct leap_clock {
+	int64_t		leap;		/* Month end, UTC */
+	int32_t		dtai;		/* TAI - UTC before 'leap' */
+	int32_t		delta;
+};
+
+int leap_clock_init(struct leap_clock *lc, int year, int month, int dtai,
+    int delta);
+int leap_clock_load(struct leap_clock *lc, const char *name);
+int clock_gettime_tai(const struct leap_clock *lc, struct timespec *ts);
+int clock_gettime_utc_leap(const struct leap_clock *lc, struct timespec *ts,
+    int *leap);
+void test_leap_clock(void);
+void bench_clock_tai(unsigned long n);
+void bench_clock_tai_kernel(unsigned long n);
+
+/* leap_file.c */
+#define NTP_UNIX_EPOCH	2208988800U	/* 1970-01-01 in NTP seconds */
+
+int leapfile_render(char *buf, size_t len, const struct leap_entry *lt,
+    int nlt, int year, int month, int dtai, int delta, time_t now);
+int leapfile_write(const char *path, const struct leap_entry *lt, int nlt,
+    int year, int month, int dtai, int delta, time_t now);
+int leapfile_syncdir(const char *path);
+void test_leapfile(void);
+int main_leapfile(int argc, char **argv);
+
+/* leap_dnssec.c */
+typedef ssize_t dnssec_fetch_f(void *priv, const uint8_t *name,
+    size_t namelen, unsigned qtype, uint8_t *r, size_t rlen);
+int dnssec_validate(const uint8_t *r, size_t len, const uint8_t *name,
+    size_t namelen, time_t now, dnssec_fetch_f *f, void *priv,
+    uint32_t *addr, unsigned *naddr, time_t *expire);
+void test_leap_dnssec(void);
+void bench_rrsig(unsigned long n);
+
+/* leap_metrics.c */
+uint64_t metric_usec(void);
+void metric_query(int error, uint64_t usec);
+void metric_decode(int error);
+void metric_announcement(int year, int month, int dtai, int delta);
+void leap_metrics_print(FILE *fo);
+int leap_metrics_write(const char *path);
+void test_leap_metrics(void);
+void bench_metric(unsigned long n);
+
+/* leap_serve.c */
+int dns_name(const char *fqdn, uint8_t *wire, size_t len);
+void test_leap_serve(void);
+void bench_rrl(unsigned long n);
+void bench_lookup(unsigned long n);
+int main_serve(int argc, char **argv);
+
+/* leap_xdp.c */
+struct xdp_msg {
+	const uint8_t		*q;		/* DNS query */
+	size_t			qlen;
+	uint8_t			*r;		/* DNS response */
+	ssize_t			rlen;		/* In: room, out: length */
+	uint32_t		saddr;		/* Source, network order */
+	uint16_t		sport;
+};
+
+typedef void xdp_answer_f(void *priv, struct xdp_msg *m, unsigned n);
+
+struct xdp_port;
+struct xdp_port *xdp_open(const char *ifname, unsigned nq, unsigned port);
+unsigned xdp_queues(const struct xdp_port *xp);
+int xdp_loop(struct xdp_port *xp, unsigned queue, xdp_answer_f *f,
+    void *priv);
+void xdp_stop(struct xdp_port *xp);
+void xdp_close(struct xdp_port *xp);
+void test_leap_xdp(xdp_answer_f *f, void *priv, const char *fqdn,
+    uint32_t addr);
+
+/* leap_audit.c */
+void test_leap_audit(void);
+int main_audit(int argc, char **argv);
+
+/* leap_bench.c */
+extern volatile uintmax_t bench_sink;
+int main_bench(int argc, char **argv);
+
+/* leap_pcap.c */
+void test_leap_pcap(void);
+void bench_pcap(unsigned long n);
+int main_pcap(int argc, char **argv);
+
+/* leap_query.c */
+#define LQ_DNSSEC	0x01		/* Require a validated answer */
+#define LQ_TCP		0x02		/* Query over TCP */
+#define LQ_TLS		0x04		/* Query over TLS */
+
+#define LQ_MAXADDR	16
+
+struct lq_answer {
+	uint32_t		addr[LQ_MAXADDR];
+	unsigned		naddr;
+	uint32_t		ttl;		/* Lowest A TTL */
+	uint32_t		sigexp;		/* Earliest RRSIG expiry */
+	int			ad;
+	int			tc;
+	int			rcode;
+};
+
+struct lq_result {
+	const char		*fqdn;
+	int			error;
+	int			year;
+	int			month;
+	int			tai;
+	int			delta;
+};
+
+int query_leapsecond_ns(const char *server, const char *port,
+    const char *fqdn, unsigned flags,
+    int *year, int *month, int *tai, int *delta, char **ip);
+int query_leapsecond_many(const char *server, const char *port,
+    unsigned flags, struct lq_result *lr, unsigned n);
+int query_leapsecond_tls(const char *cafile, const char *name);
+size_t lq_query(uint8_t *q, unsigned id, const uint8_t *name, size_t namelen,
+    unsigned flags);
+int lq_parse(const uint8_t *r, size_t len, const uint8_t *q, size_t qend,
+    struct lq_answer *la);
+uint32_t leap_random(void);
+void test_leap_query(void);
+void bench_answer(unsigned long n);
+void bench_answer_dnssec(unsigned long n);
+int main_query(int argc, char **argv);
@@ -0,0 +1,484 @@
+/*-
+ * Copyright (c) 2015 Poul-Henning Kamp <phk@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Arm the kernel leap-second machinery from the DNS announcement.
+ *
+ * The NTP kernel code (on both FreeBSD and Linux) inserts or deletes
+ * the leap second at the end of the UTC day during which STA_INS or
+ * STA_DEL is set, so the flag must be set on the last day of the
+ * announced month, and not before.  To stay well clear of the day
+ * boundaries on either side, we arm at noon UTC on that day.
+ *
+ * Between events the process sleeps on a timer with an absolute
+ * deadline; it does not poll.  On Linux a timerfd is used, so that
+ * a step of the system clock wakes us up to recalculate.
+ *
+ * After every good query the announcement is published to the shared
+ * state segment (see leap_smear.c), from which applications can get
+ * TAI and the smeared UTC without asking the kernel.  With -S linear
+ * or -S cosine the fleet smears the leap second, and the kernel is
+ * left alone so that it does not step as well.
+ *
+ * With -l every good announcement is also kept in a last-known-good
+ * file (see leap_store.c), and at startup the state is published from
+ * that file before the first query, so that a machine which boots
+ * without network still knows about the coming leap second.
+ *
+ * The only decision logic is in leap_arm_plan(), which takes the
+ * current time as argument, so that it can be exercised with a fake
+ * clock by the test-vectors below.
+ *
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/timex.h>
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif
+
+#include "dns_leap.h"
+
+#define ARM_LEAD	(12 * 3600)	/* Arm this long before month end */
+#define ARM_RETRY	(15 * 60)	/* Retry interval for failed queries */
+
+static int arm_foreground;
+
+/*
+ * Decide what to do about an announcement at time 'now'.
+ *
+ * '*when' is the time when leap_arm_plan() should be consulted again.
+ *
+ * '*sta' is the kernel status flag the announcement calls for.
+ */
+
+enum arm_action
+leap_arm_plan(int year, int month, int delta, time_t now,
+    time_t *when, int *sta)
+{
+	time_t end;
+
+	end = leap_month_end(year, month);
+	*sta = 0;
+	if (now >= end) {
+		*when = now + ARM_RETRY;
+		return (ARM_STALE);
+	}
+	if (delta == 0) {
+		*when = end;
+		return (ARM_IDLE);
+	}
+	*sta = delta > 0 ? STA_INS : STA_DEL;
+	if (now < end - ARM_LEAD) {
+		*when = end - ARM_LEAD;
+		return (ARM_WAIT);
+	}
+	*when = end;
+	return (ARM_NOW);
+}
+
+/*
+ * The kernel status for 'act', starting from 'status'.  Only ARM_NOW
+ * sets STA_INS or STA_DEL; otherwise they are cleared, so that a flag
+ * set for an announcement which was since retracted or moved does not
+ * insert a leap second anyway, and so that Linux leaves TIME_WAIT
+ * after a leap second.
+ */
+
+int
+leap_arm_status(int status, enum arm_action act, int sta)
+{
+
+	status &= ~(STA_INS | STA_DEL);
+	if (act == ARM_NOW)
+		status |= sta;
+	return (status);
+}
+
+static void
+arm_log(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	if (arm_foreground) {
+		vfprintf(stderr, fmt, ap);
+		fprintf(stderr, "\n");
+	} else {
+		vsyslog(LOG_NOTICE, fmt, ap);
+	}
+	va_end(ap);
+}
+
+static const char *
+arm_time(time_t t, char *buf, size_t len)
+{
+	struct tm tm;
+
+	(void)gmtime_r(&t, &tm);
+	(void)strftime(buf, len, "%Y-%m-%d %H:%M:%S UTC", &tm);
+	return (buf);
+}
+
+/*
+ * Sleep until the absolute UTC time 'when'.
+ *
+ * Returns 1 if the system clock was stepped before we got there.
+ */
+
+static int
+sleep_until(time_t when)
+{
+	struct timespec ts;
+#ifdef __linux__
+	struct itimerspec its;
+	uint64_t n;
+	int fd, retval;
+
+	fd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC);
+	if (fd >= 0) {
+		memset(&its, 0, sizeof its);
+		its.it_value.tv_sec = when;
+		retval = timerfd_settime(fd,
+		    TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL);
+		if (retval == 0) {
+			do
+				retval = read(fd, &n, sizeof n);
+			while (retval < 0 && errno == EINTR);
+			if (retval < 0 && errno == ECANCELED)
+				retval = 1;
+			else if (retval > 0)
+				retval = 0;
+		}
+		(void)close(fd);
+		return (retval);
+	}
+#endif
+	ts.tv_sec = when;
+	ts.tv_nsec = 0;
+	while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &ts, NULL) ==
+	    EINTR)
+		continue;
+	return (0);
+}
+
+static int
+arm_kernel(enum arm_action act, int sta, int dryrun)
+{
+	struct timex tx;
+	int status;
+
+	memset(&tx, 0, sizeof tx);
+	if (ntp_adjtime(&tx) < 0) {
+		arm_log("ntp_adjtime(read): %s", strerror(errno));
+		return (-1);
+	}
+	status = leap_arm_status(tx.status, act, sta);
+	if (status == tx.status)
+		return (0);
+	tx.modes = MOD_STATUS;
+	tx.status = status;
+	if (dryrun) {
+		arm_log("Dry-run: would set kernel status 0x%04x", tx.status);
+		return (0);
+	}
+	if (ntp_adjtime(&tx) < 0) {
+		arm_log("ntp_adjtime(write): %s", strerror(errno));
+		return (-1);
+	}
+	arm_log("Kernel status set to 0x%04x", tx.status);
+	return (0);
+}
+
+static void
+arm_publish(int y, int m, int t, int d, int kind, int width, int64_t updated)
+{
+	struct leap_state ls;
+
+	memset(&ls, 0, sizeof ls);
+	ls.version = LEAP_STATE_VERSION;
+	ls.year = y;
+	ls.month = m;
+	ls.dtai = t;
+	ls.delta = d;
+	(void)smear_init(&ls.smear, y, m, d, kind, width);
+	ls.updated = updated;
+	if (leap_state_publish(LEAP_STATE_NAME, &ls))
+		arm_log("Cannot publish %s: %s", LEAP_STATE_NAME,
+		    strerror(errno));
+}
+
+static void
+usage_arm(void)
+{
+
+	fprintf(stderr, "Usage: dns_leap arm [-dn] [-l file] [-m metrics] "
+	    "[-S step|linear|cosine]\n\t    [-w hours] [fqdn]\n");
+	fprintf(stderr, "\t-d\tStay in foreground, log to stderr\n");
+	fprintf(stderr, "\t-l\tKeep the last good announcement in this"
+	    " file (" LEAP_STORE_PATH ")\n");
+	fprintf(stderr, "\t-m\tWrite metrics to this file after each query\n");
+	fprintf(stderr, "\t-n\tDry-run, do not touch the kernel (implies -d)\n");
+	fprintf(stderr, "\t-S\tPublish this smear, only 'step' arms the"
+	    " kernel (step)\n");
+	fprintf(stderr, "\t-w\tSmear window in hours (24)\n");
+	exit(1);
+}
+
+int
+main_arm(int argc, char **argv)
+{
+	const char *fqdn = "leapsecond.utcd.org";
+	const char *metrics = NULL, *lkg = NULL;
+	int ch, error, dryrun = 0, valid = 0, sta;
+	int year = 0, month = 0, delta = 0;
+	int kind = SMEAR_STEP, width = 24 * 3600;
+	int64_t stored;
+	char *e;
+	long l;
+	int y, m, t, d;
+	enum arm_action act;
+	time_t now, when;
+	char buf[40];
+
+	while ((ch = getopt(argc, argv, "dl:m:nS:w:")) != -1) {
+		switch (ch) {
+		case 'd':
+			arm_foreground = 1;
+			break;
+		case 'l':
+			lkg = optarg;
+			break;
+		case 'm':
+			metrics = optarg;
+			break;
+		case 'n':
+			arm_foreground = 1;
+			dryrun = 1;
+			break;
+		case 'S':
+			kind = smear_kind(optarg);
+			if (kind < 0)
+				usage_arm();
+			break;
+		case 'w':
+			l = strtol(optarg, &e, 10);
+			if (*e != '\0' || l < 0 || l > 7 * 24)
+				usage_arm();
+			width = (int)l * 3600;
+			break;
+		default:
+			usage_arm();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc > 1)
+		usage_arm();
+	if (argc == 1)
+		fqdn = argv[0];
+
+	if (!arm_foreground && daemon(0, 0)) {
+		perror("daemon");
+		return (1);
+	}
+
+	/* Until the network is up, start from the last good announcement */
+	if (lkg != NULL &&
+	    leap_store_read(lkg, &y, &m, &t, &d, &stored) == 0) {
+		arm_log("Stored announcement %04d-%02d dTAI %d %+d from %s",
+		    y, m, t, d, arm_time(stored, buf, sizeof buf));
+		year = y;
+		month = m;
+		delta = d;
+		valid = 1;
+		arm_publish(y, m, t, d, kind, width, stored);
+	}
+
+	for (;;) {
+		/*
+		 * Always re-query, so that a retracted announcement is
+		 * caught before we arm.  Fall back on the last good one.
+		 */
+		error = query_leapsecond(fqdn, &y, &m, &t, &d, NULL);
+		if (error == 0) {
+			year = y;
+			month = m;
+			delta = d;
+			valid = 1;
+			metric_announcement(y, m, t, d);
+			now = time(NULL);
+			arm_publish(y, m, t, d, kind, width, now);
+			if (lkg != NULL &&
+			    leap_store_write(lkg, y, m, t, d, now) < 0)
+				arm_log("Cannot write %s: %s", lkg,
+				    strerror(errno));
+		} else {
+			arm_log("Query for %s failed with error %d",
+			    fqdn, error);
+		}
+		if (metrics != NULL && leap_metrics_write(metrics))
+			arm_log("Cannot write %s: %s", metrics,
+			    strerror(errno));
+		now = time(NULL);
+		if (!valid) {
+			when = now + ARM_RETRY;
+			act = ARM_STALE;
+		} else {
+			act = leap_arm_plan(year, month, delta, now,
+			    &when, &sta);
+		}
+
+		switch (act) {
+		case ARM_IDLE:
+			arm_log("No leap second until end of %04d-%02d",
+			    year, month);
+			(void)arm_kernel(act, sta, dryrun);
+			break;
+		case ARM_WAIT:
+			arm_log("Leap second (%+d) at end of %04d-%02d,"
+			    " arming at %s", delta, year, month,
+			    arm_time(when, buf, sizeof buf));
+			(void)arm_kernel(act, sta, dryrun);
+			break;
+		case ARM_NOW:
+			if (kind != SMEAR_STEP && width > 0) {
+				arm_log("Leap second (%+d) at %s is smeared,"
+				    " kernel not armed", delta,
+				    arm_time(when, buf, sizeof buf));
+				break;
+			}
+			arm_log("Leap second (%+d) at %s, arming kernel",
+			    delta, arm_time(when, buf, sizeof buf));
+			(void)arm_kernel(act, sta, dryrun);
+			break;
+		case ARM_STALE:
+			arm_log("No valid announcement, retry at %s",
+			    arm_time(when, buf, sizeof buf));
+			(void)arm_kernel(act, sta, dryrun);
+			break;
+		}
+
+		error = sleep_until(when);
+		if (error < 0) {
+			arm_log("Timer failed: %s", strerror(errno));
+			return (1);
+		}
+		if (error > 0)
+			arm_log("System clock stepped, recalculating");
+	}
+}
+
+/*
+ * The 'now' column is the fake clock fed to leap_arm_plan()
+ */
+
+static const struct arm_vector {
+	int		year;
+	int		month;
+	int		delta;
+	time_t		now;
+	enum arm_action	act;
+	time_t		when;
+	int		sta;
+} arm_vectors[] = {
+	{ 2015,  6, +1, 1433116800, ARM_WAIT,  1435665600, STA_INS },
+	{ 2015,  6, +1, 1435665599, ARM_WAIT,  1435665600, STA_INS },
+	{ 2015,  6, +1, 1435665600, ARM_NOW,   1435708800, STA_INS },
+	{ 2015,  6, +1, 1435708799, ARM_NOW,   1435708800, STA_INS },
+	{ 2015,  6, +1, 1435708800, ARM_STALE, 1435709700, 0 },
+	{ 1993, 12,  0,  757000000, ARM_IDLE,   757382400, 0 },
+	{ 2135,  1, -1, 5209570800, ARM_NOW,   5209574400, STA_DEL },
+	{ 0,     0,  0,          0, ARM_IDLE,           0, 0 }
+};
+
+/*
+ * A retraction: armed for 2015-06 at noon, then the announcement is
+ * withdrawn before midnight, and later moved to 2015-12.  'status' is
+ * the kernel status after each step, STA_PLL must survive.
+ */
+
+static const struct arm_retract {
+	int		year;
+	int		month;
+	int		delta;
+	time_t		now;
+	enum arm_action	act;
+	int		status;
+} arm_retract[] = {
+	{ 2015,  6, +1, 1435665600, ARM_NOW,   STA_PLL | STA_INS },
+	{ 2015,  6,  0, 1435680000, ARM_IDLE,  STA_PLL },
+	{ 2015,  6, +1, 1435690000, ARM_NOW,   STA_PLL | STA_INS },
+	{ 2015, 12, +1, 1435700000, ARM_WAIT,  STA_PLL },
+	{ 2015, 12, -1, 1451563200, ARM_NOW,   STA_PLL | STA_DEL },
+	{ 2015, 12, -1, 1451606400, ARM_STALE, STA_PLL },
+	{ 0,     0,  0,          0, ARM_IDLE,  0 }
+};
+
+void
+test_leap_arm(void)
+{
+	const struct arm_vector *av;
+	const struct arm_retract *ar;
+	enum arm_action act;
+	time_t when;
+	int sta, status;
+
+	printf("\nChecking kernel arming plan:\n\n");
+	for (av = arm_vectors; av->year != 0; av++) {
+		act = leap_arm_plan(av->year, av->month, av->delta, av->now,
+		    &when, &sta);
+		printf("  Leap: %04d-%02d %+d  Now: %11jd  Action: %d"
+		    "  When: %11jd  STA: 0x%02x\n",
+		    av->year, av->month, av->delta, (intmax_t)av->now,
+		    act, (intmax_t)when, sta);
+		assert(act == av->act);
+		assert(when == av->when);
+		assert(sta == av->sta);
+	}
+
+	printf("\nChecking kernel status across a retraction:\n\n");
+	status = STA_PLL;
+	for (ar = arm_retract; ar->year != 0; ar++) {
+		act = leap_arm_plan(ar->year, ar->month, ar->delta, ar->now,
+		    &when, &sta);
+		status = leap_arm_status(status, act, sta);
+		printf("  Leap: %04d-%02d %+d  Now: %11jd  Action: %d"
+		    "  Status: 0x%04x\n",
+		    ar->year, ar->month, ar->delta, (intmax_t)ar->now,
+		    act, status);
+		assert(act == ar->act);
+		assert(status == ar->status);
+	}
+}
@@ -0,0 +1,996 @@
+/*-
+ * Copyright (c) 2015 Poul-Henning Kamp <phk@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Audit a fleet of recursive resolvers.
+ *
+ * Every resolver on the list is asked for the A record of the
+ * leapsecond name from a single thread: one non-blocking UDP socket
+ * per address family, and a poll(2) loop which keeps up to '-c'
+ * queries in flight.  A response is matched to its query by the DNS
+ * ID, which indexes the in-flight table, then by source address and
+ * port, then by the question, and anything else is dropped.  All
+ * queries have the same timeout, so the in-flight queries time out in
+ * the order they were sent, and a FIFO has the next deadline at its
+ * head.  A query which times out is retried with a new ID.
+ *
+ * Each resolver ends up in one class, the decoding ones by the
+ * decode_leapsecond() error code:
+ *
+ *	ok		the expected announcement
+ *	stale		a valid announcement, but not the expected one
+ *	stripped	NOERROR without any A record (class-E filtered)
+ *	not-class-E	error -1, the address was rewritten
+ *	crc		error -2, corrupted
+ *	bad-d		error -3, corrupted
+ *	rcode		SERVFAIL, REFUSED, NXDOMAIN and the like
+ *	truncated	TC=1, which is not retried over TCP
+ *	timeout		no answer to any of the '-r' tries
+ *	error		the query could not be sent
+ *
+ * The expected announcement is given with '-e', or else it is the one
+ * most resolvers gave.
+ *
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "dns_leap.h"
+
+#define AU_MAXFLIGHT	60000		/* Of the 65536 DNS IDs */
+#define AU_SOCKBUF	(4 * 1024 * 1024)
+
+enum au_class {
+	AU_OK,
+	AU_STALE,
+	AU_STRIP,
+	AU_NOTE,
+	AU_CRC,
+	AU_BADD,
+	AU_RCODE,
+	AU_TC,
+	AU_TIMEOUT,
+	AU_ERROR,
+	AU_NCLASS
+};
+
+static const char * const au_names[AU_NCLASS] = {
+	"ok", "stale", "stripped", "not-class-E", "crc", "bad-d", "rcode",
+	"truncated", "timeout", "error"
+};
+
+struct au_target {
+	struct sockaddr_storage	sa;
+	socklen_t		salen;
+	char			*name;
+	int			class;		/* -1 until done */
+	int			rcode;
+	uint32_t		addr;		/* First A record */
+	unsigned		tries;
+	unsigned		id;
+	unsigned		next;		/* Queue link, index + 1 */
+	uint64_t		sent;
+	uint64_t		rtt;
+};
+
+struct audit {
+	struct au_target	*t;
+	unsigned		nt;
+	unsigned		maxt;
+
+	uint8_t			q[DNS_MAXUDP];
+	size_t			qlen;
+	size_t			qend;
+	int			fd[2];		/* AF_INET, AF_INET6 */
+
+	unsigned		flight[65536];	/* By ID, index + 1 */
+	unsigned		head, tail;	/* Sent, oldest first */
+	unsigned		rhead, rtail;	/* Timed out, to resend */
+	unsigned		cursor;		/* Next never sent */
+	unsigned		inflight;
+	unsigned		maxflight;
+	unsigned		done;
+	unsigned		idseq;
+
+	uint64_t		timeout;	/* Microseconds */
+	unsigned		tries;
+	unsigned long		sends;
+	unsigned long		ignored;
+	uint32_t		expect;
+};
+
+static void
+au_init(struct audit *au, const char *fqdn)
+{
+	uint8_t name[DNS_MAXNAME];
+	int l;
+
+	memset(au, 0, sizeof *au);
+	au->fd[0] = au->fd[1] = -1;
+	au->maxflight = 1000;
+	au->timeout = 2000000;
+	au->tries = 3;
+	au->idseq = (unsigned)(getpid() ^ metric_usec());
+	l = dns_name(fqdn, name, sizeof name);
+	assert(l > 0);
+	au->qlen = lq_query(au->q, 0, name, l, 0);
+	au->qend = DNS_HDRLEN + l + 4;
+}
+
+static void
+au_fini(struct audit *au)
+{
+	unsigned u;
+
+	for (u = 0; u < au->nt; u++)
+		free(au->t[u].name);
+	free(au->t);
+	if (au->fd[0] >= 0)
+		(void)close(au->fd[0]);
+	if (au->fd[1] >= 0)
+		(void)close(au->fd[1]);
+}
+
+/*
+ * "192.0.2.1", "192.0.2.1:5353", "2001:db8::1" or "[2001:db8::1]:5353"
+ */
+
+static int
+au_add(struct audit *au, const char *s, unsigned port)
+{
+	struct au_target *t;
+	struct sockaddr_in *sin;
+	struct sockaddr_in6 *sin6;
+	char buf[INET6_ADDRSTRLEN];
+	const char *p, *e;
+	size_t l;
+
+	if (au->nt == au->maxt) {
+		au->maxt = au->maxt ? au->maxt * 2 : 256;
+		au->t = realloc(au->t, au->maxt * sizeof *au->t);
+		if (au->t == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	t = &au->t[au->nt];
+	memset(t, 0, sizeof *t);
+	t->class = -1;
+
+	p = s;
+	if (*s == '[') {
+		p = s + 1;
+		e = strchr(p, ']');
+		if (e == NULL || (e[1] != '\0' && e[1] != ':'))
+			return (-1);
+	} else {
+		e = strchr(s, ':');
+		if (e != NULL && strchr(e + 1, ':') != NULL)
+			e = NULL;		/* IPv6 without a port */
+		if (e == NULL)
+			e = s + strlen(s);
+	}
+	l = e - p;
+	if (l == 0 || l >= sizeof buf)
+		return (-1);
+	memcpy(buf, p, l);
+	buf[l] = '\0';
+	if (*e == ']')
+		e++;
+	if (*e == ':') {
+		port = (unsigned)strtoul(e + 1, (char **)&p, 10);
+		if (*p != '\0' || port == 0 || port > 65535)
+			return (-1);
+	} else if (*e != '\0') {
+		return (-1);
+	}
+
+	sin = (struct sockaddr_in *)&t->sa;
+	sin6 = (struct sockaddr_in6 *)&t->sa;
+	if (inet_pton(AF_INET, buf, &sin->sin_addr) == 1) {
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(port);
+		t->salen = sizeof *sin;
+	} else if (inet_pton(AF_INET6, buf, &sin6->sin6_addr) == 1) {
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port);
+		t->salen = sizeof *sin6;
+	} else {
+		return (-1);
+	}
+	t->name = strdup(s);
+	if (t->name == NULL) {
+		perror("strdup");
+		exit(1);
+	}
+	au->nt++;
+	return (0);
+}
+
+static int
+au_socket(struct audit *au, int family)
+{
+	int i = family == AF_INET ? 0 : 1, fd, n = AU_SOCKBUF;
+
+	if (au->fd[i] >= 0)
+		return (au->fd[i]);
+	fd = socket(family, SOCK_DGRAM, 0);
+	if (fd < 0)
+		return (-1);
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK)) {
+		(void)close(fd);
+		return (-1);
+	}
+	(void)setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &n, sizeof n);
+	(void)setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &n, sizeof n);
+	au->fd[i] = fd;
+	return (fd);
+}
+
+static void
+au_append(struct audit *au, unsigned *head, unsigned *tail, unsigned ti)
+{
+
+	au->t[ti - 1].next = 0;
+	if (*tail)
+		au->t[*tail - 1].next = ti;
+	else
+		*head = ti;
+	*tail = ti;
+}
+
+/*
+ * Returns 0 when sent, 1 if the socket buffer is full, -1 on error
+ */
+
+static int
+au_send(struct audit *au, unsigned ti, uint64_t now)
+{
+	struct au_target *t = &au->t[ti - 1];
+	int fd;
+
+	fd = au_socket(au, t->sa.ss_family);
+	if (fd < 0)
+		return (-1);
+	do
+		au->idseq = (au->idseq + 40503) & 0xffff;
+	while (au->flight[au->idseq] != 0);
+	t->id = au->idseq;
+	dns_put16(au->q, t->id);
+	if (sendto(fd, au->q, au->qlen, 0, (struct sockaddr *)&t->sa,
+	    t->salen) != (ssize_t)au->qlen) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK ||
+		    errno == ENOBUFS)
+			return (1);
+		return (-1);
+	}
+	au->flight[t->id] = ti;
+	au->sends++;
+	t->tries++;
+	t->sent = now;
+	au_append(au, &au->head, &au->tail, ti);
+	return (0);
+}
+
+static void
+au_finish(struct audit *au, struct au_target *t, int class)
+{
+
+	t->class = class;
+	au->inflight--;
+	au->done++;
+}
+
+/*
+ * Send retries, then new queries up to the limit.  Returns 1 if the
+ * socket buffer filled up.
+ */
+
+static int
+au_fill(struct audit *au, uint64_t now)
+{
+	unsigned ti;
+	int e;
+
+	while ((ti = au->rhead) != 0) {
+		au->rhead = au->t[ti - 1].next;
+		if (au->rhead == 0)
+			au->rtail = 0;
+		e = au_send(au, ti, now);
+		if (e > 0) {
+			au->t[ti - 1].next = au->rhead;
+			au->rhead = ti;
+			if (au->rtail == 0)
+				au->rtail = ti;
+			return (1);
+		}
+		if (e < 0)
+			au_finish(au, &au->t[ti - 1], AU_ERROR);
+	}
+	while (au->cursor < au->nt && au->inflight < au->maxflight) {
+		ti = au->cursor + 1;
+		e = au_send(au, ti, now);
+		if (e > 0)
+			return (1);
+		au->cursor++;
+		au->inflight++;
+		if (e < 0)
+			au_finish(au, &au->t[ti - 1], AU_ERROR);
+	}
+	return (0);
+}
+
+static void
+au_expire(struct audit *au, uint64_t now)
+{
+	struct au_target *t;
+	unsigned ti;
+
+	while ((ti = au->head) != 0) {
+		t = &au->t[ti - 1];
+		if (t->class < 0 && now < t->sent + au->timeout)
+			break;
+		au->head = t->next;
+		if (au->head == 0)
+			au->tail = 0;
+		if (t->class >= 0)
+			continue;		/* Answered */
+		au->flight[t->id] = 0;
+		if (t->tries < au->tries)
+			au_append(au, &au->rhead, &au->rtail, ti);
+		else
+			au_finish(au, t, AU_TIMEOUT);
+	}
+}
+
+static int
+au_same(const struct au_target *t, const struct sockaddr_storage *ss)
+{
+	const struct sockaddr_in *a = (const void *)&t->sa;
+	const struct sockaddr_in *b = (const void *)ss;
+	const struct sockaddr_in6 *a6 = (const void *)&t->sa;
+	const struct sockaddr_in6 *b6 = (const void *)ss;
+
+	if (ss->ss_family != t->sa.ss_family)
+		return (0);
+	if (ss->ss_family == AF_INET)
+		return (a->sin_port == b->sin_port &&
+		    a->sin_addr.s_addr == b->sin_addr.s_addr);
+	return (a6->sin6_port == b6->sin6_port &&
+	    !memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof a6->sin6_addr));
+}
+
+static void
+au_classify(struct au_target *t, const struct lq_answer *la)
+{
+	struct leap_answer a;
+
+	if (la->tc) {
+		t->class = AU_TC;
+	} else if (la->rcode != 0) {
+		t->class = AU_RCODE;
+		t->rcode = la->rcode;
+	} else if (la->naddr == 0) {
+		t->class = AU_STRIP;
+	} else {
+		t->addr = la->addr[0];
+		(void)decode_leapsecond_n(&t->addr, &a, 1);
+		switch (a.error) {
+		case 0:  t->class = AU_OK; break;
+		case -1: t->class = AU_NOTE; break;
+		case -2: t->class = AU_CRC; break;
+		default: t->class = AU_BADD; break;
+		}
+	}
+}
+
+static void
+au_recv(struct audit *au, int fd, uint64_t now)
+{
+	struct sockaddr_storage ss;
+	struct lq_answer la;
+	struct au_target *t;
+	uint8_t r[DNS_EDNS_SIZE];
+	socklen_t sl;
+	ssize_t n;
+	unsigned id, ti;
+
+	for (;;) {
+		sl = sizeof ss;
+		n = recvfrom(fd, r, sizeof r, 0, (struct sockaddr *)&ss, &sl);
+		if (n < 0)
+			return;
+		if (n < DNS_HDRLEN) {
+			au->ignored++;
+			continue;
+		}
+		id = dns_get16(r);
+		ti = au->flight[id];
+		if (ti == 0 || !au_same(&au->t[ti - 1], &ss)) {
+			au->ignored++;
+			continue;
+		}
+		t = &au->t[ti - 1];
+		dns_put16(au->q, id);
+		if (lq_parse(r, n, au->q, au->qend, &la)) {
+			au->ignored++;
+			continue;
+		}
+		au->flight[id] = 0;
+		t->rtt = now - t->sent;
+		au_classify(t, &la);
+		au->inflight--;
+		au->done++;
+	}
+}
+
+static int
+au_run(struct audit *au)
+{
+	struct pollfd pfd[2];
+	uint64_t now, dl;
+	int i, n, tmo, full;
+
+	while (au->done < au->nt) {
+		now = metric_usec();
+		au_expire(au, now);
+		full = au_fill(au, now);
+		if (au->done == au->nt)
+			break;
+		tmo = -1;
+		if (au->head != 0) {
+			dl = au->t[au->head - 1].sent + au->timeout;
+			tmo = dl > now ? (int)((dl - now + 999) / 1000) : 0;
+		}
+		for (i = n = 0; i < 2; i++) {
+			if (au->fd[i] < 0)
+				continue;
+			pfd[n].fd = au->fd[i];
+			pfd[n].events = POLLIN | (full ? POLLOUT : 0);
+			pfd[n].revents = 0;
+			n++;
+		}
+		if (poll(pfd, n, tmo) < 0 && errno != EINTR)
+			return (-1);
+		now = metric_usec();
+		for (i = 0; i < n; i++)
+			if (pfd[i].revents & POLLIN)
+				au_recv(au, pfd[i].fd, now);
+	}
+	return (0);
+}
+
+static int
+au_cmp32(const void *a, const void *b)
+{
+	uint32_t ua = *(const uint32_t *)a, ub = *(const uint32_t *)b;
+
+	return (ua < ub ? -1 : ua > ub);
+}
+
+static int
+au_cmp64(const void *a, const void *b)
+{
+	uint64_t ua = *(const uint64_t *)a, ub = *(const uint64_t *)b;
+
+	return (ua < ub ? -1 : ua > ub);
+}
+
+/*
+ * Settle on the expected announcement, sort the valid ones into ok and
+ * stale, and count the classes.  Returns how many gave the expected one.
+ */
+
+static unsigned
+au_settle(struct audit *au, unsigned *count)
+{
+	struct au_target *t;
+	uint32_t *v;
+	unsigned u, n, i, run, best = 0;
+
+	if (au->expect == 0) {
+		v = calloc(au->nt + 1, sizeof *v);
+		if (v == NULL) {
+			perror("calloc");
+			exit(1);
+		}
+		for (u = n = 0; u < au->nt; u++)
+			if (au->t[u].class == AU_OK ||
+			    au->t[u].class == AU_STALE)
+				v[n++] = au->t[u].addr;
+		qsort(v, n, sizeof *v, au_cmp32);
+		for (u = 0; u < n; u = i) {
+			for (i = u; i < n && v[i] == v[u]; i++)
+				continue;
+			run = i - u;
+			if (run > best) {
+				best = run;
+				au->expect = v[u];
+			}
+		}
+		free(v);
+	}
+	memset(count, 0, AU_NCLASS * sizeof *count);
+	for (u = 0; u < au->nt; u++) {
+		t = &au->t[u];
+		if (t->class == AU_OK || t->class == AU_STALE)
+			t->class = t->addr == au->expect ? AU_OK : AU_STALE;
+		count[t->class]++;
+	}
+	return (count[AU_OK]);
+}
+
+static void
+au_report(struct audit *au, FILE *fo, int verbose)
+{
+	static const char * const rcodes[] = {
+		"NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP",
+		"REFUSED"
+	};
+	unsigned count[AU_NCLASS], u, n;
+	struct leap_answer la;
+	struct au_target *t;
+	uint64_t *rtt;
+	char det[48];
+
+	(void)au_settle(au, count);
+	if (au->expect != 0) {
+		(void)decode_leapsecond_n(&au->expect, &la, 1);
+		fprintf(fo, "Expected: %04d-%02d dTAI: %d Delta: %+d\n",
+		    la.year, la.month, la.dtai, la.delta);
+	}
+	fprintf(fo, "Resolvers: %u  Queries: %lu  Ignored: %lu\n",
+	    au->nt, au->sends, au->ignored);
+	for (u = 0; u < AU_NCLASS; u++)
+		if (count[u] != 0)
+			fprintf(fo, "  %-12s %8u  %5.1f%%\n", au_names[u],
+			    count[u], 100. * count[u] / au->nt);
+
+	rtt = calloc(au->nt + 1, sizeof *rtt);
+	if (rtt == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	for (u = n = 0; u < au->nt; u++)
+		if (au->t[u].class != AU_TIMEOUT &&
+		    au->t[u].class != AU_ERROR)
+			rtt[n++] = au->t[u].rtt;
+	if (n > 0) {
+		qsort(rtt, n, sizeof *rtt, au_cmp64);
+		fprintf(fo, "Response time ms: p50 %.1f  p90 %.1f  p99 %.1f"
+		    "  max %.1f\n", rtt[n / 2] * 1e-3, rtt[n * 9 / 10] * 1e-3,
+		    rtt[n * 99 / 100] * 1e-3, rtt[n - 1] * 1e-3);
+	}
+	free(rtt);
+
+	for (u = 0; u < au->nt; u++) {
+		t = &au->t[u];
+		if (t->class == AU_OK && !verbose)
+			continue;
+		det[0] = '\0';
+		switch (t->class) {
+		case AU_OK:
+		case AU_STALE:
+			(void)decode_leapsecond_n(&t->addr, &la, 1);
+			(void)snprintf(det, sizeof det, "%04d-%02d %d %+d",
+			    la.year, la.month, la.dtai, la.delta);
+			break;
+		case AU_NOTE:
+		case AU_CRC:
+		case AU_BADD:
+			(void)snprintf(det, sizeof det, "%u.%u.%u.%u",
+			    t->addr >> 24, (t->addr >> 16) & 0xff,
+			    (t->addr >> 8) & 0xff, t->addr & 0xff);
+			break;
+		case AU_RCODE:
+			if (t->rcode < 6)
+				(void)snprintf(det, sizeof det, "%s",
+				    rcodes[t->rcode]);
+			else
+				(void)snprintf(det, sizeof det, "rcode %d",
+				    t->rcode);
+			break;
+		case AU_TIMEOUT:
+			(void)snprintf(det, sizeof det, "%u tries", t->tries);
+			break;
+		default:
+			break;
+		}
+		if (t->class == AU_TIMEOUT || t->class == AU_ERROR)
+			fprintf(fo, "%-40s %-12s %s\n", t->name,
+			    au_names[t->class], det);
+		else
+			fprintf(fo, "%-40s %-12s %-20s %8.1f ms\n", t->name,
+			    au_names[t->class], det, t->rtt * 1e-3);
+	}
+}
+
+static int
+au_file(struct audit *au, const char *path, unsigned port)
+{
+	char line[256], *p, *e;
+	FILE *fi;
+	int retval = 0;
+
+	fi = fopen(path, "r");
+	if (fi == NULL) {
+		perror(path);
+		return (-1);
+	}
+	while (fgets(line, sizeof line, fi) != NULL) {
+		p = line + strspn(line, " \t");
+		e = p + strcspn(p, " \t\r\n#");
+		if (e == p)
+			continue;
+		*e = '\0';
+		if (au_add(au, p, port)) {
+			fprintf(stderr, "%s: bad resolver '%s'\n", path, p);
+			retval = -1;
+		}
+	}
+	(void)fclose(fi);
+	return (retval);
+}
+
+static void
+usage_audit(void)
+{
+
+	fprintf(stderr, "Usage: dns_leap audit [-v] [-c inflight] "
+	    "[-e year-month,dtai,delta] [-f file]\n"
+	    "\t    [-n fqdn] [-p port] [-r tries] [-t ms] [resolver ...]\n");
+	exit(1);
+}
+
+int
+main_audit(int argc, char **argv)
+{
+	static struct audit au;
+	const char *fqdn = "leapsecond.utcd.org", *file = NULL;
+	unsigned count[AU_NCLASS], port = 53;
+	int ch, i, verbose = 0, y, m, t, d;
+	long c = 1000, r = 3, ms = 2000;
+	uint32_t expect = 0;
+	uint64_t t0;
+	double dt;
+
+	while ((ch = getopt(argc, argv, "c:e:f:n:p:r:t:v")) != -1) {
+		switch (ch) {
+		case 'c':
+			c = atol(optarg);
+			break;
+		case 'e':
+			if (sscanf(optarg, "%d-%d,%d,%d", &y, &m, &t, &d) != 4)
+				usage_audit();
+			expect = encode_leapsecond(y, m, t, d);
+			if (expect == 0)
+				usage_audit();
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		case 'n':
+			fqdn = optarg;
+			break;
+		case 'p':
+			port = (unsigned)atoi(optarg);
+			break;
+		case 'r':
+			r = atol(optarg);
+			break;
+		case 't':
+			ms = atol(optarg);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage_audit();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (c < 1 || c > AU_MAXFLIGHT || r < 1 || r > 10 || ms < 1 ||
+	    port < 1 || port > 65535 || dns_name(fqdn, au.q, DNS_MAXNAME) < 0)
+		usage_audit();
+
+	au_init(&au, fqdn);
+	au.maxflight = c;
+	au.tries = r;
+	au.timeout = ms * 1000;
+	au.expect = expect;
+	if (file != NULL && au_file(&au, file, port))
+		return (1);
+	for (i = 0; i < argc; i++) {
+		if (au_add(&au, argv[i], port)) {
+			fprintf(stderr, "Bad resolver '%s'\n", argv[i]);
+			return (1);
+		}
+	}
+	if (au.nt == 0)
+		usage_audit();
+
+	t0 = metric_usec();
+	if (au_run(&au)) {
+		perror("poll");
+		return (1);
+	}
+	dt = (metric_usec() - t0) * 1e-6;
+	if (verbose)
+		fprintf(stderr, "%lu queries in %.3f s, %.0f/s\n",
+		    au.sends, dt, dt > 0 ? au.sends / dt : 0);
+	au_report(&au, stdout, verbose);
+	i = au_settle(&au, count) == au.nt ? 0 : 2;
+	au_fini(&au);
+	return (i);
+}
+
+/*
+ * Stand-in resolvers with configurable faults, on loopback ports
+ * served by one thread.
+ */
+
+enum si_fault {
+	SI_OK,
+	SI_CASE,			/* 0x20 mixed case question */
+	SI_STALE,
+	SI_STRIP,
+	SI_REWRITE,
+	SI_CRC,
+	SI_BADD,
+	SI_SERVFAIL,
+	SI_TC,
+	SI_DROP,
+	SI_FIRST,			/* Drops the first try */
+	SI_SPOOF,			/* Wrong ID first, from elsewhere */
+	SI_NFAULT
+};
+
+static const int si_class[SI_NFAULT] = {
+	AU_OK, AU_OK, AU_STALE, AU_STRIP, AU_NOTE, AU_CRC, AU_BADD,
+	AU_RCODE, AU_TC, AU_TIMEOUT, AU_OK, AU_OK
+};
+
+#define SI_N		(SI_NFAULT * 20)
+
+struct stand_in {
+	int			fd[SI_N + 1];
+	int			fault[SI_N + 1];
+	unsigned		seen[SI_N + 1];
+	int			n;
+	int			stop[2];
+	pthread_t		thr;
+};
+
+static void
+si_respond(struct stand_in *si, int i, uint8_t *r, size_t n,
+    const struct sockaddr_storage *ss, socklen_t sl)
+{
+	uint32_t a = encode_leapsecond(2016, 12, 37, 0), u;
+	size_t pos = DNS_HDRLEN;
+	int fault = si->fault[i], an = 1;
+
+	if (fault == SI_DROP || (fault == SI_FIRST && si->seen[i]++ == 0))
+		return;
+	while (pos < n && r[pos] != 0)
+		pos += r[pos] + 1;
+	pos += 5;
+	if (pos > n)
+		return;
+	r[2] |= 0x80;
+	r[3] = 0x80;				/* RA */
+	switch (fault) {
+	case SI_CASE:	r[DNS_HDRLEN + 1] ^= 0x20; break;
+	case SI_STALE:	a = encode_leapsecond(2016, 6, 36, 0); break;
+	case SI_STRIP:	an = 0; break;
+	case SI_REWRITE: a = 0x7f000001; break;
+	case SI_CRC:	a ^= 0x100; break;
+	case SI_BADD:
+		u = ((a & 0x0fffffff) >> 8) | (3 << 7);	/* d = 3 */
+		a = 0xf0000000 | u << 8 | crc8(u, 20);
+		break;
+	case SI_SERVFAIL: an = 0; r[3] |= 2; break;
+	case SI_TC:	an = 0; r[2] |= 0x02; break;
+	default:	break;
+	}
+	dns_put16(r + 6, an);
+	dns_put16(r + 8, 0);
+	dns_put16(r + 10, 0);
+	if (an) {
+		dns_put16(r + pos, 0xc000 | DNS_HDRLEN);
+		dns_put16(r + pos + 2, T_A);
+		dns_put16(r + pos + 4, C_IN);
+		dns_put32(r + pos + 6, 300);
+		dns_put16(r + pos + 10, 4);
+		dns_put32(r + pos + 12, a);
+		pos += 16;
+	}
+	if (fault == SI_SPOOF) {
+		/* The right ID, but from the neighbour's port */
+		(void)sendto(si->fd[(i + 1) % SI_N], r, pos, 0,
+		    (const struct sockaddr *)ss, sl);
+		r[1] ^= 1;
+		(void)sendto(si->fd[i], r, pos, 0,
+		    (const struct sockaddr *)ss, sl);
+		r[1] ^= 1;
+	}
+	(void)sendto(si->fd[i], r, pos, 0, (const struct sockaddr *)ss, sl);
+}
+
+static void *
+si_thread(void *priv)
+{
+	struct stand_in *si = priv;
+	struct pollfd pfd[SI_N + 2];
+	struct sockaddr_storage ss;
+	uint8_t r[DNS_EDNS_SIZE];
+	socklen_t sl;
+	ssize_t n;
+	int i;
+
+	for (i = 0; i < si->n; i++) {
+		pfd[i].fd = si->fd[i];
+		pfd[i].events = POLLIN;
+	}
+	pfd[i].fd = si->stop[0];
+	pfd[i].events = POLLIN;
+	for (;;) {
+		if (poll(pfd, si->n + 1, -1) <= 0)
+			continue;
+		if (pfd[si->n].revents)
+			return (NULL);
+		for (i = 0; i < si->n; i++) {
+			if (!(pfd[i].revents & POLLIN))
+				continue;
+			sl = sizeof ss;
+			n = recvfrom(si->fd[i], r, sizeof r, 0,
+			    (struct sockaddr *)&ss, &sl);
+			if (n >= DNS_HDRLEN)
+				si_respond(si, i, r, n, &ss, sl);
+		}
+	}
+}
+
+static int
+si_open(int family, char *name, size_t len)
+{
+	struct sockaddr_storage ss;
+	struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+	socklen_t sl;
+	int fd;
+
+	memset(&ss, 0, sizeof ss);
+	ss.ss_family = family;
+	if (family == AF_INET) {
+		sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		sl = sizeof *sin;
+	} else {
+		sin6->sin6_addr = in6addr_loopback;
+		sl = sizeof *sin6;
+	}
+	fd = socket(family, SOCK_DGRAM, 0);
+	if (fd < 0)
+		return (-1);
+	if (bind(fd, (struct sockaddr *)&ss, sl) ||
+	    getsockname(fd, (struct sockaddr *)&ss, &sl)) {
+		(void)close(fd);
+		return (-1);
+	}
+	if (family == AF_INET)
+		(void)snprintf(name, len, "127.0.0.1:%u",
+		    ntohs(sin->sin_port));
+	else
+		(void)snprintf(name, len, "[::1]:%u", ntohs(sin6->sin6_port));
+	return (fd);
+}
+
+void
+test_leap_audit(void)
+{
+	static struct stand_in si;
+	static struct audit au;
+	unsigned count[AU_NCLASS], u;
+	char name[64];
+	int i, fd;
+
+	printf("\nChecking resolver auditor:\n\n");
+
+	au_init(&au, "leapsecond.example.org");
+	assert(au_add(&au, "192.0.2.1", 53) == 0);
+	assert(au_add(&au, "192.0.2.1:5353", 53) == 0);
+	assert(au_add(&au, "2001:db8::1", 53) == 0);
+	assert(au_add(&au, "[2001:db8::1]:853", 53) == 0);
+	assert(au_add(&au, "[2001:db8::1]", 53) == 0);
+	assert(au_add(&au, "192.0.2.1:0", 53) == -1);
+	assert(au_add(&au, "192.0.2.1:x", 53) == -1);
+	assert(au_add(&au, "[2001:db8::1]x", 53) == -1);
+	assert(au_add(&au, "resolver.example.org", 53) == -1);
+	assert(au.nt == 5);
+	assert(ntohs(((struct sockaddr_in *)&au.t[1].sa)->sin_port) == 5353);
+	assert(ntohs(((struct sockaddr_in6 *)&au.t[3].sa)->sin6_port) == 853);
+	assert(ntohs(((struct sockaddr_in6 *)&au.t[4].sa)->sin6_port) == 53);
+	au_fini(&au);
+
+	au_init(&au, "leapsecond.example.org");
+	au.maxflight = 50;
+	au.timeout = 100000;
+	au.tries = 2;
+	assert(pipe(si.stop) == 0);
+	for (i = 0; i < SI_N; i++) {
+		fd = si_open(AF_INET, name, sizeof name);
+		assert(fd >= 0);
+		si.fault[si.n] = i % SI_NFAULT;
+		si.fd[si.n++] = fd;
+		assert(au_add(&au, name, 53) == 0);
+	}
+	fd = si_open(AF_INET6, name, sizeof name);
+	if (fd >= 0) {
+		si.fault[si.n] = SI_OK;
+		si.fd[si.n++] = fd;
+		assert(au_add(&au, name, 53) == 0);
+	}
+	assert(pthread_create(&si.thr, NULL, si_thread, &si) == 0);
+	assert(au_run(&au) == 0);
+	assert(write(si.stop[1], "", 1) == 1);
+	assert(pthread_join(si.thr, NULL) == 0);
+
+	(void)au_settle(&au, count);
+	printf("  Stand-ins: %d  Queries: %lu  Ignored: %lu\n", si.n,
+	    au.sends, au.ignored);
+	for (u = 0; u < AU_NCLASS; u++)
+		printf("  %-12s %4u\n", au_names[u], count[u]);
+	assert(au.expect == encode_leapsecond(2016, 12, 37, 0));
+	for (i = 0; i < si.n; i++)
+		assert(au.t[i].class == si_class[si.fault[i]]);
+	assert(au.t[SI_SERVFAIL].rcode == 2);
+	assert(au.t[SI_FIRST].tries == 2 && au.t[SI_DROP].tries == 2);
+	assert(au.ignored >= 2 * SI_N / SI_NFAULT);
+	assert(au.inflight == 0 && au.head == 0 && au.rhead == 0);
+	for (u = 0; u < 65536; u++)
+		assert(au.flight[u] == 0);
+
+	/* With '-e' the majority can be stale */
+	au.expect = encode_leapsecond(2016, 6, 36, 0);
+	assert(au_settle(&au, count) == SI_N / SI_NFAULT);
+
+	for (i = 0; i < si.n; i++)
+		(void)close(si.fd[i]);
+	(void)close(si.stop[0]);
+	(void)close(si.stop[1]);
+	au_fini(&au);
+}
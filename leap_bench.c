@@ -0,0 +1,192 @@
+/*-
+ * Copyright (c) 2015 Poul-Henning Kamp <phk@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Micro-benchmarks.
+ *
+ * Each benchmark is a function which performs 'n' iterations of the
+ * operation; the iteration count is doubled until a run takes long
+ * enough to time reliably.  Results which could otherwise be optimized
+ * away are accumulated into 'bench_sink'.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dns_leap.h"
+
+#define BENCH_MINTIME	0.25		/* Seconds */
+
+volatile uintmax_t bench_sink;
+
+static void
+bench_crc8(unsigned long n)
+{
+	unsigned long u;
+	unsigned sum = 0;
+
+	for (u = 0; u < n; u++)
+		sum += crc8((uint32_t)u & 0x0fffffff, 28);
+	bench_sink += sum;
+}
+
+static void
+bench_encode(unsigned long n)
+{
+	unsigned long u;
+	uint32_t sum = 0;
+
+	for (u = 0; u < n; u++)
+		sum += encode_leapsecond(1972 + (u & 0x3f), 1 + (u % 12),
+		    u & 0x7f, (int)(u % 3) - 1);
+	bench_sink += sum;
+}
+
+static void
+bench_decode(unsigned long n)
+{
+	static const char *ips[] = {
+	    "240.3.9.77", "240.15.10.108", "242.18.28.160", "255.76.200.237",
+	    "127.240.133.76", "255.209.76.40", "241.179.152.73", "244.23.35.255"
+	};
+	unsigned long u;
+	int sum = 0, year, month, dtai, delta;
+
+	for (u = 0; u < n; u++) {
+		sum += decode_leapsecond(ips[u & 7],
+		    &year, &month, &dtai, &delta);
+		sum += year + month + dtai + delta;
+	}
+	bench_sink += sum;
+}
+
+static void
+bench_decode_batch(unsigned long n)
+{
+	static const uint32_t ips[] = {
+	    0xf003094d, 0xf00f0a6c, 0xf2121ca0, 0xff4cc8ed,
+	    0x7ff0854c, 0xffd14c28, 0xf1b39849, 0xf41723ff
+	};
+	struct leap_answer la[256];
+	uint32_t addr[256];
+	unsigned long u;
+	size_t i, sum = 0;
+
+	for (i = 0; i < 256; i++)
+		addr[i] = ips[i & 7];
+	for (u = 0; u < n; u += 256) {
+		sum += decode_leapsecond_n(addr, la, 256);
+		sum += la[u & 255].year;
+	}
+	bench_sink += sum;
+}
+
+static const struct bench {
+	const char	*name;
+	void		(*func)(unsigned long n);
+} benches[] = {
+	{ "crc8",		bench_crc8 },
+	{ "encode",		bench_encode },
+	{ "decode",		bench_decode },
+	{ "decode_batch",	bench_decode_batch },
+	{ "rrl",		bench_rrl },
+	{ "lookup",		bench_lookup },
+	{ "smear",		bench_smear },
+	{ "smear_bulk",		bench_smear_bulk },
+	{ "civil",		bench_civil },
+	{ "civil_bulk",		bench_civil_bulk },
+	{ "convert",		bench_convert },
+	{ "pcap",		bench_pcap },
+	{ "clock_tai",		bench_clock_tai },
+	{ "store_read",		bench_store_read },
+	{ "clock_tai_kernel",	bench_clock_tai_kernel },
+	{ "metric",		bench_metric },
+	{ "answer",		bench_answer },
+	{ "answer_dnssec",	bench_answer_dnssec },
+#ifdef WITH_OPENSSL
+	{ "rrsig",		bench_rrsig },
+#endif
+	{ NULL,			NULL }
+};
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+static void
+bench_run(const struct bench *b)
+{
+	unsigned long n;
+	double t0, dt;
+
+	b->func(1);			/* Warm up, and any one-time setup */
+	for (n = 1000; ; n *= 2) {
+		t0 = bench_now();
+		b->func(n);
+		dt = bench_now() - t0;
+		if (dt >= BENCH_MINTIME)
+			break;
+	}
+	printf("  %-16s %10.2f ns/op  (%lu iterations)\n",
+	    b->name, dt * 1e9 / n, n);
+}
+
+int
+main_bench(int argc, char **argv)
+{
+	const struct bench *b;
+	int i, found;
+
+	if (argc == 1) {
+		for (b = benches; b->name != NULL; b++)
+			bench_run(b);
+		return (0);
+	}
+	for (i = 1; i < argc; i++) {
+		found = 0;
+		for (b = benches; b->name != NULL; b++) {
+			if (!strcmp(argv[i], b->name)) {
+				bench_run(b);
+				found = 1;
+			}
+		}
+		if (!found) {
+			fprintf(stderr, "Unknown benchmark: %s\n", argv[i]);
+			fprintf(stderr, "Benchmarks:");
+			for (b = benches; b->name != NULL; b++)
+				fprintf(stderr, " %s", b->name);
+			fprintf(stderr, "\n");
+			return (1);
+		}
+	}
+	return (0);
+}
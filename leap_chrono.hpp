@@ -0,0 +1,423 @@
+/*-
+ * Copyright (c) 2015 Poul-Henning Kamp <phk@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * C++20 <chrono> clocks backed by the DNS announcement.
+ *
+ * std::chrono::utc_clock and tai_clock get their leap seconds from the
+ * tzdb, which libstdc++ loads from the leap-seconds file on first use:
+ * milliseconds of start-up, and only as fresh as the installed tzdata.
+ * Here the history is LEAP_TABLE() from dns_leap.h, available at
+ * compile time, plus the one announcement decoded from DNS.
+ *
+ * dns_leap::utc_clock and dns_leap::tai_clock have the same epochs and
+ * semantics as their std:: namesakes, so code can switch between them
+ * by changing the namespace.  Every conversion has a constexpr
+ * overload taking a leap_seconds, and one which uses the process-wide
+ * announcement set with set_announcement() or update().  now() reads
+ * CLOCK_REALTIME through clock_gettime_utc_leap() and
+ * clock_gettime_tai(), see leap_clock.c, so there is no file I/O and,
+ * outside the leap second itself, no system call.
+ *
+ *	#include "leap_chrono.hpp"
+ *
+ *	dns_leap::update();
+ *	auto t = dns_leap::tai_clock::now();
+ *
+ * Link with the C files, as for dns_leap itself.
+ *
+ */
+
+#ifndef LEAP_CHRONO_HPP
+#define LEAP_CHRONO_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <type_traits>
+
+extern "C" {
+#include "dns_leap.h"
+}
+
+namespace dns_leap {
+
+using std::chrono::seconds;
+using std::chrono::sys_seconds;
+using std::chrono::sys_time;
+
+struct leap_second_info {
+	bool		is_leap_second;
+	seconds		elapsed;
+};
+
+namespace detail {
+
+struct entry {
+	int		year;
+	int		month;
+	int		dtai;
+};
+
+#define LEAP_CHRONO_ENTRY(y, m, t)	{ y, m, t },
+inline constexpr entry table[] = { LEAP_TABLE(LEAP_CHRONO_ENTRY) };
+#undef LEAP_CHRONO_ENTRY
+inline constexpr int table_len = sizeof table / sizeof table[0];
+
+/* The first second after 'year'-'month' */
+constexpr sys_seconds
+month_end(int year, int month)
+{
+	using namespace std::chrono;
+
+	return (sys_days{(std::chrono::year{year} /
+	    std::chrono::month{unsigned(month)} + months{1}) / 1});
+}
+
+}  // namespace detail
+
+/*
+ * The compiled-in leap seconds, and one announcement on top.  An
+ * announcement which contradicts the table, or is beyond a leap second
+ * the table does not have, is not used and valid() is false.
+ */
+
+class leap_seconds {
+public:
+	constexpr leap_seconds() = default;
+
+	constexpr
+	leap_seconds(int year, int month, int dtai, int delta)
+	{
+		int before, after;
+
+		if (month < 1 || month > 12 || delta < -1 || delta > 1 ||
+		    year < 1972) {
+			valid_ = false;
+			return;
+		}
+		when_ = detail::month_end(year, month);
+		before = dtai_at(when_ - seconds{1});
+		after = dtai_at(when_);
+		if (before != dtai) {
+			valid_ = false;
+		} else if (when_ > last()) {
+			extra_ = delta;
+		} else if (after != dtai + delta) {
+			valid_ = false;
+		}
+	}
+
+	constexpr bool valid() const { return (valid_); }
+
+	/* TAI - UTC at 't', 10 s before 1972 */
+	constexpr int
+	dtai_at(sys_seconds t) const
+	{
+		int i, dtai = detail::table[0].dtai;
+
+		for (i = 1; i < detail::table_len; i++) {
+			if (t < detail::month_end(detail::table[i].year,
+			    detail::table[i].month))
+				break;
+			dtai = detail::table[i].dtai;
+		}
+		if (extra_ != 0 && t >= when_)
+			dtai += extra_;
+		return (dtai);
+	}
+
+	template <class D>
+	constexpr leap_second_info
+	info(std::chrono::utc_time<D> u) const
+	{
+		leap_second_info li{false, seconds{0}};
+		sys_seconds d;
+		seconds e;
+		int i, n = detail::table_len + (extra_ != 0);
+
+		for (i = 1; i < n; i++) {
+			d = step(i, e);
+			if (u >= std::chrono::utc_seconds{
+			    d.time_since_epoch() + e}) {
+				li.elapsed = e;
+			} else {
+				if (e > li.elapsed && u >= std::chrono::utc_seconds{
+				    d.time_since_epoch() + li.elapsed}) {
+					li.is_leap_second = true;
+					li.elapsed = e;
+				}
+				break;
+			}
+		}
+		return (li);
+	}
+
+private:
+	/* Where leap second 'i' ends, and how many have been by then */
+	constexpr sys_seconds
+	step(int i, seconds &elapsed) const
+	{
+		if (i == detail::table_len) {
+			elapsed = seconds{detail::table[i - 1].dtai + extra_ -
+			    detail::table[0].dtai};
+			return (when_);
+		}
+		elapsed = seconds{detail::table[i].dtai -
+		    detail::table[0].dtai};
+		return (detail::month_end(detail::table[i].year,
+		    detail::table[i].month));
+	}
+
+	constexpr sys_seconds
+	last() const
+	{
+		return (detail::month_end(
+		    detail::table[detail::table_len - 1].year,
+		    detail::table[detail::table_len - 1].month));
+	}
+
+	sys_seconds	when_{};
+	int		extra_ = 0;
+	bool		valid_ = true;
+};
+
+/*
+ * The process-wide announcement, packed into one word so that it can
+ * be replaced while other threads read the clocks.
+ */
+
+inline std::atomic<std::int64_t> announced{0};
+
+inline bool
+set_announcement(int year, int month, int dtai, int delta)
+{
+	if (!leap_seconds{year, month, dtai, delta}.valid())
+		return (false);
+	announced.store(((std::int64_t)year << 24) | (month << 16) |
+	    ((dtai & 0xff) << 8) | (delta + 1), std::memory_order_relaxed);
+	return (true);
+}
+
+inline leap_seconds
+current()
+{
+	std::int64_t a = announced.load(std::memory_order_relaxed);
+
+	if (a == 0)
+		return (leap_seconds{});
+	return (leap_seconds{(int)(a >> 24), (int)(a >> 16) & 0xff,
+	    (int)(std::int8_t)(a >> 8), (int)(a & 0xff) - 1});
+}
+
+/* Query DNS and use the answer, returns the query_leapsecond() error */
+inline int
+update(const char *fqdn = "leapsecond.utcd.org")
+{
+	int error, year, month, dtai, delta;
+
+	error = query_leapsecond(fqdn, &year, &month, &dtai, &delta, nullptr);
+	if (error == 0 && !set_announcement(year, month, dtai, delta))
+		error = -1;
+	return (error);
+}
+
+class utc_clock {
+public:
+	using rep = std::chrono::system_clock::rep;
+	using period = std::chrono::system_clock::period;
+	using duration = std::chrono::duration<rep, period>;
+	using time_point = std::chrono::time_point<std::chrono::utc_clock,
+	    duration>;
+	static constexpr bool is_steady = false;
+
+	template <class D>
+	using utc_time = std::chrono::utc_time<D>;
+	template <class D>
+	using common = std::common_type_t<D, seconds>;
+
+	template <class D>
+	static constexpr utc_time<common<D>>
+	from_sys(const leap_seconds &ls, const sys_time<D> &t)
+	{
+		auto s = std::chrono::floor<seconds>(t);
+
+		return (utc_time<common<D>>{t.time_since_epoch() +
+		    seconds{ls.dtai_at(s) - detail::table[0].dtai}});
+	}
+
+	template <class D>
+	static constexpr sys_time<common<D>>
+	to_sys(const leap_seconds &ls, const utc_time<D> &u)
+	{
+		leap_second_info li = ls.info(u);
+		sys_time<common<D>> t{u.time_since_epoch() - li.elapsed};
+
+		if (li.is_leap_second)
+			return (std::chrono::floor<seconds>(t) + seconds{1} -
+			    common<D>{1});
+		return (t);
+	}
+
+	template <class D>
+	static utc_time<common<D>>
+	from_sys(const sys_time<D> &t)
+	{
+		return (from_sys(current(), t));
+	}
+
+	template <class D>
+	static sys_time<common<D>>
+	to_sys(const utc_time<D> &u)
+	{
+		return (to_sys(current(), u));
+	}
+
+	static time_point
+	now()
+	{
+		leap_seconds ls = current();
+		struct timespec ts;
+		int leap;
+
+		(void)clock_gettime_utc_leap(kernel(), &ts, &leap);
+		return (from_sys(ls, sys_time<duration>{
+		    std::chrono::duration_cast<duration>(
+		    seconds{ts.tv_sec} + std::chrono::nanoseconds{ts.tv_nsec})})
+		    + seconds{leap});
+	}
+
+	/* The announcement as leap_clock.c wants it */
+	static const struct leap_clock *
+	kernel()
+	{
+		static thread_local struct leap_clock lc;
+		static thread_local std::int64_t a = -1;
+		std::int64_t n = announced.load(std::memory_order_relaxed);
+		const detail::entry &l = detail::table[detail::table_len - 1];
+		const detail::entry &p = detail::table[detail::table_len - 2];
+
+		if (n == a)
+			return (&lc);
+		a = n;
+		if (n == 0)
+			(void)leap_clock_init(&lc, l.year, l.month, p.dtai,
+			    l.dtai - p.dtai);
+		else
+			(void)leap_clock_init(&lc, (int)(n >> 24),
+			    (int)(n >> 16) & 0xff, (int)(std::int8_t)(n >> 8),
+			    (int)(n & 0xff) - 1);
+		return (&lc);
+	}
+};
+
+template <class D>
+constexpr leap_second_info
+get_leap_second_info(const leap_seconds &ls, const std::chrono::utc_time<D> &u)
+{
+	return (ls.info(u));
+}
+
+template <class D>
+leap_second_info
+get_leap_second_info(const std::chrono::utc_time<D> &u)
+{
+	return (current().info(u));
+}
+
+class tai_clock {
+public:
+	using rep = std::chrono::system_clock::rep;
+	using period = std::chrono::system_clock::period;
+	using duration = std::chrono::duration<rep, period>;
+	using time_point = std::chrono::time_point<std::chrono::tai_clock,
+	    duration>;
+	static constexpr bool is_steady = false;
+
+	/* 1958-01-01 TAI is 1970-01-01 UTC less 12 years and 10 s */
+	static constexpr seconds epoch{378691210};
+
+	template <class D>
+	using common = std::common_type_t<D, seconds>;
+
+	template <class D>
+	static constexpr std::chrono::utc_time<common<D>>
+	to_utc(const std::chrono::tai_time<D> &t)
+	{
+		return (std::chrono::utc_time<common<D>>{
+		    t.time_since_epoch() - epoch});
+	}
+
+	template <class D>
+	static constexpr std::chrono::tai_time<common<D>>
+	from_utc(const std::chrono::utc_time<D> &u)
+	{
+		return (std::chrono::tai_time<common<D>>{
+		    u.time_since_epoch() + epoch});
+	}
+
+	static time_point
+	now()
+	{
+		struct timespec ts;
+
+		(void)clock_gettime_tai(utc_clock::kernel(), &ts);
+		return (time_point{std::chrono::duration_cast<duration>(
+		    seconds{ts.tv_sec} + std::chrono::nanoseconds{ts.tv_nsec} +
+		    epoch - seconds{detail::table[0].dtai})});
+	}
+};
+
+/* Checked by the compiler wherever this header is used */
+
+namespace detail {
+
+using namespace std::chrono_literals;
+
+constexpr sys_seconds y2017 = month_end(2016, 12);
+
+static_assert(leap_seconds{}.dtai_at(y2017 - 1s) == 36);
+static_assert(leap_seconds{}.dtai_at(y2017) == 37);
+static_assert(leap_seconds{}.dtai_at(sys_seconds{0s}) == 10);
+static_assert(utc_clock::from_sys(leap_seconds{}, y2017).time_since_epoch() ==
+    y2017.time_since_epoch() + 27s);
+static_assert(get_leap_second_info(leap_seconds{},
+    utc_clock::from_sys(leap_seconds{}, y2017) - 1s).is_leap_second);
+static_assert(!get_leap_second_info(leap_seconds{},
+    utc_clock::from_sys(leap_seconds{}, y2017)).is_leap_second);
+static_assert(utc_clock::to_sys(leap_seconds{},
+    utc_clock::from_sys(leap_seconds{}, y2017) - 1s) == y2017 - 1s);
+static_assert(leap_seconds{2016, 12, 36, 1}.valid());
+static_assert(!leap_seconds{2016, 12, 37, 1}.valid());
+static_assert(leap_seconds{2026, 12, 37, 1}.dtai_at(
+    month_end(2026, 12)) == 38);
+static_assert(leap_seconds{2026, 12, 37, -1}.info(
+    std::chrono::utc_seconds{month_end(2026, 12).time_since_epoch() +
+    26s}).elapsed == 26s);
+
+}  // namespace detail
+
+}  // namespace dns_leap
+
+#endif /* LEAP_CHRONO_HPP */
@@ -0,0 +1,264 @@
+/*-
+ * Copyright (c) 2015 Poul-Henning Kamp <phk@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * TAI, and UTC with the leap second flagged, without a system call.
+ *
+ * CLOCK_TAI is only right if something has told the kernel the TAI
+ * offset, and on many kernels it is a system call rather than a vDSO
+ * read.  Here CLOCK_REALTIME, which the vDSO serves everywhere, is
+ * combined with the decoded announcement: before the end of the
+ * announced month TAI - UTC is 'dtai', after it 'dtai + delta'.
+ *
+ * The difficult part is an inserted leap second.  When the kernel is
+ * armed it steps CLOCK_REALTIME back one second at midnight, so the
+ * last second of the month is read twice and the second reading is
+ * really 23:59:60.  Only the kernel knows which reading is which, so
+ * from a second before the leap to a second after it we ask it with
+ * ntp_adjtime(2), which returns the time and the TIME_OOP state in
+ * one go.  That costs a system call for two seconds per leap second,
+ * and nothing the rest of the time.  A deleted leap second needs no
+ * help, the kernel simply skips 23:59:59.
+ *
+ * The state is either set from a decoded announcement with
+ * leap_clock_init(), or from the shared state published by
+ * 'dns_leap arm' with leap_clock_load().  Both are cheap enough to
+ * call every so often to pick up new announcements.
+ *
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/timex.h>
+
+#include "dns_leap.h"
+
+int
+leap_clock_init(struct leap_clock *lc, int year, int month, int dtai,
+    int delta)
+{
+
+	memset(lc, 0, sizeof *lc);
+	if (month < 1 || month > 12 || delta < -1 || delta > 1)
+		return (-1);
+	lc->leap = leap_month_end(year, month);
+	lc->dtai = dtai;
+	lc->delta = delta;
+	return (0);
+}
+
+int
+leap_clock_load(struct leap_clock *lc, const char *name)
+{
+	struct leap_state ls;
+
+	if (leap_state_read(name, &ls))
+		return (-1);
+	return (leap_clock_init(lc, ls.year, ls.month, ls.dtai, ls.delta));
+}
+
+/*
+ * TAI - UTC at UTC second 't', 'oop' if the kernel says we are in
+ * an inserted leap second.
+ */
+
+static int
+leap_clock_offset(const struct leap_clock *lc, time_t t, int oop)
+{
+
+	if (t >= lc->leap || oop)
+		return (lc->dtai + lc->delta);
+	return (lc->dtai);
+}
+
+static int
+leap_clock_kernel(struct timespec *ts, int *oop)
+{
+#ifdef __linux__
+	struct timex tx;
+	int state;
+
+	memset(&tx, 0, sizeof tx);
+	state = ntp_adjtime(&tx);
+	if (state < 0)
+		return (-1);
+	ts->tv_sec = tx.time.tv_sec;
+	ts->tv_nsec = tx.time.tv_usec * (tx.status & STA_NANO ? 1 : 1000);
+#else
+	struct ntptimeval ntv;
+	int state;
+
+	state = ntp_gettime(&ntv);
+	if (state < 0)
+		return (-1);
+	*ts = ntv.time;
+#endif
+	*oop = state == TIME_OOP;
+	return (0);
+}
+
+/*
+ * Read UTC, with '*oop' set during an inserted leap second.  Only an
+ * inserted leap second near 'now' takes the slow path.
+ */
+
+static inline int
+leap_clock_read(const struct leap_clock *lc, struct timespec *ts, int *oop)
+{
+
+	if (clock_gettime(CLOCK_REALTIME, ts))
+		return (-1);
+	*oop = 0;
+	if (__builtin_expect(lc->delta > 0 &&
+	    ts->tv_sec >= lc->leap - 1 && ts->tv_sec <= lc->leap, 0))
+		return (leap_clock_kernel(ts, oop));
+	return (0);
+}
+
+int
+clock_gettime_tai(const struct leap_clock *lc, struct timespec *ts)
+{
+	int oop;
+
+	if (leap_clock_read(lc, ts, &oop))
+		return (-1);
+	ts->tv_sec += leap_clock_offset(lc, ts->tv_sec, oop);
+	return (0);
+}
+
+/*
+ * UTC, with '*leap' set if this is 23:59:60, in which case 'ts'
+ * reads 23:59:59.
+ */
+
+int
+clock_gettime_utc_leap(const struct leap_clock *lc, struct timespec *ts,
+    int *leap)
+{
+
+	return (leap_clock_read(lc, ts, leap));
+}
+
+void
+bench_clock_tai(unsigned long n)
+{
+	struct leap_clock lc;
+	struct timespec ts;
+	unsigned long u;
+	uintmax_t sum = 0;
+
+	assert(leap_clock_init(&lc, 2016, 12, 36, 1) == 0);
+	for (u = 0; u < n; u++) {
+		(void)clock_gettime_tai(&lc, &ts);
+		sum += ts.tv_nsec;
+	}
+	bench_sink += sum;
+}
+
+void
+bench_clock_tai_kernel(unsigned long n)
+{
+	struct timespec ts;
+	unsigned long u;
+	uintmax_t sum = 0;
+
+	for (u = 0; u < n; u++) {
+#ifdef CLOCK_TAI
+		(void)clock_gettime(CLOCK_TAI, &ts);
+#else
+		(void)clock_gettime(CLOCK_REALTIME, &ts);
+#endif
+		sum += ts.tv_nsec;
+	}
+	bench_sink += sum;
+}
+
+/*
+ * Around the 2016-12 leap second.  't' is relative to it, and 'oop'
+ * is what the kernel would say.
+ */
+
+static const struct clock_vector {
+	int		delta;
+	int		t;
+	int		oop;
+	int		tai;
+} clock_vectors[] = {
+	{ +1, -86400,	0,	36 },
+	{ +1,	  -1,	0,	36 },	/* 23:59:59 */
+	{ +1,	  -1,	1,	37 },	/* 23:59:60 */
+	{ +1,	   0,	0,	37 },
+	{ +1,  86400,	0,	37 },
+	{ -1,	  -2,	0,	36 },	/* 23:59:58 */
+	{ -1,	   0,	0,	35 },
+	{  0,	   0,	0,	36 },
+	{  0,	   0,	-1,	0 }
+};
+
+void
+test_leap_clock(void)
+{
+	const struct clock_vector *cv;
+	struct leap_clock lc;
+	struct timespec ts, tr;
+	time_t t;
+	int oop;
+
+	printf("\nChecking userspace TAI clock:\n\n");
+	for (cv = clock_vectors; cv->oop >= 0; cv++) {
+		assert(leap_clock_init(&lc, 2016, 12, 36, cv->delta) == 0);
+		t = lc.leap + cv->t;
+		printf("  Delta: %+d  T: %+6d  OOP: %d  TAI - UTC: %d\n",
+		    cv->delta, cv->t, cv->oop,
+		    leap_clock_offset(&lc, t, cv->oop));
+		assert(leap_clock_offset(&lc, t, cv->oop) == cv->tai);
+	}
+	assert(leap_clock_init(&lc, 2016, 0, 36, 1) == -1);
+	assert(leap_clock_init(&lc, 2016, 12, 36, 2) == -1);
+
+	/* Live, the 2016-12 leap second is long past */
+	assert(leap_clock_init(&lc, 2016, 12, 36, 1) == 0);
+	assert(clock_gettime_utc_leap(&lc, &tr, &oop) == 0);
+	assert(clock_gettime_tai(&lc, &ts) == 0);
+	printf("  Now: TAI - UTC: %lld\n", (long long)(ts.tv_sec - tr.tv_sec));
+	assert(!oop);
+	assert(ts.tv_sec - tr.tv_sec == 37 || ts.tv_sec - tr.tv_sec == 38);
+
+	/* The slow path is right when the kernel is not armed */
+	assert(clock_gettime(CLOCK_REALTIME, &tr) == 0);
+	assert(leap_clock_init(&lc, 1970, 1, 10, 1) == 0);
+	lc.leap = tr.tv_sec;
+	if (clock_gettime_tai(&lc, &ts) != 0) {
+		printf("  Slow path: %s, skipped\n", strerror(errno));
+		return;
+	}
+	printf("  Slow path: TAI - UTC: %lld\n",
+	    (long long)(ts.tv_sec - tr.tv_sec));
+	assert(ts.tv_sec - tr.tv_sec == 11);
+}
@@ -0,0 +1,872 @@
+/*-
+ * Copyright (c) 2015 Poul-Henning Kamp <phk@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Re-stamp log files from UTC to TAI.
+ *
+ * A line which starts with an ISO 8601 UTC timestamp,
+ *
+ *	2016-12-31T23:59:60.25Z message
+ *
+ * has it replaced by the same instant in TAI, without the zone suffix
+ * since it is no longer UTC, keeping the separator and the fraction:
+ *
+ *	2017-01-01T00:00:36.25 message
+ *
+ * The suffix may be 'Z', '+00:00' or absent.  Other lines, timestamps
+ * before 1972, and a :60 second where the table has no leap second are
+ * copied unchanged.  The leap seconds are those of "history.<fqdn>"
+ * and the current announcement, or the compiled-in table with -n.
+ *
+ * The job is disk bound, so the design is a pipeline rather than a
+ * fast parser: the main thread cuts the input, mmap(2)ed if it is a
+ * file or read otherwise, into chunks which end on a newline.  A pool
+ * of workers converts chunks as they come, each in a private output
+ * buffer, and a writer thread writes the buffers in input order.  The
+ * chunks live in a ring of 2 * jobs + 2 slots, which bounds the memory
+ * and makes a slow writer stall the reader.
+ *
+ * Each worker first parses every timestamp of its chunk, then has the
+ * calendar kernel turn all the TAI days into dates in one bulk call,
+ * and then writes the output.
+ *
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netdb.h>
+
+#include "dns_leap.h"
+
+#define CV_CHUNK	(1 << 20)	/* Bytes, before the next newline */
+#define CV_MAXJOBS	64
+#define CV_MAXLEAP	256
+
+/* From 't' on, TAI - UTC is 'dtai' */
+struct cv_leap {
+	int64_t		t;
+	int		dtai;
+};
+
+enum cv_state { CV_FREE, CV_READY, CV_DONE };
+
+struct cv_chunk {
+	enum cv_state	state;
+	const char	*in;
+	size_t		len;
+	int		midline;	/* Does not start a line */
+	char		*buf;		/* Input, when not mmap'ed */
+	char		*out;
+	size_t		outlen;
+	size_t		outsize;
+};
+
+/* A timestamp found in pass one */
+struct cv_rec {
+	size_t		off;		/* Start of line */
+	uint32_t	digits;		/* Length up to end of fraction */
+	uint32_t	len;		/* Length with the suffix */
+	int32_t		sod;		/* TAI second of day */
+};
+
+struct cv_work {
+	const struct cv	*cv;
+	struct cv_rec	*rec;
+	int32_t		*z, *y, *m, *d;
+	size_t		max;
+	int		hint;
+};
+
+struct cv {
+	pthread_mutex_t	mtx;
+	pthread_cond_t	cond;
+	struct cv_chunk	*chunk;
+	unsigned	nchunk;
+	unsigned long	nread;
+	unsigned long	nwork;
+	unsigned long	nwritten;
+	int		eof;
+	int		error;
+	int		fd;
+	unsigned long	converted;
+	const struct cv_leap *leap;
+	int		nleap;
+};
+
+/*
+ * The leap seconds as instants, from an announcement history
+ */
+
+static int
+cv_leaps(struct cv_leap *cl, const struct leap_entry *le, int n,
+    int year, int month, int dtai, int delta)
+{
+	int i, nl = 0;
+
+	for (i = 0; i < n && nl < CV_MAXLEAP - 1; i++) {
+		cl[nl].t = leap_month_end(le[i].year, le[i].month);
+		cl[nl++].dtai = le[i].dtai;
+	}
+	if (delta != 0 && nl > 0 && nl < CV_MAXLEAP &&
+	    leap_month_end(year, month) > cl[nl - 1].t &&
+	    dtai == cl[nl - 1].dtai) {
+		cl[nl].t = leap_month_end(year, month);
+		cl[nl++].dtai = dtai + delta;
+	}
+	return (nl);
+}
+
+/* The index of the entry in force at 't', or -1 */
+static int
+cv_lookup(struct cv_work *w, int64_t t)
+{
+	const struct cv_leap *cl = w->cv->leap;
+	int i = w->hint, n = w->cv->nleap;
+
+	if (n == 0 || t < cl[0].t)
+		return (-1);
+	if (t < cl[i].t || (i + 1 < n && t >= cl[i + 1].t)) {
+		for (i = n - 1; t < cl[i].t; i--)
+			continue;
+		w->hint = i;
+	}
+	return (i);
+}
+
+static inline int
+cv_num(const char *p, int n)
+{
+	int v = 0;
+
+	while (n--) {
+		if (*p < '0' || *p > '9')
+			return (-1);
+		v = v * 10 + (*p++ - '0');
+	}
+	return (v);
+}
+
+/*
+ * Parse a UTC timestamp at 'p', return the TAI seconds or -1 if there
+ * is none to convert.
+ */
+
+static int64_t
+cv_parse(struct cv_work *w, const char *p, size_t len, struct cv_rec *r)
+{
+	int y, mo, d, h, mi, s, yy, mm, dd, i;
+	size_t n;
+	int64_t t;
+
+	if (len < 19 || p[4] != '-' || p[7] != '-' ||
+	    (p[10] != 'T' && p[10] != ' ') || p[13] != ':' || p[16] != ':')
+		return (-1);
+	y = cv_num(p, 4);
+	mo = cv_num(p + 5, 2);
+	d = cv_num(p + 8, 2);
+	h = cv_num(p + 11, 2);
+	mi = cv_num(p + 14, 2);
+	s = cv_num(p + 17, 2);
+	if (y < 1972 || mo < 1 || mo > 12 || d < 1 || d > 31 ||
+	    h < 0 || h > 23 || mi < 0 || mi > 59 || s < 0 || s > 60)
+		return (-1);
+	n = 19;
+	if (n + 1 < len && (p[n] == '.' || p[n] == ',') &&
+	    p[n + 1] >= '0' && p[n + 1] <= '9')
+		for (n++; n < len && p[n] >= '0' && p[n] <= '9'; n++)
+			continue;
+	r->digits = (uint32_t)n;
+	if (n < len && p[n] == 'Z')
+		n++;
+	else if (n + 6 <= len && !memcmp(p + n, "+00:00", 6))
+		n += 6;
+	if (n < len && p[n] != ' ' && p[n] != '\t' && p[n] != '\n' &&
+	    p[n] != '\r')
+		return (-1);
+	r->len = (uint32_t)n;
+
+	t = (int64_t)leap_days_from_civil(y, mo, d);
+	if (d > 28) {
+		leap_civil_from_days((int32_t)t, &yy, &mm, &dd);
+		if (dd != d)
+			return (-1);
+	}
+	t = t * 86400 + h * 3600 + mi * 60 + s;
+	if (s == 60) {
+		/* 23:59:60 is one past 23:59:59, before the new dTAI */
+		i = cv_lookup(w, t);
+		if (h != 23 || mi != 59 || i < 1 || w->cv->leap[i].t != t ||
+		    w->cv->leap[i].dtai != w->cv->leap[i - 1].dtai + 1)
+			return (-1);
+		return (t + w->cv->leap[i - 1].dtai);
+	}
+	i = cv_lookup(w, t);
+	if (i < 0)
+		return (-1);
+	return (t + w->cv->leap[i].dtai);
+}
+
+static void
+cv_grow(struct cv_work *w)
+{
+	size_t max = w->max ? w->max * 2 : 1024;
+
+	w->rec = realloc(w->rec, max * sizeof *w->rec);
+	w->z = realloc(w->z, max * sizeof *w->z);
+	w->y = realloc(w->y, max * sizeof *w->y);
+	w->m = realloc(w->m, max * sizeof *w->m);
+	w->d = realloc(w->d, max * sizeof *w->d);
+	if (w->rec == NULL || w->z == NULL || w->y == NULL ||
+	    w->m == NULL || w->d == NULL) {
+		perror("realloc");
+		exit(1);
+	}
+	w->max = max;
+}
+
+static inline void
+cv_put(char *p, int v, int n)
+{
+
+	while (n--) {
+		p[n] = '0' + v % 10;
+		v /= 10;
+	}
+}
+
+/*
+ * Convert one chunk into c->out, returns the number of timestamps
+ */
+
+static unsigned long
+cv_convert(struct cv_work *w, struct cv_chunk *c)
+{
+	const char *p = c->in, *e = c->in + c->len, *nl;
+	struct cv_rec *r;
+	char *o;
+	size_t nrec = 0, i, pos = 0;
+	unsigned long n = 0;
+	int64_t tai;
+
+	if (c->outsize < c->len) {
+		free(c->out);
+		c->outsize = c->len > CV_CHUNK ? c->len : CV_CHUNK;
+		c->out = malloc(c->outsize);
+		if (c->out == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+	}
+
+	/* Pass one: find and convert the timestamps */
+	if (c->midline) {
+		nl = memchr(p, '\n', e - p);
+		p = nl == NULL ? e : nl + 1;
+	}
+	for (; p < e; p = nl + 1) {
+		nl = memchr(p, '\n', e - p);
+		if (nl == NULL)
+			nl = e;
+		if (nrec == w->max)
+			cv_grow(w);
+		r = &w->rec[nrec];
+		tai = cv_parse(w, p, nl - p, r);
+		if (tai < 0)
+			continue;
+		r->off = p - c->in;
+		r->sod = (int32_t)(tai % 86400);
+		w->z[nrec++] = (int32_t)(tai / 86400);
+	}
+
+	/* Pass two: all the dates at once */
+	leap_civil_from_days_n(w->z, w->y, w->m, w->d, nrec);
+
+	/* Pass three: copy, with the new timestamps */
+	o = c->out;
+	for (i = 0; i < nrec; i++) {
+		r = &w->rec[i];
+		if (w->y[i] > 9999)
+			continue;
+		memcpy(o, c->in + pos, r->off - pos);
+		o += r->off - pos;
+		p = c->in + r->off;
+		cv_put(o, w->y[i], 4);
+		o[4] = '-';
+		cv_put(o + 5, w->m[i], 2);
+		o[7] = '-';
+		cv_put(o + 8, w->d[i], 2);
+		o[10] = p[10];
+		cv_put(o + 11, r->sod / 3600, 2);
+		o[13] = ':';
+		cv_put(o + 14, r->sod / 60 % 60, 2);
+		o[16] = ':';
+		cv_put(o + 17, r->sod % 60, 2);
+		memcpy(o + 19, p + 19, r->digits - 19);
+		o += r->digits;
+		pos = r->off + r->len;
+		n++;
+	}
+	memcpy(o, c->in + pos, c->len - pos);
+	o += c->len - pos;
+	c->outlen = o - c->out;
+	return (n);
+}
+
+static void *
+cv_worker(void *priv)
+{
+	struct cv *cv = priv;
+	struct cv_work w;
+	struct cv_chunk *c;
+	unsigned long n;
+
+	memset(&w, 0, sizeof w);
+	w.cv = cv;
+	for (;;) {
+		(void)pthread_mutex_lock(&cv->mtx);
+		while (cv->nwork == cv->nread && !cv->eof)
+			(void)pthread_cond_wait(&cv->cond, &cv->mtx);
+		if (cv->nwork == cv->nread) {
+			(void)pthread_mutex_unlock(&cv->mtx);
+			break;
+		}
+		c = &cv->chunk[cv->nwork++ % cv->nchunk];
+		(void)pthread_mutex_unlock(&cv->mtx);
+
+		n = cv_convert(&w, c);
+
+		(void)pthread_mutex_lock(&cv->mtx);
+		c->state = CV_DONE;
+		cv->converted += n;
+		(void)pthread_cond_broadcast(&cv->cond);
+		(void)pthread_mutex_unlock(&cv->mtx);
+	}
+	free(w.rec);
+	free(w.z);
+	free(w.y);
+	free(w.m);
+	free(w.d);
+	return (NULL);
+}
+
+static int
+cv_write(int fd, const char *p, size_t len)
+{
+	ssize_t l;
+
+	while (len > 0) {
+		l = write(fd, p, len);
+		if (l < 0 && errno == EINTR)
+			continue;
+		if (l <= 0)
+			return (-1);
+		p += l;
+		len -= l;
+	}
+	return (0);
+}
+
+static void *
+cv_writer(void *priv)
+{
+	struct cv *cv = priv;
+	struct cv_chunk *c;
+
+	for (;;) {
+		(void)pthread_mutex_lock(&cv->mtx);
+		for (;;) {
+			c = &cv->chunk[cv->nwritten % cv->nchunk];
+			if (cv->nwritten < cv->nread && c->state == CV_DONE)
+				break;
+			if (cv->nwritten == cv->nread && cv->eof)
+				break;
+			(void)pthread_cond_wait(&cv->cond, &cv->mtx);
+		}
+		if (cv->nwritten == cv->nread) {
+			(void)pthread_mutex_unlock(&cv->mtx);
+			break;
+		}
+		(void)pthread_mutex_unlock(&cv->mtx);
+
+		/* After an error, keep draining so the reader is not stuck */
+		if (!cv->error && cv_write(cv->fd, c->out, c->outlen))
+			cv->error = errno;
+
+		(void)pthread_mutex_lock(&cv->mtx);
+		c->state = CV_FREE;
+		cv->nwritten++;
+		(void)pthread_cond_broadcast(&cv->cond);
+		(void)pthread_mutex_unlock(&cv->mtx);
+	}
+	return (NULL);
+}
+
+/*
+ * Fill 'c' with the next chunk of a mapped file, returns 0 at the end
+ */
+
+static int
+cv_next_map(struct cv_chunk *c, const char *map, size_t size, size_t *pos,
+    size_t chunk)
+{
+	const char *nl;
+	size_t len;
+
+	if (*pos == size)
+		return (0);
+	len = size - *pos;
+	if (len > chunk) {
+		nl = memchr(map + *pos + chunk, '\n', len - chunk);
+		if (nl != NULL)
+			len = nl + 1 - (map + *pos);
+	}
+	c->in = map + *pos;
+	c->len = len;
+	c->midline = 0;
+	*pos += len;
+	return (1);
+}
+
+/*
+ * Fill 'c' from a stream, carrying a partial last line over to the
+ * next chunk in 'carry'.  Returns 0 at the end, -1 on error.
+ */
+
+static int
+cv_next_read(struct cv_chunk *c, int fd, char *carry, size_t *ncarry,
+    int *midline, size_t chunk)
+{
+	const char *nl;
+	size_t len;
+	ssize_t l;
+
+	if (c->buf == NULL) {
+		c->buf = malloc(chunk);
+		if (c->buf == NULL)
+			return (-1);
+	}
+	memcpy(c->buf, carry, *ncarry);
+	len = *ncarry;
+	while (len < chunk) {
+		l = read(fd, c->buf + len, chunk - len);
+		if (l < 0 && errno == EINTR)
+			continue;
+		if (l < 0)
+			return (-1);
+		if (l == 0)
+			break;
+		len += l;
+	}
+	if (len == 0)
+		return (0);
+	c->in = c->buf;
+	c->midline = *midline;
+	c->len = len;
+	*ncarry = 0;
+	*midline = 0;
+	if (len == chunk) {
+		for (nl = c->buf + len - 1; nl >= c->buf && *nl != '\n'; nl--)
+			continue;
+		if (nl < c->buf) {
+			*midline = 1;	/* A line longer than a chunk */
+		} else {
+			c->len = nl + 1 - c->buf;
+			*ncarry = len - c->len;
+			memcpy(carry, nl + 1, *ncarry);
+		}
+	}
+	return (1);
+}
+
+/*
+ * Convert 'in' to 'out' with 'jobs' workers.  Returns 0 or an errno.
+ */
+
+static int
+cv_run(struct cv *cv, int in, int jobs, size_t chunk)
+{
+	pthread_t thr[CV_MAXJOBS + 1];
+	struct cv_chunk *c;
+	struct stat st;
+	const char *map = NULL;
+	char *carry = NULL;
+	size_t pos = 0, ncarry = 0;
+	unsigned u;
+	int i, error = 0, midline = 0, more;
+
+	(void)pthread_mutex_init(&cv->mtx, NULL);
+	(void)pthread_cond_init(&cv->cond, NULL);
+	cv->nchunk = 2 * jobs + 2;
+	cv->chunk = calloc(cv->nchunk, sizeof *cv->chunk);
+	if (cv->chunk == NULL)
+		return (errno);
+	if (!fstat(in, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in, 0);
+		if (map == MAP_FAILED)
+			map = NULL;
+		else
+			(void)madvise((void *)(uintptr_t)map, st.st_size,
+			    MADV_SEQUENTIAL);
+	}
+	if (map == NULL && (carry = malloc(chunk)) == NULL)
+		return (errno);
+
+	for (i = 0; i < jobs; i++)
+		if (pthread_create(&thr[i], NULL, cv_worker, cv))
+			break;
+	if (i < jobs || pthread_create(&thr[i], NULL, cv_writer, cv)) {
+		fprintf(stderr, "pthread_create failed\n");
+		exit(1);
+	}
+
+	for (;;) {
+		c = &cv->chunk[cv->nread % cv->nchunk];
+		(void)pthread_mutex_lock(&cv->mtx);
+		while (c->state != CV_FREE)
+			(void)pthread_cond_wait(&cv->cond, &cv->mtx);
+		(void)pthread_mutex_unlock(&cv->mtx);
+		if (map != NULL)
+			more = cv_next_map(c, map, st.st_size, &pos, chunk);
+		else
+			more = cv_next_read(c, in, carry, &ncarry, &midline,
+			    chunk);
+		if (more < 0)
+			error = errno;
+		if (more <= 0)
+			break;
+		(void)pthread_mutex_lock(&cv->mtx);
+		c->state = CV_READY;
+		cv->nread++;
+		(void)pthread_cond_broadcast(&cv->cond);
+		(void)pthread_mutex_unlock(&cv->mtx);
+	}
+	(void)pthread_mutex_lock(&cv->mtx);
+	cv->eof = 1;
+	(void)pthread_cond_broadcast(&cv->cond);
+	(void)pthread_mutex_unlock(&cv->mtx);
+	for (i = 0; i <= jobs; i++)
+		(void)pthread_join(thr[i], NULL);
+
+	if (map != NULL)
+		(void)munmap((void *)(uintptr_t)map, st.st_size);
+	for (u = 0; u < cv->nchunk; u++) {
+		free(cv->chunk[u].buf);
+		free(cv->chunk[u].out);
+	}
+	free(cv->chunk);
+	free(carry);
+	(void)pthread_cond_destroy(&cv->cond);
+	(void)pthread_mutex_destroy(&cv->mtx);
+	return (error ? error : cv->error);
+}
+
+static void
+usage_convert(void)
+{
+
+	fprintf(stderr, "Usage: dns_leap convert [-nv] [-f fqdn] "
+	    "[-j threads] [-o output] [input]\n");
+	fprintf(stderr, "\t-f\tTake the leap seconds from this name "
+	    "(leapsecond.utcd.org)\n");
+	fprintf(stderr, "\t-j\tWorker threads (one per CPU)\n");
+	fprintf(stderr, "\t-n\tDo not query, use the compiled-in table\n");
+	fprintf(stderr, "\t-o\tWrite here rather than to stdout\n");
+	fprintf(stderr, "\t-v\tReport the number of timestamps converted\n");
+	exit(1);
+}
+
+int
+main_convert(int argc, char **argv)
+{
+	const char *fqdn = "leapsecond.utcd.org", *output = NULL;
+	static struct cv_leap cl[CV_MAXLEAP];
+	static struct leap_entry le[CV_MAXLEAP];
+	const struct leap_entry *lt = leap_table;
+	char hname[NI_MAXHOST];
+	struct cv cv;
+	int ch, error, in = 0, out = 1, offline = 0, verbose = 0;
+	int nlt = leap_table_len, year = 0, month = 0, tai = 0, delta = 0;
+	long jobs;
+
+	jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (jobs < 1)
+		jobs = 1;
+	if (jobs > CV_MAXJOBS)
+		jobs = CV_MAXJOBS;
+	while ((ch = getopt(argc, argv, "f:j:no:v")) != -1) {
+		switch (ch) {
+		case 'f':
+			fqdn = optarg;
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			if (jobs < 1 || jobs > CV_MAXJOBS)
+				usage_convert();
+			break;
+		case 'n':
+			offline = 1;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage_convert();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc > 1)
+		usage_convert();
+
+	if (!offline) {
+		error = query_leapsecond(fqdn, &year, &month, &tai, &delta,
+		    NULL);
+		if (error)
+			fprintf(stderr, "Query for %s failed with error %d, "
+			    "using the compiled-in table\n", fqdn, error);
+		(void)snprintf(hname, sizeof hname, "history.%s", fqdn);
+		if (!error) {
+			error = query_leap_history(hname, le, CV_MAXLEAP);
+			if (error > 0) {
+				lt = le;
+				nlt = error;
+			}
+		}
+	}
+
+	if (argc == 1) {
+		in = open(argv[0], O_RDONLY);
+		if (in < 0) {
+			perror(argv[0]);
+			return (1);
+		}
+	}
+	if (output != NULL) {
+		out = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (out < 0) {
+			perror(output);
+			return (1);
+		}
+	}
+
+	memset(&cv, 0, sizeof cv);
+	cv.leap = cl;
+	cv.nleap = cv_leaps(cl, lt, nlt, year, month, tai, delta);
+	cv.fd = out;
+	error = cv_run(&cv, in, (int)jobs, CV_CHUNK);
+	if (error) {
+		fprintf(stderr, "convert: %s\n", strerror(error));
+		return (1);
+	}
+	if (out != 1 && close(out)) {
+		perror(output);
+		return (1);
+	}
+	if (verbose)
+		fprintf(stderr, "%lu timestamps converted\n", cv.converted);
+	return (0);
+}
+
+static char bench_log[1 << 16];
+
+void
+bench_convert(unsigned long n)
+{
+	static struct cv_leap cl[CV_MAXLEAP];
+	struct cv cv;
+	struct cv_work w;
+	struct cv_chunk c;
+	unsigned long u, lines = 0;
+	size_t len = 0;
+	int l;
+
+	memset(&cv, 0, sizeof cv);
+	cv.leap = cl;
+	cv.nleap = cv_leaps(cl, leap_table, leap_table_len, 0, 0, 0, 0);
+	memset(&w, 0, sizeof w);
+	w.cv = &cv;
+	memset(&c, 0, sizeof c);
+	while (len + 80 < sizeof bench_log) {
+		l = snprintf(bench_log + len, sizeof bench_log - len,
+		    "2016-12-31T%02lu:%02lu:%02lu.%06luZ host sshd[%lu]: "
+		    "line\n", lines / 3600 % 24, lines / 60 % 60, lines % 60,
+		    lines * 7919 % 1000000, lines);
+		len += l;
+		lines++;
+	}
+	c.in = bench_log;
+	c.len = len;
+	for (u = 0; u < n; u += lines)
+		bench_sink += cv_convert(&w, &c);
+	free(c.out);
+	free(w.rec);
+	free(w.z);
+	free(w.y);
+	free(w.m);
+	free(w.d);
+}
+
+/*
+ * Per line, input and expected output
+ */
+
+static const char * const convert_vectors[][2] = {
+	{ "2016-12-31T23:59:59Z a",	"2017-01-01T00:00:35 a" },
+	{ "2016-12-31T23:59:60.5Z b",	"2017-01-01T00:00:36.5 b" },
+	{ "2017-01-01T00:00:00+00:00 c", "2017-01-01T00:00:37 c" },
+	{ "2012-06-30 23:59:60,125 d",	"2012-07-01 00:00:34,125 d" },
+	{ "2024-02-29T12:00:00.000001Z", "2024-02-29T12:00:37.000001" },
+	{ "1972-01-01T00:00:00Z",	"1972-01-01T00:00:10" },
+	{ "2026-12-31T23:59:60Z e",	"2027-01-01T00:00:37 e" },
+	{ "2015-12-31T23:59:60Z f",	NULL },	/* No leap second */
+	{ "1971-06-01T00:00:00Z g",	NULL },	/* Before UTC */
+	{ "2016-02-30T00:00:00Z h",	NULL },
+	{ "2016-12-31T23:59:59Zx",	NULL },
+	{ "2016-12-31T23:59:59-05:00",	NULL },
+	{ "",				NULL },
+	{ "no timestamp",		NULL },
+	{ NULL,				NULL }
+};
+
+static void
+test_convert_pipeline(const char *in, size_t len, const char *want,
+    size_t wantlen, int jobs, size_t chunk, int usemap)
+{
+	static struct cv_leap cl[CV_MAXLEAP];
+	struct cv cv;
+	char path[64], *got;
+	int fd[2], out;
+	ssize_t l;
+
+	(void)snprintf(path, sizeof path, "/tmp/dns_leap_convert.%ld",
+	    (long)getpid());
+	if (usemap) {
+		fd[0] = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+		assert(fd[0] >= 0);
+		assert(write(fd[0], in, len) == (ssize_t)len);
+		(void)unlink(path);
+	} else {
+		assert(pipe(fd) == 0);
+		assert(write(fd[1], in, len) == (ssize_t)len);
+		(void)close(fd[1]);
+	}
+	out = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	assert(out >= 0);
+	(void)unlink(path);
+
+	memset(&cv, 0, sizeof cv);
+	cv.leap = cl;
+	cv.nleap = cv_leaps(cl, leap_table, leap_table_len, 2026, 12, 37, 1);
+	cv.fd = out;
+	assert(cv_run(&cv, fd[0], jobs, chunk) == 0);
+	got = malloc(wantlen + 1);
+	assert(got != NULL);
+	l = pread(out, got, wantlen + 1, 0);
+	printf("  Jobs: %d  Chunk: %4zu  %s  Bytes: %zd  Converted: %lu\n",
+	    jobs, chunk, usemap ? "mmap" : "read", l, cv.converted);
+	assert(l == (ssize_t)wantlen && !memcmp(got, want, wantlen));
+	free(got);
+	(void)close(fd[0]);
+	(void)close(out);
+}
+
+void
+test_leap_convert(void)
+{
+	static struct cv_leap cl[CV_MAXLEAP];
+	static char in[16384], want[16384];
+	const char * const *vv, *exp;
+	struct cv cv;
+	struct cv_work w;
+	struct cv_chunk c;
+	size_t len = 0, wantlen = 0;
+	unsigned long n;
+	int i;
+
+	printf("\nChecking log timestamp conversion:\n\n");
+	memset(&cv, 0, sizeof cv);
+	cv.leap = cl;
+	cv.nleap = cv_leaps(cl, leap_table, leap_table_len, 2026, 12, 37, 1);
+	assert(cv.nleap == leap_table_len + 1);
+	assert(cv_leaps(cl, leap_table, leap_table_len, 2026, 12, 36, 1) ==
+	    leap_table_len);
+	memset(&w, 0, sizeof w);
+	w.cv = &cv;
+	memset(&c, 0, sizeof c);
+	for (vv = convert_vectors[0]; vv[0] != NULL; vv += 2) {
+		c.in = vv[0];
+		c.len = strlen(vv[0]);
+		n = cv_convert(&w, &c);
+		printf("  %-28s -> %.*s\n", vv[0], (int)c.outlen, c.out);
+		assert(n == (vv[1] != NULL));
+		exp = vv[1] != NULL ? vv[1] : vv[0];
+		assert(c.outlen == strlen(exp) && !memcmp(c.out, exp, c.outlen));
+	}
+
+	/* Only whole lines start with a timestamp */
+	c.in = "2016-12-31T23:59:59Z\n2016-12-31T23:59:59Z\n";
+	c.len = strlen(c.in);
+	c.midline = 1;
+	assert(cv_convert(&w, &c) == 1);
+	assert(!memcmp(c.out, "2016-12-31T23:59:59Z\n2017-01-01T00:00:35\n",
+	    c.outlen));
+	free(c.out);
+	free(w.rec);
+	free(w.z);
+	free(w.y);
+	free(w.m);
+	free(w.d);
+
+	/* The threaded pipeline keeps the order, and cuts only at lines */
+	for (i = 0; len + 400 < sizeof in; i++) {
+		vv = convert_vectors[i % 14];
+		len += snprintf(in + len, sizeof in - len, "%s %d\n",
+		    vv[0], i);
+		wantlen += snprintf(want + wantlen, sizeof want - wantlen,
+		    "%s %d\n", vv[1] != NULL ? vv[1] : vv[0], i);
+	}
+	memset(in + len, 'x', 300);	/* A line longer than a chunk */
+	memcpy(in + len, "2016-12-31T23:59:60Z ", 21);
+	memset(want + wantlen, 'x', 300);
+	memcpy(want + wantlen, "2017-01-01T00:00:36 ", 20);
+	len += 300;
+	wantlen += 299;
+	test_convert_pipeline(in, len, want, wantlen, 1, 256, 0);
+	test_convert_pipeline(in, len, want, wantlen, 4, 256, 0);
+	test_convert_pipeline(in, len, want, wantlen, 3, 100, 1);
+	test_convert_pipeline(in, len, want, wantlen, 8, CV_CHUNK, 1);
+}
@@ -0,0 +1,193 @@
+/*-
+ * Copyright (c) 2015 Poul-Henning Kamp <phk@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Calendar arithmetic: days since 1970 from a proleptic gregorian
+ * date and back, MJD, and the month counter of the announcement.
+ *
+ * The algorithms are Howard Hinnant's, shifted by LEAP_DATE_ERAS eras
+ * of 400 years so that every intermediate is unsigned.  Then all the
+ * divisions are by constants, which compilers turn into multiplies,
+ * and the January/February correction is itself such a division, so
+ * there are no branches.  The same macros in dns_leap.h expand to the
+ * scalar inline functions and, with the GCC/Clang vector extensions,
+ * to the bulk conversion below, so the two cannot disagree.
+ *
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dns_leap.h"
+
+#if defined(__GNUC__) && !defined(NO_SIMD)
+typedef uint32_t date_vu __attribute__((vector_size(16)));
+typedef int32_t date_vi __attribute__((vector_size(16)));
+
+void
+leap_civil_from_days_n(const int32_t *z, int32_t *year, int32_t *month,
+    int32_t *day, size_t n)
+{
+	date_vi vz;
+	date_vu y, m, d;
+	size_t i, nv = n & ~(size_t)3;
+
+	for (i = 0; i < nv; i += 4) {
+		memcpy(&vz, z + i, sizeof vz);
+		LEAP_CIVIL(date_vu, vz, y, m, d);
+		memcpy(year + i, &y, sizeof y);
+		memcpy(month + i, &m, sizeof m);
+		memcpy(day + i, &d, sizeof d);
+	}
+	for (i = nv; i < n; i++)
+		leap_civil_from_days(z[i], year + i, month + i, day + i);
+}
+#else
+void
+leap_civil_from_days_n(const int32_t *z, int32_t *year, int32_t *month,
+    int32_t *day, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		leap_civil_from_days(z[i], year + i, month + i, day + i);
+}
+#endif
+
+static int32_t bench_z[1024], bench_y[1024], bench_m[1024], bench_d[1024];
+
+void
+bench_civil(unsigned long n)
+{
+	unsigned long u;
+	int y, m, d, sum = 0;
+
+	for (u = 0; u < n; u++) {
+		leap_civil_from_days((int32_t)(u * 37 & 0xfffff), &y, &m, &d);
+		sum += y + m + d;
+	}
+	bench_sink += sum;
+}
+
+void
+bench_civil_bulk(unsigned long n)
+{
+	unsigned long u;
+	int i, sum = 0;
+
+	for (i = 0; i < 1024; i++)
+		bench_z[i] = i * 37;
+	for (u = 0; u < n; u += 1024) {
+		leap_civil_from_days_n(bench_z, bench_y, bench_m, bench_d,
+		    1024);
+		sum += bench_y[u & 1023];
+	}
+	bench_sink += sum;
+}
+
+static const struct date_vector {
+	int		year;
+	int		month;
+	int		day;
+	int32_t		z;
+} date_vectors[] = {
+	{ 1970,	 1,  1,	      0 },
+	{ 1969, 12, 31,	     -1 },
+	{ 1972,	 1,  1,	    730 },	/* MJD 41317, start of UTC */
+	{ 2000,	 2, 29,	  11016 },
+	{ 2000,	 3,  1,	  11017 },
+	{ 2016, 12, 31,	  17166 },
+	{ 2100,	 3,  1,	  47541 },
+	{ 1900,	 2, 28,	 -25509 },
+	{ 1900,	 3,  1,	 -25508 },
+	{    0,	 3,  1,	-719468 },
+	{   -1,	12, 31,	-719529 },
+	{ 0,	 0,  0,	      0 }
+};
+
+/*
+ * Howard Hinnant's signed originals, to check against
+ */
+
+static int32_t
+ref_days(int y, int m, int d)
+{
+	int era, yoe, doy, doe;
+
+	y -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return (era * 146097 + doe - 719468);
+}
+
+void
+test_leap_date(void)
+{
+	const struct date_vector *dv;
+	static int32_t z[4003], y[4003], m[4003], d[4003];
+	int32_t i, j;
+	int yy, mm, dd;
+
+	printf("\nChecking calendar:\n\n");
+	for (dv = date_vectors; dv->month != 0; dv++) {
+		leap_civil_from_days(dv->z, &yy, &mm, &dd);
+		printf("  Days: %8d  Date: %05d-%02d-%02d  MJD: %d\n",
+		    dv->z, yy, mm, dd, dv->z + LEAP_MJD_UNIX);
+		assert(yy == dv->year && mm == dv->month && dd == dv->day);
+		assert(leap_days_from_civil(dv->year, dv->month, dv->day) ==
+		    dv->z);
+		assert(leap_unix_mjd(leap_mjd_unix(dv->z + LEAP_MJD_UNIX)) ==
+		    dv->z + LEAP_MJD_UNIX);
+		assert(leap_unix_mjd(leap_mjd_unix(dv->z + LEAP_MJD_UNIX) +
+		    86399) == dv->z + LEAP_MJD_UNIX);
+	}
+
+	/* Every day from -2000 to 4000, scalar and bulk */
+	for (i = -1449953; i < 757000; i += 4003) {
+		for (j = 0; j < 4003; j++)
+			z[j] = i + j;
+		leap_civil_from_days_n(z, y, m, d, 4003);
+		for (j = 0; j < 4003; j++) {
+			leap_civil_from_days(z[j], &yy, &mm, &dd);
+			assert(yy == y[j] && mm == m[j] && dd == d[j]);
+			assert(ref_days(yy, mm, dd) == z[j]);
+			assert(leap_days_from_civil(yy, mm, dd) == z[j]);
+		}
+	}
+	printf("  Round trip: years %d to %d\n", -2000, y[4002]);
+
+	for (i = -300; i < 0x800; i++) {
+		leap_month_from_index(i, &yy, &mm);
+		assert(leap_month_index(yy, mm) == i);
+	}
+	leap_month_from_index(1, &yy, &mm);
+	assert(yy == 1971 && mm == 12);
+	assert(leap_month_end(2016, 12) == 1483228800);
+	assert(leap_month_end(2015, 6) == 1435708800);
+	assert(leap_month_end(1969, 12) == 0);
+}
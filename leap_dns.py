@@ -36,6 +36,26 @@ def crc8(b, n):
 	crc >>= 24
 	return crc
 
+# Calendar, as in leap_date.c
+
+def days_from_civil(y, m, d):
+	# Days since 1970-01-01 of a proleptic gregorian date
+	jf = (14 - m) // 12
+	y -= jf
+	era = y // 400
+	yoe = y - era * 400
+	doy = (153 * (m + 12 * jf - 3) + 2) // 5 + d - 1
+	return era * 146097 + yoe * 365 + yoe // 4 - yoe // 100 + doy - 719468
+
+MJD_UNIX = 40587
+
+def month_index(y, m):
+	# The month counter of the announcement, 1971-12 is 1
+	return (y - 1971) * 12 + m - 11
+
+def month_from_index(mn):
+	return (1971 + (mn + 10) // 12, 1 + (mn + 10) % 12)
+
 def dec(i):
 	r = ""
 	j = i.split(".")
@@ -61,11 +81,7 @@ def dec(i):
 	w >>= 7	
 	d = w & 0x03
 	w >>= 2	
-	mn = w
-
-	mn += 10
-	m = (mn % 12) + 1
-	y = mn / 12 + 1971
+	y, m = month_from_index(w)
 	# assert d != 3
 	if d == 2:
 		dt = +1
@@ -83,8 +99,8 @@ def dec(i):
 
 def enc(y, m, b, a):
 
-	# Encode the month number.  Dec 1971 = 0
-	w = (y - 1971) * 12 + m - 11
+	# Encode the month number.  Dec 1971 = 1
+	w = month_index(y, m)
 	assert w < 2048
 
 	# Encode the leap-second polarity
@@ -123,7 +139,7 @@ print("YYYY MM before  after  encoded crc IP               Decoded")
 print("-" * 73)
 
 ll = list()
-lmnum = 6
+lmn = month_index(1972, 6)
 ldut1 = 9
 fi = open("_Cache_Leap_Second_History.dat")
 for l in fi:
@@ -135,19 +151,16 @@ for l in fi:
 	assert month >= 1 and month <= 12
 	year = int(i[3])
 	assert year >= 1972
-	if month == 1:
-		month = 12
-		year -= 1
-	elif month == 7:
-		month -= 1
+	assert float(i[0]) == days_from_civil(year, month, 1) + MJD_UNIX
+	# The month which ends where the new dTAI starts
+	mn = month_index(year, month) - 1
+	year, month = month_from_index(mn)
 	dut1 = int(i[4])
-	mnum = (year - 1972) * 12 + month - 1
-	for x in range(lmnum, mnum, 6):
-		y = 1972 + (x+1) // 12
-		m = (x+1) % 12
+	for x in range(lmn, mn, 6):
+		y, m = month_from_index(x)
 		enc(y, m, ldut1, ldut1)
 	enc(year, month, ldut1, dut1)
-	lmnum = mnum + 6
+	lmn = mn + 6
 	ldut1 = dut1
 print("")
 
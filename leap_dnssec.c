@@ -0,0 +1,1210 @@
+/*-
+ * Copyright (c) 2015 Poul-Henning Kamp <phk@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * DNSSEC validation of the announcement, for LQ_DNSSEC queries.
+ *
+ * The resolver is asked with DO and CD set, so it passes the RRSIGs on
+ * without judging them, and the A RRset is checked here:  One of its
+ * RRSIGs must verify with a DNSKEY of the signing zone, that zone's
+ * DNSKEY RRset must be signed by a key matching one of its DS records,
+ * and the DS RRset must in turn verify with the parent zone's keys, up
+ * to the root zone trust anchors compiled in below.  The DS and DNSKEY
+ * RRsets are fetched through the same resolver and transport as the
+ * query itself.
+ *
+ * Each validated DNSKEY RRset is cached, with its public keys parsed,
+ * until its TTL runs out or the signatures along the chain expire,
+ * whichever comes first.  With the chain cached, validating a fresh
+ * answer costs one signature verification and no extra queries, see
+ * the "rrsig" benchmark.  The cache is not thread-safe.
+ *
+ * The algorithms are RSA/SHA-256 (8), RSA/SHA-512 (10), ECDSA P-256
+ * (13), ECDSA P-384 (14) and Ed25519 (15), the DS digests SHA-1,
+ * SHA-256 and SHA-384.  Answers synthesized from a wildcard, through a
+ * CNAME, or from an unsigned delegation are not validated, there are
+ * no NSEC/NSEC3 proofs here.
+ *
+ * Needs OpenSSL 3 and -DWITH_OPENSSL.  Without it dnssec_validate()
+ * always fails, and LQ_DNSSEC falls back to trusting the resolver's AD
+ * bit, see leap_query.c.
+ *
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef WITH_OPENSSL
+#include <openssl/bn.h>
+#include <openssl/core_names.h>
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/param_build.h>
+#include <openssl/rsa.h>
+#endif
+
+#include "dns_leap.h"
+
+#ifdef WITH_OPENSSL
+
+#define DS_NZONES	16		/* Cached DNSKEY RRsets */
+#define DS_NKEYS	8		/* Keys per zone */
+#define DS_MAXKEY	1024		/* DNSKEY RDATA */
+#define DS_NRR		32		/* RRs per RRset */
+#define DS_NSIG		8		/* RRSIGs per RRset */
+#define DS_DEPTH	8		/* Zone cuts above the signer */
+#define DS_MAXRESP	4096
+#define DS_MAXDATA	16384		/* Signed data */
+#define DS_MAXCACHE	86400		/* Seconds */
+
+#define DNSKEY_ZONE	0x0100
+
+struct ds_rr {
+	const uint8_t		*p;
+	size_t			len;
+};
+
+struct ds_set {
+	const uint8_t		*owner;		/* Lower case wire format */
+	size_t			ownerlen;
+	unsigned		type;
+	uint32_t		ttl;		/* Lowest */
+	unsigned		n, nsig;
+	struct ds_rr		rr[DS_NRR];
+	struct ds_rr		sig[DS_NSIG];
+};
+
+struct ds_key {
+	unsigned		tag;
+	size_t			len;
+	uint8_t			rdata[DS_MAXKEY];
+	EVP_PKEY		*pkey;		/* Made on first use */
+};
+
+struct ds_zone {
+	uint8_t			name[DNS_MAXNAME];
+	size_t			namelen;
+	time_t			expire;
+	unsigned		nkey;
+	struct ds_key		key[DS_NKEYS];
+};
+
+static struct ds_zone ds_cache[DS_NZONES];
+
+/* The root zone KSK-2017 and KSK-2024, from IANA's root-anchors.xml */
+static const char * const ds_root[] = {
+	"20326 8 2 E06D44B80B8F1D39A95C0B0D7C65D084"
+	    "58E880409BBC683457104237C7F8EC8D",
+	"38696 8 2 683D2D0ACB8C9B712A1948B27F741219"
+	    "298D0A450D612C483AF444A4C0FB2B16",
+	NULL
+};
+static const char * const *ds_anchor = ds_root;
+
+/*
+ * Read the possibly compressed name at *pos, in lower case
+ */
+
+static int
+ds_name(const uint8_t *r, size_t len, size_t *pos, uint8_t *out,
+    size_t *outlen)
+{
+	size_t p = *pos, o = 0;
+	unsigned l, i, hops = 0;
+	int jumped = 0;
+
+	for (;;) {
+		if (p >= len)
+			return (-1);
+		l = r[p];
+		if ((l & 0xc0) == 0xc0) {
+			if (p + 1 >= len || ++hops > 32)
+				return (-1);
+			if (!jumped)
+				*pos = p + 2;
+			jumped = 1;
+			p = (l & 0x3f) << 8 | r[p + 1];
+			continue;
+		}
+		if ((l & 0xc0) || p + 1 + l > len || o + 1 + l > DNS_MAXNAME)
+			return (-1);
+		out[o++] = l;
+		for (i = 0; i < l; i++)
+			out[o++] = dns_lower(r[p + 1 + i]);
+		p += 1 + l;
+		if (l == 0)
+			break;
+	}
+	if (!jumped)
+		*pos = p;
+	*outlen = o;
+	return (0);
+}
+
+static unsigned
+ds_labels(const uint8_t *name)
+{
+	unsigned n = 0;
+
+	for (; *name != 0; name += 1 + *name)
+		n++;
+	return (n);
+}
+
+/* Is 'zone' 'name' or an ancestor of it */
+static int
+ds_under(const uint8_t *name, size_t nl, const uint8_t *zone, size_t zl)
+{
+	size_t o;
+
+	for (o = 0; o < nl; o += 1 + name[o])
+		if (nl - o == zl && !memcmp(name + o, zone, zl))
+			return (1);
+	return (0);
+}
+
+static unsigned
+ds_keytag(const uint8_t *k, size_t len)
+{
+	uint32_t ac = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		ac += (i & 1) ? k[i] : (uint32_t)k[i] << 8;
+	ac += (ac >> 16) & 0xffff;
+	return (ac & 0xffff);
+}
+
+/*
+ * Collect the RRset of s->owner and s->type, and the RRSIGs covering
+ * it, from the answer section.
+ */
+
+static int
+ds_collect(const uint8_t *r, size_t len, struct ds_set *s)
+{
+	uint8_t nm[DNS_MAXNAME];
+	size_t pos = DNS_HDRLEN, nl;
+	unsigned qd, an, i, type, class, rdlen;
+	uint32_t ttl;
+
+	s->n = s->nsig = 0;
+	s->ttl = UINT32_MAX;
+	if (len < DNS_HDRLEN || (r[3] & 0x0f) != 0)
+		return (-1);
+	qd = dns_get16(r + 4);
+	an = dns_get16(r + 6);
+	for (i = 0; i < qd; i++) {
+		if (ds_name(r, len, &pos, nm, &nl) || pos + 4 > len)
+			return (-1);
+		pos += 4;
+	}
+	for (i = 0; i < an; i++) {
+		if (ds_name(r, len, &pos, nm, &nl) || pos + 10 > len)
+			return (-1);
+		type = dns_get16(r + pos);
+		class = dns_get16(r + pos + 2);
+		ttl = dns_get32(r + pos + 4);
+		rdlen = dns_get16(r + pos + 8);
+		pos += 10;
+		if (pos + rdlen > len)
+			return (-1);
+		if (class != C_IN || nl != s->ownerlen ||
+		    memcmp(nm, s->owner, nl)) {
+			pos += rdlen;
+			continue;
+		}
+		if (type == s->type && s->n < DS_NRR) {
+			s->rr[s->n].p = r + pos;
+			s->rr[s->n++].len = rdlen;
+			if (ttl < s->ttl)
+				s->ttl = ttl;
+		} else if (type == T_RRSIG && rdlen > 18 &&
+		    dns_get16(r + pos) == s->type && s->nsig < DS_NSIG) {
+			s->sig[s->nsig].p = r + pos;
+			s->sig[s->nsig++].len = rdlen;
+		}
+		pos += rdlen;
+	}
+	return (s->n > 0 && s->nsig > 0 ? 0 : -1);
+}
+
+static int
+ds_rrcmp(const void *a, const void *b)
+{
+	const struct ds_rr *ra = a, *rb = b;
+	int c;
+
+	c = memcmp(ra->p, rb->p, ra->len < rb->len ? ra->len : rb->len);
+	if (c != 0)
+		return (c);
+	return ((ra->len > rb->len) - (ra->len < rb->len));
+}
+
+/*
+ * The data an RRSIG signs (RFC 4034 3.1.8.1): its own RDATA up to the
+ * signature, then the RRset in canonical order, without duplicates.
+ * None of the types checked here have names in their RDATA.
+ */
+
+static ssize_t
+ds_data(const struct ds_set *s, const uint8_t *sig, const uint8_t *signer,
+    size_t sl, uint8_t *d, size_t dlen)
+{
+	struct ds_rr rr[DS_NRR];
+	size_t l;
+	unsigned i;
+
+	memcpy(rr, s->rr, s->n * sizeof rr[0]);
+	qsort(rr, s->n, sizeof rr[0], ds_rrcmp);
+	if (18 + sl > dlen)
+		return (-1);
+	memcpy(d, sig, 18);
+	memcpy(d + 18, signer, sl);
+	l = 18 + sl;
+	for (i = 0; i < s->n; i++) {
+		if (i > 0 && !ds_rrcmp(&rr[i - 1], &rr[i]))
+			continue;
+		if (l + s->ownerlen + 10 + rr[i].len > dlen)
+			return (-1);
+		memcpy(d + l, s->owner, s->ownerlen);
+		l += s->ownerlen;
+		dns_put16(d + l, s->type);
+		dns_put16(d + l + 2, C_IN);
+		memcpy(d + l + 4, sig + 4, 4);		/* Original TTL */
+		dns_put16(d + l + 8, rr[i].len);
+		memcpy(d + l + 10, rr[i].p, rr[i].len);
+		l += 10 + rr[i].len;
+	}
+	return ((ssize_t)l);
+}
+
+static EVP_PKEY *
+ds_pkey(struct ds_key *k)
+{
+	const uint8_t *p = k->rdata + 4;
+	size_t pl = k->len - 4, el;
+	uint8_t pt[1 + 96];
+	OSSL_PARAM_BLD *pb = NULL;
+	OSSL_PARAM *pa = NULL;
+	EVP_PKEY_CTX *pc = NULL;
+	BIGNUM *n = NULL, *e = NULL;
+	const char *type = "EC";
+	int ok = 0;
+
+	if (k->pkey != NULL)
+		return (k->pkey);
+	pb = OSSL_PARAM_BLD_new();
+	if (pb == NULL)
+		return (NULL);
+	switch (k->rdata[3]) {
+	case 8:
+	case 10:
+		type = "RSA";
+		el = pl > 0 ? p[0] : 0;
+		p++;
+		pl--;
+		if (el == 0 && pl >= 2) {
+			el = dns_get16(p);
+			p += 2;
+			pl -= 2;
+		}
+		if (el == 0 || el >= pl)
+			break;
+		e = BN_bin2bn(p, el, NULL);
+		n = BN_bin2bn(p + el, pl - el, NULL);
+		ok = n != NULL && e != NULL &&
+		    OSSL_PARAM_BLD_push_BN(pb, OSSL_PKEY_PARAM_RSA_N, n) &&
+		    OSSL_PARAM_BLD_push_BN(pb, OSSL_PKEY_PARAM_RSA_E, e);
+		break;
+	case 13:
+	case 14:
+		if (pl != (k->rdata[3] == 13 ? 64U : 96U))
+			break;
+		pt[0] = 0x04;			/* Uncompressed point */
+		memcpy(pt + 1, p, pl);
+		ok = OSSL_PARAM_BLD_push_utf8_string(pb,
+		    OSSL_PKEY_PARAM_GROUP_NAME,
+		    k->rdata[3] == 13 ? "P-256" : "P-384", 0) &&
+		    OSSL_PARAM_BLD_push_octet_string(pb,
+		    OSSL_PKEY_PARAM_PUB_KEY, pt, 1 + pl);
+		break;
+	case 15:
+		if (pl == 32)
+			k->pkey = EVP_PKEY_new_raw_public_key(EVP_PKEY_ED25519,
+			    NULL, p, pl);
+		break;
+	default:
+		break;
+	}
+	if (ok)
+		pa = OSSL_PARAM_BLD_to_param(pb);
+	if (pa != NULL)
+		pc = EVP_PKEY_CTX_new_from_name(NULL, type, NULL);
+	if (pc != NULL && EVP_PKEY_fromdata_init(pc) == 1)
+		(void)EVP_PKEY_fromdata(pc, &k->pkey, EVP_PKEY_PUBLIC_KEY, pa);
+	EVP_PKEY_CTX_free(pc);
+	OSSL_PARAM_free(pa);
+	OSSL_PARAM_BLD_free(pb);
+	BN_free(n);
+	BN_free(e);
+	return (k->pkey);
+}
+
+static int
+ds_crypto(struct ds_key *k, const uint8_t *d, size_t dl, const uint8_t *s,
+    size_t sl)
+{
+	const EVP_MD *md = NULL;
+	EVP_PKEY *pk;
+	EVP_MD_CTX *mc;
+	ECDSA_SIG *es;
+	BIGNUM *br, *bs;
+	uint8_t der[128], *dp;
+	size_t hl = 0;
+	int ok;
+
+	pk = ds_pkey(k);
+	if (pk == NULL)
+		return (-1);
+	switch (k->rdata[3]) {
+	case 8:		md = EVP_sha256();		break;
+	case 10:	md = EVP_sha512();		break;
+	case 13:	md = EVP_sha256(); hl = 32;	break;
+	case 14:	md = EVP_sha384(); hl = 48;	break;
+	default:					break;
+	}
+	if (hl != 0) {
+		/* DNSSEC has r|s, OpenSSL wants DER */
+		if (sl != 2 * hl)
+			return (-1);
+		es = ECDSA_SIG_new();
+		br = BN_bin2bn(s, hl, NULL);
+		bs = BN_bin2bn(s + hl, hl, NULL);
+		if (es == NULL || br == NULL || bs == NULL ||
+		    !ECDSA_SIG_set0(es, br, bs)) {
+			ECDSA_SIG_free(es);
+			BN_free(br);
+			BN_free(bs);
+			return (-1);
+		}
+		ok = i2d_ECDSA_SIG(es, NULL);
+		if (ok > 0 && (size_t)ok <= sizeof der) {
+			dp = der;
+			ok = i2d_ECDSA_SIG(es, &dp);
+		}
+		ECDSA_SIG_free(es);
+		if (ok <= 0 || (size_t)ok > sizeof der)
+			return (-1);
+		s = der;
+		sl = ok;
+	}
+	mc = EVP_MD_CTX_new();
+	ok = mc != NULL &&
+	    EVP_DigestVerifyInit(mc, NULL, md, NULL, pk) == 1 &&
+	    EVP_DigestVerify(mc, s, sl, d, dl) == 1;
+	EVP_MD_CTX_free(mc);
+	return (ok ? 0 : -1);
+}
+
+/*
+ * Verify the RRset with any key in 'z' allowed by 'mask'.  Returns the
+ * expiry of the signature which verified in *expire.
+ */
+
+static int
+ds_verify(const struct ds_set *s, struct ds_zone *z, unsigned mask,
+    time_t now, time_t *expire)
+{
+	uint8_t signer[DNS_MAXNAME], d[DS_MAXDATA];
+	const struct ds_rr *sig;
+	struct ds_key *k;
+	uint32_t t = (uint32_t)now, exp, inc;
+	size_t pos, sl;
+	ssize_t dl;
+	unsigned i, j;
+
+	if (!ds_under(s->owner, s->ownerlen, z->name, z->namelen))
+		return (-1);
+	for (i = 0; i < s->nsig; i++) {
+		sig = &s->sig[i];
+		pos = 18;
+		if (ds_name(sig->p, sig->len, &pos, signer, &sl) ||
+		    pos != 18 + sl || pos >= sig->len)
+			continue;		/* Compressed or no signature */
+		if (sl != z->namelen || memcmp(signer, z->name, sl))
+			continue;
+		if (sig->p[3] != ds_labels(s->owner))
+			continue;		/* Wildcard */
+		exp = dns_get32(sig->p + 8);
+		inc = dns_get32(sig->p + 12);
+		if ((int32_t)(t - inc) < 0 || (int32_t)(exp - t) < 0)
+			continue;
+		dl = ds_data(s, sig->p, signer, sl, d, sizeof d);
+		if (dl < 0)
+			continue;
+		for (j = 0; j < z->nkey; j++) {
+			k = &z->key[j];
+			if (!(mask & (1U << j)) ||
+			    k->tag != dns_get16(sig->p + 16) ||
+			    k->rdata[3] != sig->p[2] || k->rdata[2] != 3 ||
+			    !(dns_get16(k->rdata) & DNSKEY_ZONE))
+				continue;
+			if (ds_crypto(k, d, dl, sig->p + pos,
+			    sig->len - pos) == 0) {
+				*expire = now + (int32_t)(exp - t);
+				return (0);
+			}
+		}
+	}
+	return (-1);
+}
+
+/*
+ * DS digest of the DNSKEY 'key' of zone 'name', returns its length
+ */
+
+static int
+ds_digest(const uint8_t *name, size_t nl, const uint8_t *key, size_t kl,
+    unsigned dtype, uint8_t *out)
+{
+	const EVP_MD *md;
+	EVP_MD_CTX *mc;
+	unsigned ol = 0;
+	int ok;
+
+	switch (dtype) {
+	case 1:		md = EVP_sha1();	break;
+	case 2:		md = EVP_sha256();	break;
+	case 4:		md = EVP_sha384();	break;
+	default:	return (-1);
+	}
+	mc = EVP_MD_CTX_new();
+	ok = mc != NULL && EVP_DigestInit_ex(mc, md, NULL) == 1 &&
+	    EVP_DigestUpdate(mc, name, nl) == 1 &&
+	    EVP_DigestUpdate(mc, key, kl) == 1 &&
+	    EVP_DigestFinal_ex(mc, out, &ol) == 1;
+	EVP_MD_CTX_free(mc);
+	return (ok ? (int)ol : -1);
+}
+
+static int
+ds_match(const uint8_t *name, size_t nl, const struct ds_key *k,
+    const struct ds_rr *ds)
+{
+	uint8_t dg[EVP_MAX_MD_SIZE];
+	int l;
+
+	if (ds->len < 4 || dns_get16(ds->p) != k->tag ||
+	    ds->p[2] != k->rdata[3])
+		return (0);
+	l = ds_digest(name, nl, k->rdata, k->len, ds->p[3], dg);
+	return (l > 0 && (size_t)l == ds->len - 4 &&
+	    !memcmp(dg, ds->p + 4, l));
+}
+
+/* "tag alg type hex" */
+static int
+ds_parse_anchor(const char *s, uint8_t *rd, size_t len)
+{
+	unsigned tag, alg, dt, b;
+	size_t l = 4;
+	int n;
+
+	if (sscanf(s, "%u %u %u %n", &tag, &alg, &dt, &n) != 3)
+		return (-1);
+	dns_put16(rd, tag);
+	rd[2] = alg;
+	rd[3] = dt;
+	for (s += n; l < len && sscanf(s, "%2x", &b) == 1; s += 2)
+		rd[l++] = b;
+	return ((int)l);
+}
+
+static void
+ds_zone_free(struct ds_zone *z)
+{
+	unsigned i;
+
+	for (i = 0; i < z->nkey; i++)
+		EVP_PKEY_free(z->key[i].pkey);
+	memset(z, 0, sizeof *z);
+}
+
+static void
+ds_flush(void)
+{
+	unsigned i;
+
+	for (i = 0; i < DS_NZONES; i++)
+		ds_zone_free(&ds_cache[i]);
+}
+
+/*
+ * The validated DNSKEY RRset of zone 'name', from the cache or else
+ * fetched and validated against the DS RRset, itself validated by the
+ * parent zone, or against the trust anchors for the root.
+ */
+
+static struct ds_zone *
+ds_zone(const uint8_t *name, size_t nl, time_t now, dnssec_fetch_f *f,
+    void *priv, int depth)
+{
+	static struct ds_zone z;
+	uint8_t r[DS_MAXRESP], dsr[DS_MAXRESP], anchor[DS_NRR][64];
+	uint8_t parent[DNS_MAXNAME];
+	struct ds_set ds, dk;
+	struct ds_zone *pz, *slot;
+	size_t pos, pl;
+	time_t expire, e;
+	ssize_t l;
+	unsigned i, j, mask = 0;
+	int al;
+
+	for (i = 0; i < DS_NZONES; i++)
+		if (ds_cache[i].namelen == nl && now < ds_cache[i].expire &&
+		    !memcmp(ds_cache[i].name, name, nl))
+			return (&ds_cache[i]);
+	if (depth > DS_DEPTH)
+		return (NULL);
+
+	expire = now + DS_MAXCACHE;
+	ds.owner = name;
+	ds.ownerlen = nl;
+	ds.type = T_DS;
+	if (nl == 1) {
+		ds.n = 0;
+		for (i = 0; ds_anchor[i] != NULL && i < DS_NRR; i++) {
+			al = ds_parse_anchor(ds_anchor[i], anchor[i],
+			    sizeof anchor[i]);
+			if (al < 0)
+				continue;
+			ds.rr[ds.n].p = anchor[i];
+			ds.rr[ds.n++].len = al;
+		}
+	} else {
+		l = f(priv, name, nl, T_DS, dsr, sizeof dsr);
+		if (l < 0 || ds_collect(dsr, l, &ds))
+			return (NULL);
+		pos = 18;
+		if (ds_name(ds.sig[0].p, ds.sig[0].len, &pos, parent, &pl) ||
+		    pl >= nl || !ds_under(name, nl, parent, pl))
+			return (NULL);
+		pz = ds_zone(parent, pl, now, f, priv, depth + 1);
+		if (pz == NULL || ds_verify(&ds, pz, ~0U, now, &e))
+			return (NULL);
+		if (e < expire)
+			expire = e;
+		if (pz->expire < expire)
+			expire = pz->expire;
+		if (now + (time_t)ds.ttl < expire)
+			expire = now + ds.ttl;
+	}
+
+	l = f(priv, name, nl, T_DNSKEY, r, sizeof r);
+	dk.owner = name;
+	dk.ownerlen = nl;
+	dk.type = T_DNSKEY;
+	if (l < 0 || ds_collect(r, l, &dk))
+		return (NULL);
+	memset(&z, 0, sizeof z);
+	memcpy(z.name, name, nl);
+	z.namelen = nl;
+	for (i = 0; i < dk.n && z.nkey < DS_NKEYS; i++) {
+		if (dk.rr[i].len < 4 || dk.rr[i].len > DS_MAXKEY)
+			continue;
+		memcpy(z.key[z.nkey].rdata, dk.rr[i].p, dk.rr[i].len);
+		z.key[z.nkey].len = dk.rr[i].len;
+		z.key[z.nkey].tag = ds_keytag(dk.rr[i].p, dk.rr[i].len);
+		for (j = 0; j < ds.n; j++)
+			if (ds_match(name, nl, &z.key[z.nkey], &ds.rr[j]))
+				mask |= 1U << z.nkey;
+		z.nkey++;
+	}
+	/* The DNSKEY RRset must be signed by a key the DS vouches for */
+	if (mask == 0 || ds_verify(&dk, &z, mask, now, &e)) {
+		ds_zone_free(&z);
+		return (NULL);
+	}
+	if (e < expire)
+		expire = e;
+	if (now + (time_t)dk.ttl < expire)
+		expire = now + dk.ttl;
+	z.expire = expire;
+
+	slot = &ds_cache[0];
+	for (i = 0; i < DS_NZONES; i++)
+		if (ds_cache[i].expire < slot->expire)
+			slot = &ds_cache[i];
+	ds_zone_free(slot);
+	*slot = z;
+	return (slot);
+}
+
+/*
+ * Validate the A RRset of 'name' in response 'r', fetching DS and
+ * DNSKEY RRsets through 'f' as needed.  On success the validated
+ * addresses are returned in 'addr' (room for *naddr), and *expire is
+ * when the validation runs out.
+ */
+
+int
+dnssec_validate(const uint8_t *r, size_t len, const uint8_t *name,
+    size_t namelen, time_t now, dnssec_fetch_f *f, void *priv,
+    uint32_t *addr, unsigned *naddr, time_t *expire)
+{
+	uint8_t lname[DNS_MAXNAME], signer[DNS_MAXNAME];
+	struct ds_set a;
+	struct ds_zone *z;
+	size_t i, pos, sl;
+	time_t e;
+	unsigned u, n;
+
+	if (namelen > sizeof lname)
+		return (-1);
+	for (i = 0; i < namelen; i++)
+		lname[i] = dns_lower(name[i]);
+	a.owner = lname;
+	a.ownerlen = namelen;
+	a.type = T_A;
+	if (ds_collect(r, len, &a))
+		return (-1);
+	for (u = 0; u < a.nsig; u++) {
+		pos = 18;
+		if (ds_name(a.sig[u].p, a.sig[u].len, &pos, signer, &sl))
+			continue;
+		z = ds_zone(signer, sl, now, f, priv, 0);
+		if (z == NULL || ds_verify(&a, z, ~0U, now, &e))
+			continue;
+		if (z->expire < e)
+			e = z->expire;
+		if (now + (time_t)a.ttl < e)
+			e = now + a.ttl;
+		for (i = n = 0; i < a.n && n < *naddr; i++)
+			if (a.rr[i].len == 4)
+				addr[n++] = dns_get32(a.rr[i].p);
+		*naddr = n;
+		*expire = e;
+		return (0);
+	}
+	return (-1);
+}
+
+/*
+ * Self-test --------------------------------------------------------
+ */
+
+struct ds_tkey {
+	EVP_PKEY		*pkey;
+	size_t			len;
+	uint8_t			rdata[DS_MAXKEY];
+};
+
+static void
+ds_tkey(struct ds_tkey *k, unsigned flags, unsigned alg)
+{
+	BIGNUM *n = NULL, *e = NULL;
+	uint8_t pt[1 + 64];
+	size_t l;
+
+	switch (alg) {
+	case 8:
+		k->pkey = EVP_RSA_gen(2048);
+		assert(k->pkey != NULL);
+		assert(EVP_PKEY_get_bn_param(k->pkey, OSSL_PKEY_PARAM_RSA_N,
+		    &n) == 1);
+		assert(EVP_PKEY_get_bn_param(k->pkey, OSSL_PKEY_PARAM_RSA_E,
+		    &e) == 1);
+		k->rdata[4] = BN_num_bytes(e);
+		(void)BN_bn2bin(e, k->rdata + 5);
+		l = 1 + k->rdata[4];
+		l += BN_bn2bin(n, k->rdata + 4 + l);
+		BN_free(n);
+		BN_free(e);
+		break;
+	case 13:
+		k->pkey = EVP_EC_gen("P-256");
+		assert(k->pkey != NULL);
+		assert(EVP_PKEY_get_octet_string_param(k->pkey,
+		    OSSL_PKEY_PARAM_PUB_KEY, pt, sizeof pt, &l) == 1);
+		assert(l == 65 && pt[0] == 0x04);
+		memcpy(k->rdata + 4, pt + 1, 64);
+		l = 64;
+		break;
+	default:
+		k->pkey = EVP_PKEY_Q_keygen(NULL, NULL, "ED25519");
+		assert(k->pkey != NULL);
+		l = 32;
+		assert(EVP_PKEY_get_raw_public_key(k->pkey, k->rdata + 4,
+		    &l) == 1);
+		break;
+	}
+	dns_put16(k->rdata, flags);
+	k->rdata[2] = 3;
+	k->rdata[3] = alg;
+	k->len = 4 + l;
+}
+
+/*
+ * Sign RRset 's' of zone 'zone', returns the RRSIG RDATA length
+ */
+
+static size_t
+ds_tsign(const struct ds_tkey *k, const struct ds_set *s,
+    const uint8_t *zone, size_t zl, unsigned labels, uint32_t inc,
+    uint32_t exp, uint8_t *out)
+{
+	uint8_t d[DS_MAXDATA], der[128];
+	const unsigned char *dp;
+	const BIGNUM *br, *bs;
+	EVP_MD_CTX *mc;
+	ECDSA_SIG *es;
+	size_t sl;
+	ssize_t dl;
+
+	dns_put16(out, s->type);
+	out[2] = k->rdata[3];
+	out[3] = labels;
+	dns_put32(out + 4, 3600);
+	dns_put32(out + 8, exp);
+	dns_put32(out + 12, inc);
+	dns_put16(out + 16, ds_keytag(k->rdata, k->len));
+	memcpy(out + 18, zone, zl);
+	dl = ds_data(s, out, zone, zl, d, sizeof d);
+	assert(dl > 0);
+	mc = EVP_MD_CTX_new();
+	assert(mc != NULL);
+	assert(EVP_DigestSignInit(mc, NULL, k->rdata[3] == 15 ? NULL :
+	    EVP_sha256(), NULL, k->pkey) == 1);
+	sl = 512;
+	assert(EVP_DigestSign(mc, out + 18 + zl, &sl, d, dl) == 1);
+	EVP_MD_CTX_free(mc);
+	if (k->rdata[3] == 13) {
+		memcpy(der, out + 18 + zl, sl);
+		dp = der;
+		es = d2i_ECDSA_SIG(NULL, &dp, sl);
+		assert(es != NULL);
+		ECDSA_SIG_get0(es, &br, &bs);
+		(void)BN_bn2binpad(br, out + 18 + zl, 32);
+		(void)BN_bn2binpad(bs, out + 18 + zl + 32, 32);
+		ECDSA_SIG_free(es);
+		sl = 64;
+	}
+	return (18 + zl + sl);
+}
+
+struct ds_tresp {
+	const char		*name;
+	unsigned		type;
+	size_t			len;
+	uint8_t			r[DS_MAXRESP];
+};
+
+/*
+ * A response with the RRset 'rd' of 'name', signed by 'k' of 'zone'.
+ * The answer owners are compressed pointers to the question.
+ */
+
+static void
+ds_tresp(struct ds_tresp *t, const char *name, unsigned type,
+    struct ds_rr *rd, unsigned n, const struct ds_tkey *k, const char *zone,
+    unsigned labels, uint32_t inc, uint32_t exp)
+{
+	uint8_t nm[DNS_MAXNAME], lnm[DNS_MAXNAME], zn[DNS_MAXNAME];
+	uint8_t sig[DS_MAXKEY];
+	struct ds_set s;
+	size_t l, nl, zl, sl;
+	unsigned i;
+
+	nl = dns_name(name, nm, sizeof nm);
+	zl = dns_name(zone, zn, sizeof zn);
+	for (i = 0; i < nl; i++)
+		lnm[i] = dns_lower(nm[i]);
+	memset(&s, 0, sizeof s);
+	s.owner = lnm;
+	s.ownerlen = nl;
+	s.type = type;
+	s.n = n;
+	memcpy(s.rr, rd, n * sizeof rd[0]);
+	sl = ds_tsign(k, &s, zn, zl, labels, inc, exp, sig);
+
+	t->name = name;
+	t->type = type;
+	memset(t->r, 0, DNS_HDRLEN);
+	t->r[2] = 0x81;
+	t->r[3] = 0x80;
+	dns_put16(t->r + 4, 1);
+	dns_put16(t->r + 6, n + 1);
+	l = DNS_HDRLEN;
+	memcpy(t->r + l, nm, nl);
+	l += nl;
+	dns_put16(t->r + l, type);
+	dns_put16(t->r + l + 2, C_IN);
+	l += 4;
+	for (i = 0; i <= n; i++) {
+		dns_put16(t->r + l, 0xc000 | DNS_HDRLEN);
+		dns_put16(t->r + l + 2, i < n ? type : T_RRSIG);
+		dns_put16(t->r + l + 4, C_IN);
+		dns_put32(t->r + l + 6, 3600);
+		dns_put16(t->r + l + 10, i < n ? rd[i].len : sl);
+		memcpy(t->r + l + 12, i < n ? rd[i].p : sig,
+		    i < n ? rd[i].len : sl);
+		l += 12 + (i < n ? rd[i].len : sl);
+	}
+	t->len = l;
+}
+
+#define DS_TINC		1700000000
+#define DS_TEXP		1900000000
+#define DS_TNOW		1800000000
+
+static struct ds_test {
+	struct ds_tkey		root, org, ksk, zsk;
+	uint8_t			dsorg[4 + 48], dsex[4 + 32];
+	char			anchor[128];
+	const char		*anchors[2];
+	struct ds_tresp		resp[5];	/* Fetched */
+	struct ds_tresp		leaf;
+	unsigned		nfetch;
+} *ds_t;
+
+static ssize_t
+ds_tfetch(void *priv, const uint8_t *name, size_t namelen, unsigned qtype,
+    uint8_t *r, size_t rlen)
+{
+	struct ds_test *t = priv;
+	uint8_t nm[DNS_MAXNAME];
+	unsigned i;
+	int nl;
+
+	for (i = 0; i < 5; i++) {
+		nl = dns_name(t->resp[i].name, nm, sizeof nm);
+		if (t->resp[i].type != qtype || (size_t)nl != namelen ||
+		    memcmp(nm, name, nl) || t->resp[i].len > rlen)
+			continue;
+		t->nfetch++;
+		memcpy(r, t->resp[i].r, t->resp[i].len);
+		return ((ssize_t)t->resp[i].len);
+	}
+	return (-1);
+}
+
+/*
+ * A three level chain: the root with an RSA key, "org" with Ed25519
+ * and a SHA-384 DS, "example.org" with an ECDSA KSK and ZSK.
+ */
+
+static struct ds_test *
+ds_tsetup(void)
+{
+	struct ds_test *t;
+	struct ds_rr rd[2];
+	uint8_t org[8], ex[16], a[4], dg[32];
+	size_t l;
+	int i;
+
+	if (ds_t != NULL)
+		return (ds_t);
+	t = calloc(1, sizeof *t);
+	assert(t != NULL);
+	ds_tkey(&t->root, 257, 8);
+	ds_tkey(&t->org, 257, 15);
+	ds_tkey(&t->ksk, 257, 13);
+	ds_tkey(&t->zsk, 256, 13);
+
+	(void)dns_name("org", org, sizeof org);
+	(void)dns_name("example.org", ex, sizeof ex);
+	dns_put16(t->dsorg, ds_keytag(t->org.rdata, t->org.len));
+	t->dsorg[2] = 15;
+	t->dsorg[3] = 4;
+	assert(ds_digest(org, 5, t->org.rdata, t->org.len, 4,
+	    t->dsorg + 4) == 48);
+	dns_put16(t->dsex, ds_keytag(t->ksk.rdata, t->ksk.len));
+	t->dsex[2] = 13;
+	t->dsex[3] = 2;
+	assert(ds_digest(ex, 13, t->ksk.rdata, t->ksk.len, 2,
+	    t->dsex + 4) == 32);
+
+	l = snprintf(t->anchor, sizeof t->anchor, "%u 8 2 ",
+	    ds_keytag(t->root.rdata, t->root.len));
+	assert(ds_digest((const uint8_t *)"", 1, t->root.rdata, t->root.len,
+	    2, dg) == 32);
+	for (i = 0; i < 32; i++)
+		l += snprintf(t->anchor + l, sizeof t->anchor - l, "%02X",
+		    dg[i]);
+	t->anchors[0] = t->anchor;
+
+	rd[0].p = t->root.rdata;
+	rd[0].len = t->root.len;
+	ds_tresp(&t->resp[0], "", T_DNSKEY, rd, 1, &t->root, "", 0,
+	    DS_TINC, DS_TEXP);
+	rd[0].p = t->dsorg;
+	rd[0].len = sizeof t->dsorg;
+	ds_tresp(&t->resp[1], "org", T_DS, rd, 1, &t->root, "", 1,
+	    DS_TINC, DS_TEXP);
+	rd[0].p = t->org.rdata;
+	rd[0].len = t->org.len;
+	ds_tresp(&t->resp[2], "org", T_DNSKEY, rd, 1, &t->org, "org", 1,
+	    DS_TINC, DS_TEXP);
+	rd[0].p = t->dsex;
+	rd[0].len = sizeof t->dsex;
+	ds_tresp(&t->resp[3], "example.org", T_DS, rd, 1, &t->org, "org", 2,
+	    DS_TINC, DS_TEXP);
+	rd[0].p = t->zsk.rdata;
+	rd[0].len = t->zsk.len;
+	rd[1].p = t->ksk.rdata;
+	rd[1].len = t->ksk.len;
+	ds_tresp(&t->resp[4], "example.org", T_DNSKEY, rd, 2, &t->ksk,
+	    "example.org", 2, DS_TINC, DS_TEXP);
+	dns_put32(a, 0xf41723ff);
+	rd[0].p = a;
+	rd[0].len = 4;
+	ds_tresp(&t->leaf, "LeapSecond.Example.org", T_A, rd, 1, &t->zsk,
+	    "example.org", 3, DS_TINC, DS_TEXP - 1000);
+	ds_t = t;
+	return (t);
+}
+
+static int
+ds_tvalidate(const struct ds_tresp *tr, time_t now, time_t *expire)
+{
+	uint8_t nm[DNS_MAXNAME];
+	uint32_t addr[4];
+	unsigned naddr = 4;
+	int nl, error;
+
+	nl = dns_name("leapsecond.example.org", nm, sizeof nm);
+	error = dnssec_validate(tr->r, tr->len, nm, nl, now, ds_tfetch, ds_t,
+	    addr, &naddr, expire);
+	if (error == 0)
+		assert(naddr == 1 && addr[0] == 0xf41723ff);
+	return (error);
+}
+
+/*
+ * RFC 8080 section 6.1, the Ed25519 example: DNSKEY, DS and the MX
+ * RRset of example.com with its RRSIG.
+ */
+
+static void
+ds_rfc8080(void)
+{
+	static const uint8_t key[] = {
+		0x01, 0x01, 0x03, 0x0f,
+		0x97, 0x4d, 0x96, 0xa2, 0x2d, 0x22, 0x4b, 0xc0,
+		0x1a, 0xdb, 0x91, 0x50, 0x91, 0x47, 0x7d, 0x44,
+		0xcc, 0xd9, 0x1c, 0x9a, 0x41, 0xa1, 0x14, 0x30,
+		0x01, 0x01, 0x17, 0xd5, 0x2c, 0x59, 0x24, 0x0e,
+	};
+	static const uint8_t ds[] = {
+		0x0e, 0x1d, 0x0f, 0x02,
+		0x3a, 0xa5, 0xab, 0x37, 0xef, 0xce, 0x57, 0xf7,
+		0x37, 0xfc, 0x16, 0x27, 0x01, 0x3f, 0xee, 0x07,
+		0xbd, 0xf2, 0x41, 0xbd, 0x10, 0xf3, 0xb1, 0x96,
+		0x4a, 0xb5, 0x5c, 0x78, 0xe7, 0x9a, 0x30, 0x4b,
+	};
+	static const uint8_t mx[] = "\x00\x0a\x04mail\x07" "example\x03" "com";
+	static const uint8_t sig[] = {
+		0x00, 0x0f, 0x0f, 0x02, 0x00, 0x00, 0x0e, 0x10,
+		0x55, 0xd4, 0xfc, 0x60, 0x55, 0xb9, 0x4c, 0xe0,
+		0x0e, 0x1d,
+		0x07, 'e', 'x', 'a', 'm', 'p', 'l', 'e',
+		0x03, 'c', 'o', 'm', 0x00,
+		0xa0, 0xbf, 0x64, 0xac, 0x9b, 0xa7, 0xef, 0x17,
+		0xc1, 0x38, 0x85, 0x9c, 0x18, 0x78, 0xbb, 0x99,
+		0xa8, 0x39, 0xfe, 0x17, 0x59, 0xac, 0xa5, 0xb0,
+		0xd7, 0x98, 0xcf, 0x1a, 0xb1, 0xe9, 0x8d, 0x07,
+		0x91, 0x02, 0xf4, 0xdd, 0xb3, 0x36, 0x8f, 0x0f,
+		0xe4, 0x0b, 0xb3, 0x77, 0xf1, 0xf0, 0x0e, 0x0c,
+		0xdd, 0xed, 0xb7, 0x99, 0x16, 0x7d, 0x56, 0xb6,
+		0xe9, 0x32, 0x78, 0x30, 0x72, 0xba, 0x8d, 0x02,
+	};
+	static struct ds_zone z;
+	struct ds_set s;
+	struct ds_rr dr;
+	time_t e;
+	int l;
+
+	memset(&z, 0, sizeof z);
+	z.namelen = dns_name("example.com", z.name, sizeof z.name);
+	z.nkey = 1;
+	z.key[0].len = sizeof key;
+	memcpy(z.key[0].rdata, key, sizeof key);
+	z.key[0].tag = ds_keytag(key, sizeof key);
+	dr.p = ds;
+	dr.len = sizeof ds;
+	assert(z.key[0].tag == 3613);
+	assert(ds_match(z.name, z.namelen, &z.key[0], &dr));
+
+	memset(&s, 0, sizeof s);
+	s.owner = z.name;
+	s.ownerlen = z.namelen;
+	s.type = 15;
+	s.n = 1;
+	s.rr[0].p = mx;
+	s.rr[0].len = sizeof mx;	/* With the root label */
+	s.nsig = 1;
+	s.sig[0].p = sig;
+	s.sig[0].len = sizeof sig;
+	l = ds_verify(&s, &z, 1, 1439000000, &e);
+	printf("  RFC 8080 Ed25519:  Key tag: %u  Result: %d\n",
+	    z.key[0].tag, l);
+	assert(l == 0 && e == 1440021600);
+	s.rr[0].p = (const uint8_t *)"\x00\x0b\x04mail\x07" "example\x03"
+	    "com";
+	assert(ds_verify(&s, &z, 1, 1439000000, &e) == -1);
+	ds_zone_free(&z);
+}
+
+void
+test_leap_dnssec(void)
+{
+	struct ds_test *t;
+	struct ds_tresp bad;
+	struct ds_tkey other;
+	struct ds_rr rd;
+	uint8_t a[4];
+	time_t e;
+	int l;
+
+	printf("\nChecking DNSSEC validation:\n\n");
+	ds_rfc8080();
+
+	t = ds_tsetup();
+	ds_anchor = t->anchors;
+	ds_flush();
+	t->nfetch = 0;
+	l = ds_tvalidate(&t->leaf, DS_TNOW, &e);
+	printf("  Chain:  Result: %d  Fetched: %u  Expires: +%jd s\n",
+	    l, t->nfetch, (intmax_t)(e - DS_TNOW));
+	assert(l == 0 && t->nfetch == 5);
+	assert(e == DS_TNOW + 3600);		/* The A TTL */
+	l = ds_tvalidate(&t->leaf, DS_TNOW + 10, &e);
+	printf("  Cached: Result: %d  Fetched: %u\n", l, t->nfetch);
+	assert(l == 0 && t->nfetch == 5);
+
+	/* Tampered address */
+	bad = t->leaf;
+	bad.r[bad.len - (12 + 18 + 13 + 64) - 1] ^= 1;
+	assert(ds_tvalidate(&bad, DS_TNOW, &e) == -1);
+	/* Signature expired, and not yet valid */
+	assert(ds_tvalidate(&t->leaf, DS_TEXP - 999, &e) == -1);
+	assert(ds_tvalidate(&t->leaf, DS_TINC - 1, &e) == -1);
+	/* Signed by a key not in the DNSKEY RRset */
+	ds_tkey(&other, 256, 13);
+	dns_put32(a, 0xf41723ff);
+	rd.p = a;
+	rd.len = 4;
+	ds_tresp(&bad, "leapsecond.example.org", T_A, &rd, 1, &other,
+	    "example.org", 3, DS_TINC, DS_TEXP);
+	assert(ds_tvalidate(&bad, DS_TNOW, &e) == -1);
+	/* Wildcard expansion */
+	ds_tresp(&bad, "leapsecond.example.org", T_A, &rd, 1, &t->zsk,
+	    "example.org", 2, DS_TINC, DS_TEXP);
+	assert(ds_tvalidate(&bad, DS_TNOW, &e) == -1);
+	/* DNSKEY RRset signed by the ZSK only, which no DS vouches for */
+	ds_flush();
+	bad = t->resp[4];
+	rd.p = t->zsk.rdata;
+	rd.len = t->zsk.len;
+	ds_tresp(&t->resp[4], "example.org", T_DNSKEY, &rd, 1, &t->zsk,
+	    "example.org", 2, DS_TINC, DS_TEXP);
+	assert(ds_tvalidate(&t->leaf, DS_TNOW, &e) == -1);
+	t->resp[4] = bad;
+	/* Another trust anchor */
+	ds_flush();
+	t->anchor[strlen(t->anchor) - 1] ^= 1;
+	assert(ds_tvalidate(&t->leaf, DS_TNOW, &e) == -1);
+	t->anchor[strlen(t->anchor) - 1] ^= 1;
+	assert(ds_tvalidate(&t->leaf, DS_TNOW, &e) == 0);
+	printf("  Rejected: tampered, expired, early, foreign key, "
+	    "wildcard, ZSK-only, anchor\n");
+
+	EVP_PKEY_free(other.pkey);
+	ds_flush();
+	ds_anchor = ds_root;
+}
+
+/*
+ * Validating a fresh answer with the chain cached:  One ECDSA P-256
+ * verification plus the parsing.
+ */
+
+void
+bench_rrsig(unsigned long n)
+{
+	struct ds_test *t;
+	unsigned long u;
+	time_t e;
+	int sum = 0;
+
+	t = ds_tsetup();
+	ds_anchor = t->anchors;
+	for (u = 0; u < n; u++)
+		sum += ds_tvalidate(&t->leaf, DS_TNOW, &e);
+	ds_flush();
+	ds_anchor = ds_root;
+	bench_sink += sum;
+}
+
+#else /* !WITH_OPENSSL */
+
+int
+dnssec_validate(const uint8_t *r, size_t len, const uint8_t *name,
+    size_t namelen, time_t now, dnssec_fetch_f *f, void *priv,
+    uint32_t *addr, unsigned *naddr, time_t *expire)
+{
+
+	(void)r;
+	(void)len;
+	(void)name;
+	(void)namelen;
+	(void)now;
+	(void)f;
+	(void)priv;
+	(void)addr;
+	(void)naddr;
+	(void)expire;
+	errno = EOPNOTSUPP;
+	return (-1);
+}
+
+void
+test_leap_dnssec(void)
+{
+}
+
+void
+bench_rrsig(unsigned long n)
+{
+
+	(void)n;
+}
+
+#endif
@@ -0,0 +1,354 @@
+/*-
+ * Copyright (c) 2015 Poul-Henning Kamp <phk@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * DUT1 and the leap second announcement in one IPv6 address.
+ *
+ * Specification:
+ * --------------
+ *
+ *    3                   2                   1                   0
+ *  1 0 9 8 7 6 5 4 3 2 1 0 9 8 7 6 5 4 3 2 1 0 9 8 7 6 5 4 3 2 1 0
+ * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ * |0 0 0 0 1 1 0 1 0 0 0 1 0 1 1 1|0 0 1|        month        | d |
+ * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ * |     dTAI      |                     DUT1                      |
+ * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ * |                 MJD                   |         days          |
+ * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ * |                            CRC-32C                            |
+ * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *
+ * 0x0d17  Fixed tag.  0d17::/16 is in 0800::/5, which is "Reserved by
+ *         IETF", for the same reason the IPv4 encoding uses class-E.
+ *
+ * 001     Version, this is version 1.
+ *
+ * 'month', 'd' and 'dTAI' are as in the IPv4 encoding, see dns_leap.c,
+ * but dTAI has eight bits.
+ *
+ * 'DUT1'  UT1 - UTC in microseconds, two's complement, 24 bits.
+ *
+ * 'MJD'   Modified Julian Date of the first day DUT1 is valid.
+ *
+ * 'days'  DUT1 is valid until the end of day MJD + days.
+ *
+ * CRC-32C (Castagnoli, as in iSCSI) of the first twelve octets.
+ *
+ *
+ * Example:
+ * --------
+ *
+ * The IPv6 address "d17:2876:24f9:c0a4:e18:a00f:c098:c0e0" says:
+ * a leap second at the end of December 2016, UTC = TAI - 36 sec until
+ * then, and UT1 - UTC = -0.409436 sec from 2016-12-16 (MJD 57738)
+ * through 2016-12-31 (MJD 57753).
+ *
+ * Design notes:
+ * -------------
+ *
+ * Clients get everything in one AAAA query, where they before needed
+ * the A record and another source for DUT1.  The validity interval
+ * lets them refuse a DUT1 which a stale resolver cache handed out.
+ *
+ * DUT1 stays well inside +/- 0.9 s by definition, so 24 bits of
+ * microseconds leave plenty of room.  The MJD field is good until
+ * about year 4700, and 'days' allows intervals up to 11 years.
+ *
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "dns_leap.h"
+
+#define DUT1_TAG	0x0d17
+#define DUT1_VERSION	1
+#define DUT1_MAX	((1 << 23) - 1)
+#define DUT1_MAXMJD	((1 << 20) - 1)
+#define DUT1_MAXDAYS	((1 << 12) - 1)
+
+/*
+ * Bitwise, LSB first, polynomial 0x1edc6f41 reflected.  Twelve octets
+ * per answer do not deserve a table.
+ */
+
+uint32_t
+crc32c(const uint8_t *p, size_t len)
+{
+	uint32_t crc = 0xffffffff;
+	int i;
+
+	while (len-- > 0) {
+		crc ^= *p++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+	}
+	return (~crc);
+}
+
+/*
+ * Encode 'ld' into the 16 octets of an AAAA record.
+ *
+ * Returns -1 if a field is out of range.
+ */
+
+int
+encode_dut1(const struct leap_dut1 *ld, uint8_t *aaaa)
+{
+	int mn, days;
+	uint32_t d;
+
+	mn = leap_month_index(ld->year, ld->month);
+	if (mn < 0 || mn > 0x7ff || ld->month < 1 || ld->month > 12)
+		return (-1);
+	if (ld->dtai < 0 || ld->dtai > 0xff ||
+	    ld->delta < -1 || ld->delta > 1)
+		return (-1);
+	if (ld->dut1 < -DUT1_MAX - 1 || ld->dut1 > DUT1_MAX)
+		return (-1);
+	days = ld->mjd_until - ld->mjd_from;
+	if (ld->mjd_from < 0 || ld->mjd_from > DUT1_MAXMJD ||
+	    days < 0 || days > DUT1_MAXDAYS)
+		return (-1);
+
+	d = ld->delta > 0 ? 2 : ld->delta < 0 ? 1 : 0;
+	dns_put32(aaaa, ((uint32_t)DUT1_TAG << 16) |
+	    (DUT1_VERSION << 13) | ((uint32_t)mn << 2) | d);
+	dns_put32(aaaa + 4, ((uint32_t)ld->dtai << 24) |
+	    ((uint32_t)ld->dut1 & 0xffffff));
+	dns_put32(aaaa + 8, ((uint32_t)ld->mjd_from << 12) | days);
+	dns_put32(aaaa + 12, crc32c(aaaa, 12));
+	return (0);
+}
+
+/*
+ * Decode a numeric IPv6 string.  The errors are those of
+ * decode_leapsecond(): -1 not ours, -2 CRC failed, -3 invalid field.
+ */
+
+int
+decode_dut1(const char *ip, struct leap_dut1 *ld)
+{
+	uint8_t a[16];
+	uint32_t u, mn, d;
+
+	memset(ld, 0, sizeof *ld);
+
+	/* Convert, check & remove the tag ----------------------------*/
+
+	if (inet_pton(AF_INET6, ip, a) != 1)
+		return (-1);
+	u = dns_get32(a);
+	if ((u >> 16) != DUT1_TAG)
+		return (-1);
+
+	/* Check CRC-32C ----------------------------------------------*/
+
+	if (crc32c(a, 12) != dns_get32(a + 12))
+		return (-2);
+
+	/* Split into fields & check ----------------------------------*/
+
+	d = u & 3;
+	mn = (u >> 2) & 0x7ff;
+	if (((u >> 13) & 7) != DUT1_VERSION || d == 3)
+		return (-3);
+
+	leap_month_from_index(mn, &ld->year, &ld->month);
+	ld->delta = d == 2 ? +1 : d == 1 ? -1 : 0;
+	u = dns_get32(a + 4);
+	ld->dtai = u >> 24;
+	ld->dut1 = (int32_t)(u << 8) >> 8;
+	u = dns_get32(a + 8);
+	ld->mjd_from = u >> 12;
+	ld->mjd_until = ld->mjd_from + (u & 0xfff);
+	return (0);
+}
+
+/*
+ * Query the AAAA record of 'fqdn', like query_leapsecond() does A.
+ */
+
+int
+query_dut1(const char *fqdn, struct leap_dut1 *ld, char **ip)
+{
+	struct addrinfo hints, *res, *res0;
+	char hbuf[NI_MAXHOST];
+	int error;
+
+	memset(ld, 0, sizeof *ld);
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_INET6;
+	hints.ai_socktype = SOCK_STREAM;
+	error = getaddrinfo(fqdn, NULL, &hints, &res0);
+	if (error != 0) {
+		fprintf(stderr, "Lookup error: %s\n", gai_strerror(error));
+		return (-10);
+	}
+	error = -11;
+	for (res = res0; res; res = res->ai_next) {
+		if (getnameinfo(res->ai_addr, res->ai_addrlen,
+		    hbuf, sizeof(hbuf), NULL, 0, NI_NUMERICHOST) != 0)
+			continue;
+		error = decode_dut1(hbuf, ld);
+		if (error == 0) {
+			if (ip != NULL)
+				*ip = strdup(hbuf);
+			break;
+		}
+	}
+	freeaddrinfo(res0);
+	return (error);
+}
+
+static void
+print_dut1(const char *ip, int error, const struct leap_dut1 *ld)
+{
+
+	printf("  IP: %-39s  Error: %2d\n", ip, error);
+	if (error == 0)
+		printf("    Year: %4d  Month %2d  dTAI: %3d  Delta: %2d  "
+		    "DUT1: %+9.6f  MJD: %d-%d\n", ld->year, ld->month,
+		    ld->dtai, ld->delta, ld->dut1 * 1e-6, ld->mjd_from,
+		    ld->mjd_until);
+}
+
+static void
+usage_dut1(void)
+{
+
+	fprintf(stderr, "Usage: dns_leap dut1 [fqdn]\n"
+	    "       dns_leap dut1 -e year month dtai delta dut1 "
+	    "mjd-from mjd-until\n");
+	exit(1);
+}
+
+int
+main_dut1(int argc, char **argv)
+{
+	const char *fqdn = "leapsecond.utcd.org";
+	struct leap_dut1 ld;
+	char buf[INET6_ADDRSTRLEN], *ip;
+	uint8_t a[16];
+	int error;
+
+	/* No getopt(3), DUT1 may be negative */
+	argc--;
+	argv++;
+	if (argc > 0 && !strcmp(argv[0], "-e")) {
+		argc--;
+		argv++;
+		if (argc != 7)
+			usage_dut1();
+		ld.year = atoi(argv[0]);
+		ld.month = atoi(argv[1]);
+		ld.dtai = atoi(argv[2]);
+		ld.delta = atoi(argv[3]);
+		ld.dut1 = (int)lround(atof(argv[4]) * 1e6);
+		ld.mjd_from = atoi(argv[5]);
+		ld.mjd_until = atoi(argv[6]);
+		if (encode_dut1(&ld, a)) {
+			fprintf(stderr, "Field out of range\n");
+			return (1);
+		}
+		printf("%s\n", inet_ntop(AF_INET6, a, buf, sizeof buf));
+		return (0);
+	}
+	if (argc > 1 || (argc == 1 && argv[0][0] == '-'))
+		usage_dut1();
+	if (argc == 1)
+		fqdn = argv[0];
+	error = query_dut1(fqdn, &ld, &ip);
+	if (error) {
+		fprintf(stderr, "Query for %s failed with error %d\n",
+		    fqdn, error);
+		return (1);
+	}
+	print_dut1(ip, error, &ld);
+	free(ip);
+	return (0);
+}
+
+static const struct dut1_vector {
+	const char	*ip;
+	int		error;
+	struct leap_dut1 ld;
+} dut1_vectors[] = {
+	{ "d17:2876:24f9:c0a4:e18:a00f:c098:c0e0", 0,
+	    { 2016, 12, 36, +1, -409436, 57738, 57753 } },
+	{ "d17:282e:2307:a120:df1:105b:a648:4d8f", 0,
+	    { 2015,  6, 35, +1,  500000, 57105, 57196 } },
+	{ "d17:2006:900::fff:8a9f:e52b", 0,
+	    { 1971, 12,  9, +1,       0,     0,  4095 } },
+	{ "d17:3ffd:ff80:0:ffff:f000:2505:d28d", 0,
+	    { 2142,  6, 255, -1, -8388608, 1048575, 1048575 } },
+	{ "244.23.35.255",			-1, { 0, 0, 0, 0, 0, 0, 0 } },
+	{ "2001:db8::1",			-1, { 0, 0, 0, 0, 0, 0, 0 } },
+	{ "d17:2876:24f9:c0a4:e18:a00f:c098:c0e1", -2,
+	    { 0, 0, 0, 0, 0, 0, 0 } },
+	{ "d17:876:24f9:c0a4:e18:a00f:de1f:1a29", -3,
+	    { 0, 0, 0, 0, 0, 0, 0 } },
+	{ NULL,					0, { 0, 0, 0, 0, 0, 0, 0 } }
+};
+
+void
+test_leap_dut1(void)
+{
+	const struct dut1_vector *dv;
+	struct leap_dut1 ld;
+	char buf[INET6_ADDRSTRLEN];
+	uint8_t a[16];
+	int error;
+
+	printf("\nChecking DUT1 AAAA test-vectors:\n\n");
+	assert(crc32c((const uint8_t *)"123456789", 9) == 0xe3069283);
+	for (dv = dut1_vectors; dv->ip != NULL; dv++) {
+		error = decode_dut1(dv->ip, &ld);
+		print_dut1(dv->ip, error, &ld);
+		assert(error == dv->error);
+		assert(!memcmp(&ld, &dv->ld, sizeof ld));
+		if (error != 0)
+			continue;
+		assert(encode_dut1(&ld, a) == 0);
+		assert(inet_ntop(AF_INET6, a, buf, sizeof buf) != NULL);
+		assert(!strcmp(buf, dv->ip));
+	}
+	ld = dut1_vectors[0].ld;
+	ld.dut1 = DUT1_MAX + 1;
+	assert(encode_dut1(&ld, a) == -1);
+	ld = dut1_vectors[0].ld;
+	ld.mjd_until = ld.mjd_from - 1;
+	assert(encode_dut1(&ld, a) == -1);
+}
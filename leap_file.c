@@ -0,0 +1,383 @@
+/*-
+ * Copyright (c) 2015 Poul-Henning Kamp <phk@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Write the announcement as an NTP "leap-seconds.list" file.
+ *
+ * Both ntpd ("leapfile") and chrony ("leapseclist") read this format:
+ *
+ *	#$	<NTP time of last update>
+ *	#@	<NTP time of expiry>
+ *	<NTP time>	<dTAI from then on>	# <date>
+ *
+ * The DNS announcement only tells us the present dTAI and what happens
+ * at the end of the horizon month, so the history comes from the
+ * history RRset, see leap_table.c, fetched once at startup, or else the
+ * compiled-in leap_table[].  The file expires at the end of the
+ * horizon month, which is as far as the announcement vouches for.  The
+ * last update is when the announcement was fetched.
+ *
+ * The "#h" SHA-1 line is omitted, ntpd accepts the file with a warning.
+ *
+ * The file is only rewritten if anything but the update time would
+ * change, so "#$" says when the contents were last fetched new.  It is
+ * replaced atomically, by writing a temporary file, renaming it into
+ * place and syncing the directory, so that after a crash there is
+ * either the old or the new file.
+ *
+ */
+
+#include <assert.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <netdb.h>
+
+#include "dns_leap.h"
+
+#define LF_MAXHIST	256		/* History RRset entries */
+
+static const char * const month_name[12] = {
+	"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+	"Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+static int
+lf_printf(char *buf, size_t len, size_t *pos, const char *fmt, ...)
+{
+	va_list ap;
+	int i;
+
+	va_start(ap, fmt);
+	i = vsnprintf(buf + *pos, len - *pos, fmt, ap);
+	va_end(ap);
+	if (i < 0 || (size_t)i >= len - *pos)
+		return (-1);
+	*pos += i;
+	return (0);
+}
+
+/*
+ * Line for dTAI changing at the end of 'year'-'month'
+ */
+
+static int
+lf_line(char *buf, size_t len, size_t *pos, int year, int month, int dtai)
+{
+	uintmax_t t;
+
+	t = (uintmax_t)leap_month_end(year, month) + NTP_UNIX_EPOCH;
+	if (month == 12) {
+		year++;
+		month = 1;
+	} else {
+		month++;
+	}
+	return (lf_printf(buf, len, pos, "%ju\t%d\t# 1 %s %d\n",
+	    t, dtai, month_name[month - 1], year));
+}
+
+/*
+ * Returns length of file, or -1 if the buffer is too small, or if the
+ * announcement is inconsistent with, or newer than, the 'nlt' entries
+ * of 'lt'.  'now' is when the announcement was fetched.
+ */
+
+int
+leapfile_render(char *buf, size_t len, const struct leap_entry *lt, int nlt,
+    int year, int month, int dtai, int delta, time_t now)
+{
+	const struct leap_entry *le, *last = NULL;
+	uintmax_t expire, update;
+	size_t pos = 0;
+	int i;
+
+	if (nlt < 1 || dtai > lt[nlt - 1].dtai)
+		return (-1);
+	expire = (uintmax_t)leap_month_end(year, month) + NTP_UNIX_EPOCH;
+	for (i = 0; i < nlt; i++) {
+		le = &lt[i];
+		if (le->dtai > dtai)
+			break;
+		if ((uintmax_t)leap_month_end(le->year, le->month) +
+		    NTP_UNIX_EPOCH >= expire)
+			return (-1);
+		last = le;
+	}
+	if (delta == 0 && last == NULL)
+		return (-1);
+	update = (uintmax_t)now + NTP_UNIX_EPOCH;
+
+	if (lf_printf(buf, len, &pos,
+	    "# Generated by dns_leap from the DNS leap-second announcement\n"
+	    "#$\t%ju\n#@\t%ju\n", update, expire))
+		return (-1);
+	for (i = 0; i < nlt && lt[i].dtai <= dtai; i++) {
+		le = &lt[i];
+		if (lf_line(buf, len, &pos, le->year, le->month, le->dtai))
+			return (-1);
+	}
+	if (delta != 0 &&
+	    lf_line(buf, len, &pos, year, month, dtai + delta))
+		return (-1);
+	return ((int)pos);
+}
+
+/*
+ * Are the two renderings the same but for the "#$" line?
+ */
+
+static int
+lf_same(const char *a, const char *b)
+{
+	const char *ua, *ub;
+
+	ua = strstr(a, "\n#$\t");
+	ub = strstr(b, "\n#$\t");
+	if (ua == NULL || ub == NULL || ua - a != ub - b ||
+	    memcmp(a, b, ua - a))
+		return (0);
+	ua = strchr(ua + 1, '\n');
+	ub = strchr(ub + 1, '\n');
+	return (ua != NULL && ub != NULL && !strcmp(ua, ub));
+}
+
+/*
+ * fsync(2) the directory holding 'path', so that a rename(2) into it
+ * survives a crash.  Also used by leap_store.c.
+ */
+
+int
+leapfile_syncdir(const char *path)
+{
+	char dir[PATH_MAX], *p;
+	int fd, error;
+
+	if (snprintf(dir, sizeof dir, "%s", path) >= (int)sizeof dir)
+		return (-1);
+	p = strrchr(dir, '/');
+	if (p == NULL)
+		strcpy(dir, ".");
+	else
+		p[p == dir] = '\0';
+	fd = open(dir, O_RDONLY);
+	if (fd < 0)
+		return (-1);
+	error = fsync(fd);
+	(void)close(fd);
+	return (error);
+}
+
+/*
+ * Returns 1 if the file was (re)written, 0 if it was up to date.
+ */
+
+int
+leapfile_write(const char *path, const struct leap_entry *lt, int nlt,
+    int year, int month, int dtai, int delta, time_t now)
+{
+	char buf[4096], old[sizeof buf + 1], tmp[PATH_MAX];
+	ssize_t n;
+	int fd, l;
+
+	l = leapfile_render(buf, sizeof buf, lt, nlt,
+	    year, month, dtai, delta, now);
+	if (l < 0)
+		return (-1);
+
+	fd = open(path, O_RDONLY);
+	if (fd >= 0) {
+		n = read(fd, old, sizeof old - 1);
+		(void)close(fd);
+		if (n >= 0) {
+			old[n] = '\0';
+			if (lf_same(old, buf))
+				return (0);
+		}
+	}
+
+	if (snprintf(tmp, sizeof tmp, "%s.tmp", path) >= (int)sizeof tmp)
+		return (-1);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return (-1);
+	if (write(fd, buf, l) != l || fsync(fd)) {
+		(void)close(fd);
+		(void)unlink(tmp);
+		return (-1);
+	}
+	if (close(fd) || rename(tmp, path)) {
+		(void)unlink(tmp);
+		return (-1);
+	}
+	if (leapfile_syncdir(path))
+		return (-1);
+	return (1);
+}
+
+int
+main_leapfile(int argc, char **argv)
+{
+	const char *fqdn = "leapsecond.utcd.org";
+	const struct leap_entry *lt = leap_table;
+	struct leap_entry le[LF_MAXHIST];
+	char hname[NI_MAXHOST];
+	int error, year, month, tai, delta, nlt = leap_table_len;
+
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "Usage: dns_leap leapfile path [fqdn]\n");
+		return (1);
+	}
+	if (argc == 3)
+		fqdn = argv[2];
+
+	error = query_leapsecond(fqdn, &year, &month, &tai, &delta, NULL);
+	if (error) {
+		fprintf(stderr, "Query for %s failed with error %d\n",
+		    fqdn, error);
+		return (1);
+	}
+	(void)snprintf(hname, sizeof hname, "history.%s", fqdn);
+	error = query_leap_history(hname, le, LF_MAXHIST);
+	if (error > 0) {
+		lt = le;
+		nlt = error;
+	} else {
+		fprintf(stderr, "Query for %s failed with error %d, "
+		    "using the compiled-in history\n", hname, error);
+	}
+	error = leapfile_write(argv[1], lt, nlt, year, month, tai, delta,
+	    time(NULL));
+	if (error < 0) {
+		perror(argv[1]);
+		return (1);
+	}
+	printf("%s %s\n", argv[1], error ? "updated" : "unchanged");
+	return (0);
+}
+
+static const struct leapfile_vector {
+	int		year;
+	int		month;
+	int		dtai;
+	int		delta;
+	int		lines;
+	const char	*last;
+} leapfile_vectors[] = {
+	{ 1971, 12,  9, +1,  1, "2272060800\t10\t# 1 Jan 1972\n" },
+	{ 2015,  6, 35, +1, 27, "3644697600\t36\t# 1 Jul 2015\n" },
+	{ 2026, 12, 37,  0, 28, "3692217600\t37\t# 1 Jan 2017\n" },
+	{ 2016, 12, 37,  0, -1, NULL },
+	{ 2026, 12, 38, +1, -1, NULL },
+	{ 0,     0,  0,  0,  0, NULL }
+};
+
+/*
+ * "#$" is the fetch time, and a later fetch of the same announcement
+ * leaves the file alone.
+ */
+
+static void
+test_leapfile_write(void)
+{
+	char dir[] = "/tmp/dns_leap.XXXXXX", path[64], buf[4096], *p;
+	ssize_t n;
+	int fd;
+
+	assert(mkdtemp(dir) != NULL);
+	(void)snprintf(path, sizeof path, "%s/leap-seconds.list", dir);
+	assert(leapfile_write(path, leap_table, leap_table_len,
+	    2026, 12, 37, 0, 1760000000) == 1);
+	assert(leapfile_write(path, leap_table, leap_table_len,
+	    2026, 12, 37, 0, 1760086400) == 0);
+	fd = open(path, O_RDONLY);
+	assert(fd >= 0);
+	n = read(fd, buf, sizeof buf - 1);
+	(void)close(fd);
+	assert(n > 0);
+	buf[n] = '\0';
+	p = strstr(buf, "#$\t");
+	assert(p != NULL);
+	printf("  Written: %.*s  Refetched: unchanged\n",
+	    (int)strcspn(p, "\n"), p);
+	assert(strtoumax(p + 3, NULL, 10) == 1760000000 + NTP_UNIX_EPOCH);
+	assert(leapfile_write(path, leap_table, leap_table_len,
+	    2027, 6, 37, 0, 1760172800) == 1);
+	assert(unlink(path) == 0);
+	assert(rmdir(dir) == 0);
+}
+
+void
+test_leapfile(void)
+{
+	const struct leapfile_vector *lv;
+	struct leap_entry le[64];
+	char buf[4096], *p, *last;
+	int l, lines;
+
+	printf("\nChecking leap-seconds.list rendering:\n\n");
+	for (lv = leapfile_vectors; lv->year != 0; lv++) {
+		l = leapfile_render(buf, sizeof buf, leap_table,
+		    leap_table_len, lv->year, lv->month, lv->dtai, lv->delta,
+		    1760000000);
+		lines = -1;
+		last = NULL;
+		if (l >= 0) {
+			lines = 0;
+			for (p = buf; *p != '\0'; p = strchr(p, '\n') + 1) {
+				if (*p == '#')
+					continue;
+				lines++;
+				last = p;
+			}
+		}
+		printf("  Leap: %04d-%02d dTAI: %2d %+d  Lines: %2d  Last: %s",
+		    lv->year, lv->month, lv->dtai, lv->delta, lines,
+		    last != NULL ? last : "-\n");
+		assert(lines == lv->lines);
+		assert(lv->last == NULL || !strcmp(last, lv->last));
+	}
+
+	/* A history from DNS which is newer than leap_table[] */
+	memcpy(le, leap_table, leap_table_len * sizeof le[0]);
+	le[leap_table_len].year = 2026;
+	le[leap_table_len].month = 12;
+	le[leap_table_len].dtai = 38;
+	l = leapfile_render(buf, sizeof buf, le, leap_table_len + 1,
+	    2027, 6, 38, 0, 1760000000);
+	assert(l > 0);
+	last = strstr(buf, "4007750400\t38\t# 1 Jan 2027\n");
+	printf("  With 2026-12 from DNS: %s", last != NULL ? last : "-\n");
+	assert(last != NULL && last[strlen(last) - 1] == '\n');
+	assert(leapfile_render(buf, sizeof buf, le, leap_table_len,
+	    2027, 6, 38, 0, 1760000000) == -1);
+	test_leapfile_write();
+}
@@ -0,0 +1,498 @@
+/*-
+ * Copyright (c) 2015 Poul-Henning Kamp <phk@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Metrics in the Prometheus/OpenMetrics text format.
+ *
+ * The counters are sharded per thread:  Each thread bumps its own copy,
+ * allocated on first use, with plain relaxed loads and stores, so no
+ * locked instructions and no cache lines shared between threads.  The
+ * exporter sums the shards.  When a thread exits, its counts are added
+ * to a shard of retired totals, and its shard goes on a free list for
+ * the next new thread, so threads which come and go, like the refresh
+ * in leap_store.c, do not grow the list.  Both that and the exporter
+ * hold metric_mtx, so the sums never go backwards.
+ *
+ * Query latency goes into an HDR-style histogram:  Each power of two
+ * microseconds, 1us ... 8.4s, is cut into four linear sub-buckets, so
+ * a bucket is at most 25% wide, good enough to tell a 1.1ms resolver
+ * from a 1.4ms one, and bucketing costs a count-leading-zeros and two
+ * shifts.
+ *
+ * There is no HTTP listener: leap_metrics_write() atomically replaces
+ * a file, intended for the node_exporter "textfile" collector.
+ *
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dns_leap.h"
+
+#define SUB_BITS	2		/* Linear sub-buckets: 1 << SUB_BITS */
+#define NSUB		(1U << SUB_BITS)
+#define MAX_BITS	23		/* Largest finite bucket: 2^23 usec */
+#define NBUCKET		(NSUB + (MAX_BITS - SUB_BITS) * NSUB)
+
+static const struct metric_result {
+	int		error;
+	const char	*name;
+} metric_results[] = {
+	{   0, "ok" },
+	{  -1, "not_class_e" },
+	{  -2, "crc" },
+	{  -3, "illegal_d" },
+	{ -10, "lookup" },
+	{ -11, "no_address" },
+	{   0, "other" },		/* Must be last */
+};
+
+#define NRESULT	(sizeof metric_results / sizeof metric_results[0])
+
+struct metric_shard {
+	_Atomic uint64_t	query_count[NRESULT];
+	_Atomic uint64_t	decode_count[NRESULT];
+	_Atomic uint64_t	query_hist[NBUCKET + 1];
+	_Atomic uint64_t	query_usec;
+	struct metric_shard	*next;		/* All shards */
+	struct metric_shard	*next_free;
+};
+
+#define NCOUNTER	(offsetof(struct metric_shard, next) / sizeof(uint64_t))
+
+static pthread_mutex_t metric_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t metric_once = PTHREAD_ONCE_INIT;
+static pthread_key_t metric_key;
+static int metric_keyed;
+static struct metric_shard *metric_shards;
+static struct metric_shard *metric_free;
+static struct metric_shard metric_spill;	/* If calloc(3) fails */
+static struct metric_shard metric_retired;	/* Of exited threads */
+static __thread struct metric_shard *metric_mine;
+
+static _Atomic int64_t last_success;
+static _Atomic int64_t horizon;
+static _Atomic int dtai_now;
+static _Atomic int dtai_delta;
+
+uint64_t
+metric_usec(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static unsigned
+metric_index(int error)
+{
+	unsigned u;
+
+	for (u = 0; u < NRESULT - 1; u++)
+		if (metric_results[u].error == error)
+			break;
+	return (u);
+}
+
+/*
+ * The smallest bucket whose upper bound is >= usec, NBUCKET for +Inf.
+ * With w = usec - 1, buckets 0 ... NSUB - 1 are w itself, above that
+ * the top bit of w picks the power of two and the next SUB_BITS bits
+ * the sub-bucket in it.
+ */
+
+static unsigned
+metric_bucket(uint64_t usec)
+{
+	uint64_t w;
+	unsigned e;
+
+	if (usec <= 1)
+		return (0);
+	w = usec - 1;
+	if (w < NSUB)
+		return ((unsigned)w);
+	e = 63 - __builtin_clzll(w);
+	if (e >= MAX_BITS)
+		return (NBUCKET);
+	return (NSUB + (e - SUB_BITS) * NSUB +
+	    (unsigned)((w >> (e - SUB_BITS)) & (NSUB - 1)));
+}
+
+/* Upper bound of bucket 'b' in usec */
+static uint64_t
+metric_le(unsigned b)
+{
+	unsigned e;
+
+	if (b < NSUB)
+		return (b + 1);
+	e = SUB_BITS + (b - NSUB) / NSUB;
+	return ((uint64_t)(NSUB + 1 + (b - NSUB) % NSUB) << (e - SUB_BITS));
+}
+
+/*
+ * Thread exit:  Move the counts to the retired totals and put the
+ * shard on the free list.  The thread is gone, so nothing else writes
+ * the shard until metric_shard() hands it out again.
+ */
+
+static void
+metric_retire(void *priv)
+{
+	struct metric_shard *ms = priv;
+	_Atomic uint64_t *c, *r;
+	unsigned u;
+
+	c = (_Atomic uint64_t *)(void *)ms;
+	r = (_Atomic uint64_t *)(void *)&metric_retired;
+	(void)pthread_mutex_lock(&metric_mtx);
+	for (u = 0; u < NCOUNTER; u++) {
+		r[u] += atomic_load_explicit(&c[u], memory_order_relaxed);
+		atomic_store_explicit(&c[u], 0, memory_order_relaxed);
+	}
+	ms->next_free = metric_free;
+	metric_free = ms;
+	(void)pthread_mutex_unlock(&metric_mtx);
+	metric_mine = NULL;
+}
+
+static void
+metric_key_init(void)
+{
+
+	metric_keyed = pthread_key_create(&metric_key, metric_retire) == 0;
+}
+
+static struct metric_shard *
+metric_shard(void)
+{
+	struct metric_shard *ms;
+
+	if (metric_mine != NULL)
+		return (metric_mine);
+	(void)pthread_once(&metric_once, metric_key_init);
+	(void)pthread_mutex_lock(&metric_mtx);
+	ms = metric_free;
+	if (ms != NULL) {
+		metric_free = ms->next_free;
+	} else {
+		ms = calloc(1, sizeof *ms);
+		if (ms != NULL) {
+			ms->next = metric_shards;
+			metric_shards = ms;
+		}
+	}
+	(void)pthread_mutex_unlock(&metric_mtx);
+	if (ms == NULL)
+		return (metric_mine = &metric_spill);
+	if (metric_keyed)
+		(void)pthread_setspecific(metric_key, ms);
+	return (metric_mine = ms);
+}
+
+/* Only the owning thread writes a shard, the spill shard is shared */
+static inline void
+metric_add(const struct metric_shard *ms, _Atomic uint64_t *c, uint64_t n)
+{
+
+	if (ms == &metric_spill)
+		atomic_fetch_add_explicit(c, n, memory_order_relaxed);
+	else
+		atomic_store_explicit(c, n +
+		    atomic_load_explicit(c, memory_order_relaxed),
+		    memory_order_relaxed);
+}
+
+void
+metric_query(int error, uint64_t usec)
+{
+	struct metric_shard *ms = metric_shard();
+
+	metric_add(ms, &ms->query_count[metric_index(error)], 1);
+	metric_add(ms, &ms->query_hist[metric_bucket(usec)], 1);
+	metric_add(ms, &ms->query_usec, usec);
+	if (error == 0)
+		atomic_store_explicit(&last_success, time(NULL),
+		    memory_order_relaxed);
+}
+
+void
+metric_decode(int error)
+{
+
+	struct metric_shard *ms = metric_shard();
+
+	metric_add(ms, &ms->decode_count[metric_index(error)], 1);
+}
+
+void
+metric_announcement(int year, int month, int dtai, int delta)
+{
+
+	atomic_store_explicit(&horizon, leap_month_end(year, month),
+	    memory_order_relaxed);
+	atomic_store_explicit(&dtai_now, dtai, memory_order_relaxed);
+	atomic_store_explicit(&dtai_delta, delta, memory_order_relaxed);
+}
+
+static void
+metric_sum1(const struct metric_shard *ms, size_t off, unsigned n,
+    uint64_t *sum)
+{
+	const _Atomic uint64_t *c;
+	unsigned u;
+
+	c = (const _Atomic uint64_t *)(const void *)((const char *)ms + off);
+	for (u = 0; u < n; u++)
+		sum[u] += atomic_load_explicit(&c[u], memory_order_relaxed);
+}
+
+/*
+ * Add up the 'n' counters at offset 'off' in all the shards
+ */
+
+static void
+metric_sum(size_t off, unsigned n, uint64_t *sum)
+{
+	const struct metric_shard *ms;
+
+	memset(sum, 0, n * sizeof *sum);
+	(void)pthread_mutex_lock(&metric_mtx);
+	for (ms = metric_shards; ms != NULL; ms = ms->next)
+		metric_sum1(ms, off, n, sum);
+	metric_sum1(&metric_spill, off, n, sum);
+	metric_sum1(&metric_retired, off, n, sum);
+	(void)pthread_mutex_unlock(&metric_mtx);
+}
+
+static void
+print_results(FILE *fo, const char *name, const char *help, size_t off)
+{
+	uint64_t cnt[NRESULT];
+	unsigned u;
+
+	metric_sum(off, NRESULT, cnt);
+	fprintf(fo, "# HELP %s %s\n", name, help);
+	fprintf(fo, "# TYPE %s counter\n", name);
+	for (u = 0; u < NRESULT; u++)
+		fprintf(fo, "%s_total{result=\"%s\"} %ju\n",
+		    name, metric_results[u].name, (uintmax_t)cnt[u]);
+}
+
+void
+leap_metrics_print(FILE *fo)
+{
+	const char *n = "dns_leap_query_duration_seconds";
+	uint64_t hist[NBUCKET + 1], usec, sum = 0;
+	unsigned u;
+
+	print_results(fo, "dns_leap_queries",
+	    "Outcome of query_leapsecond()",
+	    offsetof(struct metric_shard, query_count));
+	print_results(fo, "dns_leap_decodes",
+	    "Outcome of decode_leapsecond() on resolver answers",
+	    offsetof(struct metric_shard, decode_count));
+
+	metric_sum(offsetof(struct metric_shard, query_hist), NBUCKET + 1,
+	    hist);
+	metric_sum(offsetof(struct metric_shard, query_usec), 1, &usec);
+	fprintf(fo, "# HELP %s Time spent in query_leapsecond()\n", n);
+	fprintf(fo, "# TYPE %s histogram\n", n);
+	for (u = 0; u <= NBUCKET; u++) {
+		sum += hist[u];
+		if (u < NBUCKET)
+			fprintf(fo, "%s_bucket{le=\"%.6f\"} %ju\n",
+			    n, metric_le(u) * 1e-6, (uintmax_t)sum);
+		else
+			fprintf(fo, "%s_bucket{le=\"+Inf\"} %ju\n",
+			    n, (uintmax_t)sum);
+	}
+	fprintf(fo, "%s_sum %.6f\n", n, 1e-6 * usec);
+	fprintf(fo, "%s_count %ju\n", n, (uintmax_t)sum);
+
+	fprintf(fo, "# HELP dns_leap_last_success_timestamp_seconds"
+	    " Time of last valid announcement\n");
+	fprintf(fo, "# TYPE dns_leap_last_success_timestamp_seconds gauge\n");
+	fprintf(fo, "dns_leap_last_success_timestamp_seconds %jd\n",
+	    (intmax_t)atomic_load_explicit(&last_success,
+	    memory_order_relaxed));
+	fprintf(fo, "# HELP dns_leap_horizon_timestamp_seconds"
+	    " End of the announced month\n");
+	fprintf(fo, "# TYPE dns_leap_horizon_timestamp_seconds gauge\n");
+	fprintf(fo, "dns_leap_horizon_timestamp_seconds %jd\n",
+	    (intmax_t)atomic_load_explicit(&horizon, memory_order_relaxed));
+	fprintf(fo, "# HELP dns_leap_dtai_seconds TAI - UTC until horizon\n");
+	fprintf(fo, "# TYPE dns_leap_dtai_seconds gauge\n");
+	fprintf(fo, "dns_leap_dtai_seconds %d\n",
+	    atomic_load_explicit(&dtai_now, memory_order_relaxed));
+	fprintf(fo, "# HELP dns_leap_delta_seconds"
+	    " Leap second at end of horizon\n");
+	fprintf(fo, "# TYPE dns_leap_delta_seconds gauge\n");
+	fprintf(fo, "dns_leap_delta_seconds %d\n",
+	    atomic_load_explicit(&dtai_delta, memory_order_relaxed));
+}
+
+int
+leap_metrics_write(const char *path)
+{
+	char tmp[1024];
+	FILE *fo;
+
+	if (snprintf(tmp, sizeof tmp, "%s.tmp", path) >= (int)sizeof tmp)
+		return (-1);
+	fo = fopen(tmp, "w");
+	if (fo == NULL)
+		return (-1);
+	leap_metrics_print(fo);
+	if (fflush(fo) || fsync(fileno(fo))) {
+		(void)fclose(fo);
+		(void)unlink(tmp);
+		return (-1);
+	}
+	if (fclose(fo) || rename(tmp, path)) {
+		(void)unlink(tmp);
+		return (-1);
+	}
+	return (0);
+}
+
+static const struct bucket_vector {
+	uint64_t	usec;
+	unsigned	bucket;
+} bucket_vectors[] = {
+	{          0,  0 },
+	{          1,  0 },
+	{          2,  1 },
+	{          3,  2 },
+	{          4,  3 },
+	{          5,  4 },
+	{          8,  7 },
+	{          9,  8 },
+	{         10,  8 },
+	{       1024, 35 },
+	{       1025, 36 },
+	{       1500, 37 },
+	{    8388608, 87 },
+	{    8388609, NBUCKET },
+	{ UINT64_MAX, NBUCKET },
+};
+
+#define TEST_THREADS	4
+#define TEST_QUERIES	100000
+
+static void *
+test_thread(void *priv)
+{
+	unsigned u;
+
+	(void)priv;
+	for (u = 0; u < TEST_QUERIES; u++)
+		metric_query(u & 1 ? -10 : 0, 1000 + u % 1000);
+	return (NULL);
+}
+
+void
+test_leap_metrics(void)
+{
+	uint64_t before[NBUCKET + 1], after[NBUCKET + 1], n;
+	pthread_t thr[TEST_THREADS];
+	const struct metric_shard *ms;
+	unsigned u, b, nshard;
+
+	printf("\nChecking latency histogram buckets:\n\n");
+	for (u = 0; u < sizeof bucket_vectors / sizeof bucket_vectors[0];
+	    u++) {
+		b = metric_bucket(bucket_vectors[u].usec);
+		printf("  Usec: %20ju  Bucket: %2u  Le: ",
+		    (uintmax_t)bucket_vectors[u].usec, b);
+		if (b < NBUCKET)
+			printf("%ju\n", (uintmax_t)metric_le(b));
+		else
+			printf("+Inf\n");
+		assert(b == bucket_vectors[u].bucket);
+	}
+	/* Each value lands in the first bucket which can hold it */
+	for (n = 1; n <= (1ULL << MAX_BITS); n += 1 + (n >> 12)) {
+		b = metric_bucket(n);
+		assert(b < NBUCKET && n <= metric_le(b));
+		assert(b == 0 || n > metric_le(b - 1));
+		assert(b < NSUB || metric_le(b) - metric_le(b - 1) <=
+		    (metric_le(b) + NSUB) / (NSUB + 1));
+	}
+	assert(metric_index(0) == 0);
+	assert(metric_index(-11) == NRESULT - 2);
+	assert(metric_index(-4) == NRESULT - 1);
+
+	printf("\nChecking per-thread metric shards:\n\n");
+	metric_sum(offsetof(struct metric_shard, query_hist), NBUCKET + 1,
+	    before);
+	for (u = 0; u < TEST_THREADS; u++)
+		assert(pthread_create(&thr[u], NULL, test_thread, NULL) == 0);
+	for (u = 0; u < TEST_THREADS; u++)
+		assert(pthread_join(thr[u], NULL) == 0);
+	metric_sum(offsetof(struct metric_shard, query_hist), NBUCKET + 1,
+	    after);
+	for (n = 0, u = 0; u <= NBUCKET; u++)
+		n += after[u] - before[u];
+	printf("  Threads: %d  Queries: %ju\n", TEST_THREADS, (uintmax_t)n);
+	assert(n == (uint64_t)TEST_THREADS * TEST_QUERIES);
+	/* 1000 ... 1999 usec, four sub-buckets per power of two */
+	assert(after[metric_bucket(1000)] - before[metric_bucket(1000)] ==
+	    (uint64_t)TEST_THREADS * TEST_QUERIES / 1000 * 25);
+
+	/* Threads one after another reuse the retired shards */
+	for (nshard = 0, ms = metric_shards; ms != NULL; ms = ms->next)
+		nshard++;
+	for (u = 0; u < 10 * TEST_THREADS; u++) {
+		assert(pthread_create(&thr[0], NULL, test_thread, NULL) == 0);
+		assert(pthread_join(thr[0], NULL) == 0);
+	}
+	for (b = 0, ms = metric_shards; ms != NULL; ms = ms->next)
+		b++;
+	metric_sum(offsetof(struct metric_shard, query_hist), NBUCKET + 1,
+	    before);
+	for (n = 0, u = 0; u <= NBUCKET; u++)
+		n += before[u] - after[u];
+	printf("  Threads: %d one by one  Queries: %ju  Shards: %u -> %u\n",
+	    10 * TEST_THREADS, (uintmax_t)n, nshard, b);
+	assert(b == nshard);
+	assert(n == (uint64_t)10 * TEST_THREADS * TEST_QUERIES);
+}
+
+void
+bench_metric(unsigned long n)
+{
+	unsigned long u;
+
+	for (u = 0; u < n; u++)
+		metric_query(0, u & 0xfffff);
+	bench_sink += u;
+}
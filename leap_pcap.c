@@ -0,0 +1,833 @@
+/*-
+ * Copyright (c) 2015 Poul-Henning Kamp <phk@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Audit resolvers from packet captures.
+ *
+ * Scans pcap files for the answers resolvers gave to A queries for the
+ * leapsecond name, or names below it, and reports per resolver how
+ * many were good, how many were not class-E at all (rewritten by the
+ * resolver or a middlebox), had a bad CRC or a bad 'd', came back
+ * without any A record (stripped, as filters of martians do), with an
+ * error rcode, or truncated.  The announcement each resolver last gave
+ * as a single A record is shown, flagged if it differs from the one
+ * most resolvers gave.
+ *
+ * The file is mmap(2)ed, and Ethernet (with VLAN tags), Linux cooked,
+ * BSD loopback and raw IP link types are parsed in place, IPv4 and
+ * IPv6, UDP from port 53, without copying the packet.  The answers
+ * are queued, and decoded a batch at a time by decode_leapsecond_n().
+ * Fragments and DNS over TCP are skipped.
+ *
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "dns_leap.h"
+
+#define PCAP_BATCH	1024
+#define PCAP_MAXCONS	64		/* Distinct announcements tallied */
+
+/* Link types, from pcap-linktype(7) */
+#define LT_NULL		0
+#define LT_EN10MB	1
+#define LT_RAW		101
+#define LT_LOOP		108
+#define LT_LINUX_SLL	113
+#define LT_LINUX_SLL2	276
+
+struct pcap_resolver {
+	uint8_t		addr[16];
+	int		family;		/* 0 = free slot */
+	unsigned long	responses;
+	unsigned long	answers;
+	unsigned long	ok;
+	unsigned long	note;		/* Not class-E */
+	unsigned long	crc;
+	unsigned long	bad;
+	unsigned long	strip;
+	unsigned long	rcode;
+	unsigned long	tc;
+	uint32_t	last;		/* Last good single-A answer */
+};
+
+struct pcap_scan {
+	uint8_t		name[DNS_MAXNAME + 1];	/* Wire format, lower */
+	size_t		namelen;
+	unsigned	port;
+
+	struct pcap_resolver *res;
+	unsigned	nres;
+	unsigned	maxres;		/* Power of two */
+
+	uint32_t	addr[PCAP_BATCH];
+	unsigned	who[PCAP_BATCH];
+	uint8_t		single[PCAP_BATCH];
+	struct leap_answer la[PCAP_BATCH];
+	size_t		nbatch;
+
+	uint32_t	cons[PCAP_MAXCONS];
+	unsigned long	ncons[PCAP_MAXCONS];
+	int		ncon;
+
+	unsigned long	packets;
+	unsigned long	responses;
+	unsigned long	answers;
+	uint64_t	bytes;
+};
+
+static void pcap_flush(struct pcap_scan *ps);
+
+static inline uint32_t
+pcap_u32(const uint8_t *p)
+{
+	uint32_t u;
+
+	memcpy(&u, p, sizeof u);
+	return (u);
+}
+
+static int
+pcap_name(struct pcap_scan *ps, const char *fqdn)
+{
+	const char *p, *e;
+	size_t l, n = 0;
+
+	for (p = fqdn; *p != '\0'; p = *e == '.' ? e + 1 : e) {
+		e = strchr(p, '.');
+		if (e == NULL)
+			e = p + strlen(p);
+		l = e - p;
+		if (l == 0 || l > 63 || n + l + 2 > sizeof ps->name)
+			return (-1);
+		ps->name[n++] = (uint8_t)l;
+		while (p < e) {
+			ps->name[n++] = (uint8_t)(*p >= 'A' && *p <= 'Z' ?
+			    *p + 32 : *p);
+			p++;
+		}
+	}
+	ps->name[n++] = 0;
+	ps->namelen = n;
+	return (0);
+}
+
+/*
+ * The resolver slot for an address, open addressing on a table kept
+ * at most half full.  The queued answers refer to slots, so they are
+ * tallied before the table is rehashed.
+ */
+
+static struct pcap_resolver *
+pcap_resolver(struct pcap_scan *ps, int family, const uint8_t *a)
+{
+	struct pcap_resolver *old, *r;
+	size_t alen = family == AF_INET ? 4 : 16;
+	uint32_t h = 2166136261U;
+	unsigned i, n;
+
+	if (2 * (ps->nres + 1) > ps->maxres) {
+		pcap_flush(ps);
+		old = ps->res;
+		n = ps->maxres;
+		ps->maxres = n ? n * 2 : 64;
+		ps->res = calloc(ps->maxres, sizeof *ps->res);
+		if (ps->res == NULL) {
+			perror("calloc");
+			exit(1);
+		}
+		ps->nres = 0;
+		for (i = 0; i < n; i++) {
+			if (old[i].family == 0)
+				continue;
+			r = pcap_resolver(ps, old[i].family, old[i].addr);
+			*r = old[i];
+		}
+		free(old);
+	}
+	for (i = 0; i < alen; i++)
+		h = (h ^ a[i]) * 16777619U;
+	for (i = h & (ps->maxres - 1); ; i = (i + 1) & (ps->maxres - 1)) {
+		r = &ps->res[i];
+		if (r->family == 0) {
+			memset(r, 0, sizeof *r);
+			r->family = family;
+			memcpy(r->addr, a, alen);
+			ps->nres++;
+			return (r);
+		}
+		if (r->family == family && !memcmp(r->addr, a, alen))
+			return (r);
+	}
+}
+
+static void
+pcap_flush(struct pcap_scan *ps)
+{
+	struct pcap_resolver *r;
+	size_t i;
+	int j;
+
+	(void)decode_leapsecond_n(ps->addr, ps->la, ps->nbatch);
+	for (i = 0; i < ps->nbatch; i++) {
+		r = &ps->res[ps->who[i]];
+		switch (ps->la[i].error) {
+		case 0:
+			r->ok++;
+			if (!ps->single[i])
+				break;
+			r->last = ps->addr[i];
+			for (j = 0; j < ps->ncon; j++)
+				if (ps->cons[j] == ps->addr[i])
+					break;
+			if (j == ps->ncon && j < PCAP_MAXCONS)
+				ps->cons[ps->ncon++] = ps->addr[i];
+			if (j < PCAP_MAXCONS)
+				ps->ncons[j]++;
+			break;
+		case -1: r->note++; break;
+		case -2: r->crc++; break;
+		default: r->bad++; break;
+		}
+	}
+	ps->nbatch = 0;
+}
+
+/*
+ * Skip a possibly compressed name, returns the offset after it or 0
+ */
+
+static size_t
+pcap_skip_name(const uint8_t *p, size_t len, size_t off)
+{
+
+	while (off < len) {
+		if (p[off] == 0)
+			return (off + 1);
+		if ((p[off] & 0xc0) == 0xc0)
+			return (off + 2 <= len ? off + 2 : 0);
+		if (p[off] & 0xc0)
+			return (0);
+		off += p[off] + 1;
+	}
+	return (0);
+}
+
+/*
+ * A DNS message from 'src'.  Only answers to one A IN question for our
+ * name or below it count.
+ */
+
+static void
+pcap_dns(struct pcap_scan *ps, int family, const uint8_t *src,
+    const uint8_t *p, size_t len)
+{
+	struct pcap_resolver *r;
+	size_t off, qend, i;
+	unsigned an, type, rdlen, flags, u, c, naddr = 0;
+	const uint8_t *q;
+
+	if (len < DNS_HDRLEN)
+		return;
+	flags = dns_get16(p + 2);
+	if (!(flags & 0x8000) || (flags & 0x7800) || dns_get16(p + 4) != 1)
+		return;
+
+	/* The question, compared from the end for the suffix */
+	qend = pcap_skip_name(p, len, DNS_HDRLEN);
+	if (qend == 0 || qend + 4 > len || qend - DNS_HDRLEN < ps->namelen)
+		return;
+	if (dns_get16(p + qend) != 1 || dns_get16(p + qend + 2) != 1)
+		return;
+	q = p + qend - ps->namelen;
+	for (off = DNS_HDRLEN; off < (size_t)(q - p); off += p[off] + 1)
+		if (p[off] & 0xc0)
+			return;
+	if (off != (size_t)(q - p))
+		return;		/* Not on a label boundary */
+	for (i = 0; i < ps->namelen; i++) {
+		c = q[i];
+		if (c >= 'A' && c <= 'Z')
+			c += 32;
+		if (c != ps->name[i])
+			return;
+	}
+
+	ps->responses++;
+	r = pcap_resolver(ps, family, src);
+	r->responses++;
+	if (flags & 0x0200) {
+		r->tc++;
+		return;
+	}
+	if (flags & 0x000f) {
+		r->rcode++;
+		return;
+	}
+
+	an = dns_get16(p + 6);
+	off = qend + 4;
+	for (u = 0; u < an; u++) {
+		off = pcap_skip_name(p, len, off);
+		if (off == 0 || off + 10 > len)
+			break;
+		type = dns_get16(p + off);
+		rdlen = dns_get16(p + off + 8);
+		if (off + 10 + rdlen > len)
+			break;
+		if (type == 1 && dns_get16(p + off + 2) == 1 && rdlen == 4) {
+			if (ps->nbatch == PCAP_BATCH)
+				pcap_flush(ps);
+			ps->addr[ps->nbatch] = dns_get32(p + off + 10);
+			ps->who[ps->nbatch] = r - ps->res;
+			ps->single[ps->nbatch] = an == 1;
+			ps->nbatch++;
+			naddr++;
+		}
+		off += 10 + rdlen;
+	}
+	r->answers += naddr;
+	ps->answers += naddr;
+	if (naddr == 0)
+		r->strip++;
+}
+
+/*
+ * From the IP header on
+ */
+
+static void
+pcap_ip(struct pcap_scan *ps, const uint8_t *p, size_t len)
+{
+	size_t hl, tl;
+	unsigned nh;
+
+	if (len < 20)
+		return;
+	if ((p[0] >> 4) == 4) {
+		hl = (p[0] & 0xf) * 4;
+		tl = dns_get16(p + 2);
+		if (hl < 20 || tl < hl + 8 || tl > len || p[9] != 17 ||
+		    (dns_get16(p + 6) & 0x3fff))
+			return;		/* Not UDP, or a fragment */
+		if (dns_get16(p + hl) != ps->port)
+			return;
+		pcap_dns(ps, AF_INET, p + 12, p + hl + 8, tl - hl - 8);
+	} else if ((p[0] >> 4) == 6) {
+		if (len < 40 || 40 + (size_t)dns_get16(p + 4) > len)
+			return;
+		len = 40 + dns_get16(p + 4);
+		nh = p[6];
+		hl = 40;
+		/* Hop-by-hop, routing and destination options */
+		while ((nh == 0 || nh == 43 || nh == 60) && hl + 8 <= len) {
+			nh = p[hl];
+			hl += (p[hl + 1] + 1) * 8;
+		}
+		if (nh != 17 || hl + 8 > len || dns_get16(p + hl) != ps->port)
+			return;
+		pcap_dns(ps, AF_INET6, p + 8, p + hl + 8, len - hl - 8);
+	}
+}
+
+static void
+pcap_packet(struct pcap_scan *ps, int linktype, const uint8_t *p,
+    size_t len)
+{
+	unsigned et;
+	size_t hl;
+
+	switch (linktype) {
+	case LT_EN10MB:
+		if (len < 14)
+			return;
+		et = dns_get16(p + 12);
+		p += 14;
+		len -= 14;
+		while ((et == 0x8100 || et == 0x88a8) && len >= 4) {
+			et = dns_get16(p + 2);
+			p += 4;
+			len -= 4;
+		}
+		if (et != 0x0800 && et != 0x86dd)
+			return;
+		break;
+	case LT_LINUX_SLL:
+	case LT_LINUX_SLL2:
+		hl = linktype == LT_LINUX_SLL ? 16 : 20;
+		if (len < hl)
+			return;
+		et = dns_get16(p + (linktype == LT_LINUX_SLL ? 14 : 0));
+		if (et != 0x0800 && et != 0x86dd)
+			return;
+		p += hl;
+		len -= hl;
+		break;
+	case LT_NULL:
+	case LT_LOOP:
+		if (len < 4)
+			return;
+		p += 4;
+		len -= 4;
+		break;
+	case LT_RAW:
+		break;
+	default:
+		return;
+	}
+	pcap_ip(ps, p, len);
+}
+
+/*
+ * A whole capture file in memory, returns -1 if it is not one.
+ */
+
+static int
+pcap_scan_buf(struct pcap_scan *ps, const uint8_t *p, size_t len)
+{
+	uint32_t magic, incl;
+	int swap, linktype;
+	size_t off;
+
+	if (len < 24)
+		return (-1);
+	memcpy(&magic, p, 4);
+	if (magic == 0xa1b2c3d4 || magic == 0xa1b23c4d)
+		swap = 0;
+	else if (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1)
+		swap = 1;
+	else
+		return (-1);
+#define PCAP32(q)	(swap ? __builtin_bswap32(pcap_u32(q)) : pcap_u32(q))
+	linktype = (int)(PCAP32(p + 20) & 0xffff);
+	for (off = 24; off + 16 <= len; off += 16 + incl) {
+		incl = PCAP32(p + off + 8);
+		if (incl > len - off - 16)
+			break;		/* Cut short */
+		ps->packets++;
+		ps->bytes += 16 + incl;
+		pcap_packet(ps, linktype, p + off + 16, incl);
+	}
+#undef PCAP32
+	pcap_flush(ps);
+	return (0);
+}
+
+static int
+pcap_cmp(const void *a, const void *b)
+{
+	const struct pcap_resolver *ra = a, *rb = b;
+
+	if (ra->responses != rb->responses)
+		return (ra->responses < rb->responses ? 1 : -1);
+	return (memcmp(ra->addr, rb->addr, sizeof ra->addr));
+}
+
+static void
+pcap_report(struct pcap_scan *ps, FILE *fo)
+{
+	struct pcap_resolver *r, *rs;
+	struct leap_answer la;
+	char buf[INET6_ADDRSTRLEN], ann[32];
+	uint32_t cons = 0;
+	unsigned long best = 0;
+	unsigned i, n;
+	int j;
+
+	for (j = 0; j < ps->ncon; j++) {
+		if (ps->ncons[j] > best) {
+			best = ps->ncons[j];
+			cons = ps->cons[j];
+		}
+	}
+	if (cons != 0) {
+		(void)decode_leapsecond_n(&cons, &la, 1);
+		fprintf(fo, "Consensus: %04d-%02d dTAI: %d Delta: %+d"
+		    " (%lu answers)\n", la.year, la.month, la.dtai, la.delta,
+		    best);
+	}
+
+	rs = calloc(ps->nres + 1, sizeof *rs);
+	if (rs == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	for (i = n = 0; i < ps->maxres; i++)
+		if (ps->res[i].family != 0)
+			rs[n++] = ps->res[i];
+	qsort(rs, n, sizeof *rs, pcap_cmp);
+
+	fprintf(fo, "%-39s %9s %8s %8s %6s %6s %6s %6s %6s %6s  %s\n",
+	    "Resolver", "Responses", "Answers", "OK", "NotE", "CRC", "Bad",
+	    "Strip", "Rcode", "TC", "Last");
+	for (i = 0; i < n; i++) {
+		r = &rs[i];
+		(void)inet_ntop(r->family, r->addr, buf, sizeof buf);
+		ann[0] = '\0';
+		if (r->last != 0) {
+			(void)decode_leapsecond_n(&r->last, &la, 1);
+			(void)snprintf(ann, sizeof ann, "%04d-%02d %d %+d%s",
+			    la.year, la.month, la.dtai, la.delta,
+			    r->last != cons ? " !" : "");
+		}
+		fprintf(fo,
+		    "%-39s %9lu %8lu %8lu %6lu %6lu %6lu %6lu %6lu %6lu  %s\n",
+		    buf, r->responses, r->answers, r->ok, r->note, r->crc,
+		    r->bad, r->strip, r->rcode, r->tc, ann);
+	}
+	free(rs);
+}
+
+static void
+usage_pcap(void)
+{
+
+	fprintf(stderr,
+	    "Usage: dns_leap pcap [-v] [-n fqdn] [-p port] file ...\n");
+	exit(1);
+}
+
+int
+main_pcap(int argc, char **argv)
+{
+	static struct pcap_scan ps;
+	const char *fqdn = "leapsecond.utcd.org";
+	struct timespec t0, t1;
+	struct stat st;
+	void *p;
+	double dt;
+	int ch, fd, i, verbose = 0;
+
+	ps.port = 53;
+	while ((ch = getopt(argc, argv, "n:p:v")) != -1) {
+		switch (ch) {
+		case 'n':
+			fqdn = optarg;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'p':
+			ps.port = atoi(optarg);
+			break;
+		default:
+			usage_pcap();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc < 1 || pcap_name(&ps, fqdn))
+		usage_pcap();
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < argc; i++) {
+		fd = open(argv[i], O_RDONLY);
+		if (fd < 0 || fstat(fd, &st)) {
+			perror(argv[i]);
+			return (1);
+		}
+		p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		(void)close(fd);
+		if (p == MAP_FAILED) {
+			perror(argv[i]);
+			return (1);
+		}
+		(void)madvise(p, st.st_size, MADV_SEQUENTIAL);
+		if (pcap_scan_buf(&ps, p, st.st_size)) {
+			fprintf(stderr, "%s: not a pcap file"
+			    " (pcapng is not supported)\n", argv[i]);
+			return (1);
+		}
+		(void)munmap(p, st.st_size);
+	}
+	(void)clock_gettime(CLOCK_MONOTONIC, &t1);
+	dt = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+	printf("Packets: %lu  Responses: %lu  Answers: %lu\n",
+	    ps.packets, ps.responses, ps.answers);
+	if (verbose)
+		fprintf(stderr, "%ju bytes in %.3f s, %.2f GB/s\n",
+		    (uintmax_t)ps.bytes, dt, dt > 0 ? ps.bytes / dt * 1e-9 : 0);
+	pcap_report(&ps, stdout);
+	return (0);
+}
+
+/*
+ * Build a capture in memory for the test and the bench
+ */
+
+static size_t
+pcap_test_packet(uint8_t *p, int linktype, int v6, int vlan, unsigned src,
+    const char *qname, int flags, const uint32_t *a, int na)
+{
+	uint8_t *ip, *udp, *dns;
+	size_t l, n = 16, dl;
+	int i;
+
+	memset(p, 0, 16);
+	if (linktype == LT_EN10MB) {
+		memset(p + n, 0, 12);
+		n += 12;
+		if (vlan) {
+			dns_put16(p + n, 0x8100);
+			dns_put16(p + n + 2, 42);
+			n += 4;
+		}
+		dns_put16(p + n, v6 ? 0x86dd : 0x0800);
+		n += 2;
+	} else if (linktype == LT_LINUX_SLL) {
+		memset(p + n, 0, 14);
+		dns_put16(p + n + 14, v6 ? 0x86dd : 0x0800);
+		n += 16;
+	}
+	ip = p + n;
+	udp = ip + (v6 ? 40 : 20);
+	dns = udp + 8;
+
+	memset(dns, 0, DNS_HDRLEN);
+	dns_put16(dns, 0x1234);
+	dns_put16(dns + 2, 0x8180 | flags);
+	dns_put16(dns + 4, 1);
+	dns_put16(dns + 6, na);
+	dl = DNS_HDRLEN + dns_name(qname, dns + DNS_HDRLEN, DNS_MAXNAME);
+	dns_put16(dns + dl, 1);
+	dns_put16(dns + dl + 2, 1);
+	dl += 4;
+	for (i = 0; i < na; i++) {
+		dns_put16(dns + dl, 0xc00c);
+		dns_put16(dns + dl + 2, 1);
+		dns_put16(dns + dl + 4, 1);
+		dns_put32(dns + dl + 6, 3600);
+		dns_put16(dns + dl + 10, 4);
+		dns_put32(dns + dl + 12, a[i]);
+		dl += 16;
+	}
+
+	dns_put16(udp, 53);
+	dns_put16(udp + 2, 40000);
+	dns_put16(udp + 4, 8 + dl);
+	dns_put16(udp + 6, 0);
+	if (v6) {
+		memset(ip, 0, 40);
+		ip[0] = 0x60;
+		dns_put16(ip + 4, 8 + dl);
+		ip[6] = 17;
+		ip[7] = 64;
+		ip[8] = 0x20;
+		ip[9] = 0x01;
+		ip[10] = 0x0d;
+		ip[11] = 0xb8;
+		dns_put32(ip + 20, src);
+		l = 40 + 8 + dl;
+	} else {
+		memset(ip, 0, 20);
+		ip[0] = 0x45;
+		dns_put16(ip + 2, 20 + 8 + dl);
+		ip[8] = 64;
+		ip[9] = 17;
+		dns_put32(ip + 12, src);
+		l = 20 + 8 + dl;
+	}
+	l += ip - (p + 16);
+	memcpy(p + 8, &(uint32_t){ (uint32_t)l }, 4);
+	memcpy(p + 12, &(uint32_t){ (uint32_t)l }, 4);
+	return (16 + l);
+}
+
+static size_t
+pcap_test_header(uint8_t *p, int linktype)
+{
+	uint32_t h[6] = { 0xa1b2c3d4, 0x00040002, 0, 0, 65535, 0 };
+
+	h[5] = linktype;
+	memcpy(p, h, sizeof h);
+	return (sizeof h);
+}
+
+#define T_RES(a, b, c, d)	(((uint32_t)(a) << 24) | ((b) << 16) | \
+				    ((c) << 8) | (d))
+
+static uint8_t pcap_test_buf[1 << 20];
+
+void
+bench_pcap(unsigned long n)
+{
+	static struct pcap_scan ps;
+	uint32_t a = encode_leapsecond(2016, 12, 36, 1);
+	size_t len;
+	unsigned long u, per;
+
+	len = pcap_test_header(pcap_test_buf, LT_EN10MB);
+	for (per = 0; len + 200 < sizeof pcap_test_buf; per++)
+		len += pcap_test_packet(pcap_test_buf + len, LT_EN10MB, 0, 0,
+		    T_RES(10, 0, per >> 8 & 0xff, per & 0xff),
+		    "leapsecond.utcd.org", 0, &a, 1);
+	if (ps.port == 0) {
+		ps.port = 53;
+		(void)pcap_name(&ps, "leapsecond.utcd.org");
+	}
+	for (u = 0; u < n; u += per)
+		(void)pcap_scan_buf(&ps, pcap_test_buf, len);
+	bench_sink += ps.packets;
+}
+
+void
+test_leap_pcap(void)
+{
+	static struct pcap_scan ps;
+	struct pcap_resolver *r;
+	struct leap_answer la[64];
+	uint32_t a[4], addr[64];
+	uint8_t *p = pcap_test_buf;
+	char buf[16];
+	size_t len;
+	int i, y, m, t, d, e;
+	unsigned u;
+
+	printf("\nChecking batch decoder and pcap scanner:\n\n");
+
+	/* The batch decoder agrees with decode_leapsecond() */
+	for (i = 0, u = 0x9e3779b9; i < 100000; i++) {
+		for (e = 0; e < 64; e++) {
+			u = u * 1103515245 + 12345;
+			addr[e] = e & 1 ? u | 0xf0000000 :
+			    encode_leapsecond(1972 + e, 6, e, e % 3 - 1) ^
+			    (u & (u >> 7) & (u >> 13) & 0x0300ff00);
+		}
+		(void)decode_leapsecond_n(addr, la, 64);
+		for (e = 0; e < 64; e += 1 + (i & 7)) {
+			(void)snprintf(buf, sizeof buf, "%u.%u.%u.%u",
+			    addr[e] >> 24, (addr[e] >> 16) & 0xff,
+			    (addr[e] >> 8) & 0xff, addr[e] & 0xff);
+			assert(decode_leapsecond(buf, &y, &m, &t, &d) ==
+			    la[e].error);
+			assert(y == la[e].year && m == la[e].month &&
+			    t == la[e].dtai && d == la[e].delta);
+		}
+	}
+	addr[0] = 0x7f000001;
+	assert(decode_leapsecond_n(addr, la, 1) == 0 && la[0].error == -1);
+
+	/*
+	 * 10.0.0.1 good, 10.0.0.2 rewritten and stripped over VLAN,
+	 * 2001:db8::3 bad CRC and a history RRset, 10.0.0.4 SERVFAIL and
+	 * TC, 10.0.0.5 an old announcement, other names are ignored.
+	 */
+	a[0] = encode_leapsecond(2016, 12, 36, 1);
+	a[1] = encode_leapsecond(2015, 6, 35, 1);
+	len = pcap_test_header(p, LT_EN10MB);
+	for (i = 0; i < 3; i++)
+		len += pcap_test_packet(p + len, LT_EN10MB, 0, 0,
+		    T_RES(10, 0, 0, 1), "leapsecond.utcd.org", 0, a, 1);
+	len += pcap_test_packet(p + len, LT_EN10MB, 0, 1,
+	    T_RES(10, 0, 0, 2), "LeapSecond.UTCD.org", 0,
+	    &(uint32_t){ T_RES(192, 0, 2, 1) }, 1);
+	len += pcap_test_packet(p + len, LT_EN10MB, 0, 1,
+	    T_RES(10, 0, 0, 2), "leapsecond.utcd.org", 0, a, 0);
+	len += pcap_test_packet(p + len, LT_EN10MB, 1, 0, 3,
+	    "leapsecond.utcd.org", 0, &(uint32_t){ a[0] ^ 1 }, 1);
+	len += pcap_test_packet(p + len, LT_EN10MB, 1, 0, 3,
+	    "history.leapsecond.utcd.org", 0, a, 2);
+	len += pcap_test_packet(p + len, LT_EN10MB, 0, 0,
+	    T_RES(10, 0, 0, 4), "leapsecond.utcd.org", 2, a, 0);
+	len += pcap_test_packet(p + len, LT_EN10MB, 0, 0,
+	    T_RES(10, 0, 0, 4), "leapsecond.utcd.org", 0x200, a, 0);
+	len += pcap_test_packet(p + len, LT_EN10MB, 0, 0,
+	    T_RES(10, 0, 0, 5), "leapsecond.utcd.org", 0, a + 1, 1);
+	len += pcap_test_packet(p + len, LT_EN10MB, 0, 0,
+	    T_RES(10, 0, 0, 6), "xleapsecond.utcd.org", 0, a, 1);
+	len += pcap_test_packet(p + len, LT_EN10MB, 0, 0,
+	    T_RES(10, 0, 0, 6), "utcd.org", 0, a, 1);
+	len += pcap_test_packet(p + len, LT_EN10MB, 0, 0,
+	    T_RES(10, 0, 0, 6), "example.com", 0, a, 1);
+	len -= 10;			/* Last packet cut short */
+
+	ps.port = 53;
+	assert(pcap_name(&ps, "leapsecond.utcd.org.") == 0);
+	assert(pcap_scan_buf(&ps, p, 10) == -1);
+	assert(pcap_scan_buf(&ps, p, len) == 0);
+	printf("  Packets: %lu  Responses: %lu  Answers: %lu\n",
+	    ps.packets, ps.responses, ps.answers);
+	assert(ps.packets == 12 && ps.responses == 10 && ps.answers == 8);
+
+	r = pcap_resolver(&ps, AF_INET, (const uint8_t *)"\12\0\0\1");
+	assert(r->responses == 3 && r->ok == 3 && r->last == a[0]);
+	r = pcap_resolver(&ps, AF_INET, (const uint8_t *)"\12\0\0\2");
+	assert(r->responses == 2 && r->note == 1 && r->strip == 1);
+	r = pcap_resolver(&ps, AF_INET6,
+	    (const uint8_t *)"\40\1\15\270\0\0\0\0\0\0\0\0\0\0\0\3");
+	assert(r->responses == 2 && r->crc == 1 && r->ok == 2 &&
+	    r->last == 0);
+	r = pcap_resolver(&ps, AF_INET, (const uint8_t *)"\12\0\0\4");
+	assert(r->responses == 2 && r->rcode == 1 && r->tc == 1);
+	assert(ps.nres == 5);
+
+	/* Linux cooked and raw IP */
+	len = pcap_test_packet(p, LT_LINUX_SLL, 0, 0, T_RES(10, 0, 0, 5),
+	    "leapsecond.utcd.org", 0, a, 1);
+	pcap_packet(&ps, LT_LINUX_SLL, p + 16, len - 16);
+	len = pcap_test_packet(p, LT_RAW, 1, 0, 5,
+	    "leapsecond.utcd.org", 0, a, 1);
+	pcap_packet(&ps, LT_RAW, p + 16, len - 16);
+	pcap_packet(&ps, LT_EN10MB, p + 16, len - 16);
+	pcap_flush(&ps);
+	r = pcap_resolver(&ps, AF_INET, (const uint8_t *)"\12\0\0\5");
+	assert(r->responses == 2 && r->ok == 2 && r->last == a[0]);
+	assert(ps.nres == 6 && ps.responses == 12);
+	pcap_report(&ps, stdout);
+	free(ps.res);
+
+	/* Enough resolvers to grow the table with answers queued */
+	memset(&ps, 0, sizeof ps);
+	ps.port = 53;
+	assert(pcap_name(&ps, "leapsecond.utcd.org") == 0);
+	len = pcap_test_header(p, LT_EN10MB);
+	for (i = 0; i < 200; i++)
+		len += pcap_test_packet(p + len, LT_EN10MB, 0, 0,
+		    T_RES(10, 1, 0, i), "leapsecond.utcd.org", 0, a, 1);
+	assert(pcap_scan_buf(&ps, p, len) == 0);
+	assert(ps.nres == 200 && ps.maxres >= 512);
+	for (i = 0; i < 200; i++) {
+		dns_put32((uint8_t *)buf, T_RES(10, 1, 0, i));
+		r = pcap_resolver(&ps, AF_INET, (const uint8_t *)buf);
+		assert(r->responses == 1 && r->ok == 1 && r->last == a[0]);
+	}
+	printf("  Resolvers: %u  Table: %u\n", ps.nres, ps.maxres);
+	free(ps.res);
+}
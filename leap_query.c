@@ -0,0 +1,1405 @@
+/*-
+ * Copyright (c) 2015 Poul-Henning Kamp <phk@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Native DNS client for the leap second announcement.
+ *
+ * query_leapsecond() uses getaddrinfo(3), which is maximally portable,
+ * but tells us nothing about the answer beyond the addresses.  This
+ * talks DNS to a recursive resolver directly, which gives access to
+ * the TTL and to the DNSSEC status of the answer.
+ *
+ * With LQ_DNSSEC, when built with -DWITH_OPENSSL, the query sets the DO
+ * and CD bits and the answer is validated here, see leap_dnssec.c:  The
+ * RRSIG of the A RRset is verified against the DNSKEY/DS chain up to
+ * the root trust anchors, which is fetched through the same resolver
+ * and cached until its signatures expire, so a refresh costs one round
+ * trip and one signature verification.  Only the addresses in the
+ * validated RRset are used.  Without OpenSSL the query sets DO and AD,
+ * and the answer is accepted if the resolver sets AD, meaning that it
+ * validated it; that is only as trustworthy as the path to the
+ * resolver, which should then be on localhost or a protected link.
+ *
+ * Answers are cached here until their TTL runs out or, for validated
+ * answers, until the validation expires, whichever comes first.
+ *
+ * A truncated (TC=1) UDP answer is retried over TCP, and LQ_TCP goes
+ * straight to TCP.  The TCP connection is kept open and reused for
+ * the next query to the same server, opened with TCP Fast Open where
+ * the kernel supports it.  query_leapsecond_many() sends a batch of
+ * queries on it back to back and takes the responses in any order, as
+ * RFC 7766 allows the server to send them.  Neither the cache nor the
+ * connection are thread-safe.
+ *
+ * LQ_TLS runs the same connection over TLS (RFC 7858, port 853), when
+ * built with -DWITH_OPENSSL.  The server certificate is verified.  The
+ * latest TLS session ticket is kept, so that when the server has closed
+ * the idle connection, the next one resumes the session and only costs
+ * one round trip more than plain TCP, and none with TCP Fast Open.
+ *
+ * The returned errors are the same as for query_leapsecond(), plus:
+ *
+ *	-12	LQ_DNSSEC was requested, but the answer was not validated
+ *
+ * and query_leapsecond_bulletin() in leap_table.c adds:
+ *
+ *	-13	No such Bulletin C, or the answer is for another month
+ *
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+#if defined(__has_include)
+#  if __has_include(<sys/random.h>)
+#    include <sys/random.h>
+#    define LQ_GETRANDOM
+#  endif
+#endif
+
+#ifdef WITH_OPENSSL
+#include <pthread.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#endif
+
+#include "dns_leap.h"
+
+#define LQ_TIMEOUT	2000		/* Milliseconds per try */
+#define LQ_TRIES	3
+#define LQ_NCACHE	8
+#define LQ_MAXPIPE	16		/* TCP queries in flight */
+#define LQ_MAXRESP	4096		/* Kept for validation */
+
+#ifdef WITH_OPENSSL
+#define LQ_DNSSEC_BITS	0x10		/* CD, validated in leap_dnssec.c */
+#else
+#define LQ_DNSSEC_BITS	0x20		/* AD, validated by the resolver */
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL	0
+#endif
+
+static struct lq_cache {
+	char			fqdn[DNS_MAXNAME + 1];
+	unsigned		flags;
+	time_t			expire;
+	uint32_t		addr;
+} lq_cache[LQ_NCACHE];
+
+struct lq_pending {
+	uint8_t			q[2 + DNS_MAXUDP];	/* TCP length + query */
+	size_t			qlen;
+	size_t			qend;
+	int			done;
+	struct lq_answer	la;
+	size_t			rlen;
+	uint8_t			r[LQ_MAXRESP];		/* The response */
+};
+
+static int lq_tcp_fd = -1;
+static struct sockaddr_storage lq_tcp_peer;
+static socklen_t lq_tcp_peerlen;
+static short lq_want;			/* What the transport waits for */
+
+#ifdef WITH_OPENSSL
+static const char *lq_tls_cafile;
+static const char *lq_tls_name;
+static SSL_CTX *lq_tls_ctx;
+static SSL *lq_tls;
+static SSL_SESSION *lq_tls_sess;
+#endif
+
+/*
+ * Random numbers which must not be guessable, query IDs here and the
+ * rate limiter's hash seed in leap_serve.c.  getrandom(2) where the C
+ * library has it (glibc 2.25, FreeBSD 12), else /dev/urandom, and the
+ * clock as a last resort.
+ */
+
+uint32_t
+leap_random(void)
+{
+	uint32_t v;
+	int fd;
+
+#ifdef LQ_GETRANDOM
+	if (getrandom(&v, sizeof v, 0) == (ssize_t)sizeof v)
+		return (v);
+#endif
+	fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		if (read(fd, &v, sizeof v) == (ssize_t)sizeof v) {
+			(void)close(fd);
+			return (v);
+		}
+		(void)close(fd);
+	}
+	return ((uint32_t)metric_usec() ^ (uint32_t)getpid() << 16);
+}
+
+/*
+ * Build query with ID 'id', returns length
+ */
+
+static size_t
+lq_query_type(uint8_t *q, unsigned id, const uint8_t *name, size_t namelen,
+    unsigned qtype, unsigned flags)
+{
+	size_t l;
+
+	memset(q, 0, DNS_HDRLEN);
+	dns_put16(q, id);
+	q[2] = 0x01;			/* RD */
+	if (flags & LQ_DNSSEC)
+		q[3] = LQ_DNSSEC_BITS;
+	dns_put16(q + 4, 1);
+	dns_put16(q + 10, 1);
+	l = DNS_HDRLEN;
+
+	memcpy(q + l, name, namelen);
+	l += namelen;
+	dns_put16(q + l, qtype);
+	dns_put16(q + l + 2, C_IN);
+	l += 4;
+
+	q[l] = 0;
+	dns_put16(q + l + 1, T_OPT);
+	dns_put16(q + l + 3, DNS_EDNS_SIZE);
+	dns_put16(q + l + 5, 0);
+	dns_put16(q + l + 7, (flags & LQ_DNSSEC) ? 0x8000 : 0);	/* DO */
+	dns_put16(q + l + 9, 0);
+	return (l + 11);
+}
+
+size_t
+lq_query(uint8_t *q, unsigned id, const uint8_t *name, size_t namelen,
+    unsigned flags)
+{
+
+	return (lq_query_type(q, id, name, namelen, T_A, flags));
+}
+
+static int
+lq_skipname(const uint8_t *r, size_t len, size_t *pos)
+{
+	unsigned l;
+
+	for (;;) {
+		if (*pos >= len)
+			return (-1);
+		l = r[*pos];
+		if ((l & 0xc0) == 0xc0) {
+			*pos += 2;
+			return (*pos <= len ? 0 : -1);
+		}
+		if (l & 0xc0)
+			return (-1);
+		*pos += 1 + l;
+		if (l == 0)
+			return (0);
+	}
+}
+
+/*
+ * Parse response 'r' to query 'q', whose question ends at 'qend'.
+ */
+
+int
+lq_parse(const uint8_t *r, size_t len, const uint8_t *q, size_t qend,
+    struct lq_answer *la)
+{
+	unsigned an, type, class, rdlen, i;
+	uint32_t ttl;
+	size_t pos;
+
+	memset(la, 0, sizeof *la);
+	if (len < qend || r[0] != q[0] || r[1] != q[1])
+		return (-1);
+	if (!(r[2] & 0x80) || dns_get16(r + 4) != 1)
+		return (-1);
+	for (pos = DNS_HDRLEN; pos < qend; pos++)
+		if (dns_lower(r[pos]) != dns_lower(q[pos]))
+			return (-1);
+	la->tc = (r[2] & 0x02) != 0;
+	la->ad = (r[3] & 0x20) != 0;
+	la->rcode = r[3] & 0x0f;
+	la->ttl = UINT32_MAX;
+
+	an = dns_get16(r + 6);
+	for (i = 0; i < an; i++) {
+		if (lq_skipname(r, len, &pos) || pos + 10 > len)
+			return (-1);
+		type = dns_get16(r + pos);
+		class = dns_get16(r + pos + 2);
+		ttl = dns_get32(r + pos + 4);
+		rdlen = dns_get16(r + pos + 8);
+		pos += 10;
+		if (pos + rdlen > len)
+			return (-1);
+		if (type == T_A && class == C_IN && rdlen == 4 &&
+		    la->naddr < LQ_MAXADDR) {
+			la->addr[la->naddr++] = dns_get32(r + pos);
+			if (ttl < la->ttl)
+				la->ttl = ttl;
+		} else if (type == T_RRSIG && rdlen >= 18 &&
+		    dns_get16(r + pos) == T_A) {
+			ttl = dns_get32(r + pos + 8);
+			if (la->sigexp == 0 || ttl < la->sigexp)
+				la->sigexp = ttl;
+		}
+		pos += rdlen;
+	}
+	return (0);
+}
+
+/*
+ * Send query over UDP, wait for a response with matching ID
+ */
+
+static ssize_t
+lq_udp(const struct addrinfo *ai, const uint8_t *q, size_t qlen,
+    uint8_t *r, size_t rlen)
+{
+	struct pollfd pfd;
+	uint64_t deadline, now;
+	ssize_t n;
+	int fd, try;
+
+	fd = socket(ai->ai_family, SOCK_DGRAM, 0);
+	if (fd < 0)
+		return (-1);
+	if (connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+		(void)close(fd);
+		return (-1);
+	}
+	for (try = 0; try < LQ_TRIES; try++) {
+		if (send(fd, q, qlen, 0) != (ssize_t)qlen)
+			break;
+		deadline = metric_usec() + LQ_TIMEOUT * 1000;
+		while ((now = metric_usec()) < deadline) {
+			pfd.fd = fd;
+			pfd.events = POLLIN;
+			if (poll(&pfd, 1, (deadline - now + 999) / 1000) <= 0)
+				continue;
+			n = recv(fd, r, rlen, 0);
+			if (n >= DNS_HDRLEN && r[0] == q[0] && r[1] == q[1]) {
+				(void)close(fd);
+				return (n);
+			}
+		}
+	}
+	(void)close(fd);
+	return (-1);
+}
+
+/*
+ * First "nameserver" in /etc/resolv.conf
+ */
+
+static int
+lq_resolver(char *buf, size_t len)
+{
+	char line[256], fmt[32];
+	FILE *fi;
+	int retval = -1;
+
+	fi = fopen("/etc/resolv.conf", "r");
+	if (fi == NULL)
+		return (-1);
+	(void)snprintf(fmt, sizeof fmt, " nameserver %%%zus", len - 1);
+	while (fgets(line, sizeof line, fi) != NULL) {
+		if (sscanf(line, fmt, buf) == 1) {
+			retval = 0;
+			break;
+		}
+	}
+	(void)fclose(fi);
+	return (retval);
+}
+
+static int
+lq_decode(uint32_t addr, int *year, int *month, int *tai, int *delta,
+    char **ip)
+{
+	char buf[16];
+	int error;
+
+	(void)snprintf(buf, sizeof buf, "%u.%u.%u.%u", addr >> 24,
+	    (addr >> 16) & 0xff, (addr >> 8) & 0xff, addr & 0xff);
+	error = decode_leapsecond(buf, year, month, tai, delta);
+	if (error == 0 && ip != NULL)
+		*ip = strdup(buf);
+	return (error);
+}
+
+/*
+ * Wait until 'fd' is ready for 'events' or the deadline passes
+ */
+
+static int
+lq_wait(int fd, short events, uint64_t deadline)
+{
+	struct pollfd pfd;
+	uint64_t now;
+
+	while ((now = metric_usec()) < deadline) {
+		pfd.fd = fd;
+		pfd.events = events;
+		if (poll(&pfd, 1, (deadline - now + 999) / 1000) > 0)
+			return (0);
+	}
+	errno = ETIMEDOUT;
+	return (-1);
+}
+
+static void
+lq_tcp_close(void)
+{
+
+#ifdef WITH_OPENSSL
+	if (lq_tls != NULL) {
+		/* A clean shutdown keeps the session resumable */
+		(void)SSL_shutdown(lq_tls);
+		SSL_free(lq_tls);
+		lq_tls = NULL;
+	}
+#endif
+	if (lq_tcp_fd >= 0)
+		(void)close(lq_tcp_fd);
+	lq_tcp_fd = -1;
+}
+
+#ifdef WITH_OPENSSL
+/*
+ * TLS 1.3 session tickets arrive after the handshake, keep the latest
+ * one for the next connection to the same server.
+ */
+
+static int
+lq_tls_newsess(SSL *ssl, SSL_SESSION *sess)
+{
+
+	(void)ssl;
+	if (lq_tls_sess != NULL)
+		SSL_SESSION_free(lq_tls_sess);
+	lq_tls_sess = sess;
+	return (1);
+}
+
+static SSL_CTX *
+lq_tls_init(void)
+{
+	SSL_CTX *ctx;
+	int ok;
+
+	if (lq_tls_ctx != NULL)
+		return (lq_tls_ctx);
+	ctx = SSL_CTX_new(TLS_client_method());
+	if (ctx == NULL)
+		return (NULL);
+	(void)SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+	if (lq_tls_cafile != NULL)
+		ok = SSL_CTX_load_verify_locations(ctx, lq_tls_cafile, NULL);
+	else
+		ok = SSL_CTX_set_default_verify_paths(ctx);
+	if (!ok) {
+		SSL_CTX_free(ctx);
+		return (NULL);
+	}
+	(void)SSL_CTX_set_session_cache_mode(ctx,
+	    SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, lq_tls_newsess);
+	lq_tls_ctx = ctx;
+	return (ctx);
+}
+
+/*
+ * Start TLS on a connected socket.  The certificate must match the
+ * authentication name if one was given, otherwise the server address.
+ * The handshake happens in the first lq_send().
+ */
+
+static int
+lq_tls_start(int fd, const struct addrinfo *ai)
+{
+	char host[NI_MAXHOST];
+	SSL_CTX *ctx;
+	int ok;
+
+	ctx = lq_tls_init();
+	if (ctx == NULL)
+		return (-1);
+	lq_tls = SSL_new(ctx);
+	if (lq_tls == NULL)
+		return (-1);
+	if (lq_tls_name != NULL) {
+		ok = SSL_set1_host(lq_tls, lq_tls_name) &&
+		    SSL_set_tlsext_host_name(lq_tls, lq_tls_name);
+	} else {
+		ok = !getnameinfo(ai->ai_addr, ai->ai_addrlen,
+		    host, sizeof host, NULL, 0, NI_NUMERICHOST) &&
+		    X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(lq_tls),
+		    host);
+	}
+	if (ok && lq_tls_sess != NULL)
+		ok = SSL_set_session(lq_tls, lq_tls_sess);
+	if (!ok || !SSL_set_fd(lq_tls, fd)) {
+		SSL_free(lq_tls);
+		lq_tls = NULL;
+		return (-1);
+	}
+	SSL_set_connect_state(lq_tls);
+	return (0);
+}
+
+static ssize_t
+lq_tls_io(int ret)
+{
+
+	if (ret > 0)
+		return (ret);
+	switch (SSL_get_error(lq_tls, ret)) {
+	case SSL_ERROR_WANT_READ:
+		lq_want = POLLIN;
+		errno = EAGAIN;
+		return (-1);
+	case SSL_ERROR_WANT_WRITE:
+		lq_want = POLLOUT;
+		errno = EAGAIN;
+		return (-1);
+	case SSL_ERROR_ZERO_RETURN:
+		return (0);
+	default:
+		ERR_clear_error();
+		errno = EPROTO;
+		return (-1);
+	}
+}
+#endif
+
+/*
+ * Transport I/O on the TCP connection, through TLS if it is on.  On -1
+ * with EAGAIN, lq_want says what to poll(2) for.
+ */
+
+static ssize_t
+lq_send(int fd, const void *b, size_t l)
+{
+
+#ifdef WITH_OPENSSL
+	if (lq_tls != NULL)
+		return (lq_tls_io(SSL_write(lq_tls, b, l)));
+#endif
+	lq_want = POLLOUT;
+	return (send(fd, b, l, MSG_NOSIGNAL));
+}
+
+static ssize_t
+lq_recv(int fd, void *b, size_t l)
+{
+
+#ifdef WITH_OPENSSL
+	if (lq_tls != NULL)
+		return (lq_tls_io(SSL_read(lq_tls, b, l)));
+#endif
+	lq_want = POLLIN;
+	return (recv(fd, b, l, 0));
+}
+
+/*
+ * Reuse the open connection if it goes to the same place, otherwise
+ * start a new one.  The connect completes, or fails, in the background
+ * and with TCP Fast Open it is finished by the first send().
+ */
+
+static int
+lq_tcp_connect(const struct addrinfo *ai, int tls)
+{
+	int fd, one = 1, same;
+
+	same = lq_tcp_peerlen == ai->ai_addrlen &&
+	    !memcmp(&lq_tcp_peer, ai->ai_addr, ai->ai_addrlen);
+#ifdef WITH_OPENSSL
+	if (lq_tcp_fd >= 0 && same && (lq_tls != NULL) == tls)
+		return (lq_tcp_fd);
+	lq_tcp_close();
+	if (!same && lq_tls_sess != NULL) {
+		SSL_SESSION_free(lq_tls_sess);
+		lq_tls_sess = NULL;
+	}
+#else
+	if (tls)
+		return (-1);
+	if (lq_tcp_fd >= 0 && same)
+		return (lq_tcp_fd);
+	lq_tcp_close();
+#endif
+	if (ai->ai_addrlen > sizeof lq_tcp_peer)
+		return (-1);
+	fd = socket(ai->ai_family, SOCK_STREAM, 0);
+	if (fd < 0)
+		return (-1);
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK)) {
+		(void)close(fd);
+		return (-1);
+	}
+	(void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+#ifdef TCP_FASTOPEN_CONNECT
+	(void)setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+	    &one, sizeof one);
+#endif
+	if (connect(fd, ai->ai_addr, ai->ai_addrlen) && errno != EINPROGRESS) {
+		(void)close(fd);
+		return (-1);
+	}
+	lq_tcp_fd = fd;
+	memcpy(&lq_tcp_peer, ai->ai_addr, ai->ai_addrlen);
+	lq_tcp_peerlen = ai->ai_addrlen;
+#ifdef WITH_OPENSSL
+	if (tls && lq_tls_start(fd, ai)) {
+		lq_tcp_close();
+		return (-1);
+	}
+#endif
+	return (fd);
+}
+
+/*
+ * Send all the pending queries in one go, then take the responses in
+ * whatever order they come, matching them up by ID and question.
+ */
+
+static int
+lq_tcp_xfer(int fd, struct lq_pending *p, unsigned n, uint64_t deadline)
+{
+	uint8_t buf[LQ_MAXPIPE * (2 + DNS_MAXUDP)], r[2 + 65535];
+	size_t len = 0, off, want, have;
+	unsigned u, left = 0;
+	ssize_t k;
+
+	assert(n <= LQ_MAXPIPE);
+	for (u = 0; u < n; u++) {
+		if (p[u].done)
+			continue;
+		memcpy(buf + len, p[u].q, 2 + p[u].qlen);
+		len += 2 + p[u].qlen;
+		left++;
+	}
+	for (off = 0; off < len; off += k) {
+		k = lq_send(fd, buf + off, len - off);
+		if (k >= 0)
+			continue;
+		if (errno != EAGAIN && errno != EINPROGRESS &&
+		    errno != ENOTCONN && errno != EINTR)
+			return (-1);
+		if (lq_wait(fd, lq_want, deadline))
+			return (-1);
+		k = 0;
+	}
+	for (have = 0; left > 0; ) {
+		want = have < 2 ? 2 : 2 + (size_t)dns_get16(r);
+		if (have == want) {
+			for (u = 0; u < n; u++) {
+				if (p[u].done || lq_parse(r + 2, want - 2,
+				    p[u].q + 2, p[u].qend, &p[u].la))
+					continue;
+				p[u].done = 1;
+				p[u].rlen = 0;
+				if (want - 2 <= sizeof p[u].r) {
+					memcpy(p[u].r, r + 2, want - 2);
+					p[u].rlen = want - 2;
+				}
+				left--;
+				break;
+			}
+			have = 0;
+			continue;
+		}
+		k = lq_recv(fd, r + have, want - have);
+		if (k > 0) {
+			have += k;
+			continue;
+		}
+		if (k == 0 || (errno != EAGAIN && errno != EINTR))
+			return (-1);
+		if (lq_wait(fd, lq_want, deadline))
+			return (-1);
+	}
+	return (0);
+}
+
+/*
+ * If a reused connection fails, the server probably closed it while
+ * idle, so try once more on a fresh one.  Queries already answered
+ * are not sent again.
+ */
+
+static int
+lq_tcp(const struct addrinfo *ai, struct lq_pending *p, unsigned n, int tls)
+{
+	uint64_t deadline;
+	int fd, reused, try;
+
+	deadline = metric_usec() + (uint64_t)LQ_TIMEOUT * LQ_TRIES * 1000;
+	for (try = 0; try < 2; try++) {
+		reused = lq_tcp_fd >= 0;
+		fd = lq_tcp_connect(ai, tls);
+		if (fd < 0)
+			return (-1);
+		if (lq_tcp_xfer(fd, p, n, deadline) == 0)
+			return (0);
+		lq_tcp_close();
+		if (!reused)
+			break;
+	}
+	return (-1);
+}
+
+static int
+lq_server(const char *server, const char *port, unsigned flags,
+    struct addrinfo **res)
+{
+	struct addrinfo hints;
+	char sbuf[NI_MAXHOST];
+	int error;
+
+	if (server == NULL) {
+		if (lq_resolver(sbuf, sizeof sbuf))
+			return (-10);
+		server = sbuf;
+	}
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+	if (port == NULL)
+		port = (flags & LQ_TLS) ? "853" : "53";
+	error = getaddrinfo(server, port, &hints, res);
+	if (error) {
+		fprintf(stderr, "Resolver %s: %s\n", server,
+		    gai_strerror(error));
+		return (-10);
+	}
+	return (0);
+}
+
+static void
+lq_pend_name(struct lq_pending *p, unsigned id, const uint8_t *name,
+    size_t namelen, unsigned qtype, unsigned flags)
+{
+
+	p->qlen = lq_query_type(p->q + 2, id, name, namelen, qtype, flags);
+	dns_put16(p->q, p->qlen);
+	p->qend = DNS_HDRLEN + namelen + 4;
+	p->done = 0;
+	p->rlen = 0;
+}
+
+static int
+lq_pend(struct lq_pending *p, unsigned id, const char *fqdn, unsigned flags)
+{
+	uint8_t name[DNS_MAXNAME];
+	int l;
+
+	l = dns_name(fqdn, name, sizeof name);
+	if (l < 0)
+		return (-10);
+	lq_pend_name(p, id, name, l, T_A, flags);
+	return (0);
+}
+
+/*
+ * UDP first, unless told otherwise, and TCP if the answer was truncated
+ */
+
+static int
+lq_lookup(const char *server, const char *port, unsigned flags,
+    struct lq_pending *p)
+{
+	struct addrinfo *res;
+	ssize_t n;
+
+	if (lq_server(server, port, flags, &res))
+		return (-10);
+	if (!(flags & (LQ_TCP | LQ_TLS))) {
+		n = lq_udp(res, p->q + 2, p->qlen, p->r, DNS_EDNS_SIZE);
+		if (n < 0 || lq_parse(p->r, n, p->q + 2, p->qend, &p->la)) {
+			freeaddrinfo(res);
+			return (-10);
+		}
+		p->rlen = n;
+		p->done = !p->la.tc;
+	}
+	if (!p->done)
+		(void)lq_tcp(res, p, 1, (flags & LQ_TLS) != 0);
+	freeaddrinfo(res);
+	if (!p->done || p->la.rcode != 0)
+		return (-10);
+	return (0);
+}
+
+#ifdef WITH_OPENSSL
+/*
+ * Fetch DS and DNSKEY RRsets for leap_dnssec.c the same way
+ */
+
+struct lq_via {
+	const char		*server;
+	const char		*port;
+	unsigned		flags;
+};
+
+static ssize_t
+lq_fetch(void *priv, const uint8_t *name, size_t namelen, unsigned qtype,
+    uint8_t *r, size_t rlen)
+{
+	const struct lq_via *v = priv;
+	struct lq_pending p;
+
+	lq_pend_name(&p, leap_random() & 0xffff, name, namelen, qtype,
+	    v->flags);
+	if (lq_lookup(v->server, v->port, v->flags, &p) || p.rlen > rlen)
+		return (-1);
+	memcpy(r, p.r, p.rlen);
+	return ((ssize_t)p.rlen);
+}
+#endif
+
+static const struct lq_cache *
+lq_cached(const char *fqdn, unsigned flags, time_t now)
+{
+	const struct lq_cache *lc;
+
+	for (lc = lq_cache; lc < lq_cache + LQ_NCACHE; lc++)
+		if (lc->flags == (flags & LQ_DNSSEC) &&
+		    !strcmp(lc->fqdn, fqdn) && now < lc->expire)
+			return (lc);
+	return (NULL);
+}
+
+/*
+ * Check and decode the answer to a lookup which returned 'error', and
+ * cache it if good.
+ */
+
+static int
+lq_finish(const char *server, const char *port, const char *fqdn,
+    unsigned flags, time_t now, const struct lq_pending *p, int error,
+    int *year, int *month, int *tai, int *delta, char **ip)
+{
+	struct lq_cache *lc, *lcold;
+	struct lq_answer lv;
+	const struct lq_answer *la = &p->la;
+	time_t expire, sigexp = 0;
+	unsigned u;
+#ifdef WITH_OPENSSL
+	struct lq_via via;
+
+	if (error == 0 && (flags & LQ_DNSSEC)) {
+		via.server = server;
+		via.port = port;
+		via.flags = flags;
+		lv = p->la;
+		lv.naddr = LQ_MAXADDR;
+		if (dnssec_validate(p->r, p->rlen, p->q + 2 + DNS_HDRLEN,
+		    p->qend - DNS_HDRLEN - 4, now, lq_fetch, &via,
+		    lv.addr, &lv.naddr, &sigexp))
+			error = -12;
+		la = &lv;
+	}
+#else
+	(void)server;
+	(void)port;
+	(void)lv;
+	if (error == 0 && (flags & LQ_DNSSEC) && !la->ad)
+		error = -12;
+	sigexp = la->sigexp;
+#endif
+	if (error != 0)
+		return (error);
+	error = -11;
+	for (u = 0; u < la->naddr; u++) {
+		error = lq_decode(la->addr[u], year, month, tai, delta, ip);
+		metric_decode(error);
+		if (error == 0)
+			break;
+	}
+	if (error != 0 || strlen(fqdn) >= sizeof lq_cache[0].fqdn)
+		return (error);
+
+	lcold = &lq_cache[0];
+	for (lc = lq_cache; lc < lq_cache + LQ_NCACHE; lc++)
+		if (lc->expire < lcold->expire)
+			lcold = lc;
+	expire = now + la->ttl;
+	if ((flags & LQ_DNSSEC) && sigexp != 0 && sigexp < expire)
+		expire = sigexp;
+	strcpy(lcold->fqdn, fqdn);
+	lcold->flags = flags & LQ_DNSSEC;
+	lcold->expire = expire;
+	lcold->addr = la->addr[u];
+	return (0);
+}
+
+/*
+ * Like query_leapsecond(), but asks 'server' (default: the first one in
+ * /etc/resolv.conf) on 'port' (default: 53) directly.
+ */
+
+int
+query_leapsecond_ns(const char *server, const char *port, const char *fqdn,
+    unsigned flags, int *year, int *month, int *tai, int *delta, char **ip)
+{
+	const struct lq_cache *lc;
+	struct lq_pending p;
+	uint64_t t0;
+	time_t now;
+	int error;
+
+	LEAP_PROBE1(query__entry, fqdn);
+	now = time(NULL);
+	lc = lq_cached(fqdn, flags, now);
+	if (lc != NULL)
+		return (lq_decode(lc->addr, year, month, tai, delta, ip));
+
+	t0 = metric_usec();
+	error = lq_pend(&p, leap_random() & 0xffff, fqdn, flags);
+	if (error == 0)
+		error = lq_lookup(server, port, flags, &p);
+	error = lq_finish(server, port, fqdn, flags, now, &p, error,
+	    year, month, tai, delta, ip);
+	t0 = metric_usec() - t0;
+	metric_query(error, t0);
+	LEAP_PROBE3(query__return, fqdn, error, t0);
+	return (error);
+}
+
+/*
+ * Look up all the names in 'lr'.  Those not in the cache are queried
+ * over one TCP connection, LQ_MAXPIPE at a time, without waiting for
+ * one response before sending the next query.  Returns the number of
+ * names which failed, lr[].error says why.
+ */
+
+int
+query_leapsecond_many(const char *server, const char *port, unsigned flags,
+    struct lq_result *lr, unsigned n)
+{
+	struct lq_pending p[LQ_MAXPIPE];
+	struct lq_result *r;
+	const struct lq_cache *lc;
+	struct addrinfo *res;
+	unsigned u, k, np, id, idx[LQ_MAXPIPE], fail = 0;
+	uint64_t t0;
+	time_t now;
+	int error;
+
+	if (lq_server(server, port, flags, &res)) {
+		for (u = 0; u < n; u++)
+			lr[u].error = -10;
+		return (n);
+	}
+	now = time(NULL);
+	id = leap_random();
+	for (u = 0; u < n; ) {
+		for (np = 0; u < n && np < LQ_MAXPIPE; u++) {
+			r = &lr[u];
+			lc = lq_cached(r->fqdn, flags, now);
+			if (lc != NULL)
+				r->error = lq_decode(lc->addr,
+				    &r->year, &r->month, &r->tai, &r->delta,
+				    NULL);
+			else if (lq_pend(&p[np], (id + u) & 0xffff, r->fqdn,
+			    flags))
+				r->error = -10;
+			else
+				idx[np++] = u;
+			LEAP_PROBE1(query__entry, r->fqdn);
+		}
+		if (np == 0)
+			continue;
+		t0 = metric_usec();
+		(void)lq_tcp(res, p, np, (flags & LQ_TLS) != 0);
+		t0 = metric_usec() - t0;
+		for (k = 0; k < np; k++) {
+			r = &lr[idx[k]];
+			error = p[k].done && p[k].la.rcode == 0 ? 0 : -10;
+			r->error = lq_finish(server, port, r->fqdn, flags,
+			    now, &p[k], error, &r->year, &r->month, &r->tai,
+			    &r->delta, NULL);
+			metric_query(r->error, t0);
+			LEAP_PROBE3(query__return, r->fqdn, r->error, t0);
+		}
+	}
+	freeaddrinfo(res);
+	for (u = 0; u < n; u++)
+		fail += lr[u].error != 0;
+	return (fail);
+}
+
+/*
+ * Set up for LQ_TLS: the CA certificates to trust (default: the
+ * system's) and the name the server certificate must be for (default:
+ * its address).  Returns -1 if built without TLS support.
+ *
+ * A resumed session is not checked against the name again, so any
+ * saved session is forgotten here.  OpenSSL writes to the socket with
+ * write(2), so this also ignores SIGPIPE.
+ */
+
+int
+query_leapsecond_tls(const char *cafile, const char *name)
+{
+
+#ifdef WITH_OPENSSL
+	(void)signal(SIGPIPE, SIG_IGN);
+	if (lq_tls_sess != NULL)
+		SSL_SESSION_free(lq_tls_sess);
+	lq_tls_sess = NULL;
+	lq_tls_cafile = cafile;
+	lq_tls_name = name;
+	return (0);
+#else
+	(void)cafile;
+	(void)name;
+	return (-1);
+#endif
+}
+
+static void
+usage_query(void)
+{
+
+	fprintf(stderr,
+	    "Usage: dns_leap query [-DTt] [-a name] [-c cafile] [-p port] "
+	    "[-s server]\n\t\t[fqdn ...]\n");
+	fprintf(stderr, "\t-D\tRequire a DNSSEC validated answer\n");
+	fprintf(stderr, "\t-T\tQuery over TCP\n");
+	fprintf(stderr, "\t-t\tQuery over TLS\n");
+	fprintf(stderr, "\t-a\tName in the TLS server certificate\n");
+	fprintf(stderr, "\t-c\tTrusted TLS CA certificates\n");
+	exit(1);
+}
+
+int
+main_query(int argc, char **argv)
+{
+	const char *fqdn = "leapsecond.utcd.org";
+	const char *server = NULL, *port = NULL;
+	const char *cafile = NULL, *authname = NULL;
+	struct lq_result *lr;
+	int ch, error, year, month, tai, delta, i;
+	unsigned flags = 0;
+	char *ip = NULL;
+
+	while ((ch = getopt(argc, argv, "DTa:c:p:s:t")) != -1) {
+		switch (ch) {
+		case 'a':
+			authname = optarg;
+			break;
+		case 'c':
+			cafile = optarg;
+			break;
+		case 'D':
+			flags |= LQ_DNSSEC;
+			break;
+		case 'T':
+			flags |= LQ_TCP;
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 's':
+			server = optarg;
+			break;
+		case 't':
+			flags |= LQ_TLS;
+			break;
+		default:
+			usage_query();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (((flags & LQ_TLS) || cafile != NULL || authname != NULL) &&
+	    query_leapsecond_tls(cafile, authname)) {
+		fprintf(stderr, "Built without TLS support\n");
+		return (1);
+	}
+	if (argc > 1) {
+		lr = calloc(argc, sizeof *lr);
+		if (lr == NULL) {
+			perror("calloc");
+			return (1);
+		}
+		for (i = 0; i < argc; i++)
+			lr[i].fqdn = argv[i];
+		error = query_leapsecond_many(server, port, flags, lr, argc);
+		for (i = 0; i < argc; i++)
+			printf("  Name: %-24s  Error: %3d  Year: %4d  "
+			    "Month %2d  dTAI: %3d  Delta: %2d\n",
+			    lr[i].fqdn, lr[i].error, lr[i].year, lr[i].month,
+			    lr[i].tai, lr[i].delta);
+		free(lr);
+		return (error != 0);
+	}
+	if (argc == 1)
+		fqdn = argv[0];
+
+	error = query_leapsecond_ns(server, port, fqdn, flags,
+	    &year, &month, &tai, &delta, &ip);
+	if (error) {
+		printf("Failed with error %d\n", error);
+		return (1);
+	}
+	printf("  IP: %-15s  Error: %2d  Year: %4d  "
+	    "Month %2d  dTAI: %3d  Delta: %2d\n",
+	    ip, error, year, month, tai, delta);
+	free(ip);
+	return (0);
+}
+
+/*
+ * Make up the response a validating resolver would send to 'q'
+ */
+
+static size_t
+lq_fake_response(uint8_t *r, const uint8_t *q, size_t qend, int dnssec)
+{
+	size_t l = qend;
+
+	memcpy(r, q, qend);
+	r[2] |= 0x80;
+	r[3] = dnssec ? 0x20 : 0;
+	dns_put16(r + 6, dnssec ? 2 : 1);
+	dns_put16(r + 10, 0);
+
+	dns_put16(r + l, 0xc000 | DNS_HDRLEN);
+	dns_put16(r + l + 2, T_A);
+	dns_put16(r + l + 4, C_IN);
+	dns_put32(r + l + 6, 300);
+	dns_put16(r + l + 10, 4);
+	dns_put32(r + l + 12, 0xf41723ff);
+	l += 16;
+	if (dnssec) {
+		dns_put16(r + l, 0xc000 | DNS_HDRLEN);
+		dns_put16(r + l + 2, T_RRSIG);
+		dns_put16(r + l + 4, C_IN);
+		dns_put32(r + l + 6, 300);
+		dns_put16(r + l + 10, 18 + 1 + 64);
+		l += 12;
+		dns_put16(r + l, T_A);
+		r[l + 2] = 15;			/* Ed25519 */
+		r[l + 3] = 3;			/* Labels */
+		dns_put32(r + l + 4, 300);
+		dns_put32(r + l + 8, 0x70000000);	/* Expiration */
+		dns_put32(r + l + 12, 0x60000000);	/* Inception */
+		dns_put16(r + l + 16, 12345);	/* Key tag */
+		r[l + 18] = 0;			/* Signer: the root */
+		memset(r + l + 19, 0x5a, 64);	/* Signature */
+		l += 18 + 1 + 64;
+	}
+	return (l);
+}
+
+static void
+bench_answer_common(unsigned long n, int dnssec)
+{
+	struct lq_answer la;
+	uint8_t name[DNS_MAXNAME], q[DNS_MAXUDP], r[DNS_MAXUDP];
+	size_t qlen, rlen, qend;
+	unsigned long u;
+	int l, sum = 0, year, month, tai, delta;
+
+	l = dns_name("leapsecond.example.org", name, sizeof name);
+	qlen = lq_query(q, 0x4242, name, l, dnssec ? LQ_DNSSEC : 0);
+	qend = DNS_HDRLEN + l + 4;
+	rlen = lq_fake_response(r, q, qend, dnssec);
+	(void)qlen;
+	for (u = 0; u < n; u++) {
+		sum += lq_parse(r, rlen, q, qend, &la);
+		if (dnssec && !la.ad)
+			sum++;
+		sum += lq_decode(la.addr[0], &year, &month, &tai, &delta,
+		    NULL);
+	}
+	bench_sink += sum;
+}
+
+/*
+ * Client side cost of handling an answer, without and with DNSSEC
+ */
+
+void
+bench_answer(unsigned long n)
+{
+
+	bench_answer_common(n, 0);
+}
+
+void
+bench_answer_dnssec(unsigned long n)
+{
+
+	bench_answer_common(n, 1);
+}
+
+/*
+ * Pipelined queries, answered in reverse order after a stray response
+ */
+
+static void
+test_lq_tcp(void)
+{
+	static const char * const names[] = {
+		"a.example.org", "b.example.org", "c.example.org"
+	};
+	struct lq_pending p[3];
+	uint8_t r[2 + DNS_MAXUDP];
+	size_t rlen;
+	int sv[2], i, l;
+
+	printf("\nChecking pipelined TCP queries:\n\n");
+	l = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	assert(l == 0);
+	for (i = 0; i < 3; i++) {
+		l = lq_pend(&p[i], 0x1000 + i, names[i], 0);
+		assert(l == 0);
+	}
+	l = fcntl(sv[0], F_SETFL, O_NONBLOCK);
+	assert(l == 0);
+	for (i = 3; i >= 0; i--) {
+		p[i % 3].q[3] ^= i == 3 ? 0xff : 0;	/* Unknown ID */
+		rlen = lq_fake_response(r + 2, p[i % 3].q + 2, p[i % 3].qend,
+		    0);
+		p[i % 3].q[3] ^= i == 3 ? 0xff : 0;
+		dns_put16(r, rlen);
+		l = write(sv[1], r, 2 + rlen);
+		assert(l == (int)(2 + rlen));
+	}
+	l = lq_tcp_xfer(sv[0], p, 3, metric_usec() + 1000000);
+	for (i = 0; i < 3; i++)
+		printf("  Name: %-14s  ID: %04x  Done: %d  Addr: %08x\n",
+		    names[i], dns_get16(p[i].q + 2), p[i].done,
+		    p[i].la.addr[0]);
+	assert(l == 0);
+	for (i = 0; i < 3; i++)
+		assert(p[i].done && p[i].la.addr[0] == 0xf41723ff);
+	(void)close(sv[0]);
+	(void)close(sv[1]);
+}
+
+#ifdef WITH_OPENSSL
+/*
+ * A DoT server stand-in: a self-signed certificate for dot.example.org,
+ * and a thread answering queries on one end of a socketpair.
+ */
+
+struct lq_stand_in {
+	SSL_CTX			*ctx;
+	int			fd;
+	pthread_t		thr;
+};
+
+static X509 *
+lq_tls_cert(EVP_PKEY *key)
+{
+	X509_EXTENSION *ext;
+	X509_NAME *nm;
+	X509 *x;
+
+	x = X509_new();
+	assert(x != NULL);
+	(void)X509_set_version(x, 2);
+	(void)ASN1_INTEGER_set(X509_get_serialNumber(x), 1);
+	(void)X509_gmtime_adj(X509_getm_notBefore(x), -3600);
+	(void)X509_gmtime_adj(X509_getm_notAfter(x), 3600);
+	(void)X509_set_pubkey(x, key);
+	nm = X509_get_subject_name(x);
+	(void)X509_NAME_add_entry_by_txt(nm, "CN", MBSTRING_ASC,
+	    (const unsigned char *)"dot.example.org", -1, -1, 0);
+	(void)X509_set_issuer_name(x, nm);
+	ext = X509V3_EXT_conf_nid(NULL, NULL, NID_subject_alt_name,
+	    "DNS:dot.example.org");
+	assert(ext != NULL);
+	(void)X509_add_ext(x, ext, -1);
+	X509_EXTENSION_free(ext);
+	assert(X509_sign(x, key, EVP_sha256()) > 0);
+	return (x);
+}
+
+static void *
+lq_stand_in(void *priv)
+{
+	struct lq_stand_in *si = priv;
+	uint8_t q[2 + DNS_MAXUDP], r[2 + DNS_MAXUDP];
+	size_t qend;
+	SSL *ssl;
+	int l;
+
+	ssl = SSL_new(si->ctx);
+	assert(ssl != NULL);
+	(void)SSL_set_fd(ssl, si->fd);
+	if (SSL_accept(ssl) == 1) {
+		while (SSL_read(ssl, q, 2) == 2) {
+			l = dns_get16(q);
+			if (l > DNS_MAXUDP || SSL_read(ssl, q + 2, l) != l)
+				break;
+			qend = DNS_HDRLEN;
+			(void)lq_skipname(q + 2, l, &qend);
+			l = lq_fake_response(r + 2, q + 2, qend + 4, 0);
+			dns_put16(r, l);
+			if (SSL_write(ssl, r, 2 + l) != 2 + l)
+				break;
+		}
+		(void)SSL_shutdown(ssl);
+	}
+	SSL_free(ssl);
+	(void)close(si->fd);
+	return (NULL);
+}
+
+/*
+ * Three connections: a full handshake, a resumed one and one where the
+ * certificate is for the wrong name.
+ */
+
+static void
+test_lq_tls(void)
+{
+	static const char * const names[] = {
+		"dot.example.org", "dot.example.org", "wrong.example.org"
+	};
+	struct lq_stand_in si;
+	struct lq_pending p;
+	EVP_PKEY *key;
+	X509 *cert;
+	int sv[2], i, l, reused;
+
+	printf("\nChecking DNS over TLS:\n\n");
+	(void)query_leapsecond_tls(NULL, names[0]);
+	key = EVP_EC_gen("P-256");
+	assert(key != NULL);
+	cert = lq_tls_cert(key);
+	si.ctx = SSL_CTX_new(TLS_server_method());
+	assert(si.ctx != NULL);
+	assert(SSL_CTX_use_certificate(si.ctx, cert) == 1);
+	assert(SSL_CTX_use_PrivateKey(si.ctx, key) == 1);
+	assert(lq_tls_init() != NULL);
+	assert(X509_STORE_add_cert(SSL_CTX_get_cert_store(lq_tls_ctx),
+	    cert) == 1);
+
+	for (i = 0; i < 3; i++) {
+		if (i == 2)
+			(void)query_leapsecond_tls(NULL, names[i]);
+		l = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+		assert(l == 0);
+		si.fd = sv[1];
+		l = pthread_create(&si.thr, NULL, lq_stand_in, &si);
+		assert(l == 0);
+		l = fcntl(sv[0], F_SETFL, O_NONBLOCK);
+		assert(l == 0);
+		lq_tcp_fd = sv[0];
+		l = lq_tls_start(sv[0], NULL);
+		assert(l == 0);
+		l = lq_pend(&p, 0x2000 + i, "leapsecond.example.org", 0);
+		assert(l == 0);
+		l = lq_tcp_xfer(sv[0], &p, 1, metric_usec() + 2000000);
+		reused = SSL_session_reused(lq_tls);
+		lq_tcp_close();
+		(void)pthread_join(si.thr, NULL);
+		printf("  Name: %-17s  Result: %2d  Done: %d  Resumed: %d\n",
+		    names[i], l, p.done, reused);
+		assert(l == (i < 2 ? 0 : -1));
+		assert(reused == (i == 1));
+		if (l == 0)
+			assert(p.la.addr[0] == 0xf41723ff);
+	}
+	(void)query_leapsecond_tls(NULL, NULL);
+	SSL_CTX_free(si.ctx);
+	X509_free(cert);
+	EVP_PKEY_free(key);
+}
+#endif
+
+void
+test_leap_query(void)
+{
+	struct lq_answer la;
+	uint8_t name[DNS_MAXNAME], q[DNS_MAXUDP], r[DNS_MAXUDP];
+	size_t qlen, rlen, qend;
+	int l;
+
+	printf("\nChecking native query parsing:\n\n");
+	l = dns_name("LeapSecond.example.org", name, sizeof name);
+	assert(l > 0);
+	qend = DNS_HDRLEN + l + 4;
+	qlen = lq_query(q, 0x4242, name, l, LQ_DNSSEC);
+	assert(qlen == qend + 11);
+	assert(q[3] == LQ_DNSSEC_BITS && q[qend + 7] == 0x80);
+
+	rlen = lq_fake_response(r, q, qend, 1);
+	r[DNS_HDRLEN + 1] = 'l';		/* 0x20 case change */
+	assert(lq_parse(r, rlen, q, qend, &la) == 0);
+	printf("  Signed:   Addr: %08x  TTL: %u  AD: %d  Sigexp: %08x\n",
+	    la.addr[0], la.ttl, la.ad, la.sigexp);
+	assert(la.naddr == 1 && la.addr[0] == 0xf41723ff);
+	assert(la.ttl == 300 && la.ad && la.sigexp == 0x70000000);
+
+	rlen = lq_fake_response(r, q, qend, 0);
+	assert(lq_parse(r, rlen, q, qend, &la) == 0);
+	printf("  Unsigned: Addr: %08x  TTL: %u  AD: %d  Sigexp: %08x\n",
+	    la.addr[0], la.ttl, la.ad, la.sigexp);
+	assert(la.naddr == 1 && !la.ad && la.sigexp == 0);
+
+	assert(lq_parse(r, rlen - 1, q, qend, &la) == -1);
+	r[1] ^= 1;
+	assert(lq_parse(r, rlen, q, qend, &la) == -1);
+	r[1] ^= 1;
+	r[DNS_HDRLEN + 2] = 'x';
+	assert(lq_parse(r, rlen, q, qend, &la) == -1);
+
+	test_lq_tcp();
+#ifdef WITH_OPENSSL
+	test_lq_tls();
+#endif
+}
@@ -0,0 +1,3135 @@
+/*-
+ * Copyright (c) 2015 Poul-Henning Kamp <phk@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Authoritative DNS responder for the leap second announcement.
+ *
+ * All answers are serialized once, when the announcement is loaded,
+ * and kept in a response cache keyed by lower-cased query name, query
+ * type (A or "anything else") and presence of EDNS.  On a hit, the
+ * cached packet is copied out and only the parts which come from the
+ * query are patched in:  The transaction ID, the RD bit and the
+ * question section, the latter so that the case of the query name is
+ * echoed back, as DNS 0x20 requires.  The answer RR points to the
+ * question with a compression pointer, so it is never touched.
+ *
+ * Queries for names below a served name get NXDOMAIN, all other names
+ * get REFUSED.  Neither is cached, they are not the hot path.
+ *
+ * On Linux, queries are received and answered in batches with
+ * recvmmsg(2)/sendmmsg(2), amortizing the system call overhead over up
+ * to SERVE_BATCH packets.  With '-j N', N threads each serve their own
+ * SO_REUSEPORT socket, so the kernel spreads the load across cores and
+ * the threads share nothing but the read-only response cache.
+ *
+ * With '-X ifname' (Linux, built with -DWITH_XDP), plain IPv4 UDP
+ * queries arriving on that interface are steered by an XDP program
+ * into AF_XDP sockets, one per receive queue up to '-j', and answered
+ * in place from user space without going through the network stack.
+ * Every other packet takes the normal path to the sockets above.  See
+ * leap_xdp.c.
+ *
+ * Response rate limiting ('-r') uses token buckets keyed by source
+ * prefix (/24 or /56), in a 4-way set-associative table indexed by a
+ * hash with a random seed, so that colliding prefixes cannot be picked
+ * from outside.  A new prefix, or one which was evicted, starts with
+ * one response rather than a full bucket.  Each thread has its own
+ * table, so there are no locks or shared cache lines on the hot path,
+ * and each thread allows the full rate, so that a client on one source
+ * port, which SO_REUSEPORT keeps on one thread, sees exactly the
+ * configured limit.  A prefix whose queries come from many ports, as
+ * spoofed ones do, is spread over all the threads and AF_XDP queues;
+ * for that, every RRL_SHARE ms one more thread adds up what each
+ * prefix was given by each table and charges every table what the
+ * others gave, see rrl_share().  Between two passes each table can
+ * still give a prefix what is left in its bucket, after that the
+ * threads together hold it to about the configured rate.
+ *
+ * When a prefix is over its limit, every '-s'th response "slips" out
+ * as an empty TC=1 answer, so that a real client behind a spoofed
+ * prefix can still retry over TCP, the rest are dropped.
+ *
+ * On Linux, TCP is served by one more thread with an edge-triggered
+ * epoll(7) loop.  Each connection can have several queries in flight
+ * (RFC 7766 pipelining), they are answered as soon as they are complete
+ * in the input buffer, so a client must match responses by ID.  The
+ * listening socket accepts TCP Fast Open, so a repeat client gets its
+ * first answer without waiting for the handshake.  Idle connections
+ * are closed after TCP_IDLE seconds.  Elsewhere only UDP is served.
+ *
+ * With '-H', the announcement is the last entry of an IERS leap second
+ * history file.  On SIGHUP, or on Linux when the history file or the
+ * signed zone is replaced, a separate thread builds a new response
+ * cache and publishes it with one atomic pointer swap.  The workers
+ * take no locks:  Each one picks up the current cache when it returns
+ * from the kernel with packets, and says so by posting the current
+ * epoch.  While blocked in the kernel it holds no cache and posts
+ * epoch zero.  The old cache is freed once all workers have been seen
+ * in a newer epoch, or offline.  If the files do not load, the old
+ * answers stay in service.
+ *
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE		/* recvmmsg(2), sendmmsg(2), accept4(2) */
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#endif
+
+#include "dns_leap.h"
+
+#define DNS_TTL		3600
+
+#define SERVE_BATCH	32
+#define SERVE_MAXJOBS	64
+
+#define SERVE_MAXHIST	256		/* History file entries */
+
+#define TCP_MAXCONN	1024
+#define TCP_IDLE	10		/* Seconds */
+#define TCP_PIPE	4		/* Buffered queries per connection */
+#define TCP_TFOQLEN	16		/* Pending TCP Fast Open requests */
+
+#define RRL_BITS	10		/* Sets */
+#define RRL_WAYS	4
+#define RRL_UNIT	1000		/* Tokens per response */
+#define RRL_SHARE	100		/* Cross-thread charging, ms */
+#define RRL_MAXRATE	1000000
+
+struct dns_query {
+	uint8_t			name[DNS_MAXNAME];	/* Lower case */
+	size_t			namelen;
+	int			qtype;
+	int			qclass;
+	int			edns;		/* 0: none, 1: EDNS, 2: +DO */
+	unsigned		udpsize;
+	size_t			qend;		/* End of question */
+};
+
+struct serve_entry {
+	uint8_t			name[DNS_MAXNAME];	/* Lower case */
+	size_t			namelen;
+	int			qtype;		/* T_A, T_DNSKEY or zero */
+	int			edns;
+	size_t			pktlen;
+	uint8_t			pkt[DNS_EDNS_SIZE];
+};
+
+/*
+ * Pre-signed records for the served name, see serve_rrs_parse()
+ */
+
+#define SERVE_MAXRRS	8
+#define SERVE_MAXRDATA	600
+
+struct serve_rrs {
+	unsigned		na;		/* The signed A RRset */
+	uint32_t		a[SERVE_MAXHIST];
+	uint32_t		attl;		/* Not DNS_TTL, if any is */
+	unsigned		n;
+	struct {
+		int		type;
+		int		covered;	/* RRSIG only */
+		uint32_t	expire;		/* RRSIG only */
+		size_t		len;
+		uint8_t		rdata[SERVE_MAXRDATA];
+	} rr[SERVE_MAXRRS];
+};
+
+#define SERVE_PERNAME	9		/* 3 qtypes x 3 EDNS variants */
+#define SERVE_MAXBUCKET	32		/* Names per hash bucket */
+#define SERVE_MAXDISP	65536		/* Displacements to try */
+#define SERVE_MAXSEED	64		/* Hash seeds to try */
+#define SERVE_MAXBULL	342		/* Half years the encoding covers */
+
+struct serve_cache {
+	unsigned		n;		/* Entries */
+	unsigned		nname;
+	unsigned		maxname;
+	uint64_t		seed;
+	uint32_t		bmask;		/* Buckets - 1 */
+	uint32_t		mask;		/* Slots - 1 */
+	uint32_t		*disp;		/* Displacement per bucket */
+	uint32_t		*slot;		/* Name index per slot */
+	uint32_t		*bull;		/* Bulletins per name */
+	struct serve_entry	e[];
+};
+
+/*
+ * Convert "leapsecond.utcd.org" to wire format, returns length or -1
+ */
+
+int
+dns_name(const char *fqdn, uint8_t *wire, size_t len)
+{
+	const char *p;
+	size_t l, pos = 0;
+
+	while (*fqdn != '\0') {
+		p = strchr(fqdn, '.');
+		l = p != NULL ? (size_t)(p - fqdn) : strlen(fqdn);
+		if (l == 0 || l > 63 || pos + 1 + l + 1 > len)
+			return (-1);
+		wire[pos++] = l;
+		memcpy(wire + pos, fqdn, l);
+		pos += l;
+		fqdn += l;
+		if (*fqdn == '.')
+			fqdn++;
+	}
+	if (pos + 1 > len || pos + 1 > DNS_MAXNAME)
+		return (-1);
+	wire[pos++] = 0;
+	return ((int)pos);
+}
+
+/*
+ * Pre-signed records -------------------------------------------------
+ *
+ * The responder does not sign anything, so no private key is kept on
+ * it.  The A RRsets it serves, with TTL DNS_TTL, and the DNSKEY RRset
+ * are signed offline with standard tools (dnssec-signzone,
+ * ldns-signzone, ...), and '-S' loads the RRSIG and DNSKEY records for
+ * the served name from their output.  '-E' prints those A RRsets as a
+ * zone file for the signer, see serve_emit(), so that re-signing is a
+ * pipeline which can run from cron or whatever changes the
+ * announcement.  The records are serialized into the response cache
+ * like everything else, so online signing costs nothing.  Signing only
+ * needs to be redone when the announcement or history changes, or
+ * before the signatures expire, which serve_rrs_check() warns about.
+ *
+ * The A records in the file, and their TTL, are read too, because the
+ * RRSIG only verifies over exactly the A RRset which was signed.  If
+ * that is not the one served, a signer run against a stale zone file,
+ * serve_rrs_verify() complains and the responder refuses DO queries
+ * for the name rather than hand validators a bogus answer.
+ *
+ * Only the subset of the master file format these tools emit for the
+ * three record types is understood: owner name first, or blank for the
+ * previous owner, optional TTL and class, $TTL, parentheses for records
+ * spanning lines, and ';' comments.
+ */
+
+#define SERVE_RESIGN	(3 * 86400)	/* Warn this long before expiry */
+#define SERVE_MAXTOK	64
+
+static int
+b64_decode(const char *src, uint8_t *dst, size_t len)
+{
+	static const char b64[] =
+	    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	const char *p;
+	uint32_t acc = 0;
+	size_t n = 0;
+	int bits = 0;
+
+	for (; *src != '\0' && *src != '='; src++) {
+		p = strchr(b64, *src);
+		if (p == NULL)
+			return (-1);
+		acc = (acc << 6) | (uint32_t)(p - b64);
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			if (n >= len)
+				return (-1);
+			dst[n++] = acc >> bits;
+		}
+	}
+	return ((int)n);
+}
+
+/*
+ * RRSIG times are YYYYMMDDHHmmSS, or plain seconds since the epoch
+ */
+
+static int
+rrs_time(const char *s, uint32_t *t)
+{
+	struct tm tm;
+	char *e;
+
+	if (strlen(s) == 14 && strspn(s, "0123456789") == 14) {
+		memset(&tm, 0, sizeof tm);
+		if (sscanf(s, "%4d%2d%2d%2d%2d%2d", &tm.tm_year, &tm.tm_mon,
+		    &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+			return (-1);
+		tm.tm_year -= 1900;
+		tm.tm_mon -= 1;
+		*t = (uint32_t)timegm(&tm);
+		return (0);
+	}
+	*t = strtoul(s, &e, 10);
+	return (*e == '\0' ? 0 : -1);
+}
+
+static int
+rrs_type(const char *s)
+{
+
+	if (!strcasecmp(s, "A"))
+		return (T_A);
+	if (!strcasecmp(s, "DNSKEY"))
+		return (T_DNSKEY);
+	if (!strcasecmp(s, "RRSIG"))
+		return (T_RRSIG);
+	if (!strncasecmp(s, "TYPE", 4))
+		return (atoi(s + 4));
+	return (-1);
+}
+
+static int
+rrs_owner(const char *tok, const char *fqdn)
+{
+	size_t l = strlen(fqdn);
+
+	if (l > 0 && fqdn[l - 1] == '.')
+		l--;
+	return (!strncasecmp(tok, fqdn, l) &&
+	    (tok[l] == '\0' || !strcmp(tok + l, ".")));
+}
+
+/*
+ * One record, already split into tokens, the type at tok[0]
+ */
+
+static int
+rrs_record(char **tok, int ntok, uint32_t ttl, struct serve_rrs *rrs)
+{
+	struct in_addr in;
+	uint8_t *p;
+	uint32_t t;
+	int type, l, i;
+	char b64[SERVE_MAXRDATA * 2];
+
+	type = rrs_type(tok[0]);
+	if (type == T_A) {
+		if (ntok < 2 || inet_pton(AF_INET, tok[1], &in) != 1 ||
+		    rrs->na >= SERVE_MAXHIST)
+			return (-1);
+		rrs->a[rrs->na++] = ntohl(in.s_addr);
+		if (ttl != DNS_TTL)
+			rrs->attl = ttl;
+		return (0);
+	}
+	if (type != T_RRSIG && type != T_DNSKEY)
+		return (0);
+	if (rrs->n >= SERVE_MAXRRS)
+		return (-1);
+	p = rrs->rr[rrs->n].rdata;
+	b64[0] = '\0';
+	if (type == T_RRSIG) {
+		if (ntok < 10)
+			return (-1);
+		rrs->rr[rrs->n].covered = rrs_type(tok[1]);
+		if (rrs->rr[rrs->n].covered < 0 || atoi(tok[4]) != DNS_TTL)
+			return (-1);
+		dns_put16(p, rrs->rr[rrs->n].covered);
+		p[2] = atoi(tok[2]);
+		p[3] = atoi(tok[3]);
+		dns_put32(p + 4, atoi(tok[4]));
+		if (rrs_time(tok[5], &t))
+			return (-1);
+		dns_put32(p + 8, t);
+		rrs->rr[rrs->n].expire = t;
+		if (rrs_time(tok[6], &t))
+			return (-1);
+		dns_put32(p + 12, t);
+		dns_put16(p + 16, atoi(tok[7]));
+		l = dns_name(tok[8], p + 18, SERVE_MAXRDATA - 18);
+		if (l < 0)
+			return (-1);
+		for (i = 0; i < l; i++)
+			p[18 + i] = dns_lower(p[18 + i]);
+		l += 18;
+		i = 9;
+	} else {
+		if (ntok < 5)
+			return (-1);
+		dns_put16(p, atoi(tok[1]));
+		p[2] = atoi(tok[2]);
+		p[3] = atoi(tok[3]);
+		l = 4;
+		i = 4;
+	}
+	for (; i < ntok; i++) {
+		if (strlen(b64) + strlen(tok[i]) >= sizeof b64)
+			return (-1);
+		strcat(b64, tok[i]);
+	}
+	i = b64_decode(b64, p + l, SERVE_MAXRDATA - l);
+	if (i <= 0)
+		return (-1);
+	rrs->rr[rrs->n].type = type;
+	rrs->rr[rrs->n].len = l + i;
+	rrs->n++;
+	return (0);
+}
+
+/*
+ * Pick the A, RRSIG and DNSKEY records for 'fqdn' out of master file
+ * text.  Returns -1 on syntax error.
+ */
+
+static int
+serve_rrs_parse(char *text, const char *fqdn, struct serve_rrs *rrs)
+{
+	char *tok[SERVE_MAXTOK], *p, *q, *r;
+	int ntok, paren = 0, ours = 0, blank, i;
+	uint32_t ttl = DNS_TTL, dttl = 0;
+
+	memset(rrs, 0, sizeof *rrs);
+	rrs->attl = DNS_TTL;
+	/* Strip comments, and join lines in parentheses */
+	for (p = q = text; *p != '\0'; p++) {
+		if (*p == ';') {
+			while (p[1] != '\0' && p[1] != '\n')
+				p++;
+			continue;
+		}
+		if (*p == '(' || *p == ')') {
+			paren += *p == '(' ? 1 : -1;
+			*q++ = ' ';
+		} else if (*p == '\n' && paren > 0) {
+			*q++ = ' ';
+		} else {
+			*q++ = *p;
+		}
+	}
+	*q = '\0';
+
+	for (p = strtok_r(text, "\n", &q); p != NULL;
+	    p = strtok_r(NULL, "\n", &q)) {
+		blank = *p == ' ' || *p == '\t';
+		ntok = 0;
+		for (tok[ntok] = strtok_r(p, " \t\r", &r);
+		    tok[ntok] != NULL && ntok < SERVE_MAXTOK - 1;
+		    tok[ntok] = strtok_r(NULL, " \t\r", &r))
+			ntok++;
+		if (ntok == 0)
+			continue;
+		if (!strcasecmp(tok[0], "$TTL")) {
+			if (ntok > 1)
+				dttl = ttl = strtoul(tok[1], NULL, 10);
+			continue;
+		}
+		if (!blank)
+			ours = -1;	/* Owner to be checked below */
+		i = 0;
+		if (ours < 0)
+			ours = rrs_owner(tok[i++], fqdn);
+		if (!ours)
+			continue;
+		/* Without a TTL: $TTL, else the last one given */
+		if (dttl != 0)
+			ttl = dttl;
+		while (i < ntok && (strspn(tok[i], "0123456789") ==
+		    strlen(tok[i]) || !strcasecmp(tok[i], "IN"))) {
+			if (strcasecmp(tok[i], "IN"))
+				ttl = strtoul(tok[i], NULL, 10);
+			i++;
+		}
+		if (i < ntok && rrs_record(tok + i, ntok - i, ttl, rrs))
+			return (-1);
+	}
+	return (paren == 0 ? 0 : -1);
+}
+
+/*
+ * Complain about RRSIGs which need renewing, returns how many
+ */
+
+static int
+serve_rrs_check(const struct serve_rrs *rrs, time_t now)
+{
+	unsigned u;
+	int n = 0;
+
+	for (u = 0; u < rrs->n; u++) {
+		if (rrs->rr[u].type != T_RRSIG)
+			continue;
+		if ((time_t)rrs->rr[u].expire - now < SERVE_RESIGN) {
+			fprintf(stderr, "RRSIG covering type %d expires at "
+			    "%u, re-sign\n", rrs->rr[u].covered,
+			    rrs->rr[u].expire);
+			n++;
+		}
+	}
+	return (n);
+}
+
+static int
+serve_rrs_has(const uint32_t *a, unsigned n, uint32_t addr)
+{
+
+	while (n-- > 0)
+		if (a[n] == addr)
+			return (1);
+	return (0);
+}
+
+/*
+ * Is the signed A RRset in 'rrs', if any, the one served for 'fqdn'?
+ * Complains and returns -1 if not.
+ */
+
+static int
+serve_rrs_verify(const struct serve_rrs *rrs, const char *fqdn,
+    const uint32_t *addr, unsigned naddr)
+{
+	unsigned u;
+	int sig = 0;
+
+	for (u = 0; rrs != NULL && u < rrs->n; u++)
+		sig |= rrs->rr[u].type == T_RRSIG && rrs->rr[u].covered == T_A;
+	if (!sig)
+		return (0);
+	if (rrs->attl != DNS_TTL) {
+		fprintf(stderr, "%s: The signed A RRset has TTL %u, not %u,"
+		    " refusing DO queries for it\n", fqdn, rrs->attl, DNS_TTL);
+		return (-1);
+	}
+	for (u = 0; u < naddr && rrs->na == naddr; u++)
+		if (!serve_rrs_has(rrs->a, rrs->na, addr[u]) ||
+		    !serve_rrs_has(addr, naddr, rrs->a[u]))
+			break;
+	if (rrs->na == naddr && u == naddr)
+		return (0);
+	fprintf(stderr, "%s: The signed A RRset is not the one served,"
+	    " refusing DO queries for it, re-sign\n", fqdn);
+	for (u = 0; u < rrs->na; u++)
+		fprintf(stderr, "\tSigned: %u.%u.%u.%u\n", rrs->a[u] >> 24,
+		    (rrs->a[u] >> 16) & 0xff, (rrs->a[u] >> 8) & 0xff,
+		    rrs->a[u] & 0xff);
+	for (u = 0; u < naddr; u++)
+		fprintf(stderr, "\tServed: %u.%u.%u.%u\n", addr[u] >> 24,
+		    (addr[u] >> 16) & 0xff, (addr[u] >> 8) & 0xff,
+		    addr[u] & 0xff);
+	return (-1);
+}
+
+static int
+serve_rrs_load(const char *path, const char *fqdn, struct serve_rrs *rrs)
+{
+	char buf[65536];
+	size_t n;
+	FILE *fi;
+
+	fi = fopen(path, "r");
+	if (fi == NULL)
+		return (-1);
+	n = fread(buf, 1, sizeof buf - 1, fi);
+	(void)fclose(fi);
+	buf[n] = '\0';
+	return (serve_rrs_parse(buf, fqdn, rrs));
+}
+
+/*
+ * Parse the query, returns -1 if it should be dropped.
+ */
+
+static int
+dns_parse(const uint8_t *q, size_t len, struct dns_query *dq)
+{
+	size_t pos = DNS_HDRLEN;
+	unsigned l, i;
+
+	memset(dq, 0, sizeof *dq);
+	if (len < DNS_HDRLEN)
+		return (-1);
+	if (q[2] & 0xf8)		/* QR or opcode set */
+		return (-1);
+	if (dns_get16(q + 4) != 1)	/* QDCOUNT */
+		return (-1);
+	do {
+		if (pos >= len)
+			return (-1);
+		l = q[pos];
+		if (l & 0xc0)
+			return (-1);
+		if (pos + 1 + l > len || dq->namelen + 1 + l > DNS_MAXNAME)
+			return (-1);
+		dq->name[dq->namelen++] = l;
+		for (i = 0; i < l; i++)
+			dq->name[dq->namelen++] = dns_lower(q[pos + 1 + i]);
+		pos += 1 + l;
+	} while (l != 0);
+	if (pos + 4 > len)
+		return (-1);
+	dq->qtype = dns_get16(q + pos);
+	dq->qclass = dns_get16(q + pos + 2);
+	pos += 4;
+	dq->qend = pos;
+	dq->udpsize = DNS_MAXUDP;
+	if (dns_get16(q + 10) > 0 && pos + 11 <= len && q[pos] == 0 &&
+	    dns_get16(q + pos + 1) == T_OPT) {
+		dq->edns = (q[pos + 7] & 0x80) ? 2 : 1;		/* DO */
+		if (dns_get16(q + pos + 3) > DNS_MAXUDP)
+			dq->udpsize = dns_get16(q + pos + 3);
+	}
+	return (0);
+}
+
+/*
+ * Serialize the header and question of a response with ID zero
+ */
+
+static size_t
+dns_hdr(uint8_t *p, const uint8_t *name, size_t namelen, int qtype,
+    int rcode)
+{
+	size_t l;
+
+	memset(p, 0, DNS_HDRLEN);
+	p[2] = 0x80;			/* QR */
+	if (rcode != R_REFUSED)
+		p[2] |= 0x04;		/* AA */
+	p[3] = rcode;
+	dns_put16(p + 4, 1);
+	l = DNS_HDRLEN;
+
+	memcpy(p + l, name, namelen);
+	l += namelen;
+	dns_put16(p + l, qtype);
+	dns_put16(p + l + 2, C_IN);
+	return (l + 4);
+}
+
+/*
+ * Append an answer RR, owned by the query name
+ */
+
+static size_t
+dns_rr(uint8_t *p, size_t l, int type, const uint8_t *rdata, size_t rdlen)
+{
+
+	dns_put16(p + l, 0xc000 | DNS_HDRLEN);
+	dns_put16(p + l + 2, type);
+	dns_put16(p + l + 4, C_IN);
+	dns_put32(p + l + 6, DNS_TTL);
+	dns_put16(p + l + 10, rdlen);
+	memcpy(p + l + 12, rdata, rdlen);
+	dns_put16(p + 6, dns_get16(p + 6) + 1);
+	return (l + 12 + rdlen);
+}
+
+static size_t
+dns_opt(uint8_t *p, size_t l, int dnssec_ok)
+{
+
+	p[l] = 0;
+	dns_put16(p + l + 1, T_OPT);
+	dns_put16(p + l + 3, DNS_EDNS_SIZE);
+	dns_put16(p + l + 5, 0);
+	dns_put16(p + l + 7, dnssec_ok ? 0x8000 : 0);
+	dns_put16(p + l + 9, 0);
+	dns_put16(p + 10, dns_get16(p + 10) + 1);
+	return (l + 11);
+}
+
+/*
+ * Answer RRs of type 'type', with their RRSIGs if 'edns' says DO.
+ */
+
+static size_t
+serve_rrset(uint8_t *p, size_t l, int type, const struct serve_rrs *rrs,
+    int edns)
+{
+	unsigned u;
+
+	for (u = 0; rrs != NULL && u < rrs->n; u++)
+		if (rrs->rr[u].type == type)
+			l = dns_rr(p, l, type, rrs->rr[u].rdata,
+			    rrs->rr[u].len);
+	for (u = 0; edns == 2 && rrs != NULL && u < rrs->n; u++)
+		if (rrs->rr[u].type == T_RRSIG && rrs->rr[u].covered == type)
+			l = dns_rr(p, l, T_RRSIG, rrs->rr[u].rdata,
+			    rrs->rr[u].len);
+	return (l);
+}
+
+/*
+ * Perfect hash over the served names, built at load time: the hash of
+ * a name picks a bucket, the bucket's displacement 'd' moves the name
+ * to slot (h1 + d * h2) & mask, and 'd' is chosen for each bucket, the
+ * fullest first, so that no two names share a slot.  With half the
+ * slots empty and four names per bucket, small displacements do.
+ */
+
+static inline uint64_t
+serve_hash(const uint8_t *p, size_t l, uint64_t seed)
+{
+	uint64_t h = seed ^ 0xcbf29ce484222325ULL;	/* FNV-1a */
+
+	while (l-- > 0) {
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
+	h ^= h >> 29;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	return (h ^ (h >> 32));
+}
+
+static inline uint32_t
+serve_slot(const struct serve_cache *sc, uint64_t h)
+{
+	uint32_t d, h2;
+
+	d = sc->disp[(h >> 32) & sc->bmask];
+	h2 = (uint32_t)((h * 0x9e3779b97f4a7c15ULL) >> 32) | 1;
+	return (((uint32_t)h + d * h2) & sc->mask);
+}
+
+static uint32_t
+serve_pow2(uint32_t n)
+{
+	uint32_t u = 1;
+
+	while (u < n)
+		u <<= 1;
+	return (u);
+}
+
+static struct serve_cache *
+serve_cache_new(unsigned nname)
+{
+	struct serve_cache *sc;
+	uint32_t nb, ns;
+
+	nb = serve_pow2((nname + 3) / 4);
+	ns = serve_pow2(2 * nname);
+	sc = calloc(1, sizeof *sc +
+	    (size_t)nname * SERVE_PERNAME * sizeof sc->e[0] +
+	    (nb + ns + (size_t)nname * SERVE_MAXBULL) * sizeof(uint32_t));
+	if (sc == NULL)
+		return (NULL);
+	sc->maxname = nname;
+	sc->bmask = nb - 1;
+	sc->mask = ns - 1;
+	sc->disp = (uint32_t *)(void *)(sc->e + nname * SERVE_PERNAME);
+	sc->slot = sc->disp + nb;
+	sc->bull = sc->slot + ns;
+	return (sc);
+}
+
+/*
+ * Add 'fqdn' answering the 'naddr' addresses in 'addr', with the
+ * pre-signed records in 'rrs', which may be NULL.  Fails if the largest
+ * answer would not fit in a packet.
+ */
+
+static int
+serve_cache_addset(struct serve_cache *sc, const char *fqdn,
+    const uint32_t *addr, int naddr, const struct serve_rrs *rrs)
+{
+	static const int qtypes[] = { T_A, T_DNSKEY, 0 };
+	struct serve_entry *e;
+	uint8_t name[DNS_MAXNAME], a[4];
+	int i, j, l, edns, stale;
+	size_t pl;
+	unsigned u;
+
+	if (sc->nname == sc->maxname)
+		return (-1);
+	stale = serve_rrs_verify(rrs, fqdn, addr, (unsigned)naddr);
+	l = dns_name(fqdn, name, sizeof name);
+	if (l < 0)
+		return (-1);
+	for (i = 0; i < l; i++)
+		name[i] = dns_lower(name[i]);
+	pl = DNS_HDRLEN + l + 4 + naddr * 16 + 11;
+	for (u = 0; rrs != NULL && u < rrs->n; u++)
+		pl += 12 + rrs->rr[u].len;
+	if (pl > DNS_EDNS_SIZE)
+		return (-1);
+
+	for (i = 0; i < 3; i++) {
+		for (edns = 0; edns <= 2; edns++) {
+			e = &sc->e[sc->n++];
+			memcpy(e->name, name, l);
+			e->namelen = l;
+			e->qtype = qtypes[i];
+			e->edns = edns;
+			if (stale && qtypes[i] == T_A && edns == 2) {
+				pl = dns_hdr(e->pkt, name, l, T_A, R_REFUSED);
+				e->pktlen = dns_opt(e->pkt, pl, 1);
+				continue;
+			}
+			pl = dns_hdr(e->pkt, name, l, qtypes[i], 0);
+			for (j = 0; qtypes[i] == T_A && j < naddr; j++) {
+				dns_put32(a, addr[j]);
+				pl = dns_rr(e->pkt, pl, T_A, a, 4);
+			}
+			if (qtypes[i] != 0)
+				pl = serve_rrset(e->pkt, pl, qtypes[i], rrs,
+				    edns);
+			if (edns)
+				pl = dns_opt(e->pkt, pl, edns == 2);
+			e->pktlen = pl;
+		}
+	}
+	sc->nname++;
+	return (0);
+}
+
+static int
+serve_cache_add(struct serve_cache *sc, const char *fqdn, uint32_t addr,
+    const struct serve_rrs *rrs)
+{
+
+	return (serve_cache_addset(sc, fqdn, &addr, 1, rrs));
+}
+
+static const struct serve_entry *
+serve_name(const struct serve_cache *sc, uint32_t i)
+{
+
+	return (&sc->e[i * SERVE_PERNAME]);
+}
+
+/*
+ * Try to place all names with hash seed 'seed'.  Returns 0 on success,
+ * 1 to try another seed and -1 if a name is there twice.
+ */
+
+static int
+serve_cache_place(struct serve_cache *sc, uint64_t seed, uint64_t *h,
+    uint32_t *cnt, uint32_t *list, uint8_t *used)
+{
+	const struct serve_entry *e1, *e2;
+	uint32_t nb = sc->bmask + 1, ns = sc->mask + 1;
+	uint32_t b, d, i, j, k, sz, maxsz = 0, s[SERVE_MAXBUCKET];
+
+	sc->seed = seed;
+	memset(cnt, 0, (nb + 1) * sizeof *cnt);
+	memset(used, 0, ns);
+	for (i = 0; i < sc->nname; i++) {
+		e1 = serve_name(sc, i);
+		h[i] = serve_hash(e1->name, e1->namelen, seed);
+		cnt[((h[i] >> 32) & sc->bmask) + 1]++;
+	}
+	for (b = 0; b < nb; b++) {
+		if (cnt[b + 1] > SERVE_MAXBUCKET)
+			return (1);
+		if (cnt[b + 1] > maxsz)
+			maxsz = cnt[b + 1];
+		cnt[b + 1] += cnt[b];
+	}
+	for (i = 0; i < sc->nname; i++)
+		list[cnt[(h[i] >> 32) & sc->bmask]++] = i;
+	/* cnt[b] is now the end of bucket b, and the start of b + 1 */
+
+	for (sz = maxsz; sz > 0; sz--) {
+		for (b = 0; b < nb; b++) {
+			j = b > 0 ? cnt[b - 1] : 0;
+			if (cnt[b] - j != sz)
+				continue;
+			for (i = 0; i < sz; i++) {
+				e1 = serve_name(sc, list[j + i]);
+				for (k = 0; k < i; k++) {
+					e2 = serve_name(sc, list[j + k]);
+					if (e1->namelen == e2->namelen &&
+					    !memcmp(e1->name, e2->name,
+					    e1->namelen))
+						return (-1);
+				}
+			}
+			for (d = 0; d < SERVE_MAXDISP; d++) {
+				sc->disp[b] = d;
+				for (i = 0; i < sz; i++) {
+					s[i] = serve_slot(sc, h[list[j + i]]);
+					if (used[s[i]])
+						break;
+					used[s[i]] = 1;
+				}
+				if (i == sz)
+					break;
+				while (i-- > 0)
+					used[s[i]] = 0;
+			}
+			if (d == SERVE_MAXDISP)
+				return (1);
+			for (i = 0; i < sz; i++)
+				sc->slot[s[i]] = list[j + i];
+		}
+	}
+	return (0);
+}
+
+static int
+serve_cache_index(struct serve_cache *sc)
+{
+	uint64_t *h;
+	uint32_t *cnt, *list;
+	uint8_t *used;
+	int retval = -1;
+	unsigned u;
+
+	h = calloc(sc->nname, sizeof *h);
+	cnt = calloc(sc->bmask + 2, sizeof *cnt);
+	list = calloc(sc->nname, sizeof *list);
+	used = calloc(sc->mask + 1, 1);
+	if (sc->nname > 0 && h != NULL && cnt != NULL && list != NULL &&
+	    used != NULL) {
+		for (u = 0; u < SERVE_MAXSEED; u++) {
+			memset(sc->disp, 0, (sc->bmask + 1) * sizeof *sc->disp);
+			memset(sc->slot, 0, (sc->mask + 1) * sizeof *sc->slot);
+			retval = serve_cache_place(sc,
+			    u * 0x9e3779b97f4a7c15ULL, h, cnt, list, used);
+			if (retval <= 0)
+				break;
+		}
+	}
+	free(h);
+	free(cnt);
+	free(list);
+	free(used);
+	return (retval == 0 ? 0 : -1);
+}
+
+/*
+ * The response cache for the single name 'fqdn'
+ */
+
+static struct serve_cache *
+serve_cache_build(const char *fqdn, uint32_t addr,
+    const struct serve_rrs *rrs)
+{
+	struct serve_cache *sc;
+
+	sc = serve_cache_new(1);
+	if (sc == NULL)
+		return (NULL);
+	if (serve_cache_add(sc, fqdn, addr, rrs) ||
+	    serve_cache_index(sc)) {
+		free(sc);
+		return (NULL);
+	}
+	return (sc);
+}
+
+/*
+ * Index of 'name' or -1.  Empty slots point at name zero, so there is
+ * always exactly one compare.
+ */
+
+static int
+serve_find(const struct serve_cache *sc, const uint8_t *name, size_t len)
+{
+	const struct serve_entry *e;
+	uint32_t i;
+
+	i = sc->slot[serve_slot(sc, serve_hash(name, len, sc->seed))];
+	e = serve_name(sc, i);
+	if (e->namelen != len || memcmp(e->name, name, len))
+		return (-1);
+	return ((int)i);
+}
+
+static const struct serve_entry *
+serve_lookup(const struct serve_cache *sc, const struct dns_query *dq)
+{
+	int i, qtype;
+
+	i = serve_find(sc, dq->name, dq->namelen);
+	if (i < 0)
+		return (NULL);
+	if (dq->qtype == T_A || dq->qtype == T_ANY)
+		qtype = 0;
+	else if (dq->qtype == T_DNSKEY)
+		qtype = 1;
+	else
+		qtype = 2;
+	return (&sc->e[i * SERVE_PERNAME + qtype * 3 + dq->edns]);
+}
+
+/*
+ * Is the query name strictly below one of the served names ?
+ */
+
+static int
+serve_below(const struct serve_cache *sc, const struct dns_query *dq)
+{
+	size_t pos;
+
+	for (pos = 1 + dq->name[0]; dq->name[pos] != 0;
+	    pos += 1 + dq->name[pos])
+		if (serve_find(sc, dq->name + pos, dq->namelen - pos) >= 0)
+			return (1);
+	return (0);
+}
+
+/*
+ * Turn a response into an empty one with TC=1
+ */
+
+static size_t
+serve_truncate(uint8_t *r)
+{
+	size_t pos = DNS_HDRLEN;
+
+	while (r[pos] != 0)
+		pos += 1 + r[pos];
+	r[2] |= 0x02;
+	dns_put16(r + 6, 0);
+	dns_put16(r + 8, 0);
+	dns_put16(r + 10, 0);
+	return (pos + 5);
+}
+
+/*
+ * Past announcements, "c49.<fqdn>" or "2015-06.<fqdn>", from the index
+ * built by leap_bulletins().  Returns the length, or zero if the query
+ * is not for one.  There are no RRSIGs for these.
+ */
+
+static size_t
+serve_bulletin(const struct serve_cache *sc, const struct dns_query *dq,
+    const uint8_t *q, uint8_t *r)
+{
+	const uint8_t *n = dq->name;
+	uint32_t u;
+	uint8_t a[4];
+	size_t l;
+	int i, k;
+
+	k = leap_bulletin_label(n + 1, n[0]);
+	if (k < 0 || k >= SERVE_MAXBULL)
+		return (0);
+	i = serve_find(sc, n + 1 + n[0], dq->namelen - 1 - n[0]);
+	if (i < 0)
+		return (0);
+	u = sc->bull[(size_t)i * SERVE_MAXBULL + k];
+	if (u == 0)
+		return (0);
+	l = dns_hdr(r, q + DNS_HDRLEN, dq->namelen, dq->qtype, 0);
+	if (dq->qtype == T_A || dq->qtype == T_ANY) {
+		dns_put32(a, u);
+		l = dns_rr(r, l, T_A, a, 4);
+	}
+	if (dq->edns)
+		l = dns_opt(r, l, dq->edns == 2);
+	return (l);
+}
+
+/*
+ * Produce the response to query 'q', returns length or -1 to drop.
+ */
+
+static ssize_t
+serve_answer(const struct serve_cache *sc, const uint8_t *q, size_t qlen,
+    uint8_t *r, size_t rlen, int tcp)
+{
+	const struct serve_entry *e;
+	struct dns_query dq;
+	size_t l;
+	int rcode;
+
+	if (dns_parse(q, qlen, &dq))
+		return (-1);
+	if (rlen < DNS_EDNS_SIZE)
+		return (-1);
+
+	e = NULL;
+	if (dq.qclass == C_IN)
+		e = serve_lookup(sc, &dq);
+	if (e != NULL) {
+		memcpy(r, e->pkt, e->pktlen);
+		memcpy(r + DNS_HDRLEN, q + DNS_HDRLEN, dq.qend - DNS_HDRLEN);
+		l = e->pktlen;
+		if (!tcp && l > dq.udpsize)
+			l = serve_truncate(r);
+	} else {
+		l = 0;
+		if (dq.qclass == C_IN)
+			l = serve_bulletin(sc, &dq, q, r);
+	}
+	if (e == NULL && l == 0) {
+		if (dq.qclass == C_IN && serve_below(sc, &dq))
+			rcode = R_NXDOMAIN;
+		else
+			rcode = R_REFUSED;
+		l = dns_hdr(r, q + DNS_HDRLEN, dq.namelen, dq.qtype, rcode);
+		dns_put16(r + dq.qend - 2, dq.qclass);
+	}
+	r[0] = q[0];
+	r[1] = q[1];
+	r[2] |= q[2] & 0x01;		/* RD */
+	return ((ssize_t)l);
+}
+
+/*
+ * Response rate limiting ---------------------------------------------
+ */
+
+enum rrl_verdict { RRL_PASS, RRL_DROP, RRL_SLIP };
+
+struct rrl_bucket {
+	_Atomic uint64_t	key;		/* Zero: unused */
+	uint32_t		stamp;		/* Milliseconds */
+	int32_t			tokens;		/* Negative: in debt */
+	uint32_t		slip;
+	_Atomic uint32_t	spent;		/* Responses passed */
+	_Atomic uint32_t	debt;		/* From rrl_share() */
+	uint32_t		seen;		/* rrl_share() only */
+};
+
+struct rrl {
+	uint32_t		rate;		/* Per second, zero: off */
+	uint32_t		slip;
+	struct rrl_bucket	b[1 << RRL_BITS][RRL_WAYS];
+};
+
+static pthread_once_t rrl_once = PTHREAD_ONCE_INIT;
+static uint64_t rrl_seed, rrl_mul;
+
+static void
+rrl_seed_init(void)
+{
+
+	rrl_seed = (uint64_t)leap_random() << 32 | leap_random();
+	rrl_mul = (uint64_t)leap_random() << 32 | leap_random() | 1;
+}
+
+static struct rrl *
+rrl_new(uint32_t rate, uint32_t slip)
+{
+	struct rrl *rl;
+
+	(void)pthread_once(&rrl_once, rrl_seed_init);
+	rl = calloc(1, sizeof *rl);
+	if (rl == NULL)
+		return (NULL);
+	rl->rate = rate;
+	rl->slip = slip;
+	return (rl);
+}
+
+static uint32_t
+rrl_now(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint32_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static uint64_t
+rrl_key(const struct sockaddr *sa)
+{
+	const struct sockaddr_in6 *sin6;
+	const uint8_t *a;
+
+	if (sa->sa_family == AF_INET) {
+		a = (const uint8_t *)
+		    &((const struct sockaddr_in *)sa)->sin_addr;
+		return ((4ULL << 56) | (a[0] << 16) | (a[1] << 8) | a[2]);
+	}
+	if (sa->sa_family != AF_INET6)
+		return (0);
+	sin6 = (const struct sockaddr_in6 *)sa;
+	a = sin6->sin6_addr.s6_addr;
+	if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr))
+		return ((4ULL << 56) | (a[12] << 16) | (a[13] << 8) | a[14]);
+	return ((6ULL << 56) | ((uint64_t)a[0] << 48) |
+	    ((uint64_t)a[1] << 40) | ((uint64_t)a[2] << 32) |
+	    ((uint64_t)a[3] << 24) | (a[4] << 16) | (a[5] << 8) | a[6]);
+}
+
+/*
+ * Multiply-shift with a random odd multiplier, so which prefixes share
+ * a set cannot be worked out from outside.
+ */
+
+static unsigned
+rrl_set(uint64_t key)
+{
+
+	return ((unsigned)(((key ^ rrl_seed) * rrl_mul) >> (64 - RRL_BITS)));
+}
+
+static enum rrl_verdict
+rrl_check(struct rrl *rl, const struct sockaddr *sa, uint32_t now)
+{
+	struct rrl_bucket *set, *b;
+	int64_t tokens, full;
+	uint64_t key;
+	uint32_t debt;
+	unsigned w;
+
+	if (rl->rate == 0)
+		return (RRL_PASS);
+	key = rrl_key(sa);
+	if (key == 0)
+		return (RRL_PASS);
+
+	full = (int64_t)rl->rate * RRL_UNIT;
+	set = rl->b[rrl_set(key)];
+	for (w = 0; w < RRL_WAYS; w++)
+		if (atomic_load_explicit(&set[w].key,
+		    memory_order_relaxed) == key)
+			break;
+	/*
+	 * A new prefix goes in a free way or in place of the one which was
+	 * refilled longest ago.  It starts with one response and fills up
+	 * at the rate from there, so that evicting it and coming back is
+	 * not a way to a fresh full bucket.
+	 */
+	if (w == RRL_WAYS) {
+		for (b = set, w = 1; w < RRL_WAYS; w++)
+			if (atomic_load_explicit(&b->key,
+			    memory_order_relaxed) != 0 &&
+			    (atomic_load_explicit(&set[w].key,
+			    memory_order_relaxed) == 0 ||
+			    now - set[w].stamp > now - b->stamp))
+				b = &set[w];
+		atomic_store_explicit(&b->key, key, memory_order_relaxed);
+		tokens = RRL_UNIT;
+		b->slip = 0;
+		if (atomic_load_explicit(&b->debt, memory_order_relaxed))
+			(void)atomic_exchange_explicit(&b->debt, 0,
+			    memory_order_relaxed);
+	} else {
+		b = &set[w];
+		tokens = b->tokens + (int64_t)(now - b->stamp > 1000 ?
+		    1000 : now - b->stamp) * rl->rate;
+		if (tokens > full)
+			tokens = full;
+		/* What the other threads passed, see rrl_share() */
+		debt = atomic_load_explicit(&b->debt, memory_order_relaxed);
+		if (debt != 0) {
+			debt = atomic_exchange_explicit(&b->debt, 0,
+			    memory_order_relaxed);
+			tokens -= (int64_t)debt * RRL_UNIT;
+			if (tokens < -full)
+				tokens = -full;
+		}
+	}
+	b->stamp = now;
+	if (tokens >= RRL_UNIT) {
+		b->tokens = (int32_t)(tokens - RRL_UNIT);
+		atomic_store_explicit(&b->spent, 1 + atomic_load_explicit(
+		    &b->spent, memory_order_relaxed), memory_order_relaxed);
+		return (RRL_PASS);
+	}
+	b->tokens = (int32_t)tokens;
+	if (rl->slip != 0 && ++b->slip >= rl->slip) {
+		b->slip = 0;
+		return (RRL_SLIP);
+	}
+	return (RRL_DROP);
+}
+
+/*
+ * Charge each thread for what the others passed.  Every RRL_SHARE ms
+ * the responses each table passed per prefix since the last time are
+ * added up over the tables, and each table's bucket for the prefix is
+ * charged the total less its own part, so the threads together come to
+ * about the configured rate.  Only this writes 'seen' and adds to
+ * 'debt', the owning thread only takes 'debt' back to zero.  A prefix
+ * evicted in between leaves its last responses to its successor in
+ * that way, which is close enough.
+ */
+
+struct rrl_spend {
+	uint64_t		key;
+	uint32_t		n;
+	struct rrl_bucket	*b;
+};
+
+static int
+rrl_spend_cmp(const void *a, const void *b)
+{
+	const struct rrl_spend *sa = a, *sb = b;
+
+	return (sa->key < sb->key ? -1 : sa->key > sb->key);
+}
+
+static void
+rrl_share(struct rrl * const *rl, unsigned nrl, struct rrl_spend *sp)
+{
+	struct rrl_bucket *b;
+	uint64_t total;
+	uint32_t spent;
+	size_t i, j, n = 0;
+	unsigned t, u;
+
+	for (t = 0; t < nrl; t++) {
+		b = rl[t]->b[0];
+		for (u = 0; u < (1U << RRL_BITS) * RRL_WAYS; u++, b++) {
+			spent = atomic_load_explicit(&b->spent,
+			    memory_order_relaxed);
+			if (spent == b->seen)
+				continue;
+			sp[n].key = atomic_load_explicit(&b->key,
+			    memory_order_relaxed);
+			sp[n].n = spent - b->seen;
+			sp[n].b = b;
+			b->seen = spent;
+			n++;
+		}
+	}
+	qsort(sp, n, sizeof *sp, rrl_spend_cmp);
+	for (i = 0; i < n; i = j) {
+		total = 0;
+		for (j = i; j < n && sp[j].key == sp[i].key; j++)
+			total += sp[j].n;
+		for (; i < j; i++)
+			if (total > sp[i].n)
+				(void)atomic_fetch_add_explicit(&sp[i].b->debt,
+				    (uint32_t)(total - sp[i].n),
+				    memory_order_relaxed);
+	}
+}
+
+struct rrl_pool {
+	struct rrl		*rl[2 * SERVE_MAXJOBS];
+	unsigned		nrl;
+};
+
+static void *
+rrl_thread(void *priv)
+{
+	const struct rrl_pool *rp = priv;
+	struct rrl_spend *sp;
+	struct timespec ts;
+
+	sp = calloc((size_t)rp->nrl * (1U << RRL_BITS) * RRL_WAYS,
+	    sizeof *sp);
+	if (sp == NULL) {
+		perror("calloc");
+		return (NULL);
+	}
+	ts.tv_sec = 0;
+	ts.tv_nsec = RRL_SHARE * 1000000L;
+	for (;;) {
+		(void)nanosleep(&ts, NULL);
+		rrl_share(rp->rl, rp->nrl, sp);
+	}
+}
+
+/*
+ * Apply rate limiting to response 'r', returns new length
+ */
+
+static ssize_t
+serve_limit(struct rrl *rl, const struct sockaddr *sa, uint32_t now,
+    uint8_t *r, ssize_t l)
+{
+
+	if (l <= 0)
+		return (l);
+	switch (rrl_check(rl, sa, now)) {
+	case RRL_PASS:
+		return (l);
+	case RRL_SLIP:
+		return ((ssize_t)serve_truncate(r));
+	default:
+		return (-1);
+	}
+}
+
+/*
+ * Serving ------------------------------------------------------------
+ */
+
+struct serve_worker {
+	pthread_t		thr;
+	int			fd;
+	_Atomic uint64_t	epoch;		/* Zero: offline */
+	struct rrl		*rl;
+	struct xdp_port		*xp;
+	unsigned		xq;
+};
+
+static _Atomic(struct serve_cache *) serve_current;
+static _Atomic uint64_t serve_epoch = 1;
+
+/*
+ * Going online, the epoch must be posted before the cache pointer is
+ * loaded, both with sequential consistency, see serve_publish().
+ */
+
+static const struct serve_cache *
+serve_online(struct serve_worker *sw)
+{
+
+	atomic_store(&sw->epoch, atomic_load(&serve_epoch));
+	return (atomic_load(&serve_current));
+}
+
+static void
+serve_offline(struct serve_worker *sw)
+{
+
+	atomic_store(&sw->epoch, 0);
+}
+
+#ifdef __linux__
+static void
+serve_loop(struct serve_worker *sw)
+{
+	static __thread struct {
+		struct mmsghdr		qm[SERVE_BATCH], rm[SERVE_BATCH];
+		struct iovec		qv[SERVE_BATCH], rv[SERVE_BATCH];
+		struct sockaddr_storage	ss[SERVE_BATCH];
+		uint8_t			q[SERVE_BATCH][DNS_MAXUDP];
+		uint8_t			r[SERVE_BATCH][DNS_EDNS_SIZE];
+	} b;
+	const struct serve_cache *sc;
+	uint32_t now;
+	ssize_t l;
+	int i, n, nr, k;
+
+	for (;;) {
+		for (i = 0; i < SERVE_BATCH; i++) {
+			b.qv[i].iov_base = b.q[i];
+			b.qv[i].iov_len = sizeof b.q[i];
+			memset(&b.qm[i], 0, sizeof b.qm[i]);
+			b.qm[i].msg_hdr.msg_name = &b.ss[i];
+			b.qm[i].msg_hdr.msg_namelen = sizeof b.ss[i];
+			b.qm[i].msg_hdr.msg_iov = &b.qv[i];
+			b.qm[i].msg_hdr.msg_iovlen = 1;
+		}
+		serve_offline(sw);
+		n = recvmmsg(sw->fd, b.qm, SERVE_BATCH, MSG_WAITFORONE, NULL);
+		sc = serve_online(sw);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("recvmmsg");
+			return;
+		}
+		now = rrl_now();
+		for (i = nr = 0; i < n; i++) {
+			l = serve_answer(sc, b.q[i], b.qm[i].msg_len,
+			    b.r[nr], sizeof b.r[nr], 0);
+			l = serve_limit(sw->rl, (struct sockaddr *)&b.ss[i],
+			    now, b.r[nr], l);
+			if (l <= 0)
+				continue;
+			b.rv[nr].iov_base = b.r[nr];
+			b.rv[nr].iov_len = l;
+			memset(&b.rm[nr], 0, sizeof b.rm[nr]);
+			b.rm[nr].msg_hdr.msg_name = &b.ss[i];
+			b.rm[nr].msg_hdr.msg_namelen =
+			    b.qm[i].msg_hdr.msg_namelen;
+			b.rm[nr].msg_hdr.msg_iov = &b.rv[nr];
+			b.rm[nr].msg_hdr.msg_iovlen = 1;
+			nr++;
+		}
+		for (i = 0; i < nr; i += k) {
+			k = sendmmsg(sw->fd, b.rm + i, nr - i, 0);
+			if (k <= 0)
+				break;
+		}
+	}
+}
+#else
+static void
+serve_loop(struct serve_worker *sw)
+{
+	const struct serve_cache *sc;
+	struct sockaddr_storage ss;
+	socklen_t sslen;
+	uint8_t q[DNS_MAXUDP], r[DNS_EDNS_SIZE];
+	ssize_t n;
+
+	for (;;) {
+		sslen = sizeof ss;
+		serve_offline(sw);
+		n = recvfrom(sw->fd, q, sizeof q, 0, (struct sockaddr *)&ss,
+		    &sslen);
+		sc = serve_online(sw);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("recvfrom");
+			return;
+		}
+		n = serve_answer(sc, q, n, r, sizeof r, 0);
+		n = serve_limit(sw->rl, (struct sockaddr *)&ss, rrl_now(),
+		    r, n);
+		if (n > 0)
+			(void)sendto(sw->fd, r, n, 0, (struct sockaddr *)&ss,
+			    sslen);
+	}
+}
+#endif
+
+/*
+ * AF_XDP receive queues hand over their packets in batches, one cache
+ * lookup per batch.
+ */
+
+static void
+serve_xdp_batch(void *priv, struct xdp_msg *m, unsigned n)
+{
+	struct serve_worker *sw = priv;
+	const struct serve_cache *sc;
+	struct sockaddr_in sin;
+	uint32_t now;
+	unsigned i;
+
+	sc = serve_online(sw);
+	now = rrl_now();
+	memset(&sin, 0, sizeof sin);
+	sin.sin_family = AF_INET;
+	for (i = 0; i < n; i++) {
+		m[i].rlen = serve_answer(sc, m[i].q, m[i].qlen, m[i].r,
+		    m[i].rlen, 0);
+		sin.sin_addr.s_addr = m[i].saddr;
+		sin.sin_port = m[i].sport;
+		m[i].rlen = serve_limit(sw->rl, (struct sockaddr *)&sin, now,
+		    m[i].r, m[i].rlen);
+	}
+	serve_offline(sw);
+}
+
+/*
+ * DNS over TCP -------------------------------------------------------
+ */
+
+struct tcp_conn {
+	int			fd;
+	unsigned		slot;
+	int			eof;
+	uint32_t		last;		/* rrl_now() */
+	size_t			inlen;
+	size_t			outoff, outlen;
+	uint8_t			in[TCP_PIPE * (2 + DNS_MAXUDP)];
+	uint8_t			out[TCP_PIPE * (2 + DNS_EDNS_SIZE)];
+};
+
+/*
+ * Answer all complete queries in the input buffer, as long as there is
+ * room for the responses.  Returns the number answered, or -1 if the
+ * connection should be dropped.
+ */
+
+static int
+tcp_consume(const struct serve_cache *sc, struct tcp_conn *tc)
+{
+	size_t ml, pos = 0;
+	ssize_t l;
+	int n = 0;
+
+	if (tc->outoff > 0) {
+		memmove(tc->out, tc->out + tc->outoff,
+		    tc->outlen - tc->outoff);
+		tc->outlen -= tc->outoff;
+		tc->outoff = 0;
+	}
+	while (tc->inlen - pos >= 2) {
+		ml = dns_get16(tc->in + pos);
+		if (ml > DNS_MAXUDP)
+			return (-1);
+		if (tc->inlen - pos < 2 + ml)
+			break;
+		if (tc->outlen + 2 + DNS_EDNS_SIZE > sizeof tc->out)
+			break;
+		l = serve_answer(sc, tc->in + pos + 2, ml,
+		    tc->out + tc->outlen + 2, DNS_EDNS_SIZE, 1);
+		if (l < 0)
+			return (-1);
+		dns_put16(tc->out + tc->outlen, l);
+		tc->outlen += 2 + l;
+		pos += 2 + ml;
+		n++;
+	}
+	if (pos > 0) {
+		memmove(tc->in, tc->in + pos, tc->inlen - pos);
+		tc->inlen -= pos;
+	}
+	return (n);
+}
+
+#ifdef __linux__
+/*
+ * With edge-triggered events we must keep going until neither reading,
+ * answering nor writing makes progress.
+ */
+
+static int
+tcp_service(const struct serve_cache *sc, struct tcp_conn *tc)
+{
+	ssize_t n;
+	int progress;
+
+	for (;;) {
+		n = tcp_consume(sc, tc);
+		if (n < 0)
+			return (-1);
+		progress = n > 0;
+		if (tc->outoff < tc->outlen) {
+			n = send(tc->fd, tc->out + tc->outoff,
+			    tc->outlen - tc->outoff, MSG_NOSIGNAL);
+			if (n > 0) {
+				tc->outoff += n;
+				progress = 1;
+			} else if (errno != EAGAIN && errno != EINTR) {
+				return (-1);
+			}
+		}
+		if (!tc->eof && tc->inlen < sizeof tc->in) {
+			n = recv(tc->fd, tc->in + tc->inlen,
+			    sizeof tc->in - tc->inlen, 0);
+			if (n > 0) {
+				tc->inlen += n;
+				progress = 1;
+			} else if (n == 0) {
+				tc->eof = 1;
+			} else if (errno != EAGAIN && errno != EINTR) {
+				return (-1);
+			}
+		}
+		if (tc->eof && tc->outoff == tc->outlen)
+			return (-1);
+		if (!progress)
+			return (0);
+	}
+}
+
+static void
+tcp_close(struct tcp_conn **conn, struct tcp_conn *tc)
+{
+
+	conn[tc->slot] = NULL;
+	(void)close(tc->fd);
+	free(tc);
+}
+
+static void
+tcp_accept(int ep, int lfd, struct tcp_conn **conn, uint32_t now)
+{
+	struct epoll_event ev;
+	struct tcp_conn *tc;
+	unsigned u;
+	int fd, one = 1;
+
+	for (;;) {
+		fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			return;
+		}
+		for (u = 0; u < TCP_MAXCONN && conn[u] != NULL; u++)
+			continue;
+		tc = u < TCP_MAXCONN ? malloc(sizeof *tc) : NULL;
+		if (tc == NULL) {
+			(void)close(fd);
+			continue;
+		}
+		/* Pipelined responses must not wait for delayed ACKs */
+		(void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY,
+		    &one, sizeof one);
+		tc->fd = fd;
+		tc->slot = u;
+		tc->eof = 0;
+		tc->last = now;
+		tc->inlen = tc->outoff = tc->outlen = 0;
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = tc;
+		if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev)) {
+			(void)close(fd);
+			free(tc);
+			continue;
+		}
+		conn[u] = tc;
+	}
+}
+
+static void *
+tcp_thread(void *priv)
+{
+	struct serve_worker *sw = priv;
+	static struct tcp_conn *conn[TCP_MAXCONN];
+	const struct serve_cache *sc;
+	struct epoll_event ev[SERVE_BATCH];
+	struct tcp_conn *tc;
+	uint32_t now, swept = 0;
+	unsigned u;
+	int ep, i, n;
+
+	ep = epoll_create1(EPOLL_CLOEXEC);
+	if (ep < 0) {
+		perror("epoll_create1");
+		return (NULL);
+	}
+	ev[0].events = EPOLLIN | EPOLLET;
+	ev[0].data.ptr = NULL;
+	if (epoll_ctl(ep, EPOLL_CTL_ADD, sw->fd, &ev[0])) {
+		perror("epoll_ctl");
+		return (NULL);
+	}
+	for (;;) {
+		serve_offline(sw);
+		n = epoll_wait(ep, ev, SERVE_BATCH, 1000);
+		sc = serve_online(sw);
+		if (n < 0 && errno != EINTR) {
+			perror("epoll_wait");
+			return (NULL);
+		}
+		now = rrl_now();
+		for (i = 0; i < n; i++) {
+			tc = ev[i].data.ptr;
+			if (tc == NULL) {
+				tcp_accept(ep, sw->fd, conn, now);
+				continue;
+			}
+			tc->last = now;
+			if (tcp_service(sc, tc))
+				tcp_close(conn, tc);
+		}
+		if (now - swept < 1000)
+			continue;
+		swept = now;
+		for (u = 0; u < TCP_MAXCONN; u++)
+			if (conn[u] != NULL &&
+			    now - conn[u]->last > TCP_IDLE * 1000)
+				tcp_close(conn, conn[u]);
+	}
+}
+
+static int
+tcp_socket(const struct addrinfo *res)
+{
+	int fd, one = 1, qlen = TCP_TFOQLEN;
+
+	fd = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+	    IPPROTO_TCP);
+	if (fd < 0)
+		return (-1);
+	(void)setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+#ifdef TCP_FASTOPEN
+	(void)setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof qlen);
+#else
+	(void)qlen;
+#endif
+	if (bind(fd, res->ai_addr, res->ai_addrlen) || listen(fd, 128)) {
+		(void)close(fd);
+		return (-1);
+	}
+	return (fd);
+}
+#endif
+
+/*
+ * Hot reload ---------------------------------------------------------
+ */
+
+struct serve_zone {
+	const char		*fqdn;
+	const char		*history;
+	const char		*signed_zone;
+	uint32_t		addr;		/* Without history */
+};
+
+struct serve_reload {
+	const char		*zonefile;
+	struct serve_zone	one;		/* From the command line */
+	struct serve_zone	*zone;		/* Served now */
+	int			nzone;
+	char			*zbuf;		/* Strings of 'zone' */
+	struct serve_worker	*sw;
+	int			nsw;
+};
+
+/*
+ * Read a zones file, one name per line:
+ *
+ *	fqdn year month dtai delta [signed-zone]
+ *	fqdn history [signed-zone]
+ *
+ * The strings point into '*bufp'.  Returns the number of zones or -1.
+ */
+
+static int
+serve_zones_read(const char *path, struct serve_zone **zp, char **bufp)
+{
+	struct serve_zone *z = NULL, *nz;
+	char *buf = NULL, *line, *next, *p, *tok[7];
+	size_t len = 0, cap = 0;
+	int n = 0, nt, lineno = 0;
+	FILE *fi;
+
+	fi = fopen(path, "r");
+	if (fi == NULL) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return (-1);
+	}
+	do {
+		if (len + 1 >= cap) {
+			cap = cap ? 2 * cap : 4096;
+			p = realloc(buf, cap);
+			if (p == NULL)
+				goto fail;
+			buf = p;
+		}
+		len += fread(buf + len, 1, cap - len - 1, fi);
+	} while (!feof(fi) && !ferror(fi));
+	if (ferror(fi))
+		goto fail;
+	buf[len] = '\0';
+
+	for (line = buf; line != NULL; line = next) {
+		lineno++;
+		next = strchr(line, '\n');
+		if (next != NULL)
+			*next++ = '\0';
+		p = strchr(line, ';');
+		if (p != NULL)
+			*p = '\0';
+		for (nt = 0; nt < 7; nt++) {
+			tok[nt] = strtok_r(nt == 0 ? line : NULL, " \t\r",
+			    &p);
+			if (tok[nt] == NULL)
+				break;
+		}
+		if (nt == 0)
+			continue;
+		if (nt != 2 && nt != 3 && nt != 5 && nt != 6) {
+			fprintf(stderr, "%s:%d: Bad zone\n", path, lineno);
+			goto fail;
+		}
+		if ((n & (n - 1)) == 0) {
+			nz = realloc(z, (n ? 2 * n : 1) * sizeof *z);
+			if (nz == NULL)
+				goto fail;
+			z = nz;
+		}
+		memset(&z[n], 0, sizeof z[n]);
+		z[n].fqdn = tok[0];
+		if (nt <= 3) {
+			z[n].history = tok[1];
+			z[n].signed_zone = nt == 3 ? tok[2] : NULL;
+		} else {
+			z[n].addr = encode_leapsecond(atoi(tok[1]),
+			    atoi(tok[2]), atoi(tok[3]), atoi(tok[4]));
+			z[n].signed_zone = nt == 6 ? tok[5] : NULL;
+			if (z[n].addr == 0) {
+				fprintf(stderr, "%s:%d: Announcement out of "
+				    "range\n", path, lineno);
+				goto fail;
+			}
+		}
+		n++;
+	}
+	(void)fclose(fi);
+	if (n == 0) {
+		fprintf(stderr, "%s: No zones\n", path);
+		free(z);
+		free(buf);
+		return (-1);
+	}
+	*zp = z;
+	*bufp = buf;
+	return (n);
+
+fail:
+	if (ferror(fi))
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+	(void)fclose(fi);
+	free(z);
+	free(buf);
+	return (-1);
+}
+
+/*
+ * The A RRsets of one zone: the announcement for 'fqdn' and the
+ * history RRset for "history.<fqdn>", see leap_table.c, read from the
+ * history file or else the compiled-in table, which '*ltp' is left
+ * pointing at.  Returns the number of history entries or -1.
+ */
+
+static int
+serve_zone_read(const struct serve_zone *z, struct leap_entry *le,
+    const struct leap_entry **ltp, int *nltp, uint32_t *addrp,
+    uint32_t *hist)
+{
+	const struct leap_entry *lt = leap_table;
+	uint32_t addr = z->addr;
+	FILE *fi;
+	int n, nlt = leap_table_len;
+
+	if (z->history != NULL) {
+		fi = fopen(z->history, "r");
+		if (fi == NULL) {
+			fprintf(stderr, "%s: %s\n", z->history,
+			    strerror(errno));
+			return (-1);
+		}
+		n = leap_history(fi, le, SERVE_MAXHIST);
+		(void)fclose(fi);
+		addr = leap_history_announce(le, n);
+		if (addr == 0) {
+			fprintf(stderr, "%s: No valid announcement\n",
+			    z->history);
+			return (-1);
+		}
+		lt = le;
+		nlt = n;
+	}
+	n = leap_history_encode(lt, nlt, hist);
+	if (n < 0) {
+		fprintf(stderr, "%s: Cannot encode history\n", z->fqdn);
+		return (-1);
+	}
+	*ltp = lt;
+	*nltp = nlt;
+	*addrp = addr;
+	return (n);
+}
+
+/*
+ * Add one zone to the cache, reading its files
+ */
+
+static int
+serve_zone_add(struct serve_cache *sc, const struct serve_zone *z,
+    int verbose)
+{
+	static struct serve_rrs rrs;
+	struct leap_entry le[SERVE_MAXHIST];
+	const struct leap_entry *lt;
+	uint32_t addr, hist[SERVE_MAXHIST];
+	char hname[DNS_MAXNAME + 10];
+	int n, nlt;
+
+	n = serve_zone_read(z, le, &lt, &nlt, &addr, hist);
+	if (n < 0)
+		return (-1);
+	memset(&rrs, 0, sizeof rrs);
+	if (z->signed_zone != NULL) {
+		if (serve_rrs_load(z->signed_zone, z->fqdn, &rrs)) {
+			fprintf(stderr, "Cannot load RRSIG/DNSKEY from %s\n",
+			    z->signed_zone);
+			return (-1);
+		}
+		(void)serve_rrs_check(&rrs, time(NULL));
+	}
+	if (serve_cache_add(sc, z->fqdn, addr, &rrs)) {
+		fprintf(stderr, "Bad name: %s\n", z->fqdn);
+		return (-1);
+	}
+	if (leap_bulletins(lt, nlt, addr,
+	    &sc->bull[(size_t)(sc->nname - 1) * SERVE_MAXBULL],
+	    SERVE_MAXBULL) < 0) {
+		fprintf(stderr, "%s: Cannot index the bulletins\n", z->fqdn);
+		return (-1);
+	}
+
+	(void)snprintf(hname, sizeof hname, "history.%s", z->fqdn);
+	memset(&rrs, 0, sizeof rrs);
+	if (z->signed_zone != NULL) {
+		if (serve_rrs_load(z->signed_zone, hname, &rrs))
+			return (-1);
+		(void)serve_rrs_check(&rrs, time(NULL));
+	}
+	if (serve_cache_addset(sc, hname, hist, n, &rrs)) {
+		fprintf(stderr, "History too long for %s\n", hname);
+		return (-1);
+	}
+	if (verbose)
+		fprintf(stderr, "Serving %u.%u.%u.%u for %s\n", addr >> 24,
+		    (addr >> 16) & 0xff, (addr >> 8) & 0xff, addr & 0xff,
+		    z->fqdn);
+	return (0);
+}
+
+/*
+ * Build a response cache from the files.  Only one thread at a time
+ * loads, first main_serve(), then serve_reloader().  The zones in 'sr'
+ * are replaced only when the new ones loaded.
+ */
+
+static struct serve_cache *
+serve_load(struct serve_reload *sr)
+{
+	struct serve_zone *zone = &sr->one;
+	struct serve_cache *sc;
+	char *zbuf = NULL;
+	int i, n = 1;
+
+	if (sr->zonefile != NULL) {
+		n = serve_zones_read(sr->zonefile, &zone, &zbuf);
+		if (n < 0)
+			return (NULL);
+	}
+	sc = serve_cache_new(2 * n);
+	for (i = 0; sc != NULL && i < n; i++)
+		if (serve_zone_add(sc, &zone[i], n == 1))
+			break;
+	if (sc != NULL && i == n && serve_cache_index(sc))
+		fprintf(stderr, "%s: Names are not unique\n",
+		    sr->zonefile != NULL ? sr->zonefile : sr->one.fqdn);
+	else if (sc != NULL && i == n) {
+		if (sr->zone != &sr->one)
+			free(sr->zone);
+		free(sr->zbuf);
+		sr->zone = zone;
+		sr->nzone = n;
+		sr->zbuf = zbuf;
+		if (n > 1)
+			fprintf(stderr, "Serving %d zones from %s\n", n,
+			    sr->zonefile);
+		return (sc);
+	}
+	free(sc);
+	if (zone != &sr->one)
+		free(zone);
+	free(zbuf);
+	return (NULL);
+}
+
+/*
+ * '-E': Print the A RRsets '-S' wants signatures for, as a zone file
+ * for the signer, so that the signed zone can be redone whenever the
+ * announcement or the history changes.
+ */
+
+static int
+serve_emit(struct serve_reload *sr, FILE *fo)
+{
+	struct serve_zone *zone = &sr->one;
+	struct leap_entry le[SERVE_MAXHIST];
+	const struct leap_entry *lt;
+	uint32_t addr, hist[SERVE_MAXHIST];
+	char *zbuf = NULL;
+	const char *dot;
+	int i, j, n = 1, nh, nlt;
+
+	if (sr->zonefile != NULL) {
+		n = serve_zones_read(sr->zonefile, &zone, &zbuf);
+		if (n < 0)
+			return (1);
+	}
+	fprintf(fo, "; A RRsets for dns_leap serve -S, sign with the"
+	    " DNSKEY RRset\n$TTL %u\n", DNS_TTL);
+	for (i = 0; i < n; i++) {
+		nh = serve_zone_read(&zone[i], le, &lt, &nlt, &addr, hist);
+		if (nh < 0)
+			break;
+		dot = zone[i].fqdn[strlen(zone[i].fqdn) - 1] == '.' ? "" : ".";
+		fprintf(fo, "%s%s\tIN\tA\t%u.%u.%u.%u\n", zone[i].fqdn, dot,
+		    addr >> 24, (addr >> 16) & 0xff, (addr >> 8) & 0xff,
+		    addr & 0xff);
+		for (j = 0; j < nh; j++)
+			fprintf(fo, "history.%s%s\tIN\tA\t%u.%u.%u.%u\n",
+			    zone[i].fqdn, dot, hist[j] >> 24,
+			    (hist[j] >> 16) & 0xff, (hist[j] >> 8) & 0xff,
+			    hist[j] & 0xff);
+	}
+	if (zone != &sr->one)
+		free(zone);
+	free(zbuf);
+	return (i == n && !fflush(fo) ? 0 : 1);
+}
+
+/*
+ * A worker which loaded the old pointer posted an epoch older than the
+ * new one before it did, and keeps it until it is done with the cache.
+ */
+
+static void
+serve_publish(const struct serve_reload *sr, struct serve_cache *sc)
+{
+	struct serve_cache *old;
+	uint64_t e, w;
+	int i;
+
+	old = atomic_exchange(&serve_current, sc);
+	e = atomic_fetch_add(&serve_epoch, 1) + 1;
+	for (i = 0; i < sr->nsw; i++)
+		while ((w = atomic_load(&sr->sw[i].epoch)) != 0 && w < e)
+			(void)usleep(1000);
+	free(old);
+}
+
+static void
+serve_refresh(struct serve_reload *sr)
+{
+	struct serve_cache *sc;
+
+	sc = serve_load(sr);
+	if (sc == NULL)
+		fprintf(stderr, "Reload failed, old answers stay\n");
+	else
+		serve_publish(sr, sc);
+}
+
+#ifdef __linux__
+/*
+ * The files of a reload: the zones file and the files of each zone
+ */
+
+static const char *
+serve_file(const struct serve_reload *sr, int i)
+{
+
+	if (i == 0)
+		return (sr->zonefile);
+	i--;
+	if (i / 2 >= sr->nzone)
+		return (NULL);
+	return (i % 2 ? sr->zone[i / 2].signed_zone : sr->zone[i / 2].history);
+}
+
+/*
+ * Watch the directories, so that files replaced by rename(2) are seen.
+ * Called again after each reload, watching a directory twice is a no-op.
+ */
+
+static void
+serve_watch(const struct serve_reload *sr, int fd)
+{
+	const char *f;
+	char buf[PATH_MAX];
+	int i;
+
+	for (i = 0; i < 1 + 2 * sr->nzone; i++) {
+		f = serve_file(sr, i);
+		if (f == NULL)
+			continue;
+		(void)snprintf(buf, sizeof buf, "%s", f);
+		if (inotify_add_watch(fd, dirname(buf),
+		    IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+			perror("inotify_add_watch");
+	}
+}
+
+static int
+serve_changed(const struct serve_reload *sr, int fd)
+{
+	union {
+		struct inotify_event	ev;
+		char			buf[4096];
+	} u;
+	const struct inotify_event *ev;
+	const char *f;
+	char buf[PATH_MAX];
+	ssize_t n;
+	size_t pos;
+	int i, changed = 0;
+
+	n = read(fd, u.buf, sizeof u.buf);
+	for (pos = 0; n > 0 && pos < (size_t)n; pos += sizeof *ev + ev->len) {
+		ev = (const struct inotify_event *)(u.buf + pos);
+		for (i = 0; ev->len > 0 && !changed &&
+		    i < 1 + 2 * sr->nzone; i++) {
+			f = serve_file(sr, i);
+			if (f == NULL)
+				continue;
+			(void)snprintf(buf, sizeof buf, "%s", f);
+			if (!strcmp(ev->name, basename(buf)))
+				changed = 1;
+		}
+	}
+	return (changed);
+}
+#endif
+
+/*
+ * SIGHUP is blocked in all threads, and taken here synchronously.
+ */
+
+static void *
+serve_reloader(void *priv)
+{
+	struct serve_reload *sr = priv;
+	sigset_t set;
+#ifdef __linux__
+	struct signalfd_siginfo si;
+	struct pollfd pfd[2];
+	int reload;
+
+	(void)sigemptyset(&set);
+	(void)sigaddset(&set, SIGHUP);
+	pfd[0].fd = signalfd(-1, &set, SFD_CLOEXEC);
+	pfd[1].fd = inotify_init1(IN_CLOEXEC);
+	if (pfd[1].fd >= 0)
+		serve_watch(sr, pfd[1].fd);
+	pfd[0].events = pfd[1].events = POLLIN;
+	for (;;) {
+		if (poll(pfd, 2, -1) < 0)
+			continue;
+		reload = 0;
+		if ((pfd[0].revents & POLLIN) &&
+		    read(pfd[0].fd, &si, sizeof si) == sizeof si)
+			reload = 1;
+		if ((pfd[1].revents & POLLIN) && serve_changed(sr, pfd[1].fd))
+			reload = 1;
+		if (reload) {
+			serve_refresh(sr);
+			if (pfd[1].fd >= 0)
+				serve_watch(sr, pfd[1].fd);
+		}
+	}
+#else
+	int sig;
+
+	(void)sigemptyset(&set);
+	(void)sigaddset(&set, SIGHUP);
+	for (;;)
+		if (sigwait(&set, &sig) == 0)
+			serve_refresh(sr);
+#endif
+	return (NULL);
+}
+
+static void *
+serve_thread(void *priv)
+{
+	struct serve_worker *sw = priv;
+
+	serve_loop(sw);
+	return (NULL);
+}
+
+static void *
+serve_xdp_thread(void *priv)
+{
+	struct serve_worker *sw = priv;
+
+	(void)xdp_loop(sw->xp, sw->xq, serve_xdp_batch, sw);
+	return (NULL);
+}
+
+static int
+serve_socket(const struct addrinfo *res, int reuseport)
+{
+	int fd, one = 1;
+
+	fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (fd < 0)
+		return (-1);
+#ifdef SO_REUSEPORT
+	if (reuseport &&
+	    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof one)) {
+		(void)close(fd);
+		return (-1);
+	}
+#else
+	(void)one;
+	if (reuseport) {
+		(void)close(fd);
+		errno = EOPNOTSUPP;
+		return (-1);
+	}
+#endif
+	if (bind(fd, res->ai_addr, res->ai_addrlen)) {
+		(void)close(fd);
+		return (-1);
+	}
+	return (fd);
+}
+
+static void
+usage_serve(void)
+{
+
+	fprintf(stderr, "Usage: dns_leap serve [-E] [-b address] [-j threads] "
+	    "[-p port] [-r rate]\n\t\t[-s slip] [-S signed-zone] [-X ifname]"
+	    " fqdn year month dtai delta\n"
+	    "       dns_leap serve [options] -H history fqdn\n"
+	    "       dns_leap serve [options] -Z zones\n");
+	exit(1);
+}
+
+int
+main_serve(int argc, char **argv)
+{
+	const char *baddr = NULL, *port = "53", *xdpif = NULL;
+	static struct serve_worker sw[2 * SERVE_MAXJOBS + 1];
+	static struct serve_reload sr;
+	static struct rrl_pool rp;
+	struct addrinfo hints, *res;
+	struct serve_cache *sc;
+	struct xdp_port *xp = NULL;
+	pthread_t thr;
+	sigset_t set;
+	long rate = 0, slip = 2;
+	int ch, i, error, jobs = 1, nx = 0, nw, emit = 0;
+
+	while ((ch = getopt(argc, argv, "b:EH:j:p:r:S:s:X:Z:")) != -1) {
+		switch (ch) {
+		case 'b':
+			baddr = optarg;
+			break;
+		case 'E':
+			emit = 1;
+			break;
+		case 'H':
+			sr.one.history = optarg;
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			if (jobs < 1 || jobs > SERVE_MAXJOBS)
+				usage_serve();
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'r':
+			rate = atol(optarg);
+			if (rate < 0 || rate > RRL_MAXRATE)
+				usage_serve();
+			break;
+		case 'S':
+			sr.one.signed_zone = optarg;
+			break;
+		case 's':
+			slip = atol(optarg);
+			if (slip < 0 || slip > 100)
+				usage_serve();
+			break;
+		case 'X':
+			xdpif = optarg;
+			break;
+		case 'Z':
+			sr.zonefile = optarg;
+			break;
+		default:
+			usage_serve();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (sr.zonefile != NULL) {
+		if (argc != 0 || sr.one.history != NULL ||
+		    sr.one.signed_zone != NULL)
+			usage_serve();
+	} else if (argc != (sr.one.history == NULL ? 5 : 1))
+		usage_serve();
+
+	sr.one.fqdn = argv[0];
+	if (sr.zonefile == NULL && sr.one.history == NULL) {
+		sr.one.addr = encode_leapsecond(atoi(argv[1]), atoi(argv[2]),
+		    atoi(argv[3]), atoi(argv[4]));
+		if (sr.one.addr == 0) {
+			fprintf(stderr, "Announcement out of range\n");
+			return (1);
+		}
+	}
+	if (emit)
+		return (serve_emit(&sr, stdout));
+	sc = serve_load(&sr);
+	if (sc == NULL)
+		return (1);
+	atomic_store(&serve_current, sc);
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_PASSIVE;
+	error = getaddrinfo(baddr, port, &hints, &res);
+	if (error) {
+		fprintf(stderr, "%s: %s\n", baddr != NULL ? baddr : "*",
+		    gai_strerror(error));
+		return (1);
+	}
+	if (xdpif != NULL) {
+		xp = xdp_open(xdpif, jobs, ntohs(res->ai_family == AF_INET6 ?
+		    ((struct sockaddr_in6 *)res->ai_addr)->sin6_port :
+		    ((struct sockaddr_in *)res->ai_addr)->sin_port));
+		if (xp == NULL)
+			return (1);
+		nx = xdp_queues(xp);
+	}
+	nw = jobs + nx;			/* Socket workers, then AF_XDP */
+	for (i = 0; i < nw; i++) {
+		sw[i].rl = rrl_new(rate, slip);	/* Each, see above */
+		if (sw[i].rl == NULL) {
+			perror("calloc");
+			return (1);
+		}
+		rp.rl[rp.nrl++] = sw[i].rl;
+		if (i >= jobs) {
+			sw[i].fd = -1;
+			sw[i].xp = xp;
+			sw[i].xq = i - jobs;
+			continue;
+		}
+		sw[i].fd = serve_socket(res, jobs > 1);
+		if (sw[i].fd < 0) {
+			perror("socket");
+			return (1);
+		}
+	}
+	sr.sw = sw;
+	sr.nsw = nw + 1;		/* The TCP worker is last */
+
+	(void)sigemptyset(&set);
+	(void)sigaddset(&set, SIGHUP);
+	error = pthread_sigmask(SIG_BLOCK, &set, NULL);
+	if (error == 0)
+		error = pthread_create(&thr, NULL, serve_reloader, &sr);
+	if (error == 0 && rate != 0 && nw > 1)
+		error = pthread_create(&thr, NULL, rrl_thread, &rp);
+	if (error) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(error));
+		return (1);
+	}
+#ifdef __linux__
+	sw[nw].fd = tcp_socket(res);
+	if (sw[nw].fd < 0) {
+		perror("TCP socket");
+		return (1);
+	}
+	error = pthread_create(&sw[nw].thr, NULL, tcp_thread, &sw[nw]);
+	if (error) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(error));
+		return (1);
+	}
+#endif
+	freeaddrinfo(res);
+
+	for (i = 1; i < nw; i++) {
+		error = pthread_create(&sw[i].thr, NULL,
+		    i < jobs ? serve_thread : serve_xdp_thread, &sw[i]);
+		if (error) {
+			fprintf(stderr, "pthread_create: %s\n",
+			    strerror(error));
+			return (1);
+		}
+	}
+	serve_loop(&sw[0]);
+	return (1);
+}
+
+static char serve_signed[] =
+    "; Output of a zone signer, abbreviated\n"
+    "$TTL 3600\n"
+    "leapsecond.example.org.\t3600\tIN\tA\t244.23.35.255\n"
+    "\t\t\t3600\tIN\tRRSIG\tA 13 3 3600 (\n"
+    "\t\t\t\t20261101000000 20261018000000 12345 example.org.\n"
+    "\t\t\t\tAAECAwQFBgcICQoLDA0ODxAREhMUFRYXGBkaGxwdHh8g\n"
+    "\t\t\t\tISIjJCUmJygpKissLS4vMDEyMzQ1Njc4OTo7PD0+Pw== )\n"
+    "LEAPSECOND.example.org. 3600 DNSKEY 257 3 13 ( ; KSK\n"
+    "\t\t\t\tAAECAwQFBgcICQoLDA0ODxAREhMUFRYXGBkaGxwdHh8g\n"
+    "\t\t\t\tISIjJCUmJygpKissLS4vMDEyMzQ1Njc4OTo7PD0+Pw== )\n"
+    "\t\t\tRRSIG DNSKEY 13 3 3600 1793491200 1792281600 12345 (\n"
+    "\t\t\t\tleapsecond.example.org. AAECAwQFBgcICQoLDA0ODxAR )\n"
+    "; Another name, ignored\n"
+    "other.example.org. 3600 IN RRSIG A 13 3 3600 1793491200 1792281600"
+    " 1 example.org. AAAA\n";
+
+/*
+ * 'edns' is 0: none, 1: EDNS, 2: EDNS with DO
+ */
+
+static const struct serve_vector {
+	const char	*name;
+	int		qtype;
+	int		edns;
+	int		len;
+	int		rcode;
+	int		ancount;
+} serve_vectors[] = {
+	{ "LeapSecond.Example.ORG",	T_A,	0,  56, 0, 1 },
+	{ "leapsecond.example.org",	T_A,	1,  67, 0, 1 },
+	{ "leapsecond.example.org",	T_A,	2, 174, 0, 2 },
+	{ "leapsecond.example.org",	T_DNSKEY, 0, 120, 0, 1 },
+	{ "leapsecond.example.org",	T_DNSKEY, 2, 203, 0, 2 },
+	{ "leapsecond.example.org",	T_ANY,	0,  56, 0, 1 },
+	{ "leapsecond.example.org",	28,	2,  51, 0, 0 },
+	{ "x.leapsecond.example.org",	T_A,	0,  42, R_NXDOMAIN, 0 },
+	{ "example.org",		T_A,	0,  29, R_REFUSED, 0 },
+	{ "",				T_A,	0,  -1, 0, 0 },
+	{ NULL,				0,	0,   0, 0, 0 }
+};
+
+/*
+ * Rate 2/s, slip 2: a new prefix gets one response, then alternating
+ * drop/slip until the bucket refills, up to a burst of two.
+ */
+
+static const struct rrl_vector {
+	const char	*src;
+	uint32_t	now;
+	enum rrl_verdict verdict;
+} rrl_vectors[] = {
+	{ "192.0.2.1",		1000,	RRL_PASS },
+	{ "192.0.2.2",		1000,	RRL_DROP },
+	{ "192.0.2.3",		1000,	RRL_SLIP },
+	{ "192.0.2.4",		1000,	RRL_DROP },
+	{ "198.51.100.1",	1000,	RRL_PASS },
+	{ "192.0.2.5",		1200,	RRL_SLIP },
+	{ "192.0.2.6",		1500,	RRL_PASS },
+	{ "192.0.2.7",		1500,	RRL_DROP },
+	{ "::ffff:192.0.2.8",	1500,	RRL_SLIP },
+	{ "2001:db8:0:1::1",	1500,	RRL_PASS },
+	{ "2001:db8:0:1::2",	1500,	RRL_DROP },
+	{ "2001:db8:0:1::3",	1500,	RRL_SLIP },
+	{ "2001:db8:0:2::3",	1500,	RRL_DROP },
+	{ "2001:db8:0:100::3",	1500,	RRL_PASS },
+	{ "192.0.2.9",		2600,	RRL_PASS },
+	{ "192.0.2.10",		2600,	RRL_PASS },
+	{ "192.0.2.11",		2600,	RRL_DROP },
+	{ "192.0.2.12",		2600,	RRL_SLIP },
+	{ NULL,			0,	RRL_PASS },
+};
+
+static void
+test_rrl(void)
+{
+	const struct rrl_vector *rv;
+	struct sockaddr_storage ss;
+	struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+	struct sockaddr_in pfx[RRL_WAYS + 1];
+	struct rrl_spend *sp;
+	struct rrl_pool rp;
+	struct rrl *rl;
+	enum rrl_verdict v;
+	unsigned u, n, pass;
+
+	rl = rrl_new(2, 2);
+	assert(rl != NULL);
+	for (rv = rrl_vectors; rv->src != NULL; rv++) {
+		memset(&ss, 0, sizeof ss);
+		if (inet_pton(AF_INET, rv->src, &sin->sin_addr) == 1) {
+			sin->sin_family = AF_INET;
+		} else {
+			assert(inet_pton(AF_INET6, rv->src,
+			    &sin6->sin6_addr) == 1);
+			sin6->sin6_family = AF_INET6;
+		}
+		v = rrl_check(rl, (struct sockaddr *)&ss, rv->now);
+		printf("  Source: %-18s  Time: %4u  Verdict: %d\n",
+		    rv->src, rv->now, v);
+		assert(v == rv->verdict);
+	}
+	free(rl);
+
+	/* One more /24 than there are ways, all in the same set */
+	memset(pfx, 0, sizeof pfx);
+	for (u = n = 0; n <= RRL_WAYS; u++) {
+		pfx[n].sin_family = AF_INET;
+		pfx[n].sin_addr.s_addr = htonl(0x0a000000 + (u << 8));
+		if (rrl_set(rrl_key((struct sockaddr *)&pfx[n])) ==
+		    rrl_set(rrl_key((struct sockaddr *)&pfx[0])))
+			n++;
+	}
+	rl = rrl_new(100, 0);
+	assert(rl != NULL);
+	/* Two colliding prefixes alternating both keep their bucket */
+	for (u = pass = 0; u < 100; u++)
+		pass += rrl_check(rl, (struct sockaddr *)&pfx[u & 1],
+		    1000) == RRL_PASS;
+	assert(pass == 2);
+	/*
+	 * Evicted by the others, the first comes back to one response
+	 * where a full second's worth would otherwise have built up.
+	 */
+	(void)rrl_check(rl, (struct sockaddr *)&pfx[1], 1001);
+	for (u = 2; u <= RRL_WAYS; u++)
+		assert(rrl_check(rl, (struct sockaddr *)&pfx[u],
+		    1000 + u) == RRL_PASS);
+	assert(rrl_check(rl, (struct sockaddr *)&pfx[0], 2000) == RRL_PASS);
+	assert(rrl_check(rl, (struct sockaddr *)&pfx[0], 2000) == RRL_DROP);
+	printf("  Colliding /24s alternating: %u passed\n", pass);
+	free(rl);
+
+	/*
+	 * One /24 spread over four tables, 4000 queries a second for ten
+	 * seconds at a rate of 100, charged across them or not.
+	 */
+	for (n = 0; n < 2; n++) {
+		for (u = 0; u < 4; u++) {
+			rp.rl[u] = rrl_new(100, 0);
+			assert(rp.rl[u] != NULL);
+		}
+		rp.nrl = 4;
+		sp = calloc((size_t)rp.nrl * (1U << RRL_BITS) * RRL_WAYS,
+		    sizeof *sp);
+		assert(sp != NULL);
+		for (u = pass = 0; u < 40000; u++) {
+			if (n == 1 && u % (4 * RRL_SHARE) == 0)
+				rrl_share(rp.rl, rp.nrl, sp);
+			pass += rrl_check(rp.rl[u & 3],
+			    (struct sockaddr *)&pfx[0], 1000 + u / 4) ==
+			    RRL_PASS;
+		}
+		printf("  Four threads, %s: %u passed in 10 s\n",
+		    n ? "charged across" : "apart", pass);
+		if (n == 0)
+			assert(pass > 3 * 1000);
+		else
+			assert(pass > 900 && pass < 1200);
+		for (u = 0; u < 4; u++)
+			free(rp.rl[u]);
+		free(sp);
+	}
+}
+
+/*
+ * Rate limiting cost per packet, 4096 sources in 1024 prefixes, all
+ * over their limit most of the time.
+ */
+
+void
+bench_rrl(unsigned long n)
+{
+	struct sockaddr_in sin;
+	struct rrl *rl;
+	unsigned long u;
+	unsigned pass = 0;
+
+	rl = rrl_new(100, 2);
+	assert(rl != NULL);
+	memset(&sin, 0, sizeof sin);
+	sin.sin_family = AF_INET;
+	for (u = 0; u < n; u++) {
+		sin.sin_addr.s_addr = htonl(0x0a000000 + (u & 0xfff) * 61);
+		pass += rrl_check(rl, (struct sockaddr *)&sin,
+		    (uint32_t)(u >> 10)) == RRL_PASS;
+	}
+	bench_sink += pass;
+	free(rl);
+}
+
+static struct serve_cache *
+test_names(unsigned n)
+{
+	struct serve_cache *sc;
+	char name[64];
+	unsigned u;
+
+	sc = serve_cache_new(n);
+	assert(sc != NULL);
+	for (u = 0; u < n; u++) {
+		(void)snprintf(name, sizeof name, "leap%u.zone%u.example",
+		    u, u % 7);
+		assert(serve_cache_add(sc, name, 0xf4000000 + u, NULL) == 0);
+	}
+	return (sc);
+}
+
+/*
+ * Name lookup cost per query, 1024 names, one in eight queries misses
+ */
+
+void
+bench_lookup(unsigned long n)
+{
+	static uint8_t names[8][1024][32];
+	static size_t lens[8][1024];
+	struct serve_cache *sc;
+	unsigned long u;
+	unsigned i, j, hit = 0;
+	char buf[64];
+	int l;
+
+	sc = test_names(1024);
+	assert(serve_cache_index(sc) == 0);
+	for (i = 0; i < 8; i++) {
+		for (j = 0; j < 1024; j++) {
+			(void)snprintf(buf, sizeof buf, "leap%u.zone%u.%s",
+			    j, j % 7, i ? "example" : "exampl");
+			l = dns_name(buf, names[i][j], sizeof names[i][j]);
+			assert(l > 0);
+			lens[i][j] = l;
+		}
+	}
+	for (u = 0; u < n; u++) {
+		i = u & 7;
+		j = (u >> 3) & 1023;
+		hit += serve_find(sc, names[i][j], lens[i][j]) >= 0;
+	}
+	bench_sink += hit;
+	free(sc);
+}
+
+/*
+ * Every name is found at its own index, others are not, and a name
+ * given twice fails.
+ */
+
+static void
+test_perfect(void)
+{
+	const struct serve_entry *e;
+	struct serve_cache *sc;
+	uint8_t name[DNS_MAXNAME];
+	unsigned u;
+	int l;
+
+	sc = test_names(1000);
+	assert(serve_cache_index(sc) == 0);
+	printf("  Names: %u  Buckets: %u  Slots: %u  Seed: %016jx\n",
+	    sc->nname, sc->bmask + 1, sc->mask + 1, (uintmax_t)sc->seed);
+	for (u = 0; u < sc->nname; u++) {
+		e = serve_name(sc, u);
+		assert(serve_find(sc, e->name, e->namelen) == (int)u);
+		assert(dns_get32(e->pkt + e->pktlen - 4) == 0xf4000000 + u);
+	}
+	l = dns_name("leap1000.zone6.example", name, sizeof name);
+	assert(serve_find(sc, name, l) == -1);
+	l = dns_name("zone6.example", name, sizeof name);
+	assert(serve_find(sc, name, l) == -1);
+	free(sc);
+
+	sc = serve_cache_new(3);
+	assert(sc != NULL);
+	assert(serve_cache_add(sc, "a.example", 1, NULL) == 0);
+	assert(serve_cache_add(sc, "b.example", 2, NULL) == 0);
+	assert(serve_cache_add(sc, "A.Example", 3, NULL) == 0);
+	assert(serve_cache_add(sc, "c.example", 4, NULL) == -1);
+	assert(serve_cache_index(sc) == -1);
+	free(sc);
+}
+
+static int
+test_query(uint8_t *q, unsigned id, const char *name, int qtype, int edns)
+{
+	int l;
+
+	memset(q, 0, DNS_HDRLEN);
+	dns_put16(q, id);
+	q[2] = 0x01;		/* RD */
+	dns_put16(q + 4, 1);
+	l = dns_name(name, q + DNS_HDRLEN, DNS_MAXNAME);
+	assert(l > 0);
+	l += DNS_HDRLEN;
+	dns_put16(q + l, qtype);
+	dns_put16(q + l + 2, C_IN);
+	l += 4;
+	if (edns) {
+		dns_put16(q + 10, 1);
+		memset(q + l, 0, 11);
+		dns_put16(q + l + 1, T_OPT);
+		dns_put16(q + l + 3, DNS_EDNS_SIZE);
+		if (edns == 2)
+			q[l + 7] = 0x80;	/* DO */
+		l += 11;
+	}
+	return (l);
+}
+
+/*
+ * The history RRset answers in one plain UDP packet, and decodes back
+ * into the table.
+ */
+
+static void
+test_history(void)
+{
+	struct serve_cache *sc;
+	struct leap_entry le[64];
+	uint32_t addr[64];
+	uint8_t q[DNS_MAXUDP], r[DNS_EDNS_SIZE];
+	ssize_t len;
+	int i, l, n;
+
+	n = leap_history_encode(leap_table, leap_table_len, addr);
+	sc = serve_cache_new(2);
+	assert(sc != NULL);
+	assert(serve_cache_add(sc, "leapsecond.example.org", addr[n - 1],
+	    NULL) == 0);
+	assert(serve_cache_addset(sc, "history.leapsecond.example.org",
+	    addr, n, NULL) == 0);
+	assert(serve_cache_index(sc) == 0);
+	l = test_query(q, 0x4711, "History.LeapSecond.example.org", T_A, 0);
+	len = serve_answer(sc, q, l, r, sizeof r, 0);
+	printf("  Len: %zd  Answers: %u\n", len, dns_get16(r + 6));
+	assert(len > 0 && len <= DNS_MAXUDP);
+	assert((r[2] & 0x02) == 0);		/* Not TC */
+	assert(dns_get16(r + 6) == (unsigned)n);
+	for (i = 0; i < n; i++)
+		addr[i] = dns_get32(r + l + 16 * i + 12);
+	assert(leap_history_decode(addr, n, le, 64) == n);
+	assert(!memcmp(le, leap_table, n * sizeof le[0]));
+	assert(serve_cache_addset(sc, "x.example", addr, 75, NULL) == -1);
+	free(sc);
+}
+
+/*
+ * Past announcements by bulletin number and by month, with their
+ * query name echoed as sent.
+ */
+
+static const struct bulletin_query {
+	const char	*name;
+	int		qtype;
+	int		edns;
+	int		rcode;
+	uint32_t	addr;
+} bulletin_queries[] = {
+	{ "c49.leapsecond.example.org",		T_A,	0, 0, 0xf41723ff },
+	{ "2015-06.LeapSecond.example.org",	T_A,	2, 0, 0xf41723ff },
+	{ "C52.leapsecond.example.org",		T_ANY,	1, 0, 0xf43b2428 },
+	{ "c52.leapsecond.example.org",	T_DNSKEY, 0, 0, 0 },
+	{ "1971-12.leapsecond.example.org",	T_A,	0, 0, 0xf003094d },
+	{ "1971-06.leapsecond.example.org",	T_A,	0, R_NXDOMAIN, 0 },
+	{ "c500.leapsecond.example.org",	T_A,	0, R_NXDOMAIN, 0 },
+	{ "c49.history.leapsecond.example.org",	T_A,	0, R_NXDOMAIN, 0 },
+	{ "c49.example.org",			T_A,	0, R_REFUSED, 0 },
+	{ NULL,					0,	0, 0, 0 }
+};
+
+static void
+test_bulletin(void)
+{
+	const struct bulletin_query *bq;
+	struct serve_cache *sc;
+	struct serve_zone z;
+	uint8_t q[DNS_MAXUDP], r[DNS_EDNS_SIZE];
+	ssize_t len;
+	int l;
+
+	memset(&z, 0, sizeof z);
+	z.fqdn = "leapsecond.example.org";
+	z.addr = encode_leapsecond(2026, 12, 37, 0);
+	sc = serve_cache_new(2);
+	assert(sc != NULL);
+	assert(serve_zone_add(sc, &z, 0) == 0);
+	assert(serve_cache_index(sc) == 0);
+	for (bq = bulletin_queries; bq->name != NULL; bq++) {
+		l = test_query(q, 0x2015, bq->name, bq->qtype, bq->edns);
+		len = serve_answer(sc, q, l, r, sizeof r, 0);
+		printf("  Query: %-36s  Len: %3zd  Rcode: %d  Answers: %u\n",
+		    bq->name, len, r[3] & 0xf, dns_get16(r + 6));
+		assert(len > 0);
+		assert((r[3] & 0xf) == bq->rcode);
+		assert(!memcmp(r + DNS_HDRLEN, q + DNS_HDRLEN,
+		    l - DNS_HDRLEN - (bq->edns ? 11 : 0)));
+		assert(dns_get16(r + 6) == (bq->addr != 0));
+		if (bq->addr != 0)
+			assert(dns_get32(r + l - (bq->edns ? 11 : 0) + 12) ==
+			    bq->addr);
+		if (bq->rcode == 0)
+			assert(dns_get16(r + 10) == (bq->edns != 0));
+	}
+	free(sc);
+}
+
+/*
+ * Signer output whose A RRset is not the one served: another address,
+ * and the right address with another TTL.  DO queries for A must be
+ * refused, the rest answered as usual.
+ */
+
+static char serve_signed_other[] =
+    "$TTL 3600\n"
+    "leapsecond.example.org. IN A 244.23.35.254\n"
+    "\tRRSIG A 13 3 3600 1793491200 1792281600 12345 example.org. AAAA\n"
+    "\tDNSKEY 257 3 13 AAECAwQFBgcICQoLDA0ODxAREhMUFRYXGBkaGxwdHh8g\n";
+
+static char serve_signed_ttl[] =
+    "leapsecond.example.org. 60 IN A 244.23.35.255\n"
+    "\t3600 RRSIG A 13 3 3600 1793491200 1792281600 12345 example.org."
+    " AAAA\n"
+    "\tDNSKEY 257 3 13 AAECAwQFBgcICQoLDA0ODxAREhMUFRYXGBkaGxwdHh8g\n";
+
+static void
+test_stale(char *text)
+{
+	struct serve_cache *sc;
+	struct serve_rrs rrs;
+	uint8_t q[DNS_MAXUDP], r[DNS_EDNS_SIZE];
+	ssize_t len;
+	int l, edns;
+
+	assert(serve_rrs_parse(text, "leapsecond.example.org", &rrs) == 0);
+	assert(rrs.na == 1 && rrs.n == 2);
+	printf("  Signed: %08x  TTL: %u\n", rrs.a[0], rrs.attl);
+	sc = serve_cache_build("leapsecond.example.org",
+	    encode_leapsecond(2015, 6, 35, +1), &rrs);
+	assert(sc != NULL);
+	for (edns = 0; edns <= 2; edns++) {
+		l = test_query(q, 0x1234, "leapsecond.example.org", T_A,
+		    edns);
+		len = serve_answer(sc, q, l, r, sizeof r, 0);
+		printf("  EDNS: %d  Len: %3zd  Rcode: %d  Answers: %u\n",
+		    edns, len, r[3] & 0xf, dns_get16(r + 6));
+		assert(len > 0);
+		assert((r[3] & 0xf) == (edns == 2 ? R_REFUSED : 0));
+		assert(dns_get16(r + 6) == (edns == 2 ? 0 : 1));
+	}
+	l = test_query(q, 0x1234, "leapsecond.example.org", T_DNSKEY, 2);
+	len = serve_answer(sc, q, l, r, sizeof r, 0);
+	assert(len > 0 && (r[3] & 0xf) == 0 && dns_get16(r + 6) == 1);
+	free(sc);
+}
+
+/*
+ * What '-E' prints for the signer is what '-S' then checks against
+ */
+
+static void
+test_emit(void)
+{
+	struct serve_reload sr;
+	struct serve_rrs rrs;
+	uint32_t hist[SERVE_MAXHIST];
+	char *text, *copy;
+	size_t len;
+	FILE *fo;
+	int n;
+
+	memset(&sr, 0, sizeof sr);
+	sr.one.fqdn = "leapsecond.example.org";
+	sr.one.addr = encode_leapsecond(2016, 12, 36, +1);
+	fo = open_memstream(&text, &len);
+	assert(fo != NULL);
+	assert(serve_emit(&sr, fo) == 0);
+	assert(fclose(fo) == 0);
+	copy = strdup(text);
+	assert(copy != NULL);
+	assert(serve_rrs_parse(text, "leapsecond.example.org", &rrs) == 0);
+	assert(rrs.na == 1 && rrs.a[0] == sr.one.addr);
+	assert(rrs.attl == DNS_TTL && rrs.n == 0);
+	n = leap_history_encode(leap_table, leap_table_len, hist);
+	assert(serve_rrs_parse(copy, "history.leapsecond.example.org",
+	    &rrs) == 0);
+	printf("  Emitted: %zu bytes, A RRsets of 1 and %u\n", len, rrs.na);
+	assert(n > 0 && rrs.na == (unsigned)n);
+	assert(!memcmp(rrs.a, hist, n * sizeof *hist));
+	free(text);
+	free(copy);
+}
+
+/*
+ * Three pipelined queries, the last one split across two reads
+ */
+
+static void
+test_tcp(const struct serve_cache *sc)
+{
+	static struct tcp_conn tc;
+	uint8_t q[DNS_MAXUDP];
+	size_t pos;
+	int i, l, n;
+
+	for (i = 0; i < 3; i++) {
+		l = test_query(q, 0x100 + i, "leapsecond.example.org",
+		    i == 1 ? T_DNSKEY : T_A, i);
+		dns_put16(tc.in + tc.inlen, l);
+		memcpy(tc.in + tc.inlen + 2, q, l);
+		tc.inlen += 2 + l;
+	}
+	tc.inlen -= 10;
+	n = tcp_consume(sc, &tc);
+	printf("  Consumed: %d  Left: %zu  Output: %zu\n",
+	    n, tc.inlen, tc.outlen);
+	assert(n == 2 && tc.inlen == 2 + (size_t)l - 10);
+	tc.inlen += 10;
+	memcpy(tc.in + tc.inlen - 10, q + l - 10, 10);
+	n = tcp_consume(sc, &tc);
+	printf("  Consumed: %d  Left: %zu  Output: %zu\n",
+	    n, tc.inlen, tc.outlen);
+	assert(n == 1 && tc.inlen == 0);
+	for (i = 0, pos = 0; pos < tc.outlen; i++) {
+		l = dns_get16(tc.out + pos);
+		assert(dns_get16(tc.out + pos + 2) == 0x100u + i);
+		assert((tc.out[pos + 4] & 0x02) == 0);	/* Not TC */
+		pos += 2 + l;
+	}
+	assert(i == 3 && pos == tc.outlen);
+
+	tc.inlen = 2;
+	dns_put16(tc.in, DNS_MAXUDP + 1);
+	assert(tcp_consume(sc, &tc) == -1);
+}
+
+static void *
+test_reload_worker(void *priv)
+{
+	struct serve_worker *sw = priv;
+
+	(void)usleep(20000);
+	(void)serve_online(sw);
+	return (NULL);
+}
+
+/*
+ * Publishing must wait for the worker which is online in the old
+ * epoch, but not for the one which is offline.
+ */
+
+static void
+test_reload(void)
+{
+	struct serve_worker sw[2];
+	struct serve_reload sr;
+	struct serve_cache *sc;
+	pthread_t thr;
+	uint64_t t0;
+	int l;
+
+	memset(sw, 0, sizeof sw);
+	memset(&sr, 0, sizeof sr);
+	sr.sw = sw;
+	sr.nsw = 2;
+	atomic_store(&serve_current,
+	    serve_cache_build("leapsecond.example.org", 0xf41723ff, NULL));
+	(void)serve_online(&sw[1]);
+	l = pthread_create(&thr, NULL, test_reload_worker, &sw[1]);
+	assert(l == 0);
+	sc = serve_cache_build("leapsecond.example.org", 0xf41724ff, NULL);
+	assert(sc != NULL);
+	t0 = metric_usec();
+	serve_publish(&sr, sc);
+	t0 = metric_usec() - t0;
+	(void)pthread_join(thr, NULL);
+	printf("  Published after: %ju usec  Epoch: %ju\n",
+	    (uintmax_t)t0, (uintmax_t)atomic_load(&serve_epoch));
+	assert(t0 >= 15000);
+	assert(atomic_load(&serve_current) == sc);
+	assert(atomic_load(&sw[1].epoch) == atomic_load(&serve_epoch));
+	free(atomic_exchange(&serve_current, NULL));
+}
+
+/*
+ * The AF_XDP path answers from the published cache, like the sockets.
+ */
+
+static void
+test_xdp(void)
+{
+	struct serve_worker sw;
+	uint32_t addr;
+
+	memset(&sw, 0, sizeof sw);
+	sw.rl = rrl_new(0, 0);
+	assert(sw.rl != NULL);
+	addr = encode_leapsecond(2016, 12, 36, +1);
+	atomic_store(&serve_current,
+	    serve_cache_build("leapsecond.example.org", addr, NULL));
+	test_leap_xdp(serve_xdp_batch, &sw, "leapsecond.example.org", addr);
+	free(atomic_exchange(&serve_current, NULL));
+	free(sw.rl);
+}
+
+void
+test_leap_serve(void)
+{
+	const struct serve_vector *sv;
+	struct serve_cache *sc;
+	struct serve_rrs rrs;
+	uint8_t q[DNS_MAXUDP], r[DNS_EDNS_SIZE];
+	char *other;
+	ssize_t len;
+	int l;
+
+	printf("\nChecking responder:\n\n");
+	/* The other name's RRSIG parses, so below it is left out by name */
+	other = strdup(serve_signed);
+	assert(other != NULL);
+	l = serve_rrs_parse(other, "other.example.org", &rrs);
+	assert(l == 0 && rrs.n == 1 && rrs.na == 0);
+	assert(rrs.rr[0].type == T_RRSIG && rrs.rr[0].covered == T_A);
+	free(other);
+	l = serve_rrs_parse(serve_signed, "leapsecond.example.org.", &rrs);
+	assert(l == 0);
+	assert(rrs.n == 3);
+	assert(rrs.na == 1 && rrs.a[0] == 0xf41723ff && rrs.attl == DNS_TTL);
+	assert(rrs.rr[0].type == T_RRSIG && rrs.rr[0].covered == T_A);
+	assert(rrs.rr[0].expire == 1793491200 && rrs.rr[0].len == 95);
+	assert(rrs.rr[1].type == T_DNSKEY && rrs.rr[1].len == 68);
+	assert(rrs.rr[2].covered == T_DNSKEY && rrs.rr[2].len == 60);
+	l = serve_rrs_check(&rrs, 1793491200 - SERVE_RESIGN - 1);
+	assert(l == 0);
+	sc = serve_cache_build("leapsecond.example.org",
+	    encode_leapsecond(2015, 6, 35, +1), &rrs);
+	assert(sc != NULL);
+	for (sv = serve_vectors; sv->name != NULL; sv++) {
+		l = test_query(q, 0x1234, sv->name, sv->qtype, sv->edns);
+		if (sv->len < 0)
+			l = DNS_HDRLEN;	/* Truncated */
+
+		len = serve_answer(sc, q, l, r, sizeof r, 0);
+		printf("  Query: %-24s  Type: %3d  EDNS: %d  Len: %3zd",
+		    sv->name, sv->qtype, sv->edns, len);
+		if (len > 0)
+			printf("  Rcode: %d  Answers: %u", r[3] & 0xf,
+			    dns_get16(r + 6));
+		printf("\n");
+		assert(len == sv->len);
+		if (len < 0)
+			continue;
+		assert(r[0] == 0x12 && r[1] == 0x34);
+		assert((r[2] & 0x81) == 0x81);
+		assert((r[3] & 0xf) == sv->rcode);
+		assert(dns_get16(r + 6) == (unsigned)sv->ancount);
+		assert(!memcmp(r + DNS_HDRLEN, q + DNS_HDRLEN,
+		    l - DNS_HDRLEN - (sv->edns ? 11 : 0)));
+		if (sv->ancount && sv->qtype != T_DNSKEY)
+			assert(!memcmp(r + l - (sv->edns ? 11 : 0) + 12,
+			    "\xf4\x17\x23\xff", 4));
+	}
+
+	printf("\nChecking TCP pipelining:\n\n");
+	test_tcp(sc);
+	free(sc);
+
+	printf("\nChecking signed A RRset against the served one:\n\n");
+	test_stale(serve_signed_other);
+	test_stale(serve_signed_ttl);
+	test_emit();
+
+	printf("\nChecking name dispatch:\n\n");
+	test_perfect();
+
+	printf("\nChecking history RRset answer:\n\n");
+	test_history();
+
+	printf("\nChecking bulletin answers:\n\n");
+	test_bulletin();
+
+	printf("\nChecking response rate limiting:\n\n");
+	test_rrl();
+
+	printf("\nChecking hot reload:\n\n");
+	test_reload();
+
+	test_xdp();
+}
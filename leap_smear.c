@@ -0,0 +1,419 @@
+/*-
+ * Copyright (c) 2015 Poul-Henning Kamp <phk@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Leap second smearing, and the shared state which says how.
+ *
+ * Rather than stepping the clock by 'delta' at the end of the
+ * announced month, the step is spread over a window of 'width'
+ * seconds centred on it, linearly or along half a cosine.  Timestamps
+ * are seconds on the scale TAI - dTAI, with dTAI from before the leap;
+ * that is what CLOCK_REALTIME reads when the kernel is not armed.  The
+ * smeared UTC is then 't - smear_offset(t)'.  A 'width' of zero, or
+ * SMEAR_STEP, gives the plain step.
+ *
+ * The cosine is a polynomial rather than cos(3), so that the scalar
+ * and the bulk code compute the same curve, and the bulk code can
+ * do it in vector registers.  The bulk code uses the GCC/Clang vector
+ * extensions, two doubles wide as both SSE2 and NEON have, and falls
+ * back to the scalar code elsewhere.
+ *
+ * 'dns_leap arm' publishes the announcement and the smear parameters
+ * in a POSIX shared memory object, so that every process on the host
+ * smears identically.  It is written under a sequence lock: 'seq' is
+ * odd while the writer is at it, and readers retry until they see the
+ * same even 'seq' before and after their copy.
+ *
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "dns_leap.h"
+
+#define SMEAR_MAXWIDTH	(7 * 86400)
+
+static const char * const smear_names[] = {
+	[SMEAR_STEP] = "step",
+	[SMEAR_LINEAR] = "linear",
+	[SMEAR_COSINE] = "cosine",
+};
+
+int
+smear_kind(const char *name)
+{
+	int i;
+
+	for (i = 0; i < 3; i++)
+		if (!strcmp(name, smear_names[i]))
+			return (i);
+	return (-1);
+}
+
+/*
+ * Smear the leap at the end of 'year'-'month' over 'width' seconds.
+ */
+
+int
+smear_init(struct leap_smear *ls, int year, int month, int delta, int kind,
+    int width)
+{
+
+	memset(ls, 0, sizeof *ls);
+	if (month < 1 || month > 12 || delta < -1 || delta > 1)
+		return (-1);
+	if (kind < SMEAR_STEP || kind > SMEAR_COSINE ||
+	    width < 0 || width > SMEAR_MAXWIDTH)
+		return (-1);
+	ls->leap = leap_month_end(year, month);
+	ls->delta = delta;
+	ls->kind = width == 0 ? SMEAR_STEP : kind;
+	ls->width = ls->kind == SMEAR_STEP ? 0 : width;
+	return (0);
+}
+
+/*
+ * (1 - cos(pi x)) / 2 = (1 + sin(pi (x - 1/2))) / 2, with the Taylor
+ * series of sin(z) to z^19, which is good to an ulp or two for
+ * |z| <= pi/2, so that the ends of the window are 0 and 1.
+ */
+
+#define SMEAR_SIN(z, z2)						\
+	((z) * (1 + (z2) * (-1 / 6. + (z2) * (1 / 120. + (z2) *	\
+	(-1 / 5040. + (z2) * (1 / 362880. + (z2) * (-1 / 39916800. +	\
+	(z2) * (1 / 6227020800. + (z2) * (-1 / 1307674368000. +	\
+	(z2) * (1 / 355687428096000. +					\
+	(z2) * (-1 / 121645100408832000.)))))))))))
+
+double
+smear_offset(const struct leap_smear *ls, double t)
+{
+	double x, z;
+
+	if (ls->kind == SMEAR_STEP)
+		return (t >= ls->leap ? ls->delta : 0);
+	x = (t - ls->leap) / ls->width + .5;
+	x = x < 0 ? 0 : x > 1 ? 1 : x;
+	if (ls->kind == SMEAR_COSINE) {
+		z = M_PI * (x - .5);
+		x = .5 + .5 * SMEAR_SIN(z, z * z);
+	}
+	return (ls->delta * x);
+}
+
+#if defined(__GNUC__) && !defined(NO_SIMD)
+typedef double smear_vd __attribute__((vector_size(16)));
+typedef int64_t smear_vi __attribute__((vector_size(16)));
+
+/*
+ * Bulk smear_offset(), two at a time.
+ */
+
+static void
+smear_bulk(const struct leap_smear *ls, const double *t, double *off,
+    size_t n)
+{
+	const smear_vd zero = { 0, 0 }, one = { 1, 1 }, half = { .5, .5 };
+	const smear_vd pi = { M_PI, M_PI };
+	smear_vd leap, rw, delta, x, z;
+	smear_vi m;
+	size_t i;
+
+	leap = (smear_vd){ ls->leap, ls->leap };
+	rw = one / (smear_vd){ ls->width, ls->width };
+	delta = (smear_vd){ ls->delta, ls->delta };
+	for (i = 0; i + 2 <= n; i += 2) {
+		memcpy(&x, t + i, sizeof x);
+		x = (x - leap) * rw + half;
+		m = x < zero;
+		x = (smear_vd)((smear_vi)x & ~m);
+		m = x > one;
+		x = (smear_vd)(((smear_vi)x & ~m) | ((smear_vi)one & m));
+		if (ls->kind == SMEAR_COSINE) {
+			z = pi * (x - half);
+			x = half + half * SMEAR_SIN(z, z * z);
+		}
+		x *= delta;
+		memcpy(off + i, &x, sizeof x);
+	}
+	for (; i < n; i++)
+		off[i] = smear_offset(ls, t[i]);
+}
+#endif
+
+/*
+ * smear_offset() for 'n' timestamps
+ */
+
+void
+smear_offsets(const struct leap_smear *ls, const double *t, double *off,
+    size_t n)
+{
+	size_t i;
+
+#if defined(__GNUC__) && !defined(NO_SIMD)
+	if (ls->kind != SMEAR_STEP) {
+		smear_bulk(ls, t, off, n);
+		return;
+	}
+#endif
+	for (i = 0; i < n; i++)
+		off[i] = smear_offset(ls, t[i]);
+}
+
+/*
+ * Shared state -------------------------------------------------------
+ */
+
+static struct leap_state *
+leap_state_map(const char *name, int writer)
+{
+	static struct {
+		char			name[64];
+		struct leap_state	*p;
+	} map[2];
+	void *p;
+	int fd;
+
+	if (map[writer].p != NULL && !strcmp(map[writer].name, name))
+		return (map[writer].p);
+	if (strlen(name) >= sizeof map[writer].name)
+		return (NULL);
+	fd = shm_open(name, writer ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+	if (fd < 0)
+		return (NULL);
+	if (writer && ftruncate(fd, sizeof *map[writer].p)) {
+		(void)close(fd);
+		return (NULL);
+	}
+	p = mmap(NULL, sizeof *map[writer].p, writer ?
+	    PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	(void)close(fd);
+	if (p == MAP_FAILED)
+		return (NULL);
+	if (map[writer].p != NULL)
+		(void)munmap(map[writer].p, sizeof *map[writer].p);
+	map[writer].p = p;
+	(void)strcpy(map[writer].name, name);
+	return (p);
+}
+
+/*
+ * Only one process, 'dns_leap arm', writes.
+ */
+
+int
+leap_state_publish(const char *name, const struct leap_state *ls)
+{
+	struct leap_state *m;
+	uint32_t seq;
+
+	m = leap_state_map(name, 1);
+	if (m == NULL)
+		return (-1);
+	seq = __atomic_load_n(&m->seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&m->seq, seq | 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy((char *)m + sizeof m->seq, (const char *)ls + sizeof ls->seq,
+	    sizeof *ls - sizeof ls->seq);
+	__atomic_store_n(&m->seq, (seq | 1) + 1, __ATOMIC_RELEASE);
+	return (0);
+}
+
+/*
+ * Returns -1 if nothing has been published.
+ */
+
+int
+leap_state_read(const char *name, struct leap_state *ls)
+{
+	const struct leap_state *m;
+	uint32_t s1, s2;
+
+	m = leap_state_map(name, 0);
+	if (m == NULL)
+		return (-1);
+	do {
+		s1 = __atomic_load_n(&m->seq, __ATOMIC_ACQUIRE);
+		memcpy(ls, m, sizeof *ls);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		s2 = __atomic_load_n(&m->seq, __ATOMIC_RELAXED);
+	} while ((s1 & 1) || s1 != s2);
+	ls->seq = s1;
+	return (ls->version == LEAP_STATE_VERSION ? 0 : -1);
+}
+
+/*
+ * Offsets per timestamp, over a day around the 2016-12 leap second
+ */
+
+static double bench_t[1024], bench_off[1024];
+
+static void
+bench_smear_setup(struct leap_smear *ls)
+{
+	int i;
+
+	assert(smear_init(ls, 2016, 12, 1, SMEAR_COSINE, 86400) == 0);
+	for (i = 0; i < 1024; i++)
+		bench_t[i] = ls->leap - 43200 + i * 84.375 + .123456;
+}
+
+void
+bench_smear(unsigned long n)
+{
+	struct leap_smear ls;
+	unsigned long u;
+	double sum = 0;
+
+	bench_smear_setup(&ls);
+	for (u = 0; u < n; u++)
+		sum += smear_offset(&ls, bench_t[u & 1023]);
+	bench_sink += (uintmax_t)sum;
+}
+
+void
+bench_smear_bulk(unsigned long n)
+{
+	struct leap_smear ls;
+	unsigned long u;
+	double sum = 0;
+
+	bench_smear_setup(&ls);
+	for (u = 0; u < n; u += 1024) {
+		smear_offsets(&ls, bench_t, bench_off, 1024);
+		sum += bench_off[u & 1023];
+	}
+	bench_sink += (uintmax_t)sum;
+}
+
+/*
+ * 't' is relative to the leap second
+ */
+
+static const struct smear_vector {
+	int		kind;
+	int		width;
+	int		delta;
+	double		t;
+	double		off;
+} smear_vectors[] = {
+	{ SMEAR_STEP,	     0, +1,	   -1,   0 },
+	{ SMEAR_STEP,	     0, +1,	    0,   1 },
+	{ SMEAR_LINEAR,	 86400, +1, -43201,   0 },
+	{ SMEAR_LINEAR,	 86400, +1, -43200,   0 },
+	{ SMEAR_LINEAR,	 86400, +1, -21600, .25 },
+	{ SMEAR_LINEAR,	 86400, +1,	    0,  .5 },
+	{ SMEAR_LINEAR,	 86400, -1,	    0, -.5 },
+	{ SMEAR_LINEAR,	 86400, +1,  43200,   1 },
+	{ SMEAR_LINEAR,	 86400, +1,  99999,   1 },
+	{ SMEAR_COSINE,	 86400, +1, -43200,   0 },
+	{ SMEAR_COSINE,	 86400, +1, -21600,   0.14644660940672624 },
+	{ SMEAR_COSINE,	 86400, +1,	    0,  .5 },
+	{ SMEAR_COSINE,	 86400, +1,  21600,   0.85355339059327376 },
+	{ SMEAR_COSINE,	 86400, +1,  43200,   1 },
+	{ SMEAR_COSINE,	  7200, -1,   1800,  -0.85355339059327376 },
+	{ SMEAR_LINEAR,	     0, +1,	   -1,   0 },	/* Step */
+	{ -1,		     0,  0,	    0,   0 }
+};
+
+void
+test_leap_smear(void)
+{
+	const struct smear_vector *sv;
+	struct leap_smear ls;
+	struct leap_state st, st2;
+	double t[1001], off[1001], o, prev, maxerr = 0;
+	char name[64];
+	int i;
+
+	printf("\nChecking leap smear:\n\n");
+	for (sv = smear_vectors; sv->kind >= 0; sv++) {
+		assert(smear_init(&ls, 2016, 12, sv->delta, sv->kind,
+		    sv->width) == 0);
+		o = smear_offset(&ls, ls.leap + sv->t);
+		printf("  Kind: %-6s  Width: %5d  Delta: %+d  T: %+6.0f"
+		    "  Offset: %+.15f\n", smear_names[sv->kind], sv->width,
+		    sv->delta, sv->t, o);
+		assert(fabs(o - sv->off) < 1e-12);
+	}
+	assert(smear_init(&ls, 2016, 13, 1, SMEAR_LINEAR, 86400) == -1);
+	assert(smear_init(&ls, 2016, 12, 1, 3, 86400) == -1);
+	assert(smear_init(&ls, 2016, 12, 1, SMEAR_LINEAR, -1) == -1);
+	assert(smear_kind("cosine") == SMEAR_COSINE);
+	assert(smear_kind("sine") == -1);
+
+	/* Bulk equals scalar, the cosine is monotonic and exact enough */
+	assert(smear_init(&ls, 2016, 12, 1, SMEAR_COSINE, 86400) == 0);
+	for (i = 0; i < 1001; i++)
+		t[i] = ls.leap - 44000 + i * 88.0;
+	smear_offsets(&ls, t, off, 1001);
+	for (i = 0, prev = 0; i < 1001; i++) {
+		o = (t[i] - ls.leap) / 86400 + .5;
+		o = o < 0 ? 0 : o > 1 ? 1 : o;
+		o = (1 - cos(M_PI * o)) / 2;
+		if (fabs(o - off[i]) > maxerr)
+			maxerr = fabs(o - off[i]);
+		assert(fabs(off[i] - smear_offset(&ls, t[i])) < 1e-15);
+		assert(off[i] >= prev);
+		prev = off[i];
+	}
+	printf("  Bulk: 1001 offsets  Max error against cos(3): %.1e\n",
+	    maxerr);
+	assert(maxerr < 1e-12);
+
+	/* Shared state round trip */
+	(void)snprintf(name, sizeof name, "/dns_leap_test.%ld",
+	    (long)getpid());
+	memset(&st, 0, sizeof st);
+	st.version = LEAP_STATE_VERSION;
+	st.year = 2016;
+	st.month = 12;
+	st.dtai = 36;
+	st.delta = 1;
+	st.smear = ls;
+	st.updated = 1482192000;
+	if (leap_state_publish(name, &st) != 0) {
+		printf("  Shared state: %s, skipped\n", strerror(errno));
+		return;
+	}
+	st.dtai = 37;
+	assert(leap_state_publish(name, &st) == 0);
+	assert(leap_state_read(name, &st2) == 0);
+	(void)shm_unlink(name);
+	printf("  Shared state: seq %u  dTAI: %d  Smear: %s/%d\n", st2.seq,
+	    st2.dtai, smear_names[st2.smear.kind], st2.smear.width);
+	assert(st2.seq == 4);
+	assert(!memcmp((char *)&st2 + sizeof st2.seq,
+	    (char *)&st + sizeof st.seq, sizeof st - sizeof st.seq));
+}
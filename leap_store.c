@@ -0,0 +1,405 @@
+/*-
+ * Copyright (c) 2015 Poul-Henning Kamp <phk@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Last-known-good announcement, for a cold start without network.
+ *
+ * An appliance booting before its network is up has nobody to ask, and
+ * query_leapsecond() fails with -10.  So the last announcement which
+ * decoded correctly is kept in a small file, by default
+ * LEAP_STORE_PATH, and read back in a few microseconds at startup.
+ *
+ * The file is one fixed 32 byte record in host byte order, so it can
+ * also be mmap(2)ed and read in place:
+ *
+ *	0	uint32_t	LKG_MAGIC
+ *	4	uint32_t	LKG_VERSION
+ *	8	uint32_t	the class-E address as published
+ *	12	uint32_t	zero
+ *	16	int64_t		when it was last validated, UNIX time
+ *	24	uint32_t	CRC-32 (IEEE) of the 24 bytes above
+ *	28	uint32_t	zero
+ *
+ * Keeping the address rather than the decoded fields means the
+ * announcement also carries its own CRC-8, so it is checked twice on
+ * the way back in.  A record written on a machine of the other byte
+ * order fails the magic check and is ignored.
+ *
+ * The file is rewritten atomically, like the leapfile, when the
+ * announcement changes, or once a day so the timestamp stays honest,
+ * which spares flash storage from a write per query.  Each writer has
+ * its own temporary file, and the directory is synced after the
+ * rename, so that the new file survives a crash.
+ *
+ * query_leapsecond_lkg() answers from the file when it can, and
+ * refreshes it from DNS in a background thread.
+ *
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "dns_leap.h"
+
+#define LKG_MAGIC	0x4c4b4731	/* "LKG1" */
+#define LKG_VERSION	1
+#define LKG_REFRESH	86400		/* Rewrite unchanged after, seconds */
+
+struct lkg {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	addr;
+	uint32_t	zero0;
+	int64_t		updated;
+	uint32_t	crc;
+	uint32_t	zero1;
+};
+
+static uint32_t
+lkg_crc32(const void *ptr, size_t len)
+{
+	const uint8_t *p = ptr;
+	uint32_t crc = 0xffffffff;
+	int i;
+
+	while (len--) {
+		crc ^= *p++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+	return (~crc);
+}
+
+static void
+lkg_seal(struct lkg *r, uint32_t addr, int64_t updated)
+{
+
+	memset(r, 0, sizeof *r);
+	r->magic = LKG_MAGIC;
+	r->version = LKG_VERSION;
+	r->addr = addr;
+	r->updated = updated;
+	r->crc = lkg_crc32(r, offsetof(struct lkg, crc));
+}
+
+/*
+ * Returns 0 with the record, or -1 if it is missing or does not check
+ * out.
+ */
+
+static int
+lkg_load(const char *path, struct lkg *r)
+{
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return (-1);
+	n = read(fd, r, sizeof *r + 1);
+	(void)close(fd);
+	if (n != sizeof *r || r->magic != LKG_MAGIC ||
+	    r->version != LKG_VERSION || r->zero0 != 0 || r->zero1 != 0 ||
+	    r->crc != lkg_crc32(r, offsetof(struct lkg, crc)))
+		return (-1);
+	return (0);
+}
+
+/*
+ * The stored announcement.  Returns -1, with the fields zeroed, if
+ * there is none.
+ */
+
+int
+leap_store_read(const char *path, int *year, int *month, int *dtai,
+    int *delta, int64_t *updated)
+{
+	struct leap_answer la;
+	struct lkg r;
+	int error;
+
+	error = lkg_load(path, &r);
+	if (error == 0 && decode_leapsecond_n(&r.addr, &la, 1) != 1)
+		error = -1;
+	if (error)
+		memset(&la, 0, sizeof la);
+	if (year != NULL)
+		*year = la.year;
+	if (month != NULL)
+		*month = la.month;
+	if (dtai != NULL)
+		*dtai = la.dtai;
+	if (delta != NULL)
+		*delta = la.delta;
+	if (updated != NULL)
+		*updated = error ? 0 : r.updated;
+	return (error);
+}
+
+/*
+ * Returns 1 if the file was written, 0 if it was current, -1 on error.
+ */
+
+int
+leap_store_write(const char *path, int year, int month, int dtai,
+    int delta, int64_t updated)
+{
+	char tmp[PATH_MAX];
+	struct lkg r, old;
+	uint32_t addr;
+	int fd;
+
+	addr = encode_leapsecond(year, month, dtai, delta);
+	if (addr == 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (lkg_load(path, &old) == 0 && old.addr == addr &&
+	    updated >= old.updated && updated - old.updated < LKG_REFRESH)
+		return (0);
+
+	lkg_seal(&r, addr, updated);
+	if (snprintf(tmp, sizeof tmp, "%s.XXXXXX", path) >= (int)sizeof tmp)
+		return (-1);
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return (-1);
+	if (fchmod(fd, 0644) || write(fd, &r, sizeof r) != sizeof r ||
+	    fsync(fd)) {
+		(void)close(fd);
+		(void)unlink(tmp);
+		return (-1);
+	}
+	if (close(fd) || rename(tmp, path)) {
+		(void)unlink(tmp);
+		return (-1);
+	}
+	if (leapfile_syncdir(path))
+		return (-1);
+	return (1);
+}
+
+/*
+ * Background refresh.  One worker thread, started on first use, does
+ * them one at a time; a request while one is queued or running is
+ * dropped.  leap_store_wait() waits for it to go idle, before exit(3)
+ * or in the tests.
+ */
+
+static pthread_once_t lkg_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t lkg_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lkg_cv = PTHREAD_COND_INITIALIZER;
+static int lkg_up, lkg_pending, lkg_busy;
+static char lkg_fqdn[NI_MAXHOST];
+static char lkg_path[PATH_MAX];
+
+static void *
+lkg_worker(void *priv)
+{
+	char fqdn[sizeof lkg_fqdn], path[sizeof lkg_path];
+	int y, m, t, d;
+
+	(void)priv;
+	(void)pthread_mutex_lock(&lkg_mtx);
+	for (;;) {
+		while (!lkg_pending)
+			(void)pthread_cond_wait(&lkg_cv, &lkg_mtx);
+		strcpy(fqdn, lkg_fqdn);
+		strcpy(path, lkg_path);
+		lkg_pending = 0;
+		lkg_busy = 1;
+		(void)pthread_mutex_unlock(&lkg_mtx);
+
+		if (query_leapsecond(fqdn, &y, &m, &t, &d, NULL) == 0)
+			(void)leap_store_write(path, y, m, t, d, time(NULL));
+
+		(void)pthread_mutex_lock(&lkg_mtx);
+		lkg_busy = 0;
+		(void)pthread_cond_broadcast(&lkg_cv);
+	}
+	return (NULL);
+}
+
+static void
+lkg_spawn(void)
+{
+	pthread_attr_t attr;
+	pthread_t tid;
+
+	(void)pthread_attr_init(&attr);
+	(void)pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	lkg_up = pthread_create(&tid, &attr, lkg_worker, NULL) == 0;
+	(void)pthread_attr_destroy(&attr);
+}
+
+void
+leap_store_wait(void)
+{
+
+	(void)pthread_mutex_lock(&lkg_mtx);
+	while (lkg_pending || lkg_busy)
+		(void)pthread_cond_wait(&lkg_cv, &lkg_mtx);
+	(void)pthread_mutex_unlock(&lkg_mtx);
+}
+
+static void
+lkg_start(const char *fqdn, const char *path)
+{
+
+	(void)pthread_once(&lkg_once, lkg_spawn);
+	(void)pthread_mutex_lock(&lkg_mtx);
+	if (lkg_up && !lkg_pending && !lkg_busy &&
+	    strlen(fqdn) < sizeof lkg_fqdn && strlen(path) < sizeof lkg_path) {
+		strcpy(lkg_fqdn, fqdn);
+		strcpy(lkg_path, path);
+		lkg_pending = 1;
+		(void)pthread_cond_broadcast(&lkg_cv);
+	}
+	(void)pthread_mutex_unlock(&lkg_mtx);
+}
+
+/*
+ * Like query_leapsecond(), but answer from the stored announcement if
+ * there is one, and refresh it in the background.  Returns 1 for a
+ * stored answer, otherwise what the live query returned, after storing
+ * a good answer.
+ */
+
+int
+query_leapsecond_lkg(const char *fqdn, const char *path,
+    int *year, int *month, int *tai, int *delta)
+{
+	int error;
+
+	if (leap_store_read(path, year, month, tai, delta, NULL) == 0) {
+		lkg_start(fqdn, path);
+		return (1);
+	}
+	error = query_leapsecond(fqdn, year, month, tai, delta, NULL);
+	if (error == 0)
+		(void)leap_store_write(path, *year, *month, *tai, *delta,
+		    time(NULL));
+	return (error);
+}
+
+static char bench_path[64];
+
+void
+bench_store_read(unsigned long n)
+{
+	unsigned long u;
+	int y, m, t, d, sum = 0;
+
+	(void)snprintf(bench_path, sizeof bench_path,
+	    "/tmp/dns_leap_bench.%ld", (long)getpid());
+	if (leap_store_write(bench_path, 2016, 12, 36, 1, time(NULL)) < 0)
+		return;
+	for (u = 0; u < n; u++) {
+		sum += leap_store_read(bench_path, &y, &m, &t, &d, NULL);
+		sum += y + m + t + d;
+	}
+	(void)unlink(bench_path);
+	bench_sink += sum;
+}
+
+void
+test_leap_store(void)
+{
+	char path[64];
+	struct timespec t0, t1;
+	struct lkg r;
+	int64_t up;
+	int y, m, t, d, fd;
+
+	printf("\nChecking last-known-good store:\n\n");
+
+	assert(sizeof r == 32);
+	assert(lkg_crc32("123456789", 9) == 0xcbf43926);
+
+	(void)snprintf(path, sizeof path, "/tmp/dns_leap_lkg.%ld",
+	    (long)getpid());
+	(void)unlink(path);
+	assert(leap_store_read(path, &y, &m, &t, &d, &up) == -1);
+	assert(y == 0 && m == 0 && t == 0 && d == 0 && up == 0);
+
+	assert(leap_store_write(path, 2016, 12, 36, 1, 1000000) == 1);
+	assert(leap_store_write(path, 2016, 12, 36, 1, 1000000) == 0);
+	assert(leap_store_write(path, 2016, 12, 36, 1,
+	    1000000 + LKG_REFRESH - 1) == 0);
+	assert(leap_store_write(path, 2016, 12, 36, 1,
+	    1000000 + LKG_REFRESH) == 1);
+	assert(leap_store_write(path, 2016, 12, 37, 0,
+	    1000000 + LKG_REFRESH) == 1);
+	assert(leap_store_write(path, 2016, 13, 37, 0, 0) == -1);
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &t0);
+	assert(leap_store_read(path, &y, &m, &t, &d, &up) == 0);
+	(void)clock_gettime(CLOCK_MONOTONIC, &t1);
+	printf("  Stored: %04d-%02d dTAI: %d Delta: %+d  Updated: %jd"
+	    "  Read in %ld ns\n", y, m, t, d, (intmax_t)up,
+	    (long)((t1.tv_sec - t0.tv_sec) * 1000000000L +
+	    t1.tv_nsec - t0.tv_nsec));
+	assert(y == 2016 && m == 12 && t == 37 && d == 0);
+	assert(up == 1000000 + LKG_REFRESH);
+
+	/* Damage: a flipped bit, short file, sealed but bad CRC-8 */
+	assert(lkg_load(path, &r) == 0);
+	r.updated ^= 4;
+	fd = open(path, O_WRONLY | O_TRUNC);
+	assert(fd >= 0);
+	assert(write(fd, &r, sizeof r) == sizeof r);
+	assert(leap_store_read(path, &y, NULL, NULL, NULL, NULL) == -1);
+	assert(y == 0);
+	assert(ftruncate(fd, sizeof r - 4) == 0);
+	assert(leap_store_read(path, NULL, NULL, NULL, NULL, NULL) == -1);
+	lkg_seal(&r, encode_leapsecond(2016, 12, 37, 0) ^ 1, 1);
+	assert(pwrite(fd, &r, sizeof r, 0) == sizeof r);
+	assert(lkg_load(path, &r) == 0);
+	assert(leap_store_read(path, NULL, NULL, NULL, NULL, NULL) == -1);
+	(void)close(fd);
+
+	/* Cold start from the store, the refresh cannot reach DNS */
+	assert(leap_store_write(path, 2016, 12, 37, 0, 1) == 1);
+	for (fd = 0; fd < 3; fd++) {
+		assert(query_leapsecond_lkg("leapsecond.invalid", path,
+		    &y, &m, &t, &d) == 1);
+		assert(y == 2016 && m == 12 && t == 37 && d == 0);
+	}
+	leap_store_wait();
+	assert(leap_store_read(path, &y, &m, &t, &d, &up) == 0);
+	assert(t == 37 && up == 1);
+	printf("  Cold start: %04d-%02d dTAI: %d Delta: %+d\n", y, m, t, d);
+	(void)unlink(path);
+}
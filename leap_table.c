@@ -0,0 +1,525 @@
+/*-
+ * Copyright (c) 2015 Poul-Henning Kamp <phk@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Compiled-in history of leap seconds.
+ *
+ * Each entry uses the same convention as the DNS announcement: at the
+ * end of 'year'-'month' dTAI became 'dtai'.  The first entry is the
+ * start of UTC as we know it, 1972-01-01, where dTAI was set to 10.
+ *
+ * Source: IERS Bulletin C, see also _Cache_Leap_Second_History.dat
+ *
+ * The table itself is LEAP_TABLE() in dns_leap.h, so that C++ code can
+ * have it at compile time, see leap_chrono.hpp.
+ *
+ * leap_history() reads that file, so that a running responder can pick
+ * up a new Bulletin C without a rebuild.  Its entries are dated by the
+ * first day with the new dTAI, and the MJD must agree; they are
+ * converted to the convention above.  Entries where dTAI does not
+ * change are kept, they announce that there is no leap second.
+ *
+ * The whole history is also published as the A RRset of
+ * "history.<fqdn>", one announcement in the class-E encoding per
+ * entry, so a client can fill its table in one round trip.  Each
+ * address announces the step into its entry; the first one is a step
+ * from dTAI - 1, as for the start of UTC.  Resolvers shuffle RRsets,
+ * so the decoder sorts, and checks that the steps join up.
+ *
+ * Past announcements are published one by one as "c<n>.<fqdn>", for
+ * IERS Bulletin C number 'n', and as "<yyyy>-<mm>.<fqdn>" for the end
+ * of June or December.  Bulletin C comes every six months, and C 49
+ * was for June 2015, so both names map to an index counting the half
+ * years since December 1971.
+ *
+ */
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "dns_leap.h"
+
+#define LEAP_ENTRY(y, m, t)	{ y, m, t },
+
+const struct leap_entry leap_table[] = {
+	LEAP_TABLE(LEAP_ENTRY)
+};
+
+const int leap_table_len = sizeof leap_table / sizeof leap_table[0];
+
+/*
+ * Read an IERS Leap_Second_History.dat into 'le', returns the number of
+ * entries or -1 if the file is malformed or has more than 'max' entries.
+ */
+
+int
+leap_history(FILE *fi, struct leap_entry *le, int max)
+{
+	char line[256];
+	double mjd;
+	int n = 0, day, month, year, dtai, mn;
+
+	while (fgets(line, sizeof line, fi) != NULL) {
+		if (line[strspn(line, " \t\r\n")] == '\0' ||
+		    line[strspn(line, " \t")] == '#')
+			continue;
+		if (sscanf(line, "%lf %d %d %d %d",
+		    &mjd, &day, &month, &year, &dtai) != 5)
+			return (-1);
+		if (day != 1 || (month != 1 && month != 7) || year < 1972 ||
+		    dtai < 10 || n == max)
+			return (-1);
+		mn = leap_month_index(year, month) - 1;
+		leap_month_from_index(mn, &le[n].year, &le[n].month);
+		if (mjd != leap_unix_mjd(leap_month_end(le[n].year,
+		    le[n].month)))
+			return (-1);
+		le[n].dtai = dtai;
+		if (n > 0 && (mn <= leap_month_index(le[n - 1].year,
+		    le[n - 1].month) || abs(dtai - le[n - 1].dtai) > 1))
+			return (-1);
+		n++;
+	}
+	return (n);
+}
+
+/*
+ * The announcement for the last entry, returns the encoded address
+ * or zero.
+ */
+
+uint32_t
+leap_history_announce(const struct leap_entry *le, int n)
+{
+
+	if (n < 2)
+		return (0);
+	return (encode_leapsecond(le[n - 1].year, le[n - 1].month,
+	    le[n - 2].dtai, le[n - 1].dtai - le[n - 2].dtai));
+}
+
+/*
+ * The history RRset for 'n' entries of 'le', returns 'n' or -1 if an
+ * entry cannot be encoded.
+ */
+
+int
+leap_history_encode(const struct leap_entry *le, int n, uint32_t *addr)
+{
+	int i, prev;
+
+	for (i = 0; i < n; i++) {
+		prev = i > 0 ? le[i - 1].dtai : le[0].dtai - 1;
+		addr[i] = encode_leapsecond(le[i].year, le[i].month, prev,
+		    le[i].dtai - prev);
+		if (addr[i] == 0)
+			return (-1);
+	}
+	return (n);
+}
+
+static int
+leap_addr_cmp(const void *a, const void *b)
+{
+	uint32_t ua = *(const uint32_t *)a, ub = *(const uint32_t *)b;
+
+	return (ua < ub ? -1 : ua > ub);
+}
+
+/*
+ * Rebuild the table from the history RRset, in any order and with
+ * duplicates.  Returns the number of entries, or -1 if an address does
+ * not decode, the steps do not join up, or there are over 'max'.
+ */
+
+int
+leap_history_decode(const uint32_t *addr, int n, struct leap_entry *le,
+    int max)
+{
+	uint32_t *u;
+	char buf[16];
+	int i, m = 0, year, month, dtai, delta;
+
+	u = malloc(n * sizeof *u);
+	if (u == NULL)
+		return (-1);
+	memcpy(u, addr, n * sizeof *u);
+	/* The month is the top of the address, below the class-E bits */
+	qsort(u, n, sizeof *u, leap_addr_cmp);
+	for (i = 0; i < n; i++) {
+		if (i > 0 && u[i] == u[i - 1])
+			continue;
+		(void)snprintf(buf, sizeof buf, "%u.%u.%u.%u", u[i] >> 24,
+		    (u[i] >> 16) & 0xff, (u[i] >> 8) & 0xff, u[i] & 0xff);
+		if (decode_leapsecond(buf, &year, &month, &dtai, &delta) ||
+		    m == max)
+			break;
+		if (m > 0 && (le[m - 1].dtai != dtai ||
+		    leap_month_index(le[m - 1].year, le[m - 1].month) >=
+		    leap_month_index(year, month)))
+			break;
+		le[m].year = year;
+		le[m].month = month;
+		le[m].dtai = dtai + delta;
+		m++;
+	}
+	free(u);
+	return (i == n ? m : -1);
+}
+
+/*
+ * Query the history RRset 'fqdn', like query_leapsecond() does the
+ * announcement.  Returns the number of entries, -10 if the lookup
+ * failed, or -11 if the RRset is not a valid history.
+ */
+
+int
+query_leap_history(const char *fqdn, struct leap_entry *le, int max)
+{
+	struct addrinfo hints, *res, *res0;
+	uint32_t *addr;
+	int error, n = 0;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	error = getaddrinfo(fqdn, NULL, &hints, &res0);
+	if (error != 0) {
+		fprintf(stderr, "Lookup error: %s\n", gai_strerror(error));
+		return (-10);
+	}
+	for (res = res0; res; res = res->ai_next)
+		n++;
+	addr = calloc(n, sizeof *addr);
+	if (addr == NULL) {
+		freeaddrinfo(res0);
+		return (-11);
+	}
+	for (n = 0, res = res0; res; res = res->ai_next)
+		addr[n++] = ntohl(((const struct sockaddr_in *)
+		    (const void *)res->ai_addr)->sin_addr.s_addr);
+	freeaddrinfo(res0);
+	n = leap_history_decode(addr, n, le, max);
+	free(addr);
+	return (n > 0 ? n : -11);
+}
+
+/*
+ * The half year index of 'year'-'month', or -1 if it is not the end of
+ * June or December in range of the encoding.
+ */
+
+static int
+leap_half(int year, int month)
+{
+	int mn = leap_month_index(year, month) - 1;
+
+	if ((month != 6 && month != 12) || mn < 0 || mn + 1 > 0x7ff)
+		return (-1);
+	return (mn / 6);
+}
+
+/*
+ * The month Bulletin C 'n' is for, returns -1 if there is none.
+ */
+
+int
+leap_bulletin_month(int n, int *year, int *month)
+{
+	int k = n + LEAP_HALF_C0;
+
+	if (n < 1 || 6 * k + 1 > 0x7ff)
+		return (-1);
+	leap_month_from_index(6 * k + 1, year, month);
+	return (0);
+}
+
+/*
+ * The half year index named by the DNS label 'p', "c49" or "2015-06",
+ * or -1.
+ */
+
+int
+leap_bulletin_label(const uint8_t *p, size_t len)
+{
+	char buf[16], *e;
+	long n;
+	int year, month;
+
+	if (len < 2 || len >= sizeof buf)
+		return (-1);
+	memcpy(buf, p, len);
+	buf[len] = '\0';
+	if (tolower((unsigned char)buf[0]) == 'c' &&
+	    isdigit((unsigned char)buf[1])) {
+		n = strtol(buf + 1, &e, 10);
+		if (*e != '\0' || n < 1 || n > 0x7ff)
+			return (-1);
+		return ((int)n + LEAP_HALF_C0);
+	}
+	if (len != 7 || buf[4] != '-' ||
+	    strspn(buf, "0123456789") != 4 ||
+	    strspn(buf + 5, "0123456789") != 2)
+		return (-1);
+	year = atoi(buf);
+	month = atoi(buf + 5);
+	return (leap_half(year, month));
+}
+
+/*
+ * The index of past announcements, by half year, from the 'n' entries
+ * of 'le' and the current announcement 'announce'.  Half years without
+ * an entry announce no leap second, those before the first entry or
+ * after the last announcement are zero.  Returns the number of half
+ * years or -1.
+ */
+
+int
+leap_bulletins(const struct leap_entry *le, int n, uint32_t announce,
+    uint32_t *bull, int max)
+{
+	char buf[16];
+	int i, k, k0, kmax, dtai, year, month, tai, delta;
+
+	if (n < 1)
+		return (-1);
+	k0 = leap_half(le[0].year, le[0].month);
+	kmax = leap_half(le[n - 1].year, le[n - 1].month);
+	(void)snprintf(buf, sizeof buf, "%u.%u.%u.%u", announce >> 24,
+	    (announce >> 16) & 0xff, (announce >> 8) & 0xff, announce & 0xff);
+	if (decode_leapsecond(buf, &year, &month, &tai, &delta) == 0 &&
+	    leap_half(year, month) > kmax)
+		kmax = leap_half(year, month);
+	else
+		announce = 0;
+	if (k0 < 0 || kmax < 0 || kmax >= max)
+		return (-1);
+
+	memset(bull, 0, max * sizeof *bull);
+	dtai = le[0].dtai - 1;
+	for (i = 0, k = k0; k <= kmax; k++) {
+		leap_month_from_index(6 * k + 1, &year, &month);
+		if (i < n && leap_half(le[i].year, le[i].month) == k) {
+			bull[k] = encode_leapsecond(year, month, dtai,
+			    le[i].dtai - dtai);
+			dtai = le[i++].dtai;
+		} else if (k == kmax && announce != 0) {
+			bull[k] = announce;
+		} else {
+			bull[k] = encode_leapsecond(year, month, dtai, 0);
+		}
+		if (bull[k] == 0)
+			return (-1);
+	}
+	return (i == n ? kmax + 1 : -1);
+}
+
+/*
+ * Query the announcement of Bulletin C 'n' from "c<n>.<fqdn>".  Also
+ * returns -13 if there is no Bulletin C 'n' or the answer is for
+ * another month, see leap_query.c for the other errors.
+ */
+
+int
+query_leapsecond_bulletin(const char *fqdn, int n,
+    int *year, int *month, int *tai, int *delta, char **ip)
+{
+	char name[NI_MAXHOST];
+	int error, y, m;
+
+	if (leap_bulletin_month(n, &y, &m))
+		return (-13);
+	(void)snprintf(name, sizeof name, "c%d.%s", n, fqdn);
+	error = query_leapsecond(name, year, month, tai, delta, ip);
+	if (error == 0 && (*year != y || *month != m))
+		return (-13);
+	return (error);
+}
+
+static const char leap_history_test[] =
+    "#  File expires on 28 December 2015\n"
+    "#    MJD        Date        TAI-UTC (s)\n"
+    "\n"
+    "    56109.0    1  7 2012       35\n"
+    "    57204.0    1  7 2015       36\n"
+    "    57570.0    1  7 2016       36\n"
+    "    57754.0    1  1 2017       37\n";
+
+static const char leap_history_bad_mjd[] =
+    "    57204.0    1  7 2015       36\n"
+    "    57569.0    1  7 2016       36\n";
+
+/*
+ * Encode the compiled-in table, and decode it shuffled, with a
+ * duplicate, a gap, and a bad address.
+ */
+
+static void
+test_leap_history_rrset(void)
+{
+	struct leap_entry le[64];
+	uint32_t addr[64], u;
+	int i, n;
+
+	n = leap_history_encode(leap_table, leap_table_len, addr);
+	assert(n == leap_table_len);
+	printf("  Entries: %d  First: %u.%u.%u.%u  RRset: %d octets\n", n,
+	    addr[0] >> 24, (addr[0] >> 16) & 0xff, (addr[0] >> 8) & 0xff,
+	    addr[0] & 0xff, n * 16);
+	assert(addr[0] == 0xf003094d);		/* 240.3.9.77 */
+	assert(addr[26] == encode_leapsecond(2015, 6, 35, 1));
+	for (i = 0; i < n / 2; i++) {
+		u = addr[i];
+		addr[i] = addr[n - 1 - i];
+		addr[n - 1 - i] = u;
+	}
+	addr[n] = addr[5];
+	assert(leap_history_decode(addr, n + 1, le, 64) == n);
+	assert(!memcmp(le, leap_table, n * sizeof le[0]));
+	assert(leap_history_decode(addr, n + 1, le, n - 1) == -1);
+	assert(leap_history_decode(addr + 1, n - 1, le, 64) == n - 1);
+	u = addr[10];
+	addr[10] = addr[11];
+	assert(leap_history_decode(addr, n, le, 64) == -1);
+	addr[10] = u;
+	addr[n - 1] ^= 1;
+	assert(leap_history_decode(addr, n, le, 64) == -1);
+}
+
+static const struct bulletin_vector {
+	const char	*label;
+	int		half;
+	uint32_t	addr;		/* From leap_table[] */
+} bulletin_vectors[] = {
+	{ "c49",	87,	0xf41723ff },	/* 244.23.35.255 */
+	{ "2015-06",	87,	0xf41723ff },
+	{ "C50",	88,	0 },
+	{ "c52",	90,	0 },
+	{ "2016-12",	90,	0 },
+	{ "1971-12",	0,	0xf003094d },	/* 240.3.9.77 */
+	{ "1972-12",	2,	0 },
+	{ "1973-06",	3,	0 },
+	{ "c1",		39,	0 },
+	{ "c0",		-1,	0 },
+	{ "c-1",	-1,	0 },
+	{ "c49x",	-1,	0 },
+	{ "2015-07",	-1,	0 },
+	{ "1971-06",	-1,	0 },
+	{ "15-06",	-1,	0 },
+	{ "history",	-1,	0 },
+	{ NULL,		0,	0 }
+};
+
+static void
+test_leap_bulletins(void)
+{
+	const struct bulletin_vector *bv;
+	uint32_t bull[400];
+	int n, year, month, tai, delta;
+	char buf[16];
+
+	n = leap_bulletins(leap_table, leap_table_len,
+	    encode_leapsecond(2026, 12, 37, 0), bull, 400);
+	printf("  Half years: %d\n", n);
+	assert(n == 111);
+	for (bv = bulletin_vectors; bv->label != NULL; bv++) {
+		n = leap_bulletin_label((const uint8_t *)bv->label,
+		    strlen(bv->label));
+		printf("  Label: %-8s  Index: %3d  Address: %08x\n",
+		    bv->label, n, n >= 0 ? bull[n] : 0);
+		assert(n == bv->half);
+		if (bv->addr != 0)
+			assert(bull[n] == bv->addr);
+	}
+	/* C 50 said: no leap second at the end of 2015 */
+	assert(bull[88] == encode_leapsecond(2015, 12, 36, 0));
+	assert(bull[90] == encode_leapsecond(2016, 12, 36, 1));
+	assert(bull[110] == encode_leapsecond(2026, 12, 37, 0));
+	assert(bull[2] == encode_leapsecond(1972, 12, 11, 1));
+	assert(bull[3] == encode_leapsecond(1973, 6, 12, 0));
+	assert(leap_bulletin_month(49, &year, &month) == 0);
+	assert(year == 2015 && month == 6);
+	assert(leap_bulletin_month(52, &year, &month) == 0);
+	assert(year == 2016 && month == 12);
+	assert(leap_bulletin_month(0, &year, &month) == -1);
+	(void)snprintf(buf, sizeof buf, "%u.%u.%u.%u", bull[89] >> 24,
+	    (bull[89] >> 16) & 0xff, (bull[89] >> 8) & 0xff, bull[89] & 0xff);
+	assert(decode_leapsecond(buf, &year, &month, &tai, &delta) == 0);
+	assert(year == 2016 && month == 6 && tai == 36 && delta == 0);
+	assert(leap_bulletins(leap_table, leap_table_len, 0, bull, 90) == -1);
+}
+
+void
+test_leap_history(void)
+{
+	struct leap_entry le[8];
+	uint32_t u;
+	FILE *fi;
+	int n;
+
+	printf("\nChecking leap second history file:\n\n");
+	fi = fmemopen((void *)(uintptr_t)leap_history_test,
+	    sizeof leap_history_test - 1, "r");
+	assert(fi != NULL);
+	n = leap_history(fi, le, 8);
+	(void)fclose(fi);
+	assert(n == 4);
+	u = leap_history_announce(le, n);
+	printf("  Entries: %d  Last: %04d-%02d %d  Announcement: %08x\n",
+	    n, le[n - 1].year, le[n - 1].month, le[n - 1].dtai, u);
+	assert(le[0].year == 2012 && le[0].month == 6 && le[0].dtai == 35);
+	assert(le[2].year == 2016 && le[2].month == 6 && le[2].dtai == 36);
+	assert(u == encode_leapsecond(2016, 12, 36, 1));
+	assert(leap_history_announce(le, 3) ==
+	    encode_leapsecond(2016, 6, 36, 0));
+	assert(leap_history_announce(le, 1) == 0);
+
+	fi = fmemopen((void *)(uintptr_t)leap_history_test,
+	    sizeof leap_history_test - 1, "r");
+	assert(fi != NULL);
+	assert(leap_history(fi, le, 3) == -1);
+	(void)fclose(fi);
+
+	fi = fmemopen((void *)(uintptr_t)leap_history_bad_mjd,
+	    sizeof leap_history_bad_mjd - 1, "r");
+	assert(fi != NULL);
+	assert(leap_history(fi, le, 8) == -1);
+	(void)fclose(fi);
+
+	printf("\nChecking history RRset encoding:\n\n");
+	test_leap_history_rrset();
+
+	printf("\nChecking bulletin index:\n\n");
+	test_leap_bulletins();
+}
@@ -0,0 +1,914 @@
+/*-
+ * Copyright (c) 2015 Poul-Henning Kamp <phk@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * AF_XDP fast path for the authoritative responder.
+ *
+ * With 'serve -X ifname', a small XDP program on the interface steers
+ * plain IPv4 UDP packets for the served port (Ethernet, no VLAN tag,
+ * no IP options, not a fragment) into AF_XDP sockets, one per receive
+ * queue, bypassing the kernel network stack.  Everything else, IPv6,
+ * TCP and all other traffic, is passed on to the stack as usual, and
+ * still reaches the socket workers.
+ *
+ * Each socket has its own UMEM of XDP_NFRAMES frames, and all four
+ * rings are XDP_NFRAMES deep, so a frame is always in exactly one
+ * place and no ring ever fills up.  The responder takes a batch of
+ * frames off the RX ring, hands the DNS payloads to the answer
+ * callback in one go, rewrites each answered frame in place (MAC, IP
+ * and UDP ports swapped, IP checksum recomputed, UDP checksum zero)
+ * and queues it on the TX ring.  Frames which are not answered, and
+ * those coming back on the completion ring, go straight back to the
+ * fill ring.
+ *
+ * The XDP program is hand-assembled, the BPF system calls are made
+ * directly, so there is no dependency on libbpf.  It is attached with
+ * a BPF link, and detaches when the process exits.  The kernel picks
+ * zero-copy or copy mode, and driver or generic XDP, by what the
+ * network driver supports.
+ *
+ * Build with -DWITH_XDP on Linux, elsewhere xdp_open() fails.  The
+ * self-test runs the responder in a private network namespace on a
+ * veth pair, and is skipped if the namespace or AF_XDP is not allowed.
+ *
+ */
+
+#if defined(__linux__) && defined(WITH_XDP)
+#define _GNU_SOURCE		/* unshare(2) */
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(WITH_XDP)
+#include <poll.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <net/if.h>
+#include <netpacket/packet.h>
+#include <arpa/inet.h>
+#include <linux/bpf.h>
+#include <linux/ethtool.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sockios.h>
+#include <linux/veth.h>
+#endif
+
+#include "dns_leap.h"
+
+#if defined(__linux__) && defined(WITH_XDP)
+
+#define XDP_NFRAMES	4096		/* UMEM frames, also ring depth */
+#define XDP_FRAME	2048
+#define XDP_BATCH	64
+#define XDP_MAXQ	64
+
+#define XDP_HDR		42		/* Ethernet, IPv4, UDP */
+
+struct xdp_ring {
+	_Atomic uint32_t	*prod;
+	_Atomic uint32_t	*cons;
+	void			*desc;
+	void			*map;
+	size_t			maplen;
+};
+
+struct xdp_sock {
+	int			fd;
+	uint8_t			*umem;
+	struct xdp_ring		rx, tx, fill, comp;
+};
+
+struct xdp_port {
+	int			ifindex;
+	int			map, prog, link;
+	unsigned		nq;
+	_Atomic int		stop;
+	struct xdp_sock		xs[XDP_MAXQ];
+};
+
+/*
+ * The XDP program.  Offsets are from the start of the Ethernet frame,
+ * r2 is the packet, r6 the context:
+ *
+ *	if (data + 42 > data_end ||
+ *	    ethertype != 0x0800 || version/ihl != 0x45 ||
+ *	    (frag & 0x3fff) != 0 || proto != UDP || dport != port)
+ *		return (XDP_PASS);
+ *	return (bpf_redirect_map(xskmap, ctx->rx_queue_index, XDP_PASS));
+ */
+
+#define XI(c, d, s, o, i)	{ .code = (c), .dst_reg = (d), \
+				  .src_reg = (s), .off = (o), .imm = (i) }
+#define XP_PASS		29
+#define XJ(n)		(XP_PASS - (n) - 1)
+#define XP_PORTHI	20
+#define XP_PORTLO	22
+#define XP_MAP		24
+
+static const struct bpf_insn xdp_insns[] = {
+	/* 0 */ XI(BPF_ALU64 | BPF_MOV | BPF_X, 6, 1, 0, 0),
+	/* 1 */ XI(BPF_LDX | BPF_MEM | BPF_W, 2, 1, 0, 0),
+	/* 2 */ XI(BPF_LDX | BPF_MEM | BPF_W, 3, 1, 4, 0),
+	/* 3 */ XI(BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0),
+	/* 4 */ XI(BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0, XDP_HDR),
+	/* 5 */ XI(BPF_JMP | BPF_JGT | BPF_X, 4, 3, XJ(5), 0),
+	/* 6 */ XI(BPF_LDX | BPF_MEM | BPF_B, 5, 2, 12, 0),
+	/* 7 */ XI(BPF_JMP | BPF_JNE | BPF_K, 5, 0, XJ(7), 0x08),
+	/* 8 */ XI(BPF_LDX | BPF_MEM | BPF_B, 5, 2, 13, 0),
+	/* 9 */ XI(BPF_JMP | BPF_JNE | BPF_K, 5, 0, XJ(9), 0x00),
+	/* 10 */ XI(BPF_LDX | BPF_MEM | BPF_B, 5, 2, 14, 0),
+	/* 11 */ XI(BPF_JMP | BPF_JNE | BPF_K, 5, 0, XJ(11), 0x45),
+	/* 12 */ XI(BPF_LDX | BPF_MEM | BPF_B, 5, 2, 20, 0),
+	/* 13 */ XI(BPF_ALU64 | BPF_AND | BPF_K, 5, 0, 0, 0x3f),
+	/* 14 */ XI(BPF_JMP | BPF_JNE | BPF_K, 5, 0, XJ(14), 0),
+	/* 15 */ XI(BPF_LDX | BPF_MEM | BPF_B, 5, 2, 21, 0),
+	/* 16 */ XI(BPF_JMP | BPF_JNE | BPF_K, 5, 0, XJ(16), 0),
+	/* 17 */ XI(BPF_LDX | BPF_MEM | BPF_B, 5, 2, 23, 0),
+	/* 18 */ XI(BPF_JMP | BPF_JNE | BPF_K, 5, 0, XJ(18), 17),
+	/* 19 */ XI(BPF_LDX | BPF_MEM | BPF_B, 5, 2, 36, 0),
+	/* 20 */ XI(BPF_JMP | BPF_JNE | BPF_K, 5, 0, XJ(20), 0),
+	/* 21 */ XI(BPF_LDX | BPF_MEM | BPF_B, 5, 2, 37, 0),
+	/* 22 */ XI(BPF_JMP | BPF_JNE | BPF_K, 5, 0, XJ(22), 0),
+	/* 23 */ XI(BPF_LDX | BPF_MEM | BPF_W, 2, 6, 16, 0),
+	/* 24 */ XI(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, 0),
+	/* 25 */ XI(0, 0, 0, 0, 0),
+	/* 26 */ XI(BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, 0, XDP_PASS),
+	/* 27 */ XI(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+	/* 28 */ XI(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+	/* 29 */ XI(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, XDP_PASS),
+	/* 30 */ XI(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+};
+
+static int
+xdp_bpf(int cmd, union bpf_attr *attr)
+{
+
+	return ((int)syscall(SYS_bpf, cmd, attr, sizeof *attr));
+}
+
+static int
+xdp_prog(int map, unsigned port)
+{
+	struct bpf_insn p[sizeof xdp_insns / sizeof xdp_insns[0]];
+	union bpf_attr attr;
+	static char log[65536];
+	int fd;
+
+	memcpy(p, xdp_insns, sizeof p);
+	p[XP_PORTHI].imm = port >> 8;
+	p[XP_PORTLO].imm = port & 0xff;
+	p[XP_MAP].imm = map;
+	memset(&attr, 0, sizeof attr);
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.insns = (uintptr_t)p;
+	attr.insn_cnt = sizeof p / sizeof p[0];
+	attr.license = (uintptr_t)"Dual BSD/GPL";
+	fd = xdp_bpf(BPF_PROG_LOAD, &attr);
+	if (fd >= 0 || errno == EPERM)
+		return (fd);
+	attr.log_buf = (uintptr_t)log;
+	attr.log_size = sizeof log;
+	attr.log_level = 1;
+	fd = xdp_bpf(BPF_PROG_LOAD, &attr);
+	if (fd < 0)
+		fprintf(stderr, "XDP program rejected:\n%s", log);
+	return (fd);
+}
+
+/*
+ * Number of receive queues, one if the driver does not say.
+ */
+
+static unsigned
+xdp_nqueues(const char *ifname)
+{
+	struct ethtool_channels ec;
+	struct ifreq ifr;
+	unsigned n = 1;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0)
+		return (n);
+	memset(&ec, 0, sizeof ec);
+	ec.cmd = ETHTOOL_GCHANNELS;
+	memset(&ifr, 0, sizeof ifr);
+	(void)snprintf(ifr.ifr_name, sizeof ifr.ifr_name, "%s", ifname);
+	ifr.ifr_data = (void *)&ec;
+	if (ioctl(fd, SIOCETHTOOL, &ifr) == 0 &&
+	    ec.rx_count + ec.combined_count > 0)
+		n = ec.rx_count + ec.combined_count;
+	(void)close(fd);
+	return (n);
+}
+
+static int
+xdp_ring(struct xdp_ring *xr, int fd, const struct xdp_ring_offset *off,
+    uint64_t pgoff, size_t esz)
+{
+
+	xr->maplen = off->desc + XDP_NFRAMES * esz;
+	xr->map = mmap(NULL, xr->maplen, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, fd, (off_t)pgoff);
+	if (xr->map == MAP_FAILED) {
+		xr->map = NULL;
+		return (-1);
+	}
+	xr->prod = (void *)((char *)xr->map + off->producer);
+	xr->cons = (void *)((char *)xr->map + off->consumer);
+	xr->desc = (char *)xr->map + off->desc;
+	return (0);
+}
+
+static int
+xdp_sock_open(struct xdp_sock *xs, int ifindex, unsigned queue)
+{
+	struct xdp_umem_reg ur;
+	struct xdp_mmap_offsets off;
+	struct sockaddr_xdp sx;
+	socklen_t ol;
+	uint64_t *fq;
+	int n = XDP_NFRAMES;
+	unsigned i;
+
+	xs->fd = socket(AF_XDP, SOCK_RAW, 0);
+	if (xs->fd < 0)
+		return (-1);
+	xs->umem = mmap(NULL, (size_t)XDP_NFRAMES * XDP_FRAME,
+	    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (xs->umem == MAP_FAILED) {
+		xs->umem = NULL;
+		return (-1);
+	}
+	memset(&ur, 0, sizeof ur);
+	ur.addr = (uintptr_t)xs->umem;
+	ur.len = (uint64_t)XDP_NFRAMES * XDP_FRAME;
+	ur.chunk_size = XDP_FRAME;
+	ol = sizeof off;
+	if (setsockopt(xs->fd, SOL_XDP, XDP_UMEM_REG, &ur, sizeof ur) ||
+	    setsockopt(xs->fd, SOL_XDP, XDP_UMEM_FILL_RING, &n, sizeof n) ||
+	    setsockopt(xs->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &n,
+	    sizeof n) ||
+	    setsockopt(xs->fd, SOL_XDP, XDP_RX_RING, &n, sizeof n) ||
+	    setsockopt(xs->fd, SOL_XDP, XDP_TX_RING, &n, sizeof n) ||
+	    getsockopt(xs->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &ol))
+		return (-1);
+	if (xdp_ring(&xs->rx, xs->fd, &off.rx, XDP_PGOFF_RX_RING,
+	    sizeof(struct xdp_desc)) ||
+	    xdp_ring(&xs->tx, xs->fd, &off.tx, XDP_PGOFF_TX_RING,
+	    sizeof(struct xdp_desc)) ||
+	    xdp_ring(&xs->fill, xs->fd, &off.fr, XDP_UMEM_PGOFF_FILL_RING,
+	    sizeof(uint64_t)) ||
+	    xdp_ring(&xs->comp, xs->fd, &off.cr,
+	    XDP_UMEM_PGOFF_COMPLETION_RING, sizeof(uint64_t)))
+		return (-1);
+
+	fq = xs->fill.desc;
+	for (i = 0; i < XDP_NFRAMES; i++)
+		fq[i] = (uint64_t)i * XDP_FRAME;
+	atomic_store_explicit(xs->fill.prod, XDP_NFRAMES,
+	    memory_order_release);
+
+	memset(&sx, 0, sizeof sx);
+	sx.sxdp_family = AF_XDP;
+	sx.sxdp_ifindex = ifindex;
+	sx.sxdp_queue_id = queue;
+	return (bind(xs->fd, (struct sockaddr *)&sx, sizeof sx));
+}
+
+static void
+xdp_sock_close(struct xdp_sock *xs)
+{
+	struct xdp_ring *xr[4] = { &xs->rx, &xs->tx, &xs->fill, &xs->comp };
+	int i;
+
+	for (i = 0; i < 4; i++)
+		if (xr[i]->map != NULL)
+			(void)munmap(xr[i]->map, xr[i]->maplen);
+	if (xs->fd >= 0)
+		(void)close(xs->fd);
+	if (xs->umem != NULL)
+		(void)munmap(xs->umem, (size_t)XDP_NFRAMES * XDP_FRAME);
+}
+
+/*
+ * Steer the served UDP port on up to 'nq' receive queues of 'ifname'
+ * into AF_XDP sockets.
+ */
+
+struct xdp_port *
+xdp_open(const char *ifname, unsigned nq, unsigned port)
+{
+	struct xdp_port *xp;
+	union bpf_attr attr;
+	const char *what;
+	unsigned i;
+	int fd;
+
+	xp = calloc(1, sizeof *xp);
+	if (xp == NULL)
+		return (NULL);
+	xp->map = xp->prog = xp->link = -1;
+	for (i = 0; i < XDP_MAXQ; i++)
+		xp->xs[i].fd = -1;
+	what = "if_nametoindex";
+	xp->ifindex = if_nametoindex(ifname);
+	if (xp->ifindex == 0)
+		goto fail;
+	xp->nq = xdp_nqueues(ifname);
+	if (xp->nq > nq)
+		xp->nq = nq;
+	if (xp->nq > XDP_MAXQ)
+		xp->nq = XDP_MAXQ;
+
+	what = "XSKMAP";
+	memset(&attr, 0, sizeof attr);
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = 4;
+	attr.value_size = 4;
+	attr.max_entries = xp->nq;
+	xp->map = xdp_bpf(BPF_MAP_CREATE, &attr);
+	if (xp->map < 0)
+		goto fail;
+	what = "XDP program";
+	xp->prog = xdp_prog(xp->map, port);
+	if (xp->prog < 0)
+		goto fail;
+	what = "AF_XDP socket";
+	for (i = 0; i < xp->nq; i++) {
+		if (xdp_sock_open(&xp->xs[i], xp->ifindex, i))
+			goto fail;
+		fd = xp->xs[i].fd;
+		memset(&attr, 0, sizeof attr);
+		attr.map_fd = xp->map;
+		attr.key = (uintptr_t)&i;
+		attr.value = (uintptr_t)&fd;
+		if (xdp_bpf(BPF_MAP_UPDATE_ELEM, &attr))
+			goto fail;
+	}
+	what = "XDP attach";
+	memset(&attr, 0, sizeof attr);
+	attr.link_create.prog_fd = xp->prog;
+	attr.link_create.target_ifindex = xp->ifindex;
+	attr.link_create.attach_type = BPF_XDP;
+	xp->link = xdp_bpf(BPF_LINK_CREATE, &attr);
+	if (xp->link < 0)
+		goto fail;
+	return (xp);
+
+  fail:
+	fprintf(stderr, "%s: %s: %s\n", ifname, what, strerror(errno));
+	xdp_close(xp);
+	return (NULL);
+}
+
+unsigned
+xdp_queues(const struct xdp_port *xp)
+{
+
+	return (xp->nq);
+}
+
+void
+xdp_stop(struct xdp_port *xp)
+{
+
+	atomic_store(&xp->stop, 1);
+}
+
+void
+xdp_close(struct xdp_port *xp)
+{
+	unsigned i;
+
+	if (xp->link >= 0)
+		(void)close(xp->link);
+	for (i = 0; i < XDP_MAXQ; i++)
+		xdp_sock_close(&xp->xs[i]);
+	if (xp->prog >= 0)
+		(void)close(xp->prog);
+	if (xp->map >= 0)
+		(void)close(xp->map);
+	free(xp);
+}
+
+static unsigned
+xdp_csum(const uint8_t *p, size_t len)
+{
+	uint32_t s = 0;
+	size_t i;
+
+	for (i = 0; i + 1 < len; i += 2)
+		s += dns_get16(p + i);
+	while (s >> 16)
+		s = (s & 0xffff) + (s >> 16);
+	return (~s & 0xffff);
+}
+
+/*
+ * The XDP program only looked at the headers it needed to steer the
+ * packet, check the rest before trusting any length.
+ */
+
+static int
+xdp_parse(const uint8_t *p, size_t len, struct xdp_msg *m)
+{
+	size_t tl, ul;
+
+	if (len < XDP_HDR + DNS_HDRLEN || p[12] != 0x08 || p[13] != 0 ||
+	    p[14] != 0x45 || (p[20] & 0x3f) != 0 || p[21] != 0 ||
+	    p[23] != 17 || xdp_csum(p + 14, 20) != 0)
+		return (0);
+	tl = dns_get16(p + 16);
+	ul = dns_get16(p + 38);
+	if (tl > len - 14 || ul < 8 + DNS_HDRLEN || ul > tl - 20)
+		return (0);
+	m->q = p + XDP_HDR;
+	m->qlen = ul - 8;
+	memcpy(&m->saddr, p + 26, 4);
+	memcpy(&m->sport, p + 34, 2);
+	return (1);
+}
+
+/*
+ * Turn the query frame into the response, returns the frame length.
+ */
+
+static size_t
+xdp_reply(uint8_t *p, const struct xdp_msg *m)
+{
+	uint8_t t[6];
+	unsigned c;
+
+	memcpy(t, p, 6);
+	memcpy(p, p + 6, 6);
+	memcpy(p + 6, t, 6);
+	memcpy(t, p + 26, 4);
+	memcpy(p + 26, p + 30, 4);
+	memcpy(p + 30, t, 4);
+	dns_put16(p + 16, 20 + 8 + m->rlen);
+	dns_put16(p + 20, 0x4000);		/* DF */
+	p[22] = 64;				/* TTL */
+	dns_put16(p + 24, 0);
+	c = xdp_csum(p + 14, 20);
+	dns_put16(p + 24, c);
+	memcpy(t, p + 34, 2);
+	memcpy(p + 34, p + 36, 2);
+	memcpy(p + 36, t, 2);
+	dns_put16(p + 38, 8 + m->rlen);
+	dns_put16(p + 40, 0);
+	memcpy(p + XDP_HDR, m->r, m->rlen);
+	return (XDP_HDR + m->rlen);
+}
+
+/*
+ * Serve receive queue 'queue' until xdp_stop().  'f' is only called
+ * with packets, never while waiting for them.
+ */
+
+int
+xdp_loop(struct xdp_port *xp, unsigned queue, xdp_answer_f *f, void *priv)
+{
+	static __thread struct xdp_msg m[XDP_BATCH];
+	static __thread uint8_t r[XDP_BATCH][DNS_EDNS_SIZE];
+	static __thread uint64_t fa[XDP_BATCH];
+	struct xdp_sock *xs = &xp->xs[queue];
+	const struct xdp_desc *rd;
+	struct xdp_desc *td;
+	uint64_t *fq, *cq;
+	struct pollfd pfd;
+	uint32_t rc, fp, tp, cc, n, i, k, t0;
+	const uint32_t mask = XDP_NFRAMES - 1;
+
+	rd = xs->rx.desc;
+	td = xs->tx.desc;
+	fq = xs->fill.desc;
+	cq = xs->comp.desc;
+	while (!atomic_load(&xp->stop)) {
+		fp = atomic_load_explicit(xs->fill.prod, memory_order_relaxed);
+		cc = atomic_load_explicit(xs->comp.cons, memory_order_relaxed);
+		n = atomic_load_explicit(xs->comp.prod, memory_order_acquire);
+		for (; cc != n; cc++)
+			fq[fp++ & mask] = cq[cc & mask];
+		atomic_store_explicit(xs->comp.cons, cc, memory_order_release);
+
+		rc = atomic_load_explicit(xs->rx.cons, memory_order_relaxed);
+		n = atomic_load_explicit(xs->rx.prod, memory_order_acquire);
+		n -= rc;
+		if (n == 0) {
+			atomic_store_explicit(xs->fill.prod, fp,
+			    memory_order_release);
+			pfd.fd = xs->fd;
+			pfd.events = POLLIN;
+			(void)poll(&pfd, 1, 100);
+			continue;
+		}
+		if (n > XDP_BATCH)
+			n = XDP_BATCH;
+		for (i = k = 0; i < n; i++) {
+			fa[k] = rd[(rc + i) & mask].addr;
+			if (!xdp_parse(xs->umem + fa[k],
+			    rd[(rc + i) & mask].len, &m[k])) {
+				fq[fp++ & mask] = fa[k];
+				continue;
+			}
+			m[k].r = r[k];
+			m[k].rlen = sizeof r[k];
+			k++;
+		}
+		atomic_store_explicit(xs->rx.cons, rc + n,
+		    memory_order_release);
+		if (k > 0)
+			f(priv, m, k);
+
+		tp = t0 = atomic_load_explicit(xs->tx.prod,
+		    memory_order_relaxed);
+		for (i = 0; i < k; i++) {
+			if (m[i].rlen <= 0 ||
+			    m[i].rlen > XDP_FRAME - XDP_HDR) {
+				fq[fp++ & mask] = fa[i];
+				continue;
+			}
+			td[tp & mask].addr = fa[i];
+			td[tp & mask].len = xdp_reply(xs->umem + fa[i], &m[i]);
+			td[tp & mask].options = 0;
+			tp++;
+		}
+		atomic_store_explicit(xs->fill.prod, fp, memory_order_release);
+		if (tp != t0) {
+			atomic_store_explicit(xs->tx.prod, tp,
+			    memory_order_release);
+			(void)sendto(xs->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+		}
+	}
+	return (0);
+}
+
+/*
+ * Self-test --------------------------------------------------------
+ */
+
+static struct rtattr *
+xdp_nlattr(struct nlmsghdr *nh, unsigned type, const void *data,
+    size_t len)
+{
+	struct rtattr *rta;
+
+	rta = (void *)((char *)nh + NLMSG_ALIGN(nh->nlmsg_len));
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH(len);
+	if (len > 0)
+		memcpy(RTA_DATA(rta), data, len);
+	nh->nlmsg_len = NLMSG_ALIGN(nh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+	return (rta);
+}
+
+static void
+xdp_nlend(struct nlmsghdr *nh, struct rtattr *rta)
+{
+
+	rta->rta_len = (char *)nh + nh->nlmsg_len - (char *)rta;
+}
+
+/*
+ * Create the veth pair 'a' - 'b' and bring both ends up.
+ */
+
+static int
+xdp_veth(const char *a, const char *b)
+{
+	struct {
+		struct nlmsghdr		nh;
+		struct ifinfomsg	ifi;
+		char			attr[512];
+	} req;
+	struct ifinfomsg ifi;
+	struct rtattr *li, *data, *peer;
+	struct nlmsgerr *ne;
+	struct ifreq ifr;
+	char buf[1024];
+	ssize_t l;
+	int fd, i;
+
+	memset(&req, 0, sizeof req);
+	req.nh.nlmsg_len = NLMSG_LENGTH(sizeof req.ifi);
+	req.nh.nlmsg_type = RTM_NEWLINK;
+	req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE | NLM_F_EXCL |
+	    NLM_F_ACK;
+	req.ifi.ifi_family = AF_UNSPEC;
+	(void)xdp_nlattr(&req.nh, IFLA_IFNAME, a, strlen(a) + 1);
+	li = xdp_nlattr(&req.nh, IFLA_LINKINFO, NULL, 0);
+	(void)xdp_nlattr(&req.nh, IFLA_INFO_KIND, "veth", 4);
+	data = xdp_nlattr(&req.nh, IFLA_INFO_DATA, NULL, 0);
+	memset(&ifi, 0, sizeof ifi);
+	peer = xdp_nlattr(&req.nh, VETH_INFO_PEER, &ifi, sizeof ifi);
+	(void)xdp_nlattr(&req.nh, IFLA_IFNAME, b, strlen(b) + 1);
+	xdp_nlend(&req.nh, peer);
+	xdp_nlend(&req.nh, data);
+	xdp_nlend(&req.nh, li);
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd < 0)
+		return (-1);
+	if (send(fd, &req, req.nh.nlmsg_len, 0) < 0 ||
+	    (l = recv(fd, buf, sizeof buf, 0)) < (ssize_t)NLMSG_LENGTH(
+	    sizeof *ne)) {
+		(void)close(fd);
+		return (-1);
+	}
+	(void)close(fd);
+	ne = NLMSG_DATA((struct nlmsghdr *)buf);
+	if (((struct nlmsghdr *)buf)->nlmsg_type == NLMSG_ERROR &&
+	    ne->error != 0) {
+		errno = -ne->error;
+		return (-1);
+	}
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0)
+		return (-1);
+	for (i = 0; i < 2; i++) {
+		memset(&ifr, 0, sizeof ifr);
+		(void)snprintf(ifr.ifr_name, sizeof ifr.ifr_name, "%s",
+		    i ? b : a);
+		if (ioctl(fd, SIOCGIFFLAGS, &ifr))
+			break;
+		ifr.ifr_flags |= IFF_UP;
+		if (ioctl(fd, SIOCSIFFLAGS, &ifr))
+			break;
+	}
+	(void)close(fd);
+	return (i == 2 ? 0 : -1);
+}
+
+#define XT_ROUNDS	100
+#define XT_BURST	64
+#define XT_SPORT	1024		/* + index in the burst */
+#define XT_NOANSWER	2000		/* Source ports of the other frames */
+
+/*
+ * An Ethernet/IPv4/UDP frame from 10.0.0.2 to 10.0.0.1.  'ihl' above
+ * five pads with IP options.
+ */
+
+static size_t
+xdp_test_frame(uint8_t *p, unsigned ihl, unsigned frag, unsigned sport,
+    unsigned dport, const uint8_t *q, size_t ql)
+{
+	size_t hl = ihl * 4;
+
+	memcpy(p, "\x02\x00\x00\x00\x00\x01\x02\x00\x00\x00\x00\x02"
+	    "\x08\x00", 14);
+	memset(p + 14, 0, hl);
+	p[14] = 0x40 | ihl;
+	dns_put16(p + 16, hl + 8 + ql);
+	dns_put16(p + 20, frag);
+	p[22] = 64;
+	p[23] = 17;
+	memcpy(p + 26, "\x0a\x00\x00\x02\x0a\x00\x00\x01", 8);
+	dns_put16(p + 24, xdp_csum(p + 14, hl));
+	dns_put16(p + 14 + hl, sport);
+	dns_put16(p + 14 + hl + 2, dport);
+	dns_put16(p + 14 + hl + 4, 8 + ql);
+	dns_put16(p + 14 + hl + 6, 0);
+	memcpy(p + 14 + hl + 8, q, ql);
+	return (14 + hl + 8 + ql);
+}
+
+struct xdp_test {
+	struct xdp_port		*xp;
+	xdp_answer_f		*f;
+	void			*priv;
+};
+
+static void *
+xdp_test_thread(void *priv)
+{
+	struct xdp_test *xt = priv;
+
+	(void)xdp_loop(xt->xp, 0, xt->f, xt->priv);
+	return (NULL);
+}
+
+static int
+xdp_test_child(xdp_answer_f *f, void *priv, const char *fqdn,
+    uint32_t addr)
+{
+	struct xdp_test xt;
+	struct sockaddr_ll sll;
+	struct lq_answer la;
+	struct pollfd pfd;
+	pthread_t thr;
+	uint8_t name[DNS_MAXNAME], q[DNS_MAXUDP], p[XDP_FRAME];
+	uint64_t t0;
+	size_t ql, qend;
+	ssize_t l;
+	unsigned round, i, got, answers = 0, dport;
+	int fd, nl;
+
+	if (unshare(CLONE_NEWNET) || xdp_veth("lx0", "lx1")) {
+		printf("  Skipped, no network namespace: %s\n",
+		    strerror(errno));
+		return (0);
+	}
+	xt.f = f;
+	xt.priv = priv;
+	xt.xp = xdp_open("lx0", 1, 53);
+	if (xt.xp == NULL) {
+		printf("  Skipped, no AF_XDP\n");
+		return (0);
+	}
+	assert(xdp_queues(xt.xp) == 1);
+	fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+	assert(fd >= 0);
+	memset(&sll, 0, sizeof sll);
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	sll.sll_ifindex = if_nametoindex("lx1");
+	assert(bind(fd, (struct sockaddr *)&sll, sizeof sll) == 0);
+	assert(pthread_create(&thr, NULL, xdp_test_thread, &xt) == 0);
+
+	nl = dns_name(fqdn, name, sizeof name);
+	assert(nl > 0);
+	qend = DNS_HDRLEN + nl + 4;
+	t0 = metric_usec();
+	for (round = 0; round < XT_ROUNDS; round++) {
+		for (i = 0; i < XT_BURST; i++) {
+			ql = lq_query(q, round * XT_BURST + i, name, nl, 0);
+			l = xdp_test_frame(p, 5, 0, XT_SPORT + i, 53, q, ql);
+			assert(send(fd, p, l, 0) == l);
+		}
+		/* Wrong port, IP options, fragment, short DNS header */
+		l = xdp_test_frame(p, 5, 0, XT_NOANSWER, 54, q, ql);
+		assert(send(fd, p, l, 0) == l);
+		l = xdp_test_frame(p, 6, 0, XT_NOANSWER + 1, 53, q, ql);
+		assert(send(fd, p, l, 0) == l);
+		l = xdp_test_frame(p, 5, 0x2000, XT_NOANSWER + 2, 53, q, ql);
+		assert(send(fd, p, l, 0) == l);
+		l = xdp_test_frame(p, 5, 0, XT_NOANSWER + 3, 53, q, 8);
+		assert(send(fd, p, l, 0) == l);
+
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		for (got = 0; got < XT_BURST; ) {
+			if (poll(&pfd, 1, 2000) <= 0)
+				break;
+			l = recv(fd, p, sizeof p, 0);
+			assert(l > 0);
+			if (l < XDP_HDR || p[12] != 0x08 || p[13] != 0 ||
+			    dns_get16(p + 34) != 53)
+				continue;
+			dport = dns_get16(p + 36);
+			assert(dport >= XT_SPORT &&
+			    dport < XT_SPORT + XT_BURST);
+			assert(!memcmp(p, "\x02\x00\x00\x00\x00\x02"
+			    "\x02\x00\x00\x00\x00\x01", 12));
+			assert(p[14] == 0x45 && xdp_csum(p + 14, 20) == 0);
+			assert(!memcmp(p + 26, "\x0a\x00\x00\x01"
+			    "\x0a\x00\x00\x02", 8));
+			assert(dns_get16(p + 16) == l - 14);
+			assert(dns_get16(p + 38) == l - 34);
+			i = dns_get16(p + XDP_HDR) - round * XT_BURST;
+			assert(i == dport - XT_SPORT);
+			(void)lq_query(q, round * XT_BURST + i, name, nl, 0);
+			assert(lq_parse(p + XDP_HDR, l - XDP_HDR, q, qend,
+			    &la) == 0);
+			assert(la.rcode == 0 && la.naddr == 1 &&
+			    la.addr[0] == addr);
+			got++;
+		}
+		answers += got;
+		if (got < XT_BURST)
+			break;
+	}
+	t0 = metric_usec() - t0;
+	xdp_stop(xt.xp);
+	(void)pthread_join(thr, NULL);
+	xdp_close(xt.xp);
+	(void)close(fd);
+	printf("  Queries: %u  Answers: %u  Rounds: %u  usec: %ju\n",
+	    XT_ROUNDS * XT_BURST, answers, round, (uintmax_t)t0);
+	assert(answers == XT_ROUNDS * XT_BURST);
+	return (0);
+}
+
+/*
+ * Answer through 'f' on one end of a veth pair, and check the frames
+ * coming back on the other end.  The frames the XDP program passes
+ * on, and the one 'f' drops, must not be answered, and more queries
+ * than there are UMEM frames must go through.
+ */
+
+void
+test_leap_xdp(xdp_answer_f *f, void *priv, const char *fqdn, uint32_t addr)
+{
+	pid_t pid;
+	int st;
+
+	printf("\nChecking AF_XDP responder:\n\n");
+	(void)fflush(stdout);
+	pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		st = xdp_test_child(f, priv, fqdn, addr);
+		(void)fflush(stdout);
+		_exit(st);
+	}
+	assert(waitpid(pid, &st, 0) == pid);
+	assert(WIFEXITED(st) && WEXITSTATUS(st) == 0);
+}
+
+#else /* !(__linux__ && WITH_XDP) */
+
+struct xdp_port *
+xdp_open(const char *ifname, unsigned nq, unsigned port)
+{
+
+	(void)nq;
+	(void)port;
+	fprintf(stderr, "%s: AF_XDP needs Linux and -DWITH_XDP\n", ifname);
+	return (NULL);
+}
+
+unsigned
+xdp_queues(const struct xdp_port *xp)
+{
+
+	(void)xp;
+	return (0);
+}
+
+int
+xdp_loop(struct xdp_port *xp, unsigned queue, xdp_answer_f *f, void *priv)
+{
+
+	(void)xp;
+	(void)queue;
+	(void)f;
+	(void)priv;
+	errno = EOPNOTSUPP;
+	return (-1);
+}
+
+void
+xdp_stop(struct xdp_port *xp)
+{
+
+	(void)xp;
+}
+
+void
+xdp_close(struct xdp_port *xp)
+{
+
+	(void)xp;
+}
+
+void
+test_leap_xdp(xdp_answer_f *f, void *priv, const char *fqdn, uint32_t addr)
+{
+
+	(void)f;
+	(void)priv;
+	(void)fqdn;
+	(void)addr;
+}
+
+#endif